@@ -0,0 +1,321 @@
+#include "fMP4-async-io.hpp"
+
+#include <cerrno>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+namespace {
+
+struct IORequest
+{
+    bool is_sync;
+    int fd;
+    const unsigned char *data;
+    size_t size;
+    uint64_t offset;
+    size_t written;
+    std::shared_ptr<const void> owner;
+    MP4AsyncIO::Completion completion;
+};
+
+/*
+ * Blocking pwrite and fdatasync on a pool of threads.
+ */
+class ThreadPoolIO : public MP4AsyncIO
+{
+public:
+
+    ThreadPoolIO(unsigned int threads)
+            : stopping(false)
+    {
+        if (threads == 0)
+            threads = 1;
+        for (unsigned int i = 0; i < threads; i++)
+            workers.push_back(std::thread(&ThreadPoolIO::Run, this));
+    }
+
+    ~ThreadPoolIO()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        cv.notify_all();
+        for (auto &worker : workers)
+            worker.join();
+    }
+
+    virtual void Write(int fd,
+                       const unsigned char *data,
+                       size_t size,
+                       uint64_t offset,
+                       const std::shared_ptr<const void> &owner,
+                       const Completion &completion)
+    {
+        Submit(new IORequest{false, fd, data, size, offset, 0, owner, completion});
+    }
+
+    virtual void Sync(int fd, const Completion &completion)
+    {
+        Submit(new IORequest{true, fd, nullptr, 0, 0, 0, nullptr, completion});
+    }
+
+    virtual const char *GetName() const { return "threads"; }
+
+private:
+
+    void Submit(IORequest *request)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            requests.push_back(request);
+        }
+        cv.notify_one();
+    }
+
+    void Run()
+    {
+        while (true) {
+            IORequest *request;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [this]() { return stopping || !requests.empty(); });
+                // Stop only once everything submitted is done.
+                if (requests.empty())
+                    return;
+                request = requests.front();
+                requests.pop_front();
+            }
+
+            int result = 0;
+            if (request->is_sync) {
+                if (fdatasync(request->fd) < 0)
+                    result = -errno;
+            } else {
+                while (request->written < request->size) {
+                    ssize_t written = pwrite(request->fd,
+                                             request->data + request->written,
+                                             request->size - request->written,
+                                             request->offset + request->written);
+                    if (written < 0 && errno == EINTR)
+                        continue;
+                    if (written <= 0) {
+                        result = (written < 0) ? -errno : -EIO;
+                        break;
+                    }
+                    request->written += written;
+                }
+                if (result == 0)
+                    result = static_cast<int>(request->written);
+            }
+
+            request->completion(result);
+            delete request;
+        }
+    }
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<IORequest *> requests;
+    std::vector<std::thread> workers;
+    bool stopping;
+};
+
+#ifdef HAVE_LIBURING
+
+/*
+ * One io_uring for all the streams: the submissions are serialized by a lock, and a single thread
+ * reaps the completions. Beyond the queue depth, the requests wait in a backlog instead of
+ * blocking the submitter, so the completion queue never overflows.
+ */
+class UringIO : public MP4AsyncIO
+{
+public:
+
+    static UringIO *Create(unsigned int queue_depth)
+    {
+        UringIO *io = new UringIO(queue_depth);
+        if (io_uring_queue_init(queue_depth, &io->ring, 0) < 0) {
+            delete io;
+            return nullptr;
+        }
+        io->initialized = true;
+
+        // IORING_OP_WRITE needs Linux 5.6.
+        bool supported = false;
+        struct io_uring_probe *probe = io_uring_get_probe_ring(&io->ring);
+        if (probe) {
+            supported = io_uring_opcode_supported(probe, IORING_OP_WRITE) && io_uring_opcode_supported(probe, IORING_OP_FSYNC);
+            io_uring_free_probe(probe);
+        }
+        if (!supported) {
+            delete io;
+            return nullptr;
+        }
+
+        io->reaper = std::thread(&UringIO::Run, io);
+        return io;
+    }
+
+    ~UringIO()
+    {
+        if (reaper.joinable()) {
+            std::unique_lock<std::mutex> lock(mutex);
+            idle_cv.wait(lock, [this]() { return in_flight == 0 && backlog.empty(); });
+
+            // A request without data tells the reaper to stop.
+            struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+            io_uring_prep_nop(sqe);
+            io_uring_sqe_set_data(sqe, nullptr);
+            io_uring_submit(&ring);
+            lock.unlock();
+            reaper.join();
+        }
+        if (initialized)
+            io_uring_queue_exit(&ring);
+    }
+
+    virtual void Write(int fd,
+                       const unsigned char *data,
+                       size_t size,
+                       uint64_t offset,
+                       const std::shared_ptr<const void> &owner,
+                       const Completion &completion)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        Submit(new IORequest{false, fd, data, size, offset, 0, owner, completion});
+    }
+
+    virtual void Sync(int fd, const Completion &completion)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        Submit(new IORequest{true, fd, nullptr, 0, 0, 0, nullptr, completion});
+    }
+
+    virtual const char *GetName() const { return "io_uring"; }
+
+private:
+
+    UringIO(unsigned int queue_depth)
+            : queue_depth(queue_depth)
+            , initialized(false)
+            , in_flight(0)
+    {
+    }
+
+    // Must hold the lock.
+    void Submit(IORequest *request)
+    {
+        if (!TrySubmit(request))
+            backlog.push_back(request);
+    }
+
+    // Must hold the lock. Return false if the queue is full.
+    bool TrySubmit(IORequest *request)
+    {
+        struct io_uring_sqe *sqe = (in_flight < queue_depth) ? io_uring_get_sqe(&ring) : nullptr;
+        if (!sqe)
+            return false;
+
+        if (request->is_sync) {
+            io_uring_prep_fsync(sqe, request->fd, IORING_FSYNC_DATASYNC);
+        } else {
+            io_uring_prep_write(sqe, request->fd,
+                                request->data + request->written,
+                                static_cast<unsigned int>(request->size - request->written),
+                                request->offset + request->written);
+        }
+        io_uring_sqe_set_data(sqe, request);
+        io_uring_submit(&ring);
+        in_flight++;
+        return true;
+    }
+
+    void Run()
+    {
+        while (true) {
+            struct io_uring_cqe *cqe;
+            if (io_uring_wait_cqe(&ring, &cqe) < 0)
+                continue;
+
+            IORequest *request = reinterpret_cast<IORequest *>(io_uring_cqe_get_data(cqe));
+            int result = cqe->res;
+            io_uring_cqe_seen(&ring, cqe);
+            if (!request)
+                return;
+
+            bool finished = true;
+            if (!request->is_sync) {
+                if (result > 0) {
+                    request->written += result;
+                    finished = (request->written >= request->size);
+                    result = static_cast<int>(request->written);
+                } else if (result == -EINTR || result == -EAGAIN) {
+                    finished = false;
+                } else if (result == 0) {
+                    result = -EIO;
+                }
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                in_flight--;
+                if (!finished) {
+                    Submit(request);
+                    request = nullptr;
+                }
+                while (!backlog.empty() && TrySubmit(backlog.front()))
+                    backlog.pop_front();
+                if (in_flight == 0 && backlog.empty())
+                    idle_cv.notify_all();
+            }
+
+            if (request) {
+                request->completion(result);
+                delete request;
+            }
+        }
+    }
+
+    const unsigned int queue_depth;
+    struct io_uring ring;
+    bool initialized;
+
+    std::mutex mutex;
+    std::condition_variable idle_cv;
+    unsigned int in_flight;
+    std::deque<IORequest *> backlog;
+    std::thread reaper;
+};
+
+#endif
+
+}
+
+MP4AsyncIO *MP4AsyncIO::Create(unsigned int queue_depth, unsigned int threads)
+{
+#ifdef HAVE_LIBURING
+    MP4AsyncIO *io = UringIO::Create(queue_depth);
+    if (io)
+        return io;
+    printf("io_uring is not available, fall back on threads\n");
+#endif
+    return new ThreadPoolIO(threads);
+}
+
+MP4AsyncIO &MP4AsyncIO::GetDefault()
+{
+    // Never released: the completions could still be running at exit.
+    static MP4AsyncIO *io = Create();
+    return *io;
+}
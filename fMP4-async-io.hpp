@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+
+/*
+ * Asynchronous file writes shared by many streams, so a slow disk never blocks the muxing threads.
+ *
+ * Backed by io_uring when built with liburing (HAVE_LIBURING) and supported by the kernel,
+ * by a pool of threads otherwise. The completions are called on an I/O thread, in any order.
+ */
+class MP4AsyncIO
+{
+public:
+
+    // The bytes written (all of them, short writes are continued), 0 for a sync, or -errno.
+    typedef std::function<void(int result)> Completion;
+
+    // Prefer io_uring with the given queue depth, or fall back on the given number of threads.
+    static MP4AsyncIO *Create(unsigned int queue_depth = 256, unsigned int threads = 4);
+
+    // Shared by the whole process, created on first use.
+    static MP4AsyncIO &GetDefault();
+
+    // Wait for the pending requests.
+    virtual ~MP4AsyncIO() {}
+
+    // The data is kept alive by owner until the completion.
+    virtual void Write(int fd,
+                       const unsigned char *data,
+                       size_t size,
+                       uint64_t offset,
+                       const std::shared_ptr<const void> &owner,
+                       const Completion &completion) = 0;
+
+    // fdatasync: covers the writes completed before it starts, not the ones still in flight.
+    virtual void Sync(int fd, const Completion &completion) = 0;
+
+    virtual const char *GetName() const = 0;
+};
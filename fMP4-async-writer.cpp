@@ -0,0 +1,193 @@
+#include "fMP4-async-writer.hpp"
+
+#include <chrono>
+
+MP4AsyncWriter::MP4AsyncWriter(MP4Writer *writer, const fMP4WriterConfig &config)
+        : MP4Writer()
+        , writer(writer)
+        , completion_callback(config.completion_callback)
+        , completion_context(config.completion_context)
+        , queue(config.async_queue_size)
+        , free_buffers(config.async_queue_size)
+        , skip_to_key_frame(false)
+        , queued_samples(0)
+        , written_samples(0)
+        , dropped_samples(0)
+        , stopping(false)
+        , muxer_waiting(false)
+        , flush_waiting(0)
+        , thread(&MP4AsyncWriter::Run, this)
+{
+}
+
+MP4AsyncWriter::~MP4AsyncWriter()
+{
+    {
+        std::lock_guard<std::mutex> lock(wait_mutex);
+        stopping.store(true);
+        muxer_cv.notify_one();
+    }
+    thread.join();
+
+    MP4Writer::Release(writer);
+}
+
+bool MP4AsyncWriter::WriteH264VideoSample(unsigned char *sample,
+                                          unsigned int sample_size,
+                                          bool is_key_frame,
+                                          unsigned long long int duration)
+{
+    return Enqueue(sample, sample_size, is_key_frame, false, 0, 0, duration, 0);
+}
+
+bool MP4AsyncWriter::WriteH264VideoSample(unsigned char *sample,
+                                          unsigned int sample_size,
+                                          bool is_key_frame,
+                                          long long int pts,
+                                          long long int dts,
+                                          unsigned long long int duration)
+{
+    return Enqueue(sample, sample_size, is_key_frame, true, pts, dts, duration, 0);
+}
+
+bool MP4AsyncWriter::WriteH264VideoSample(unsigned char *sample,
+                                          unsigned int sample_size,
+                                          bool is_key_frame,
+                                          long long int pts,
+                                          long long int dts,
+                                          unsigned long long int duration,
+                                          unsigned long long int capture_time_us)
+{
+    return Enqueue(sample, sample_size, is_key_frame, true, pts, dts, duration, capture_time_us);
+}
+
+bool MP4AsyncWriter::Enqueue(unsigned char *sample,
+                             unsigned int sample_size,
+                             bool is_key_frame,
+                             bool has_timestamps,
+                             long long int pts,
+                             long long int dts,
+                             unsigned long long int duration,
+                             unsigned long long int capture_time_us)
+{
+    // After a drop, the muxer could only resume from a key frame.
+    if (skip_to_key_frame && !is_key_frame) {
+        dropped_samples++;
+        return false;
+    }
+
+    if (queue.GetSize() >= queue.GetCapacity()) {
+        skip_to_key_frame = true;
+        dropped_samples++;
+        return false;
+    }
+
+    Sample queued;
+    free_buffers.TryPop(queued.data);
+    queued.data.assign(sample, sample + sample_size);
+    queued.is_key_frame    = is_key_frame;
+    queued.has_timestamps  = has_timestamps;
+    queued.pts             = pts;
+    queued.dts             = dts;
+    queued.duration        = duration;
+    queued.capture_time_us = capture_time_us;
+
+    // The slot of the last popped sample could still be in use by the muxing thread.
+    if (!queue.TryPush(std::move(queued))) {
+        skip_to_key_frame = true;
+        dropped_samples++;
+        return false;
+    }
+    skip_to_key_frame = false;
+    queued_samples++;
+
+    // Pairs with the fence in Run(): either the muxing thread sees the sample, or we see it waiting.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (muxer_waiting.load(std::memory_order_relaxed)) {
+        std::lock_guard<std::mutex> lock(wait_mutex);
+        muxer_cv.notify_one();
+    }
+    return true;
+}
+
+void MP4AsyncWriter::Run()
+{
+    Sample sample;
+    unsigned long long int sample_number = 0;
+    while (true) {
+        if (!queue.TryPop(sample)) {
+            std::unique_lock<std::mutex> lock(wait_mutex);
+            muxer_waiting.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            while (queue.GetSize() == 0 && !stopping.load())
+                muxer_cv.wait(lock);
+            muxer_waiting.store(false, std::memory_order_relaxed);
+
+            if (queue.GetSize() == 0)
+                break;      // Stopping, and all written
+            continue;
+        }
+
+        bool result;
+        {
+            std::lock_guard<std::mutex> lock(writer_mutex);
+            unsigned int size = static_cast<unsigned int>(sample.data.size());
+            if (sample.has_timestamps) {
+                result = writer->WriteH264VideoSample(sample.data.data(), size, sample.is_key_frame,
+                                                      sample.pts, sample.dts, sample.duration, sample.capture_time_us);
+            } else {
+                result = writer->WriteH264VideoSample(sample.data.data(), size, sample.is_key_frame, sample.duration);
+            }
+        }
+
+        if (completion_callback)
+            completion_callback(completion_context, sample_number, result);
+        sample_number++;
+
+        // Counted once notified, so a flush also waits for the completions.
+        written_samples++;
+        if (flush_waiting.load()) {
+            std::lock_guard<std::mutex> lock(wait_mutex);
+            flush_cv.notify_all();
+        }
+
+        // Its buffer is kept for a next sample.
+        free_buffers.TryPush(std::move(sample.data));
+    }
+}
+
+bool MP4AsyncWriter::Flush(int timeout_ms)
+{
+    // Only the samples queued before the flush: the writes could go on meanwhile.
+    unsigned long long int target = queued_samples.load();
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms > 0 ? timeout_ms : 0);
+
+    std::unique_lock<std::mutex> lock(wait_mutex);
+    flush_waiting++;
+    bool flushed = true;
+    while (written_samples.load() < target) {
+        if (timeout_ms < 0) {
+            flush_cv.wait(lock);
+        } else if (flush_cv.wait_until(lock, deadline) == std::cv_status::timeout) {
+            flushed = written_samples.load() >= target;
+            break;
+        }
+    }
+    flush_waiting--;
+    return flushed;
+}
+
+void MP4AsyncWriter::GetStats(fMP4WriterStats &stats) const
+{
+    {
+        std::lock_guard<std::mutex> lock(writer_mutex);
+        writer->GetStats(stats);
+    }
+    stats.queued_samples  = queue.GetSize();
+    stats.dropped_samples = dropped_samples.load();
+}
+
+void MP4AsyncWriter::RequestThumbnail()
+{
+    writer->RequestThumbnail();
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include "fMP4.hpp"
+#include "fMP4-ring.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * A writer muxing on its own thread: a write only copies the sample into a bounded queue, and the parsing,
+ * the muxing and the output callbacks all run on the muxing thread. So the thread reading the camera never
+ * waits for the muxer, nor for a slow sink behind it.
+ *
+ * When the queue is full, the sample is dropped, and so are the following ones up to the next key frame.
+ * The sample buffers go back to the writing thread once muxed, so the queue allocates nothing once warm.
+ *
+ * The writes must come from a single thread. The stats and the flush could be called from any thread.
+ */
+class MP4AsyncWriter : public MP4Writer
+{
+public:
+
+    // Take the ownership of the writer.
+    MP4AsyncWriter(MP4Writer *writer, const fMP4WriterConfig &config);
+
+    // Mux all the queued samples, then release the writer.
+    ~MP4AsyncWriter();
+
+    MP4AsyncWriter(const MP4AsyncWriter &) = delete;
+    MP4AsyncWriter &operator=(const MP4AsyncWriter &) = delete;
+
+    virtual bool WriteH264VideoSample(unsigned char *sample,
+                                      unsigned int sample_size,
+                                      bool is_key_frame,
+                                      unsigned long long int duration);
+
+    virtual bool WriteH264VideoSample(unsigned char *sample,
+                                      unsigned int sample_size,
+                                      bool is_key_frame,
+                                      long long int pts,
+                                      long long int dts,
+                                      unsigned long long int duration);
+
+    virtual bool WriteH264VideoSample(unsigned char *sample,
+                                      unsigned int sample_size,
+                                      bool is_key_frame,
+                                      long long int pts,
+                                      long long int dts,
+                                      unsigned long long int duration,
+                                      unsigned long long int capture_time_us);
+
+    virtual void GetStats(fMP4WriterStats &stats) const;
+
+    virtual void RequestThumbnail();
+
+    virtual bool Flush(int timeout_ms);
+
+private:
+
+    struct Sample
+    {
+        std::vector<unsigned char> data;
+        bool is_key_frame;
+        bool has_timestamps;        // Otherwise they follow the previous sample
+        long long int pts;
+        long long int dts;
+        unsigned long long int duration;
+        unsigned long long int capture_time_us;
+    };
+
+    bool Enqueue(unsigned char *sample,
+                 unsigned int sample_size,
+                 bool is_key_frame,
+                 bool has_timestamps,
+                 long long int pts,
+                 long long int dts,
+                 unsigned long long int duration,
+                 unsigned long long int capture_time_us);
+
+    void Run();
+
+    MP4Writer *const writer;
+    const fMP4CompletionCallback completion_callback;
+    void *const completion_context;
+
+    SPSCRing<Sample> queue;
+    SPSCRing<std::vector<unsigned char>> free_buffers;     // Back from the muxing thread
+
+    // Written by the writing thread only
+    bool skip_to_key_frame;
+    std::atomic<unsigned long long int> queued_samples;
+
+    // Owned by the muxing thread. The writer is only used under the lock, for its stats.
+    mutable std::mutex writer_mutex;
+    std::atomic<unsigned long long int> written_samples;
+    std::atomic<unsigned long long int> dropped_samples;
+
+    std::atomic<bool> stopping;
+    std::atomic<bool> muxer_waiting;
+    std::atomic<unsigned int> flush_waiting;
+    std::mutex wait_mutex;
+    std::condition_variable muxer_cv;
+    std::condition_variable flush_cv;
+
+    std::thread thread;
+};
@@ -0,0 +1,856 @@
+#pragma once
+
+#include "fMP4.h"
+#include "fMP4-box.hpp"
+#include "fMP4-nalu-filter.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <vector>
+#include <netinet/in.h>
+
+extern "C" {
+#include <libavformat/avformat.h>
+};
+
+#define GST_USE_UNSTABLE_API /* To avoid H264 parser warning */
+#include <gst/codecparsers/gsth264parser.h>
+
+/*
+ * The writer, header-only: the codec, the fragmentation and the output are template parameters,
+ * so the sample path is resolved at compile time and inlined, with no virtual call and no runtime
+ * branch on any of them. MP4Writer and the C API are an instantiation of it (see MP4WriterImp),
+ * an embedded integrator could instantiate it directly with its own sink.
+ *
+ * Codec: the track configuration and the samples of a codec, see MP4H264Codec. Its stats are added with AddStats().
+ * FragmentPolicy: where the fragments are cut, see MP4LowDelayFragments:
+ *     const char *GetMovFlags() const;
+ *     int64_t GetFragmentDurationUs() const;     // Cut by the muxer on duration, 0 for none
+ *     bool CutsBefore(unsigned int sample_size, bool is_key_frame, long long int dts);   // Before each sample
+ * Sink: where the output goes, and its buffer, see MP4CallbackSink:
+ *     int Write(unsigned char *buf, int size);
+ *     unsigned char *AcquireBuffer(size_t size, size_t &capacity);  // nullptr on failure
+ *     void ReleaseBuffer(unsigned char *buffer, size_t capacity);
+ */
+
+// av_register_all() is not thread-safe, and writers could be created from many threads.
+inline void MP4RegisterAll()
+{
+    static std::once_flag register_flag;
+    std::call_once(register_flag, []() { av_register_all(); });
+}
+
+// What the muxer needs to know about the H264 track. Parsed once from the SPS and the PPS.
+struct MP4H264TrackConfig
+{
+    unsigned char profile_idc;
+    unsigned char profile_compatibility;
+    unsigned char level_idc;
+    int width;
+    int height;
+    std::vector<unsigned char> extradata;       // avcC
+};
+
+/*
+ * H264 in AnnexB, to the AVCC samples and the avcC box of the mp4 track.
+ * Parse() splits an access unit into NALUs, the other calls work on the last parsed one.
+ */
+class MP4H264Codec
+{
+public:
+
+    typedef MP4H264TrackConfig TrackConfig;
+
+    MP4H264Codec()
+            : parser(gst_h264_nal_parser_new())
+    {
+    }
+
+    ~MP4H264Codec()
+    {
+        gst_h264_nal_parser_free(parser);
+    }
+
+    MP4H264Codec(const MP4H264Codec &) = delete;
+    MP4H264Codec &operator=(const MP4H264Codec &) = delete;
+
+    void Parse(const unsigned char *data, unsigned int length)
+    {
+        nalus.clear();
+
+        GstH264NalUnit nalu = {0};
+        unsigned int offset = 0;
+        while (gst_h264_parser_identify_nalu(parser, data, offset, length, &nalu) == GST_H264_PARSER_OK) {
+            gst_h264_parser_parse_nal(parser, &nalu);
+            offset = nalu.size + nalu.offset;
+            nalus.push_back(nalu);
+        }
+
+        // Handle the last NALU because there is no other start_code followed it.
+        if (gst_h264_parser_identify_nalu_unchecked(parser, data, offset, length, &nalu) == GST_H264_PARSER_OK) {
+            gst_h264_parser_parse_nal(parser, &nalu);
+            nalus.push_back(nalu);
+        }
+    }
+
+    // From the SPS and the PPS of the access unit.
+    bool GetTrackConfig(TrackConfig &config)
+    {
+        GstH264NalUnit nal_sps = {0}, nal_pps = {0};
+        for (auto &nalu : nalus) {
+            if (nalu.type == GST_H264_NAL_SPS) nal_sps = nalu;
+            else if (nalu.type == GST_H264_NAL_PPS) nal_pps = nalu;
+        }
+
+        if (nal_sps.size == 0 || nal_pps.size == 0) {
+            printf("Missing SPS or PPS\n");
+            return false;
+        }
+
+        // Parse SPS to get necessary params.
+        {
+            GstH264SPS sps = {0};
+            gst_h264_parser_parse_sps(parser, &nal_sps, &sps, false);
+
+            config.profile_idc = sps.profile_idc;
+            config.level_idc = sps.level_idc;
+            config.width  = sps.frame_cropping_flag ? sps.crop_rect_width : sps.width;
+            config.height = sps.frame_cropping_flag ? sps.crop_rect_height : sps.height;
+
+            config.profile_compatibility = 0x00;
+            //config.profile_compatibility = (sps.constraint_set0_flag << 7) | (sps.constraint_set1_flag << 6) |
+            //                               (sps.constraint_set2_flag << 5) | (sps.constraint_set3_flag << 4);
+        }
+
+        // Fill extra data for AVCC format
+        std::vector<unsigned char> &extradata = config.extradata;
+        extradata.clear();
+        extradata.reserve(nal_sps.size + nal_pps.size + 11);
+        extradata.push_back(0x01);                                  // configurationVersion
+        extradata.push_back(config.profile_idc);                    // AVCProfileIndication
+        extradata.push_back(config.profile_compatibility);          // profile_compatibility
+        extradata.push_back(config.level_idc);                      // AVCLevelIndication, level: 4.0
+        extradata.push_back(0xff);                                  // 6 bits reserved (111111) + 2 bits nal size length - 1 (11)
+        extradata.push_back(0xe1);                                  // 3 bits reserved (111) + 5 bits number of sps (00001)
+
+        extradata.push_back(static_cast<unsigned char>(nal_sps.size >> 8));
+        extradata.push_back(static_cast<unsigned char>(nal_sps.size));
+        extradata.insert(extradata.end(), nal_sps.data + nal_sps.offset, nal_sps.data + nal_sps.offset + nal_sps.size);
+
+        extradata.push_back(0x01);                                  // 8 bits number of pps (00000001)
+        extradata.push_back(static_cast<unsigned char>(nal_pps.size >> 8));
+        extradata.push_back(static_cast<unsigned char>(nal_pps.size));
+        extradata.insert(extradata.end(), nal_pps.data + nal_pps.offset, nal_pps.data + nal_pps.offset + nal_pps.size);
+        return true;
+    }
+
+    // A recovery point SEI in the access unit: decoding could start there, as at an IDR, even without one
+    // (intra refresh, open GOP). The pictures are exact from recovery_frame_cnt frames on.
+    bool IsRecoveryPoint()
+    {
+        for (auto &nalu : nalus) {
+            if (nalu.type != GST_H264_NAL_SEI)
+                continue;
+
+            GArray *messages = nullptr;
+            gst_h264_parser_parse_sei(parser, &nalu, &messages);
+            if (!messages)
+                continue;
+
+            bool found = false;
+            for (guint i = 0; i < messages->len && !found; i++)
+                found = g_array_index(messages, GstH264SEIMessage, i).payloadType == GST_H264_SEI_RECOVERY_POINT;
+            g_array_free(messages, TRUE);
+            if (found)
+                return true;
+        }
+        return false;
+    }
+
+    // Put the slices of the access unit into one AVCC packet, with the NALUs kept by the filter.
+    // Return false if there is no slice.
+    bool GetPacket(AVPacket &packet)
+    {
+        kept.clear();
+        bool has_slice = false;
+        filter.Begin();
+        for (auto &nalu : nalus) {
+            const unsigned char *data = nalu.data + nalu.offset;
+            unsigned int size = nalu.size;
+            if (!filter.Filter(data, size))
+                continue;
+            kept.push_back({&nalu, data, size});
+            has_slice |= (nalu.type == GST_H264_NAL_SLICE_IDR || nalu.type == GST_H264_NAL_SLICE);
+        }
+        if (!has_slice)
+            return false;
+
+        // The common case: a single slice after a 4 bytes start code. Convert AnnexB to AVC1 in place.
+        const GstH264NalUnit *first = kept[0].nalu;
+        if (kept.size() == 1 && first->offset - first->sc_offset == 4) {
+            unsigned int *p = (unsigned int *) (first->data + first->offset - 4);
+            *p = htonl(first->size);
+
+            packet.data = (unsigned char *)(p);
+            packet.size = first->size + 4;
+            return true;
+        }
+
+        // Otherwise, all the NALUs of the picture go into one packet, so they share the timestamps.
+        access_unit.clear();
+        for (auto &nalu : kept) {
+            unsigned int size = htonl(nalu.size);
+            access_unit.insert(access_unit.end(), (unsigned char *)&size, (unsigned char *)&size + 4);
+            access_unit.insert(access_unit.end(), nalu.data, nalu.data + nalu.size);
+        }
+
+        packet.data = access_unit.data();
+        packet.size = static_cast<int>(access_unit.size());
+        return true;
+    }
+
+    static void Print(const TrackConfig &config)
+    {
+        printf("Profile: %d, Compatibility: %d, Level: %d\n", config.profile_idc, config.profile_compatibility, config.level_idc);
+        printf("Width: %d, Height: %d\n", config.width, config.height);
+    }
+
+    static void SetCodecParameters(AVCodecContext *codec, const TrackConfig &config)
+    {
+        codec->codec_id   = AV_CODEC_ID_H264;
+        codec->profile    = config.profile_idc;
+        codec->level      = config.level_idc;
+        codec->codec_type = AVMEDIA_TYPE_VIDEO;
+        codec->width      = config.width;
+        codec->height     = config.height;
+        codec->pix_fmt    = AV_PIX_FMT_YUV420P;
+        codec->codec_tag  = 0;
+
+        // The avcC box, built once by GetTrackConfig.
+        codec->extradata_size = static_cast<int>(config.extradata.size());
+        codec->extradata = (uint8_t *)av_mallocz(config.extradata.size());
+        memcpy(codec->extradata, config.extradata.data(), config.extradata.size());
+    }
+
+    MP4NaluFilter &GetNaluFilter() { return filter; }
+
+    void AddStats(fMP4WriterStats &stats) const
+    {
+        filter.AddStats(stats);
+    }
+
+private:
+
+    // What goes into the sample: the NALU itself, or a copy rewritten by the filter.
+    struct KeptNalu
+    {
+        const GstH264NalUnit *nalu;
+        const unsigned char *data;
+        unsigned int size;
+    };
+
+    GstH264NalParser *parser;
+    std::vector<GstH264NalUnit> nalus;
+    MP4NaluFilter filter;
+    std::vector<KeptNalu> kept;
+    std::vector<unsigned char> access_unit;
+};
+
+// Cut at every key frame, so a GOP always starts a fragment (see MP4GopCache), and every 200 ms in between.
+struct MP4LowDelayFragments
+{
+    static const char *GetMovFlags() { return "empty_moov+default_base_moof+frag_keyframe"; }
+    static int64_t GetFragmentDurationUs() { return 200 * 1000; }
+    static bool CutsBefore(unsigned int, bool, long long int) { return false; }
+};
+
+// Only produce fragment until we have next key frame.
+struct MP4KeyFrameFragments
+{
+    static const char *GetMovFlags() { return "empty_moov+default_base_moof+frag_keyframe"; }
+    static int64_t GetFragmentDurationUs() { return 0; }
+    static bool CutsBefore(unsigned int, bool, long long int) { return false; }
+};
+
+/*
+ * Fragments of about target_bytes, so their size no longer follows the scene complexity: cut at every key frame,
+ * and in between before the sample which would take the fragment over the target, unless it lasts less than
+ * min_duration yet. Cut anyway once it lasts max_duration (0 for no limit). Durations are in the writer timescale.
+ * The size is estimated from the samples and their entries in the moof, the writer stats give the actual ones.
+ * Without a target, as MP4LowDelayFragments.
+ */
+class MP4SizeTargetedFragments
+{
+public:
+
+    explicit MP4SizeTargetedFragments(unsigned int target_bytes = 0, long long int min_duration = 0, long long int max_duration = 0)
+            : target_bytes(target_bytes)
+            , min_duration(min_duration)
+            , max_duration(max_duration)
+            , fragment_bytes(0)
+            , fragment_start(0)
+    {
+    }
+
+    const char *GetMovFlags() const { return MP4LowDelayFragments::GetMovFlags(); }
+
+    int64_t GetFragmentDurationUs() const { return target_bytes > 0 ? 0 : MP4LowDelayFragments::GetFragmentDurationUs(); }
+
+    bool CutsBefore(unsigned int sample_size, bool is_key_frame, long long int dts)
+    {
+        if (target_bytes == 0)
+            return false;
+
+        unsigned long long int sample_bytes = sample_size + SAMPLE_ENTRY_BYTES;
+        long long int duration = dts - fragment_start;
+        bool cut = fragment_bytes > 0 &&
+                   ((fragment_bytes + sample_bytes > target_bytes && duration >= min_duration) ||
+                    (max_duration > 0 && duration >= max_duration));
+
+        // The muxer cuts at the key frames itself.
+        if (cut || is_key_frame || fragment_bytes == 0) {
+            fragment_bytes = FRAGMENT_HEADER_BYTES;
+            fragment_start = dts;
+        }
+        fragment_bytes += sample_bytes;
+        return cut && !is_key_frame;
+    }
+
+private:
+
+    // moof, mfhd, traf, tfhd, tfdt, trun and the mdat header, then a trun entry per sample.
+    static const unsigned int FRAGMENT_HEADER_BYTES = 128;
+    static const unsigned int SAMPLE_ENTRY_BYTES = 16;
+
+    unsigned int target_bytes;
+    long long int min_duration;
+    long long int max_duration;
+    unsigned long long int fragment_bytes;
+    long long int fragment_start;
+};
+
+// A DataCallback given as the context of a DataCallbackWithContext.
+inline int MP4CallDataCallback(void *callback, unsigned char *buf, int buf_size)
+{
+    return reinterpret_cast<DataCallback>(callback)(buf, buf_size);
+}
+
+// A DataCallbackWithContext for no callback.
+inline int MP4DiscardData(void *, unsigned char *, int buf_size)
+{
+    return buf_size;
+}
+
+// The output to a callback, with a buffer from av_malloc.
+class MP4CallbackSink
+{
+public:
+
+    MP4CallbackSink(DataCallbackWithContext callback, void *context)
+            : callback(callback)
+            , context(context)
+    {
+    }
+
+    int Write(unsigned char *buf, int size) { return callback(context, buf, size); }
+
+    unsigned char *AcquireBuffer(size_t size, size_t &capacity)
+    {
+        unsigned char *buffer = static_cast<unsigned char *>(av_malloc(size));
+        capacity = buffer ? size : 0;
+        return buffer;
+    }
+
+    void ReleaseBuffer(unsigned char *buffer, size_t) { av_free(buffer); }
+
+private:
+
+    DataCallbackWithContext callback;
+    void *context;
+};
+
+template <typename Codec, typename FragmentPolicy, typename Sink>
+class BasicMP4Writer
+{
+public:
+
+    typedef typename Codec::TrackConfig TrackConfig;
+
+    // Timestamps and durations are in 1/timescale seconds. The output goes to the sink in chunks
+    // of output_buffer_size, 0 to size it from the first key frame (a fragment starts with it).
+    explicit BasicMP4Writer(const Sink &sink,
+                            unsigned int timescale = 1000,
+                            unsigned int output_buffer_size = 0,
+                            const FragmentPolicy &fragment_policy = FragmentPolicy())
+            : sink(sink)
+            , fragment_policy(fragment_policy)
+            , timescale(timescale > 0 ? timescale : 1000)
+            , output_buffer_size(output_buffer_size)
+            , end_time(0)
+            , last_dts(0)
+            , has_last_dts(false)
+            , has_key_frame(false)
+            , recovery_points_as_key_frames(true)
+            , format_context(nullptr)
+            , video_stream_id(0)
+            , avio_buffer(nullptr)
+            , avio_buffer_capacity(0)
+            , created_at(std::chrono::steady_clock::now())
+            , time_to_first_byte_us(-1)
+            , setup_time_us(0)
+            , output_bytes(0)
+            , box_remaining(0)
+            , box_is_mdat(false)
+            , fragment_size(0)
+            , fragments(0)
+            , fragment_bytes_min(0)
+            , fragment_bytes_max(0)
+            , fragment_bytes_mean(0)
+            , fragment_bytes_m2(0)
+    {
+        MP4RegisterAll();
+    }
+
+    // Write the trailer, so the last fragment goes out.
+    ~BasicMP4Writer()
+    {
+        if (format_context && av_write_trailer(format_context) < 0) {
+            printf("Fail to write trailer\n");
+        }
+        Free();
+    }
+
+    BasicMP4Writer(const BasicMP4Writer &) = delete;
+    BasicMP4Writer &operator=(const BasicMP4Writer &) = delete;
+
+    // Set up the muxer and write the init segment, without waiting for the first key frame.
+    // The output format is looked up if not given.
+    bool Open(const TrackConfig &config, AVOutputFormat *output_format)
+    {
+        auto start = std::chrono::steady_clock::now();
+
+        avformat_alloc_output_context2(&format_context, output_format, output_format ? nullptr : "mp4", nullptr);
+        if (!format_context) {
+            printf("Fail to create output context\n");
+            return false;
+        }
+
+        AVStream *out_stream = avformat_new_stream(format_context, nullptr);
+        if (!out_stream) {
+            printf("Fail to allocate output stream\n");
+            Free();
+            return false;
+        }
+
+        out_stream->id = video_stream_id = format_context->nb_streams - 1;
+        Codec::SetCodecParameters(out_stream->codec, config);
+
+        // Keep the default 90 kHz track timescale if it represents the caller timestamps exactly (Ex: ms).
+        // Otherwise use the caller timescale (the muxer could pick a multiple of it), so they are never rounded.
+        if (90000 % timescale != 0)
+            out_stream->time_base = (AVRational){1, static_cast<int>(timescale)};
+
+        if (format_context->oformat->flags & AVFMT_GLOBALHEADER)
+            out_stream->codec->flags |= CODEC_FLAG_GLOBAL_HEADER;
+
+        /*
+         * Open output file
+         */
+        if (!(format_context->oformat->flags & AVFMT_NOFILE)) {
+            avio_buffer = sink.AcquireBuffer(output_buffer_size > 0 ? output_buffer_size : 64 * 1024, avio_buffer_capacity);
+            if (!avio_buffer) {
+                printf("Fail to allocate output buffer\n");
+                Free();
+                return false;
+            }
+
+            // Allocate our custom AVIO context
+            AVIOContext *avio_out = avio_alloc_context(avio_buffer,
+                                                       static_cast<int>(avio_buffer_capacity),
+                                                       1,
+                                                       this,
+                                                       nullptr,
+                                                       &WriteOutput,
+                                                       nullptr
+            );
+            if (!avio_out) {
+                printf("Fail to create avio context\n");
+                Free();
+                return false;
+            }
+
+            format_context->pb = avio_out;
+            format_context->flags = AVFMT_FLAG_CUSTOM_IO;
+        }
+
+        /*
+         * Write file header
+         */
+        AVDictionary *movflags = nullptr;
+        av_dict_set(&movflags, "movflags", fragment_policy.GetMovFlags(), 0);
+        if (fragment_policy.GetFragmentDurationUs() > 0)
+            av_dict_set_int(&movflags, "frag_duration", fragment_policy.GetFragmentDurationUs(), 0);
+
+        int result = avformat_write_header(format_context, &movflags);
+        av_dict_free(&movflags);
+        if (result < 0) {
+            printf("Error occurred when opening output file\n");
+            Free();
+            return false;
+        }
+
+        // Send the init segment now, instead of with the first fragment.
+        avio_flush(format_context->pb);
+
+        setup_time_us = GetElapsedMicroseconds(start);
+        return true;
+    }
+
+    bool IsOpen() const { return format_context != nullptr; }
+
+    bool CheckTimestamps(long long int pts, long long int dts) const
+    {
+        if (pts < dts) {
+            printf("Invalid timestamps: pts %lld is before dts %lld\n", pts, dts);
+            return false;
+        }
+        if (has_last_dts && dts <= last_dts) {
+            printf("Invalid timestamps: dts %lld is not after %lld\n", dts, last_dts);
+            return false;
+        }
+        return true;
+    }
+
+    // Without B-frames, the samples simply follow each other.
+    bool Write(unsigned char *sample, unsigned int sample_size, bool is_key_frame, unsigned long long int duration)
+    {
+        long long int timestamp = static_cast<long long int>(end_time);
+        return Write(sample, sample_size, is_key_frame, timestamp, timestamp, duration);
+    }
+
+    // Samples in decode order. The first one must be a key frame (or a recovery point) with the parameter sets,
+    // unless opened already: the ones before are dropped. The sample could be converted in place.
+    // capture_time_us: the wall-clock time of the capture, in us since the Unix epoch, 0 if unknown.
+    // The one of the first sample of a fragment goes in a prft before its moof.
+    bool Write(unsigned char *sample,
+               unsigned int sample_size,
+               bool is_key_frame,
+               long long int pts,
+               long long int dts,
+               unsigned long long int duration,
+               unsigned long long int capture_time_us = 0)
+    {
+        if (!CheckTimestamps(pts, dts))
+            return false;
+
+        codec.Parse(sample, sample_size);
+
+        // Cameras with intra refresh send IDRs rarely or never: until the stream shows key frames of its own,
+        // a recovery point starts the stream, and a fragment, as a key frame (players only start at a sync sample).
+        if (is_key_frame)
+            recovery_points_as_key_frames = false;
+        else if (recovery_points_as_key_frames)
+            is_key_frame = codec.IsRecoveryPoint();
+
+        if (!has_key_frame) {
+            if (!is_key_frame) {
+                printf("Drop current frame because it is not a key frame. Need key frame for initialization\n");
+                return true;
+            }
+
+            // Already done for a writer opened from a template.
+            if (!format_context && !OpenFromKeyFrame(sample_size)) {
+                printf("Fail to add video track\n");
+                return false;
+            }
+            has_key_frame = true;
+        }
+
+        AVPacket packet = { 0 };
+        av_init_packet(&packet);
+        if (!codec.GetPacket(packet)) {
+            return true;
+        }
+
+        packet.stream_index = video_stream_id;
+        packet.pos          = -1;
+
+        packet.pts = pts;
+        packet.dts = dts;
+        packet.duration = static_cast<int>(duration);
+        av_packet_rescale_ts(&packet, (AVRational){1, static_cast<int>(timescale)}, format_context->streams[video_stream_id]->time_base);
+
+        if (is_key_frame) {
+            packet.flags |= AV_PKT_FLAG_KEY;
+        }
+
+        if (fragment_policy.CutsBefore(static_cast<unsigned int>(packet.size), is_key_frame, dts))
+            Flush();
+
+        // The fragments written meanwhile only hold the samples before this one.
+        pending_samples.push_back({static_cast<uint64_t>(packet.pts - packet.dts), capture_time_us});
+        if (av_interleaved_write_frame(format_context, &packet) < 0) {
+            printf("Fail to write frame\n");
+            pending_samples.pop_back();
+            return false;
+        }
+
+        last_dts = dts;
+        has_last_dts = true;
+        end_time = static_cast<unsigned long long int>(dts) + duration;
+        return true;
+    }
+
+    // Send the current fragment now, instead of with the next one.
+    bool Flush()
+    {
+        if (!format_context)
+            return false;
+        av_write_frame(format_context, nullptr);
+        avio_flush(format_context->pb);
+        return true;
+    }
+
+    // The end of the last sample, the timestamp of the next one without B-frames.
+    unsigned long long int GetEndTime() const { return end_time; }
+
+    void GetStats(fMP4WriterStats &stats) const
+    {
+        stats.time_to_first_byte_us = time_to_first_byte_us;
+        stats.setup_time_us         = setup_time_us;
+        stats.output_bytes          = output_bytes;
+        stats.trick_play_bytes      = 0;
+        stats.queued_samples        = 0;
+        stats.dropped_samples       = 0;
+        stats.fragments             = fragments;
+        stats.fragment_bytes_min    = fragment_bytes_min;
+        stats.fragment_bytes_max    = fragment_bytes_max;
+        stats.fragment_bytes_mean   = fragment_bytes_mean;
+        stats.fragment_bytes_stddev = (fragments > 1) ? std::sqrt(fragment_bytes_m2 / (fragments - 1)) : 0.0;
+        memset(stats.filtered_nal_bytes, 0, sizeof(stats.filtered_nal_bytes));
+        stats.filtered_sei_bytes    = 0;
+        codec.AddStats(stats);
+    }
+
+    // Ex: to set the NALU filter of MP4H264Codec before the first sample.
+    Codec &GetCodec() { return codec; }
+
+private:
+
+    static long long int GetElapsedMicroseconds(std::chrono::steady_clock::time_point start)
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    // Performs a write operation using the signature required for avio.
+    static int WriteOutput(void *opaque, uint8_t *buf, int buf_size)
+    {
+        // Don't need to write mfra box
+        if (buf[4] == 'm' && buf[5] == 'f' && buf[6] == 'r' && buf[7] == 'a') {
+            return buf_size;
+        }
+
+        BasicMP4Writer *writer = reinterpret_cast<BasicMP4Writer *>(opaque);
+        if (writer->time_to_first_byte_us < 0)
+            writer->time_to_first_byte_us = GetElapsedMicroseconds(writer->created_at);
+
+        // Along with the bytes held back from the previous call, if any.
+        if (writer->held_output.empty())
+            return writer->ForwardBoxes(buf, static_cast<size_t>(buf_size)) ? buf_size : -1;
+
+        writer->output.swap(writer->held_output);
+        writer->output.insert(writer->output.end(), buf, buf + buf_size);
+        bool result = writer->ForwardBoxes(writer->output.data(), writer->output.size());
+        writer->output.clear();
+        return result ? buf_size : -1;
+    }
+
+    /*
+     * Forward the output to the sink, following its boxes: for the size of each media fragment (from its moof
+     * to the end of its mdat), and for a prft before each moof which first sample has a capture time.
+     * A moof is held back until whole, for its decode time and its sample count.
+     */
+    bool ForwardBoxes(unsigned char *data, size_t size)
+    {
+        size_t start = 0;   // Not forwarded yet
+        size_t offset = 0;
+        while (offset < size) {
+            if (box_remaining > 0) {
+                size_t box_bytes = static_cast<size_t>(std::min<uint64_t>(size - offset, box_remaining));
+                box_remaining -= box_bytes;
+                fragment_size += box_bytes;
+                offset += box_bytes;
+
+                if (box_remaining == 0 && box_is_mdat) {
+                    AddFragment(fragment_size);
+                    box_is_mdat = false;
+                }
+                continue;
+            }
+
+            if (size - offset < 8) {
+                held_output.assign(data + offset, data + size);
+                break;
+            }
+
+            uint32_t box_size = MP4ReadU32(data + offset);
+            uint32_t box_type = MP4ReadU32(data + offset + 4);
+            if (box_size < 8) {
+                // To the end of the file, or a 64 bits size: never written for a fragment.
+                box_remaining = UINT64_MAX;
+                continue;
+            }
+
+            if (box_type == MP4_FOURCC('m', 'o', 'o', 'f')) {
+                if (box_size > size - offset) {
+                    held_output.assign(data + offset, data + size);
+                    break;
+                }
+                if (!WriteProducerReferenceTime(data + start, offset - start, data + offset, box_size))
+                    return false;
+                start = offset;
+                fragment_size = 0;
+            }
+            box_is_mdat = (box_type == MP4_FOURCC('m', 'd', 'a', 't'));
+            box_remaining = box_size - 8;
+            fragment_size += 8;
+            offset += 8;
+        }
+
+        return SinkWrite(data + start, offset - start);
+    }
+
+    // Forward the output before the moof, then the prft of its first sample, if captured at a known time.
+    bool WriteProducerReferenceTime(unsigned char *data, size_t size, const unsigned char *moof, size_t moof_size)
+    {
+        MP4MovieFragmentInfo info;
+        if (!MP4ParseMovieFragment(moof, moof_size, info)) {
+            pending_samples.clear();
+            return SinkWrite(data, size);
+        }
+
+        PendingSample first = pending_samples.empty() ? PendingSample() : pending_samples.front();
+        pending_samples.erase(pending_samples.begin(),
+                              pending_samples.begin() + std::min<size_t>(info.sample_count, pending_samples.size()));
+        if (!SinkWrite(data, size))
+            return false;
+        if (first.capture_time_us == 0)
+            return true;
+
+        unsigned char prft[PRFT_BOX_SIZE];
+        MP4WriteProducerReferenceTime(prft, video_stream_id + 1, first.capture_time_us,
+                                      info.base_decode_time + first.composition_offset);
+        return SinkWrite(prft, sizeof(prft));
+    }
+
+    bool SinkWrite(unsigned char *data, size_t size)
+    {
+        if (size == 0)
+            return true;
+        output_bytes += size;
+        return sink.Write(data, static_cast<int>(size)) >= 0;
+    }
+
+    void AddFragment(unsigned long long int size)
+    {
+        fragments++;
+        if (fragments == 1 || size < fragment_bytes_min) fragment_bytes_min = size;
+        if (fragments == 1 || size > fragment_bytes_max) fragment_bytes_max = size;
+
+        double delta = size - fragment_bytes_mean;
+        fragment_bytes_mean += delta / fragments;
+        fragment_bytes_m2 += delta * (size - fragment_bytes_mean);
+    }
+
+    // To compatible with AVC1 format, we need to add SPS/PPS into mp4 header. (In avcC box)
+    bool OpenFromKeyFrame(unsigned int key_frame_size)
+    {
+        auto start = std::chrono::steady_clock::now();
+
+        // A fragment starts with the key frame: leave room for it and the frames following it.
+        if (output_buffer_size == 0)
+            output_buffer_size = std::min(2 * key_frame_size + 4096, 1024u * 1024u);
+
+        TrackConfig config;
+        if (!codec.GetTrackConfig(config))
+            return false;
+        Codec::Print(config);
+
+        if (!Open(config, nullptr))
+            return false;
+
+        av_dump_format(format_context, 0, "CustomAVIO", 1);
+
+        setup_time_us = GetElapsedMicroseconds(start);
+        return true;
+    }
+
+    void Free()
+    {
+        if (format_context && format_context->nb_streams > video_stream_id &&
+            format_context->streams[video_stream_id]->codec) {
+            avcodec_close(format_context->streams[video_stream_id]->codec);
+        }
+
+        // Free custom AVIOContext.
+        if (format_context && !(format_context->oformat->flags & AVFMT_NOFILE) && format_context->pb)
+            av_free(format_context->pb);
+
+        // Need to free the buffer that we allocate to our custom AVIOContext.
+        if (avio_buffer)
+            sink.ReleaseBuffer(avio_buffer, avio_buffer_capacity);
+        avio_buffer = nullptr;
+        avio_buffer_capacity = 0;
+
+        if (format_context)
+            avformat_free_context(format_context);
+        format_context = nullptr;
+    }
+
+    Sink sink;
+    FragmentPolicy fragment_policy;
+    Codec codec;
+    const unsigned int timescale;
+    unsigned int output_buffer_size;
+    unsigned long long int end_time;
+    long long int last_dts;
+    bool has_last_dts;
+    bool has_key_frame;
+    bool recovery_points_as_key_frames;
+    AVFormatContext *format_context;
+    unsigned int video_stream_id;
+    unsigned char *avio_buffer;
+    size_t avio_buffer_capacity;
+
+    std::chrono::steady_clock::time_point created_at;
+    long long int time_to_first_byte_us;
+    long long int setup_time_us;
+    unsigned long long int output_bytes;
+
+    // The samples written to the fragment not out yet: for the prft of each fragment, in the track timescale.
+    struct PendingSample
+    {
+        uint64_t composition_offset;
+        unsigned long long int capture_time_us;
+    };
+    std::deque<PendingSample> pending_samples;
+
+    // The output being forwarded, and the start of the box it ends with if incomplete.
+    std::vector<unsigned char> output;
+    std::vector<unsigned char> held_output;
+
+    // The sizes of the media fragments, from the boxes of the output.
+    uint64_t box_remaining;
+    bool box_is_mdat;
+    unsigned long long int fragment_size;
+    unsigned long long int fragments;
+    unsigned long long int fragment_bytes_min;
+    unsigned long long int fragment_bytes_max;
+    double fragment_bytes_mean;
+    double fragment_bytes_m2;
+};
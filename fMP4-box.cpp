@@ -0,0 +1,227 @@
+#include "fMP4-box.hpp"
+
+bool MP4ParseBoxHeader(const unsigned char *data, size_t size, MP4BoxHeader &header)
+{
+    if (size < 8)
+        return false;
+
+    header.size = MP4ReadU32(data);
+    header.type = MP4ReadU32(data + 4);
+    header.header_size = 8;
+
+    if (header.size == 1) {
+        if (size < 16)
+            return false;
+        header.size = MP4ReadU64(data + 8);
+        header.header_size = 16;
+    }
+
+    // size == 0 (box extends to the end of file) is never produced by the writer.
+    return (header.size >= header.header_size);
+}
+
+const unsigned char *MP4FindBox(const unsigned char *data, size_t size, uint32_t type, MP4BoxHeader &header)
+{
+    size_t offset = 0;
+    while (offset < size && MP4ParseBoxHeader(data + offset, size - offset, header)) {
+        if (header.size > size - offset)
+            return nullptr;
+        if (header.type == type)
+            return data + offset;
+        offset += header.size;
+    }
+    return nullptr;
+}
+
+bool MP4ParseMovieFragment(const unsigned char *data, size_t size, MP4MovieFragmentInfo &info)
+{
+    info = MP4MovieFragmentInfo();
+
+    MP4BoxHeader moof;
+    if (!MP4ParseBoxHeader(data, size, moof) || moof.type != MP4_FOURCC('m', 'o', 'o', 'f') || moof.size > size)
+        return false;
+
+    const unsigned char *moof_payload = data + moof.header_size;
+    size_t moof_payload_size = moof.size - moof.header_size;
+
+    MP4BoxHeader header;
+    const unsigned char *mfhd = MP4FindBox(moof_payload, moof_payload_size, MP4_FOURCC('m', 'f', 'h', 'd'), header);
+    if (mfhd && header.size >= header.header_size + 8)
+        info.sequence_number = MP4ReadU32(mfhd + header.header_size + 4);
+
+    MP4BoxHeader traf_header;
+    const unsigned char *traf = MP4FindBox(moof_payload, moof_payload_size, MP4_FOURCC('t', 'r', 'a', 'f'), traf_header);
+    if (!traf)
+        return false;
+
+    const unsigned char *traf_payload = traf + traf_header.header_size;
+    size_t traf_payload_size = traf_header.size - traf_header.header_size;
+
+    // tfhd: the defaults of this track fragment
+    uint32_t default_duration = 0;
+    uint32_t default_flags = 0;
+    bool has_default_flags = false;
+    const unsigned char *tfhd = MP4FindBox(traf_payload, traf_payload_size, MP4_FOURCC('t', 'f', 'h', 'd'), header);
+    if (tfhd) {
+        if (header.size < header.header_size + 8)
+            return false;
+        const unsigned char *p = tfhd + header.header_size;
+        const unsigned char *end = tfhd + header.size;
+        uint32_t flags = MP4ReadU32(p) & 0xffffff;
+        p += 8; // version/flags + track_ID
+
+        if (flags & TFHD_BASE_DATA_OFFSET) p += 8;
+        if (flags & TFHD_SAMPLE_DESCRIPTION_INDEX) p += 4;
+        if (p > end) return false;
+        if (flags & TFHD_DEFAULT_SAMPLE_DURATION) {
+            if (p + 4 > end) return false;
+            default_duration = MP4ReadU32(p);
+            p += 4;
+        }
+        if (flags & TFHD_DEFAULT_SAMPLE_SIZE) p += 4;
+        if (p > end) return false;
+        if (flags & TFHD_DEFAULT_SAMPLE_FLAGS) {
+            if (p + 4 > end) return false;
+            default_flags = MP4ReadU32(p);
+            has_default_flags = true;
+        }
+    }
+
+    // tfdt: the decode time of the first sample
+    const unsigned char *tfdt = MP4FindBox(traf_payload, traf_payload_size, MP4_FOURCC('t', 'f', 'd', 't'), header);
+    if (tfdt && header.size >= header.header_size + 8) {
+        const unsigned char *p = tfdt + header.header_size;
+        info.tfdt_version = p[0];
+        info.tfdt_offset = (p + 4) - data;
+        if (info.tfdt_version == 1 && header.size >= header.header_size + 12) {
+            info.base_decode_time = MP4ReadU64(p + 4);
+        } else {
+            info.tfdt_version = 0;
+            info.base_decode_time = MP4ReadU32(p + 4);
+        }
+    }
+
+    // trun: the samples
+    const unsigned char *trun = MP4FindBox(traf_payload, traf_payload_size, MP4_FOURCC('t', 'r', 'u', 'n'), header);
+    if (trun && header.size >= header.header_size + 8) {
+        const unsigned char *p = trun + header.header_size;
+        const unsigned char *end = trun + header.size;
+        uint32_t flags = MP4ReadU32(p) & 0xffffff;
+        info.sample_count = MP4ReadU32(p + 4);
+        p += 8;
+
+        if (flags & TRUN_DATA_OFFSET) p += 4;
+        if (p > end) return false;
+
+        bool has_first_flags = false;
+        uint32_t first_flags = 0;
+        if (flags & TRUN_FIRST_SAMPLE_FLAGS) {
+            if (p + 4 > end) return false;
+            first_flags = MP4ReadU32(p);
+            has_first_flags = true;
+            p += 4;
+        }
+
+        unsigned int entry_size = ((flags & TRUN_SAMPLE_DURATION) ? 4 : 0) + ((flags & TRUN_SAMPLE_SIZE) ? 4 : 0) +
+                                  ((flags & TRUN_SAMPLE_FLAGS) ? 4 : 0) + ((flags & TRUN_SAMPLE_CTS) ? 4 : 0);
+        if (static_cast<uint64_t>(entry_size) * info.sample_count > static_cast<uint64_t>(end - p))
+            return false;
+
+        for (uint32_t i = 0; i < info.sample_count; i++, p += entry_size) {
+            const unsigned char *field = p;
+            if (flags & TRUN_SAMPLE_DURATION) {
+                info.duration += MP4ReadU32(field);
+                field += 4;
+            } else {
+                info.duration += default_duration;
+            }
+            if (flags & TRUN_SAMPLE_SIZE) field += 4;
+            if (i == 0 && !has_first_flags && (flags & TRUN_SAMPLE_FLAGS)) {
+                first_flags = MP4ReadU32(field);
+                has_first_flags = true;
+            }
+        }
+
+        if (!has_first_flags && has_default_flags) {
+            first_flags = default_flags;
+            has_first_flags = true;
+        }
+        info.starts_with_key_frame = has_first_flags && !(first_flags & SAMPLE_FLAG_IS_NON_SYNC);
+    }
+
+    return true;
+}
+
+bool MP4ParseTrackTimescale(const unsigned char *data, size_t size, uint32_t &timescale)
+{
+    // moov > trak > mdia > mdhd
+    static const uint32_t path[] = {
+            MP4_FOURCC('m', 'o', 'o', 'v'), MP4_FOURCC('t', 'r', 'a', 'k'),
+            MP4_FOURCC('m', 'd', 'i', 'a'), MP4_FOURCC('m', 'd', 'h', 'd')
+    };
+
+    MP4BoxHeader header;
+    const unsigned char *box = data;
+    size_t box_size = size;
+    for (uint32_t type : path) {
+        box = MP4FindBox(box, box_size, type, header);
+        if (!box)
+            return false;
+        if (type != path[3]) {
+            box += header.header_size;
+            box_size = header.size - header.header_size;
+        }
+    }
+
+    // version/flags, then creation and modification times (64 bits each in version 1)
+    if (header.size < header.header_size + 4)
+        return false;
+    const unsigned char *p = box + header.header_size;
+    size_t offset = (p[0] == 1) ? 4 + 16 : 4 + 8;
+    if (header.size < header.header_size + offset + 4)
+        return false;
+
+    uint32_t mdhd_timescale = MP4ReadU32(p + offset);
+    if (mdhd_timescale == 0)
+        return false;
+    timescale = mdhd_timescale;
+    return true;
+}
+
+void MP4WriteProducerReferenceTime(unsigned char *p, uint32_t track_id, uint64_t wall_clock_us, uint64_t media_time)
+{
+    uint64_t seconds = wall_clock_us / 1000000 + NTP_UNIX_EPOCH_OFFSET;
+    uint64_t fraction = ((wall_clock_us % 1000000) << 32) / 1000000;
+
+    MP4WriteU32(p, PRFT_BOX_SIZE);
+    MP4WriteU32(p + 4, MP4_FOURCC('p', 'r', 'f', 't'));
+    MP4WriteU32(p + 8, (1u << 24) | PRFT_FLAG_CAPTURED);
+    MP4WriteU32(p + 12, track_id);
+    MP4WriteU64(p + 16, seconds << 32 | fraction);
+    MP4WriteU64(p + 24, media_time);
+}
+
+bool MP4ParseProducerReferenceTime(const unsigned char *data, size_t size, MP4ProducerReferenceTime &prft)
+{
+    MP4BoxHeader header;
+    if (!MP4ParseBoxHeader(data, size, header) || header.type != MP4_FOURCC('p', 'r', 'f', 't') || header.size > size)
+        return false;
+
+    // version/flags, reference_track_ID, then the 64 bits NTP time, and the media time (64 bits in version 1)
+    const unsigned char *p = data + header.header_size;
+    prft.version = p[0];
+    size_t media_time_size = (prft.version == 1) ? 8 : 4;
+    if (header.size < header.header_size + 16 + media_time_size)
+        return false;
+
+    prft.track_id = MP4ReadU32(p + 4);
+    uint64_t seconds = MP4ReadU32(p + 8);
+    uint64_t fraction = MP4ReadU32(p + 12);
+    if (seconds < NTP_UNIX_EPOCH_OFFSET)
+        return false;
+    prft.wall_clock_us = (seconds - NTP_UNIX_EPOCH_OFFSET) * 1000000 + ((fraction * 1000000 + (1ULL << 31)) >> 32);
+
+    prft.media_time_offset = header.header_size + 16;
+    prft.media_time = (prft.version == 1) ? MP4ReadU64(p + 16) : MP4ReadU32(p + 16);
+    return true;
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * Minimal ISO BMFF box helpers. Only what is needed to understand the fragments we produce:
+ * box headers, and the few fields of moof/mfhd/traf/tfhd/tfdt/trun and prft.
+ */
+
+#define MP4_FOURCC(a, b, c, d) ((uint32_t)(a) << 24 | (uint32_t)(b) << 16 | (uint32_t)(c) << 8 | (uint32_t)(d))
+
+static inline uint32_t MP4ReadU32(const unsigned char *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | (uint32_t)p[3];
+}
+
+static inline uint64_t MP4ReadU64(const unsigned char *p)
+{
+    return (uint64_t)MP4ReadU32(p) << 32 | MP4ReadU32(p + 4);
+}
+
+static inline void MP4WriteU32(unsigned char *p, uint32_t value)
+{
+    p[0] = (unsigned char)(value >> 24);
+    p[1] = (unsigned char)(value >> 16);
+    p[2] = (unsigned char)(value >> 8);
+    p[3] = (unsigned char)(value);
+}
+
+static inline void MP4WriteU64(unsigned char *p, uint64_t value)
+{
+    MP4WriteU32(p, (uint32_t)(value >> 32));
+    MP4WriteU32(p + 4, (uint32_t)value);
+}
+
+// tfhd flags
+#define TFHD_BASE_DATA_OFFSET           0x000001
+#define TFHD_SAMPLE_DESCRIPTION_INDEX   0x000002
+#define TFHD_DEFAULT_SAMPLE_DURATION    0x000008
+#define TFHD_DEFAULT_SAMPLE_SIZE        0x000010
+#define TFHD_DEFAULT_SAMPLE_FLAGS       0x000020
+
+// trun flags
+#define TRUN_DATA_OFFSET                0x000001
+#define TRUN_FIRST_SAMPLE_FLAGS         0x000004
+#define TRUN_SAMPLE_DURATION            0x000100
+#define TRUN_SAMPLE_SIZE                0x000200
+#define TRUN_SAMPLE_FLAGS               0x000400
+#define TRUN_SAMPLE_CTS                 0x000800
+
+#define SAMPLE_FLAG_IS_NON_SYNC         0x00010000
+
+struct MP4BoxHeader
+{
+    uint32_t type;
+    uint64_t size;          // Including the header
+    unsigned int header_size;
+};
+
+// Return false if there are not enough bytes for the header or the header is invalid.
+bool MP4ParseBoxHeader(const unsigned char *data, size_t size, MP4BoxHeader &header);
+
+// Find the first child box of the given type in [data, data + size). Return nullptr if not found.
+const unsigned char *MP4FindBox(const unsigned char *data, size_t size, uint32_t type, MP4BoxHeader &header);
+
+struct MP4MovieFragmentInfo
+{
+    uint32_t sequence_number;
+    uint64_t base_decode_time;
+    uint64_t duration;              // Sum of the sample durations, in the track timescale
+    uint32_t sample_count;
+    bool starts_with_key_frame;
+    size_t tfdt_offset;             // Offset of the base decode time field from the moof start, 0 if no tfdt
+    unsigned int tfdt_version;
+};
+
+// Parse the first track fragment of a moof box (data points to the moof header).
+bool MP4ParseMovieFragment(const unsigned char *data, size_t size, MP4MovieFragmentInfo &info);
+
+// The timescale of the first track of an init segment (ftyp + moov, or the moov alone).
+// Return false, with timescale unchanged, if not found or invalid (0).
+bool MP4ParseTrackTimescale(const unsigned char *data, size_t size, uint32_t &timescale);
+
+/*
+ * prft: the wall-clock time of a sample, before the moof of its fragment. Version 1 only is written, 32 bytes.
+ * The flags tell which time it is, the capture time for us.
+ */
+#define PRFT_BOX_SIZE                   32
+#define PRFT_FLAG_CAPTURED              0x000018
+
+// Seconds from 1900 (NTP) to 1970 (Unix)
+#define NTP_UNIX_EPOCH_OFFSET           2208988800ULL
+
+struct MP4ProducerReferenceTime
+{
+    uint32_t track_id;
+    uint64_t wall_clock_us;         // Since the Unix epoch
+    uint64_t media_time;            // The same time, in the track timescale
+    size_t media_time_offset;       // Offset of the media time field from the prft start
+    unsigned int version;
+};
+
+// Write a version 1 prft of PRFT_BOX_SIZE bytes.
+void MP4WriteProducerReferenceTime(unsigned char *p, uint32_t track_id, uint64_t wall_clock_us, uint64_t media_time);
+
+// data points to the prft header.
+bool MP4ParseProducerReferenceTime(const unsigned char *data, size_t size, MP4ProducerReferenceTime &prft);
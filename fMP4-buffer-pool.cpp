@@ -0,0 +1,156 @@
+#include "fMP4-buffer-pool.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+
+MP4BufferBudget::MP4BufferBudget(size_t limit)
+        : limit(limit)
+        , used(0)
+{
+}
+
+bool MP4BufferBudget::Reserve(size_t size)
+{
+    size_t current = used.load(std::memory_order_relaxed);
+    do {
+        if (limit > 0 && current + size > limit)
+            return false;
+    } while (!used.compare_exchange_weak(current, current + size, std::memory_order_relaxed));
+    return true;
+}
+
+void MP4BufferBudget::Return(size_t size)
+{
+    used.fetch_sub(size, std::memory_order_relaxed);
+}
+
+/*
+ * MP4BufferPool
+ */
+MP4BufferPool::MP4BufferPool(size_t max_pooled_bytes)
+        : max_pooled_bytes(max_pooled_bytes)
+        , free_buffers(GetClassIndex(MAX_CLASS_SIZE) + 1)
+        , pooled_bytes(0)
+        , in_use_bytes(0)
+        , peak_in_use_bytes(0)
+        , hits(0)
+        , misses(0)
+        , over_budget(0)
+{
+}
+
+MP4BufferPool::~MP4BufferPool()
+{
+    if (in_use_bytes > 0)
+        printf("Buffer pool released with %zu bytes still in use\n", in_use_bytes);
+
+    for (auto &buffers : free_buffers) {
+        for (auto buffer : buffers)
+            free(buffer);
+    }
+}
+
+size_t MP4BufferPool::GetClassSize(size_t size)
+{
+    if (size > MAX_CLASS_SIZE)
+        return size;    // Not pooled
+
+    size_t class_size = MIN_CLASS_SIZE;
+    while (class_size < size)
+        class_size <<= 1;
+    return class_size;
+}
+
+unsigned int MP4BufferPool::GetClassIndex(size_t class_size)
+{
+    unsigned int index = 0;
+    for (size_t s = MIN_CLASS_SIZE; s < class_size; s <<= 1)
+        index++;
+    return index;
+}
+
+unsigned char *MP4BufferPool::Acquire(size_t size, size_t min_size, MP4BufferBudget *budget, size_t &capacity)
+{
+    size_t class_size = GetClassSize(size);
+    size_t min_class_size = GetClassSize(min_size < size ? min_size : size);
+
+    // Step down the classes until one fits in the budget.
+    bool shrunk = false;
+    while (budget && !budget->Reserve(class_size)) {
+        shrunk = true;
+        if (class_size <= min_class_size || class_size <= MIN_CLASS_SIZE) {
+            std::lock_guard<std::mutex> lock(mutex);
+            over_budget++;
+            return nullptr;
+        }
+        class_size = (class_size > MAX_CLASS_SIZE) ? MAX_CLASS_SIZE : class_size >> 1;
+    }
+
+    unsigned char *buffer = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (shrunk)
+            over_budget++;
+
+        if (class_size <= MAX_CLASS_SIZE) {
+            auto &buffers = free_buffers[GetClassIndex(class_size)];
+            if (!buffers.empty()) {
+                buffer = buffers.back();
+                buffers.pop_back();
+                pooled_bytes -= class_size;
+            }
+        }
+        (buffer ? hits : misses)++;
+
+        in_use_bytes += class_size;
+        if (in_use_bytes > peak_in_use_bytes)
+            peak_in_use_bytes = in_use_bytes;
+    }
+
+    if (!buffer)
+        buffer = static_cast<unsigned char *>(malloc(class_size));
+    if (!buffer) {
+        std::lock_guard<std::mutex> lock(mutex);
+        in_use_bytes -= class_size;
+        if (budget)
+            budget->Return(class_size);
+        return nullptr;
+    }
+
+    capacity = class_size;
+    return buffer;
+}
+
+void MP4BufferPool::Release(unsigned char *buffer, size_t capacity, MP4BufferBudget *budget)
+{
+    if (!buffer)
+        return;
+
+    if (budget)
+        budget->Return(capacity);
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        in_use_bytes -= capacity;
+        if (capacity <= MAX_CLASS_SIZE && pooled_bytes + capacity <= max_pooled_bytes) {
+            free_buffers[GetClassIndex(capacity)].push_back(buffer);
+            pooled_bytes += capacity;
+            return;
+        }
+    }
+    free(buffer);
+}
+
+fMP4BufferPoolStats MP4BufferPool::GetStats() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    fMP4BufferPoolStats stats;
+    stats.in_use_bytes      = in_use_bytes;
+    stats.peak_in_use_bytes = peak_in_use_bytes;
+    stats.pooled_bytes      = pooled_bytes;
+    stats.hits              = hits;
+    stats.misses            = misses;
+    stats.over_budget       = over_budget;
+    return stats;
+}
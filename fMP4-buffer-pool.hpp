@@ -0,0 +1,76 @@
+#pragma once
+
+#include "fMP4.h"
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+/*
+ * The memory a stream may draw from a buffer pool. Thread-safe.
+ */
+class MP4BufferBudget
+{
+public:
+
+    // 0 for no limit.
+    MP4BufferBudget(size_t limit = 0);
+
+    // Return false if the size does not fit in what is left.
+    bool Reserve(size_t size);
+
+    void Return(size_t size);
+
+    size_t GetUsed() const { return used.load(std::memory_order_relaxed); }
+
+    size_t GetLimit() const { return limit; }
+
+private:
+
+    const size_t limit;
+    std::atomic<size_t> used;
+};
+
+/*
+ * Buffers shared by many streams, by power of two size classes from 4 KB to 4 MB.
+ * A released buffer is kept for reuse, up to max_pooled_bytes in total. Thread-safe.
+ */
+class MP4BufferPool
+{
+public:
+
+    static const size_t MIN_CLASS_SIZE = 4 * 1024;
+    static const size_t MAX_CLASS_SIZE = 4 * 1024 * 1024;
+
+    MP4BufferPool(size_t max_pooled_bytes = 64 * 1024 * 1024);
+
+    // All the buffers must be released before.
+    ~MP4BufferPool();
+
+    // A buffer of the smallest class holding size. If the budget is short, a smaller class down to min_size.
+    // Return nullptr if even min_size is over the budget. The size of the class is given back by capacity.
+    unsigned char *Acquire(size_t size, size_t min_size, MP4BufferBudget *budget, size_t &capacity);
+
+    void Release(unsigned char *buffer, size_t capacity, MP4BufferBudget *budget);
+
+    fMP4BufferPoolStats GetStats() const;
+
+private:
+
+    static size_t GetClassSize(size_t size);
+    static unsigned int GetClassIndex(size_t class_size);
+
+    MP4BufferPool(const MP4BufferPool &) = delete;
+    MP4BufferPool &operator=(const MP4BufferPool &) = delete;
+
+    const size_t max_pooled_bytes;
+
+    mutable std::mutex mutex;
+    std::vector<std::vector<unsigned char *>> free_buffers;     // By class
+    size_t pooled_bytes;
+    size_t in_use_bytes;
+    size_t peak_in_use_bytes;
+    unsigned long long int hits;
+    unsigned long long int misses;
+    unsigned long long int over_budget;
+};
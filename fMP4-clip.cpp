@@ -0,0 +1,239 @@
+#include "fMP4-clip.hpp"
+#include "fMP4-box.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// The track timescale of the mov muxer, if the init segment does not tell.
+static const uint32_t DEFAULT_TIMESCALE = 90000;
+
+MP4ClipExtractor::MP4ClipExtractor()
+        : fd(-1)
+        , file_size(0)
+        , timescale(DEFAULT_TIMESCALE)
+{
+}
+
+MP4ClipExtractor::~MP4ClipExtractor()
+{
+    Close();
+}
+
+bool MP4ClipExtractor::Open(const std::string &path)
+{
+    Close();
+
+    fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        printf("Fail to open %s: %s\n", path.c_str(), strerror(errno));
+        Close();
+        return false;
+    }
+    file_size = static_cast<uint64_t>(st.st_size);
+
+    // Walk the top level boxes by their headers. A fragment runs from its moof to the end of its mdat.
+    std::vector<unsigned char> data;
+    uint64_t offset = 0;
+    bool has_moof = false;
+    Fragment fragment = Fragment();
+    MP4BoxHeader header;
+    while (ReadAt(offset, static_cast<size_t>(std::min<uint64_t>(16, file_size - offset)), data) &&
+           MP4ParseBoxHeader(data.data(), data.size(), header) && header.size <= file_size - offset) {
+        switch (header.type) {
+            case MP4_FOURCC('f', 't', 'y', 'p'):
+            case MP4_FOURCC('m', 'o', 'o', 'v'):
+                // Only the init segment at the start.
+                if (!fragments.empty() || !ReadAt(offset, static_cast<size_t>(header.size), data))
+                    break;
+                init_segment.insert(init_segment.end(), data.begin(), data.end());
+                if (header.type == MP4_FOURCC('m', 'o', 'o', 'v'))
+                    MP4ParseTrackTimescale(data.data(), data.size(), timescale);
+                break;
+            case MP4_FOURCC('m', 'o', 'o', 'f'): {
+                MP4MovieFragmentInfo info;
+                if (!ReadAt(offset, static_cast<size_t>(header.size), data) ||
+                    !MP4ParseMovieFragment(data.data(), data.size(), info)) {
+                    printf("Invalid moof at %llu in %s\n", static_cast<unsigned long long int>(offset), path.c_str());
+                    has_moof = false;
+                    break;
+                }
+                fragment.offset = offset;
+                fragment.moof_size = static_cast<uint32_t>(header.size);
+                fragment.base_decode_time = info.base_decode_time;
+                fragment.duration = info.duration;
+                fragment.is_key_frame = info.starts_with_key_frame;
+                has_moof = true;
+                break;
+            }
+            case MP4_FOURCC('m', 'd', 'a', 't'):
+                if (has_moof) {
+                    fragment.size = offset + header.size - fragment.offset;
+                    fragments.push_back(fragment);
+                    has_moof = false;
+                }
+                break;
+            default:
+                break;
+        }
+        offset += header.size;
+    }
+
+    if (init_segment.empty() || fragments.empty()) {
+        printf("No init segment or no fragment in %s\n", path.c_str());
+        Close();
+        return false;
+    }
+    return true;
+}
+
+void MP4ClipExtractor::Close()
+{
+    if (fd >= 0)
+        close(fd);
+    fd = -1;
+    file_size = 0;
+    timescale = DEFAULT_TIMESCALE;
+    init_segment.clear();
+    fragments.clear();
+}
+
+uint64_t MP4ClipExtractor::GetDurationMs() const
+{
+    if (fragments.empty())
+        return 0;
+    const Fragment &last = fragments.back();
+    return ToMs(last.base_decode_time + last.duration - fragments.front().base_decode_time);
+}
+
+bool MP4ClipExtractor::Extract(uint64_t start_ms, uint64_t end_ms, const std::string &output_path, fMP4ClipInfo &info) const
+{
+    info = fMP4ClipInfo();
+    if (fragments.empty() || end_ms <= start_ms)
+        return false;
+
+    uint64_t origin = fragments.front().base_decode_time;
+    uint64_t start_time = origin + static_cast<uint64_t>(start_ms) * timescale / 1000;
+    uint64_t end_time = origin + static_cast<uint64_t>(end_ms) * timescale / 1000;
+
+    // From the last key frame at or before the start, or the first key frame.
+    size_t first = fragments.size();
+    for (size_t i = 0; i < fragments.size(); i++) {
+        if (!fragments[i].is_key_frame)
+            continue;
+        if (first < fragments.size() && fragments[i].base_decode_time > start_time)
+            break;
+        first = i;
+    }
+    size_t last = first;
+    while (last < fragments.size() && fragments[last].base_decode_time < end_time)
+        last++;
+    if (first >= last) {
+        printf("No fragment to clip between %llu and %llu ms\n",
+               static_cast<unsigned long long int>(start_ms), static_cast<unsigned long long int>(end_ms));
+        return false;
+    }
+
+    int output_fd = open(output_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (output_fd < 0) {
+        printf("Fail to open %s: %s\n", output_path.c_str(), strerror(errno));
+        return false;
+    }
+
+    bool result = (write(output_fd, init_segment.data(), init_segment.size()) == static_cast<ssize_t>(init_segment.size()));
+
+    uint64_t clip_origin = fragments[first].base_decode_time;
+    std::vector<unsigned char> moof;
+    for (size_t i = first; result && i < last; i++) {
+        const Fragment &fragment = fragments[i];
+
+        // Only the moof is rewritten: the decode time and the sequence number.
+        MP4MovieFragmentInfo moof_info;
+        result = ReadAt(fragment.offset, fragment.moof_size, moof) &&
+                 MP4ParseMovieFragment(moof.data(), moof.size(), moof_info);
+        if (!result)
+            break;
+
+        uint64_t decode_time = fragment.base_decode_time - clip_origin;
+        if (moof_info.tfdt_offset && moof_info.tfdt_version == 1)
+            MP4WriteU64(moof.data() + moof_info.tfdt_offset, decode_time);
+        else if (moof_info.tfdt_offset)
+            MP4WriteU32(moof.data() + moof_info.tfdt_offset, static_cast<uint32_t>(decode_time));
+
+        MP4BoxHeader header;
+        const unsigned char *mfhd = MP4FindBox(moof.data() + 8, moof.size() - 8, MP4_FOURCC('m', 'f', 'h', 'd'), header);
+        if (mfhd && header.size >= header.header_size + 8)
+            MP4WriteU32(moof.data() + (mfhd - moof.data()) + header.header_size + 4, static_cast<uint32_t>(i - first + 1));
+
+        result = (write(output_fd, moof.data(), moof.size()) == static_cast<ssize_t>(moof.size())) &&
+                 Copy(output_fd, fragment.offset + fragment.moof_size, fragment.size - fragment.moof_size);
+
+        info.fragments++;
+        info.bytes += fragment.size;
+    }
+
+    if (close(output_fd) != 0 || !result) {
+        printf("Fail to write %s: %s\n", output_path.c_str(), strerror(errno));
+        return false;
+    }
+
+    const Fragment &end = fragments[last - 1];
+    info.start_ms = ToMs(clip_origin - origin);
+    info.duration_ms = ToMs(end.base_decode_time + end.duration - clip_origin);
+    info.bytes += init_segment.size();
+    return true;
+}
+
+bool MP4ClipExtractor::ReadAt(uint64_t offset, size_t size, std::vector<unsigned char> &data) const
+{
+    data.resize(size);
+    size_t done = 0;
+    while (done < size) {
+        ssize_t result = pread(fd, data.data() + done, size - done, static_cast<off_t>(offset + done));
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result <= 0)
+            return false;
+        done += static_cast<size_t>(result);
+    }
+    return (size > 0);
+}
+
+bool MP4ClipExtractor::Copy(int output_fd, uint64_t offset, uint64_t size) const
+{
+    // In the kernel, without going through user space.
+    off_t input_offset = static_cast<off_t>(offset);
+    while (size > 0) {
+        ssize_t result = sendfile(output_fd, fd, &input_offset, static_cast<size_t>(std::min<uint64_t>(size, 1 << 30)));
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result < 0 && (errno == EINVAL || errno == ENOSYS))
+            break;
+        if (result <= 0)
+            return false;
+        size -= static_cast<uint64_t>(result);
+    }
+
+    // sendfile() between these files is not supported: copy through a buffer.
+    std::vector<unsigned char> buffer;
+    while (size > 0) {
+        size_t chunk = static_cast<size_t>(std::min<uint64_t>(size, 1024 * 1024));
+        if (!ReadAt(static_cast<uint64_t>(input_offset), chunk, buffer) ||
+            write(output_fd, buffer.data(), chunk) != static_cast<ssize_t>(chunk))
+            return false;
+        input_offset += chunk;
+        size -= chunk;
+    }
+    return true;
+}
+
+uint64_t MP4ClipExtractor::ToMs(uint64_t decode_time) const
+{
+    return decode_time * 1000 / timescale;
+}
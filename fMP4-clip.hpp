@@ -0,0 +1,58 @@
+#pragma once
+
+#include "fMP4.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/*
+ * Cut clips out of a recorded fMP4 file (Ex: from MP4FileSink) by whole fragments. Only the boxes
+ * are read to build the index, the moof of every fragment and not its samples, so a clip of
+ * a long recording costs the I/O of the clip itself.
+ *
+ * A clip is the init segment of the recording followed by its fragments from the last key frame
+ * at or before the start, to the end. The moof boxes are copied with their decode time rebased to 0
+ * and renumbered from 1, the mdat boxes are copied as they are, in the kernel when possible.
+ */
+class MP4ClipExtractor
+{
+public:
+
+    MP4ClipExtractor();
+
+    ~MP4ClipExtractor();
+
+    // Read the init segment and index the fragments. A truncated last fragment is ignored.
+    bool Open(const std::string &path);
+
+    void Close();
+
+    // Of the complete fragments, from the first one.
+    uint64_t GetDurationMs() const;
+
+    // [start_ms, end_ms) from the first fragment of the recording. Return false if there is no fragment there.
+    bool Extract(uint64_t start_ms, uint64_t end_ms, const std::string &output_path, fMP4ClipInfo &info) const;
+
+private:
+
+    struct Fragment
+    {
+        uint64_t offset;                // Of the moof box
+        uint64_t size;                  // moof up to the end of its mdat
+        uint32_t moof_size;
+        uint64_t base_decode_time;
+        uint64_t duration;
+        bool is_key_frame;
+    };
+
+    bool ReadAt(uint64_t offset, size_t size, std::vector<unsigned char> &data) const;
+    bool Copy(int output_fd, uint64_t offset, uint64_t size) const;
+    uint64_t ToMs(uint64_t decode_time) const;
+
+    int fd;
+    uint64_t file_size;
+    uint32_t timescale;
+    std::vector<unsigned char> init_segment;
+    std::vector<Fragment> fragments;
+};
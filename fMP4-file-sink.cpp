@@ -0,0 +1,324 @@
+#include "fMP4-file-sink.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+// O_DIRECT needs the buffers, the offsets and the sizes aligned to the logical block size of the device.
+#define DIRECT_IO_ALIGNMENT     4096
+#define DIRECT_IO_BLOCK_SIZE    (256 * 1024)
+
+struct MP4FileSink::RecordingFile
+{
+    int fd;
+    std::string path;
+    bool direct_io;
+    uint64_t size;                          // What was given to the file so far
+    uint64_t submitted_size;                // O_DIRECT: what was submitted so far, always aligned
+
+    // One for the sink while the file is open, and one per request in flight.
+    std::atomic<unsigned int> references;
+    std::atomic<bool> syncing;
+};
+
+struct MP4FileSink::AlignedBlock
+{
+    AlignedBlock()
+            : data(nullptr)
+            , size(0)
+    {
+        if (posix_memalign(reinterpret_cast<void **>(&data), DIRECT_IO_ALIGNMENT, DIRECT_IO_BLOCK_SIZE) != 0)
+            data = nullptr;
+    }
+
+    ~AlignedBlock()
+    {
+        free(data);
+    }
+
+    unsigned char *data;
+    size_t size;
+};
+
+MP4FileSink::MP4FileSink(const fMP4FileSinkConfig &config, MP4AsyncIO &io)
+        : path_prefix(config.path_prefix ? config.path_prefix : "record")
+        , max_file_duration_ms(config.max_file_duration_ms)
+        , max_file_size(config.max_file_size)
+        , sync_interval_ms(config.sync_interval_ms)
+        , direct_io(config.direct_io)
+        , max_pending_bytes(config.max_pending_bytes)
+        , io(io)
+        , assembler([this](const MP4FragmentPtr &fragment) { Push(fragment); })
+        , file(nullptr)
+        , file_index(0)
+        , file_duration(0)
+        , skip_to_key_frame(false)
+        , open_files(0)
+        , written_bytes(0)
+        , pending_bytes(0)
+        , recorded_fragments(0)
+        , dropped_fragments(0)
+        , files(0)
+        , syncs(0)
+        , errors(0)
+{
+}
+
+MP4FileSink::~MP4FileSink()
+{
+    CloseFile();
+
+    std::unique_lock<std::mutex> lock(close_mutex);
+    close_cv.wait(lock, [this]() { return open_files == 0; });
+}
+
+int MP4FileSink::Write(void *context, unsigned char *buf, int buf_size)
+{
+    MP4FileSink *sink = reinterpret_cast<MP4FileSink *>(context);
+    sink->assembler.Append(buf, static_cast<size_t>(buf_size));
+    return buf_size;
+}
+
+void MP4FileSink::Push(const MP4FragmentPtr &fragment)
+{
+    if (fragment->type == MP4_FRAGMENT_INIT) {
+        // A new codec configuration: start a new file from the next key frame.
+        CloseFile();
+        init_fragment = fragment;
+        return;
+    }
+
+    if (!init_fragment || (!fragment->is_key_frame && (!file || skip_to_key_frame))) {
+        dropped_fragments++;
+        return;
+    }
+
+    if (max_pending_bytes > 0 && pending_bytes.load(std::memory_order_relaxed) + fragment->data.size() > max_pending_bytes) {
+        // The disk is behind: the frames depending on this one are useless, so skip to the next key frame.
+        skip_to_key_frame = true;
+        dropped_fragments++;
+        return;
+    }
+    skip_to_key_frame = false;
+
+    if (file && fragment->is_key_frame) {
+        uint32_t timescale = init_fragment->timescale;
+        bool too_long = (max_file_duration_ms > 0 && timescale > 0 &&
+                         file_duration >= static_cast<uint64_t>(max_file_duration_ms) * timescale / 1000);
+        bool too_large = (max_file_size > 0 && file->size >= max_file_size);
+        if (too_long || too_large)
+            CloseFile();
+    }
+
+    if (!file && !OpenFile()) {
+        dropped_fragments++;
+        return;
+    }
+
+    Append(fragment);
+    file_duration += fragment->duration;
+    recorded_fragments++;
+
+    SyncIfDue();
+}
+
+void MP4FileSink::Close()
+{
+    CloseFile();
+    init_fragment.reset();
+}
+
+bool MP4FileSink::OpenFile()
+{
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), "-%06u.mp4", file_index);
+    std::string path = path_prefix + suffix;
+
+    int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+    bool is_direct = direct_io;
+    int fd = open(path.c_str(), flags | (is_direct ? O_DIRECT : 0), 0644);
+    if (fd < 0 && is_direct && errno == EINVAL) {
+        printf("%s: O_DIRECT is not supported, use buffered writes\n", path.c_str());
+        is_direct = false;
+        fd = open(path.c_str(), flags, 0644);
+    }
+    if (fd < 0) {
+        printf("Fail to open %s: %s\n", path.c_str(), strerror(errno));
+        errors++;
+        return false;
+    }
+
+    file = new RecordingFile;
+    file->fd = fd;
+    file->path = path;
+    file->direct_io = is_direct;
+    file->size = 0;
+    file->submitted_size = 0;
+    file->references = 1;
+    file->syncing = false;
+
+    file_index++;
+    file_duration = 0;
+    last_sync = std::chrono::steady_clock::now();
+    files++;
+    {
+        std::lock_guard<std::mutex> lock(close_mutex);
+        open_files++;
+    }
+
+    Append(init_fragment);
+    return true;
+}
+
+void MP4FileSink::CloseFile()
+{
+    if (!file)
+        return;
+
+    if (file->direct_io)
+        SubmitBlock(true);
+
+    RecordingFile *closing = file;
+    file = nullptr;
+    Release(closing);
+}
+
+void MP4FileSink::Append(const MP4FragmentPtr &fragment)
+{
+    const unsigned char *data = fragment->data.data();
+    size_t size = fragment->data.size();
+
+    if (!file->direct_io) {
+        // No copy: the fragment is kept alive by the request.
+        file->references++;
+        pending_bytes += size;
+        RecordingFile *target = file;
+        io.Write(file->fd, data, size, file->size, fragment,
+                 [this, target, size](int result) { OnWritten(target, size, result); });
+        file->size += size;
+        return;
+    }
+
+    while (size > 0) {
+        if (!block)
+            block = std::make_shared<AlignedBlock>();
+        if (!block->data) {
+            printf("Fail to allocate an aligned block for %s\n", file->path.c_str());
+            errors++;
+            block.reset();
+            return;
+        }
+
+        size_t copied = std::min(size, static_cast<size_t>(DIRECT_IO_BLOCK_SIZE) - block->size);
+        memcpy(block->data + block->size, data, copied);
+        block->size += copied;
+        file->size += copied;
+        data += copied;
+        size -= copied;
+
+        if (block->size == DIRECT_IO_BLOCK_SIZE)
+            SubmitBlock(false);
+    }
+}
+
+void MP4FileSink::SubmitBlock(bool last)
+{
+    if (!block || block->size == 0)
+        return;
+
+    // The last block is padded up to the alignment, then the file is truncated to its real size.
+    size_t size = block->size;
+    if (last && size % DIRECT_IO_ALIGNMENT != 0) {
+        size_t padded = (size + DIRECT_IO_ALIGNMENT - 1) / DIRECT_IO_ALIGNMENT * DIRECT_IO_ALIGNMENT;
+        memset(block->data + size, 0, padded - size);
+        size = padded;
+    }
+
+    file->references++;
+    pending_bytes += size;
+    RecordingFile *target = file;
+    io.Write(file->fd, block->data, size, file->submitted_size, block,
+             [this, target, size](int result) { OnWritten(target, size, result); });
+    file->submitted_size += size;
+    block.reset();
+}
+
+void MP4FileSink::SyncIfDue()
+{
+    if (sync_interval_ms == 0 || file->syncing.load(std::memory_order_relaxed))
+        return;
+
+    auto now = std::chrono::steady_clock::now();
+    if (now - last_sync < std::chrono::milliseconds(sync_interval_ms))
+        return;
+    last_sync = now;
+
+    file->references++;
+    file->syncing = true;
+    RecordingFile *target = file;
+    io.Sync(file->fd, [this, target](int result) {
+        if (result < 0) {
+            printf("Fail to sync %s: %s\n", target->path.c_str(), strerror(-result));
+            errors++;
+        }
+        syncs++;
+        target->syncing = false;
+        Release(target);
+    });
+}
+
+void MP4FileSink::OnWritten(RecordingFile *file, size_t size, int result)
+{
+    pending_bytes -= size;
+    if (result < 0) {
+        printf("Fail to write %s: %s\n", file->path.c_str(), strerror(-result));
+        errors++;
+    } else {
+        written_bytes += size;
+    }
+    Release(file);
+}
+
+void MP4FileSink::Release(RecordingFile *file)
+{
+    if (--file->references > 0)
+        return;
+
+    // Closed, and nothing in flight any more: drop the padding, sync once more and close.
+    if (file->direct_io && ftruncate(file->fd, static_cast<off_t>(file->size)) < 0) {
+        printf("Fail to truncate %s: %s\n", file->path.c_str(), strerror(errno));
+        errors++;
+    }
+
+    io.Sync(file->fd, [this, file](int result) {
+        if (result < 0) {
+            printf("Fail to sync %s: %s\n", file->path.c_str(), strerror(-result));
+            errors++;
+        }
+        syncs++;
+        close(file->fd);
+        delete file;
+
+        std::lock_guard<std::mutex> lock(close_mutex);
+        open_files--;
+        close_cv.notify_all();
+    });
+}
+
+fMP4FileSinkStats MP4FileSink::GetStats() const
+{
+    fMP4FileSinkStats stats;
+    stats.written_bytes      = written_bytes.load();
+    stats.pending_bytes      = pending_bytes.load();
+    stats.recorded_fragments = recorded_fragments.load();
+    stats.dropped_fragments  = dropped_fragments.load();
+    stats.files              = files.load();
+    stats.syncs              = syncs.load();
+    stats.errors             = errors.load();
+    return stats;
+}
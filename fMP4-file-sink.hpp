@@ -0,0 +1,88 @@
+#pragma once
+
+#include "fMP4.h"
+#include "fMP4-async-io.hpp"
+#include "fMP4-fragment.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+
+/*
+ * Record the writer output into files, without ever waiting for the disk on the writer thread:
+ * the fragments are written through MP4AsyncIO, and kept alive until their write completes.
+ *
+ * A file starts with the init segment and a key frame. It is rotated at the first key frame
+ * after its max duration or size, or at a new init segment. fdatasync is batched, at most once
+ * per sync interval, and once more when the file is closed.
+ * When the disk is behind by more than max_pending_bytes, the fragments are dropped until the next key frame.
+ *
+ * Push() and Write() must be called from a single thread.
+ */
+class MP4FileSink
+{
+public:
+
+    MP4FileSink(const fMP4FileSinkConfig &config, MP4AsyncIO &io = MP4AsyncIO::GetDefault());
+
+    // Close the current file, and wait until all the files are synced and closed.
+    ~MP4FileSink();
+
+    // Raw writer output, given to the internal assembler which pushes the complete fragments.
+    static int Write(void *context, unsigned char *buf, int buf_size);
+
+    void Push(const MP4FragmentPtr &fragment);
+
+    // Close the current file without waiting. The recording goes on at the next init segment.
+    void Close();
+
+    fMP4FileSinkStats GetStats() const;
+
+private:
+
+    struct RecordingFile;
+    struct AlignedBlock;
+
+    bool OpenFile();
+    void CloseFile();
+    void Append(const MP4FragmentPtr &fragment);
+    void SubmitBlock(bool last);
+    void SyncIfDue();
+
+    // Called on an I/O thread when the last request of a closed file completes.
+    void Release(RecordingFile *file);
+    void OnWritten(RecordingFile *file, size_t size, int result);
+
+    const std::string path_prefix;
+    const unsigned int max_file_duration_ms;
+    const unsigned long long int max_file_size;
+    const unsigned int sync_interval_ms;
+    const bool direct_io;
+    const unsigned long long int max_pending_bytes;
+
+    MP4AsyncIO &io;
+    MP4FragmentAssembler assembler;
+
+    // Owned by the writer thread
+    MP4FragmentPtr init_fragment;
+    RecordingFile *file;
+    std::shared_ptr<AlignedBlock> block;       // O_DIRECT staging
+    unsigned int file_index;
+    uint64_t file_duration;                    // In the track timescale
+    std::chrono::steady_clock::time_point last_sync;
+    bool skip_to_key_frame;
+
+    std::mutex close_mutex;
+    std::condition_variable close_cv;
+    unsigned int open_files;
+
+    std::atomic<unsigned long long int> written_bytes;
+    std::atomic<unsigned long long int> pending_bytes;
+    std::atomic<unsigned long long int> recorded_fragments;
+    std::atomic<unsigned long long int> dropped_fragments;
+    std::atomic<unsigned long long int> files;
+    std::atomic<unsigned long long int> syncs;
+    std::atomic<unsigned long long int> errors;
+};
@@ -0,0 +1,159 @@
+#include "fMP4-fragment.hpp"
+#include "fMP4-box.hpp"
+
+#include <cstdio>
+
+/*
+ * MP4FragmentSplitter
+ */
+MP4FragmentSplitter::MP4FragmentSplitter(const FragmentHandler &handler)
+        : handler(handler)
+        , box_offset(0)
+        , timescale(0)
+{
+}
+
+void MP4FragmentSplitter::Reset()
+{
+    pending.clear();
+    box_offset = 0;
+    timescale = 0;
+}
+
+bool MP4FragmentSplitter::Append(const unsigned char *data, size_t size)
+{
+    size_t consumed = 0;
+    bool valid;
+
+    // The writer flushes at the fragment boundaries, so usually the chunk holds whole fragments.
+    if (pending.empty()) {
+        valid = Split(data, size, consumed);
+        if (valid)
+            pending.assign(data + consumed, data + size);
+    } else {
+        pending.insert(pending.end(), data, data + size);
+        valid = Split(pending.data(), pending.size(), consumed);
+        if (valid)
+            pending.erase(pending.begin(), pending.begin() + consumed);
+    }
+
+    if (!valid) {
+        printf("Invalid box in the writer output\n");
+        Reset();
+        return false;
+    }
+    return true;
+}
+
+bool MP4FragmentSplitter::Split(const unsigned char *data, size_t size, size_t &consumed)
+{
+    size_t start = 0;
+    consumed = 0;
+
+    MP4BoxHeader header;
+    while (MP4ParseBoxHeader(data + start + box_offset, size - start - box_offset, header)) {
+        if (header.size > size - start - box_offset) {
+            consumed = start;
+            return true;    // Wait for the rest of the box
+        }
+
+        size_t box_end = box_offset + static_cast<size_t>(header.size);
+        switch (header.type) {
+            case MP4_FOURCC('m', 'f', 'r', 'a'):
+                // Only written by the trailer, after the last fragment.
+                start += box_end;
+                box_offset = 0;
+                break;
+            case MP4_FOURCC('m', 'o', 'o', 'v'):
+                Emit(MP4_FRAGMENT_INIT, data + start, box_end);
+                start += box_end;
+                box_offset = 0;
+                break;
+            case MP4_FOURCC('m', 'd', 'a', 't'):
+                Emit(MP4_FRAGMENT_MEDIA, data + start, box_end);
+                start += box_end;
+                box_offset = 0;
+                break;
+            default:
+                // ftyp, styp, sidx, moof... belong to the next init or media fragment.
+                box_offset = box_end;
+                break;
+        }
+    }
+    consumed = start;
+
+    // A header could need up to 16 bytes (largesize), any more than that means it is invalid.
+    return size - start - box_offset < 16;
+}
+
+void MP4FragmentSplitter::Emit(MP4FragmentType type, const unsigned char *data, size_t size)
+{
+    MP4FragmentInfo info;
+    info.type = type;
+    info.is_key_frame = (type == MP4_FRAGMENT_INIT);
+    info.sequence_number = 0;
+    info.base_decode_time = 0;
+    info.duration = 0;
+    info.tfdt_offset = 0;
+    info.tfdt_version = 0;
+    info.payload_offset = 0;
+    info.capture_time_us = 0;
+    info.capture_media_time = 0;
+    info.prft_offset = 0;
+    info.prft_version = 0;
+
+    if (type == MP4_FRAGMENT_INIT) {
+        uint32_t init_timescale;
+        timescale = MP4ParseTrackTimescale(data, size, init_timescale) ? init_timescale : 0;
+    }
+    info.timescale = timescale;
+
+    if (type == MP4_FRAGMENT_MEDIA) {
+        // The mdat closes the fragment, so its payload runs to the end.
+        MP4BoxHeader header;
+        const unsigned char *mdat = MP4FindBox(data, size, MP4_FOURCC('m', 'd', 'a', 't'), header);
+        if (mdat)
+            info.payload_offset = (mdat - data) + header.header_size;
+
+        const unsigned char *moof = MP4FindBox(data, size, MP4_FOURCC('m', 'o', 'o', 'f'), header);
+        MP4MovieFragmentInfo moof_info;
+        if (moof && MP4ParseMovieFragment(moof, size - (moof - data), moof_info)) {
+            info.is_key_frame = moof_info.starts_with_key_frame;
+            info.sequence_number = moof_info.sequence_number;
+            info.base_decode_time = moof_info.base_decode_time;
+            info.duration = moof_info.duration;
+            if (moof_info.tfdt_offset) {
+                info.tfdt_offset = (moof - data) + moof_info.tfdt_offset;
+                info.tfdt_version = moof_info.tfdt_version;
+            }
+        }
+
+        MP4ProducerReferenceTime prft;
+        const unsigned char *prft_box = MP4FindBox(data, size, MP4_FOURCC('p', 'r', 'f', 't'), header);
+        if (prft_box && (!moof || prft_box < moof) && MP4ParseProducerReferenceTime(prft_box, size - (prft_box - data), prft)) {
+            info.capture_time_us = prft.wall_clock_us;
+            info.capture_media_time = prft.media_time;
+            info.prft_offset = (prft_box - data) + prft.media_time_offset;
+            info.prft_version = prft.version;
+        }
+    }
+
+    handler(data, size, info);
+}
+
+/*
+ * MP4FragmentAssembler
+ */
+MP4FragmentAssembler::MP4FragmentAssembler(const FragmentHandler &handler)
+        : handler(handler)
+        , splitter([this](const unsigned char *data, size_t size, const MP4FragmentInfo &info) { Emit(data, size, info); })
+{
+}
+
+void MP4FragmentAssembler::Emit(const unsigned char *data, size_t size, const MP4FragmentInfo &info)
+{
+    std::shared_ptr<MP4Fragment> fragment = std::make_shared<MP4Fragment>();
+    static_cast<MP4FragmentInfo &>(*fragment) = info;
+    fragment->data.assign(data, data + size);
+    handler(fragment);
+}
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+enum MP4FragmentType
+{
+    MP4_FRAGMENT_INIT,      // ftyp + moov
+    MP4_FRAGMENT_MEDIA      // moof + mdat
+};
+
+// What the boxes of a fragment tell about it.
+struct MP4FragmentInfo
+{
+    MP4FragmentType type;
+
+    // The timescale of the track, as given by the last init segment. 0 if unknown.
+    uint32_t timescale;
+
+    // Only meaningful for media fragments. Time values are in the track timescale.
+    bool is_key_frame;
+    uint32_t sequence_number;
+    uint64_t base_decode_time;
+    uint64_t duration;
+
+    // Where to patch the decode time (0 if there is no tfdt), and where the sample data starts.
+    size_t tfdt_offset;
+    unsigned int tfdt_version;
+    size_t payload_offset;
+
+    // From the prft before the moof, if any: when the sample at capture_media_time was captured (us since the Unix epoch,
+    // 0 if unknown), and where to patch its media time along with the decode time (0 if there is no prft).
+    uint64_t capture_time_us;
+    uint64_t capture_media_time;
+    size_t prft_offset;
+    unsigned int prft_version;
+};
+
+/*
+ * A self-contained unit of the fMP4 stream. It is immutable once emitted,
+ * so one fragment could be shared by many consumers.
+ */
+struct MP4Fragment : MP4FragmentInfo
+{
+    std::vector<unsigned char> data;
+};
+
+typedef std::shared_ptr<const MP4Fragment> MP4FragmentPtr;
+
+/*
+ * Cut the writer output (chunks of any size, as avio flushes them) at the init segments and at the fragments.
+ * A fragment within a single chunk is given from the chunk itself, only the ones spanning chunks are copied.
+ * The mfra box written at the end of the stream is dropped.
+ */
+class MP4FragmentSplitter
+{
+public:
+
+    // The data is only valid during the call.
+    typedef std::function<void(const unsigned char *data, size_t size, const MP4FragmentInfo &info)> FragmentHandler;
+
+    MP4FragmentSplitter(const FragmentHandler &handler);
+
+    // Return false if the stream is malformed. The pending data is discarded in that case.
+    bool Append(const unsigned char *data, size_t size);
+
+    void Reset();
+
+private:
+
+    // Emit the whole fragments at the start of [data, data + size), and set consumed to their size.
+    // Return false if an invalid box is found.
+    bool Split(const unsigned char *data, size_t size, size_t &consumed);
+
+    void Emit(MP4FragmentType type, const unsigned char *data, size_t size);
+
+    FragmentHandler handler;
+    std::vector<unsigned char> pending;
+    size_t box_offset;          // Start of the first incomplete box, from the start of the fragment
+    uint32_t timescale;
+};
+
+/*
+ * Collect the writer output into whole fragments, each in its own buffer.
+ */
+class MP4FragmentAssembler
+{
+public:
+
+    typedef std::function<void(const MP4FragmentPtr &)> FragmentHandler;
+
+    MP4FragmentAssembler(const FragmentHandler &handler);
+
+    // Return false if the stream is malformed. The pending data is discarded in that case.
+    bool Append(const unsigned char *data, size_t size) { return splitter.Append(data, size); }
+
+    void Reset() { splitter.Reset(); }
+
+private:
+
+    void Emit(const unsigned char *data, size_t size, const MP4FragmentInfo &info);
+
+    FragmentHandler handler;
+    MP4FragmentSplitter splitter;
+};
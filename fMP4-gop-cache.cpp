@@ -0,0 +1,141 @@
+#include "fMP4-gop-cache.hpp"
+#include "fMP4-box.hpp"
+
+MP4GopCache::MP4GopCache(size_t max_bytes)
+        : max_bytes(max_bytes)
+        , gop_bytes(0)
+        , gop_duration(0)
+        , gop_overflow(false)
+{
+}
+
+void MP4GopCache::Push(const MP4FragmentPtr &fragment)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if (fragment->type == MP4_FRAGMENT_INIT) {
+        init_fragment = fragment;
+        gop.clear();
+        gop_bytes = 0;
+        gop_duration = 0;
+        gop_overflow = false;
+        return;
+    }
+
+    if (fragment->is_key_frame) {
+        gop.clear();
+        gop_bytes = 0;
+        gop_duration = 0;
+        gop_overflow = false;
+    } else if (gop.empty() || gop_overflow) {
+        return; // Nothing to decode it from
+    }
+
+    if (gop_bytes + fragment->data.size() > max_bytes) {
+        gop.clear();
+        gop_bytes = 0;
+        gop_duration = 0;
+        gop_overflow = true;
+        return;
+    }
+
+    gop.push_back(fragment);
+    gop_bytes += fragment->data.size();
+    gop_duration += fragment->duration;
+}
+
+bool MP4GopCache::GetStartFragments(std::vector<MP4FragmentPtr> &fragments) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!init_fragment)
+        return false;
+
+    fragments.reserve(fragments.size() + gop.size() + 1);
+    fragments.push_back(init_fragment);
+    fragments.insert(fragments.end(), gop.begin(), gop.end());
+    return true;
+}
+
+void MP4GopCache::Clear()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    init_fragment.reset();
+    gop.clear();
+    gop_bytes = 0;
+    gop_duration = 0;
+    gop_overflow = false;
+}
+
+size_t MP4GopCache::GetCachedFragments() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return gop.size();
+}
+
+size_t MP4GopCache::GetCachedBytes() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return gop_bytes;
+}
+
+uint64_t MP4GopCache::GetCachedDuration() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return gop_duration;
+}
+
+/*
+ * MP4TimelineRebaser
+ */
+MP4TimelineRebaser::MP4TimelineRebaser()
+        : started(false)
+        , origin(0)
+        , next_decode_time(0)
+{
+}
+
+void MP4TimelineRebaser::Reset()
+{
+    started = false;
+    origin = 0;
+    next_decode_time = 0;
+}
+
+bool MP4TimelineRebaser::Rebase(const MP4Fragment &fragment, std::vector<unsigned char> &header)
+{
+    if (fragment.type != MP4_FRAGMENT_MEDIA || fragment.tfdt_offset == 0 || fragment.payload_offset == 0)
+        return false;
+
+    if (!started) {
+        origin = fragment.base_decode_time;
+        next_decode_time = 0;
+        started = true;
+    }
+
+    uint64_t decode_time = (fragment.base_decode_time > origin) ? fragment.base_decode_time - origin : 0;
+    if (decode_time > next_decode_time) {
+        // Some fragments were dropped by the ring, not thinned out: play on from where we are.
+        origin += decode_time - next_decode_time;
+        decode_time = next_decode_time;
+    }
+    next_decode_time = decode_time + fragment.duration;
+
+    header.assign(fragment.data.begin(), fragment.data.begin() + fragment.payload_offset);
+    if (fragment.tfdt_version == 1) {
+        MP4WriteU64(header.data() + fragment.tfdt_offset, decode_time);
+    } else {
+        MP4WriteU32(header.data() + fragment.tfdt_offset, static_cast<uint32_t>(decode_time));
+    }
+
+    // The capture time stays, for the player to measure the latency on the new timeline.
+    if (fragment.prft_offset && fragment.prft_offset < fragment.payload_offset) {
+        uint64_t shift = fragment.base_decode_time - decode_time;
+        uint64_t media_time = (fragment.capture_media_time > shift) ? fragment.capture_media_time - shift : 0;
+        if (fragment.prft_version == 1) {
+            MP4WriteU64(header.data() + fragment.prft_offset, media_time);
+        } else {
+            MP4WriteU32(header.data() + fragment.prft_offset, static_cast<uint32_t>(media_time));
+        }
+    }
+    return true;
+}
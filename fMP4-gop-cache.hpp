@@ -0,0 +1,69 @@
+#pragma once
+
+#include "fMP4-fragment.hpp"
+
+#include <mutex>
+#include <vector>
+
+/*
+ * Keep the init segment and the fragments of the most recent GOP, so a new subscriber could
+ * start decoding right away instead of waiting for the next key frame.
+ * The writer must start a fragment at every key frame (movflags frag_keyframe).
+ */
+class MP4GopCache
+{
+public:
+
+    // A GOP larger than max_bytes is not cached: the subscribers joining during it wait for the next key frame.
+    MP4GopCache(size_t max_bytes = 16 * 1024 * 1024);
+
+    void Push(const MP4FragmentPtr &fragment);
+
+    // The init segment then the cached GOP, in order. Return false if there is no init segment yet.
+    bool GetStartFragments(std::vector<MP4FragmentPtr> &fragments) const;
+
+    void Clear();
+
+    size_t GetCachedFragments() const;
+
+    size_t GetCachedBytes() const;
+
+    // In the track timescale.
+    uint64_t GetCachedDuration() const;
+
+private:
+
+    const size_t max_bytes;
+
+    mutable std::mutex mutex;
+    MP4FragmentPtr init_fragment;
+    std::vector<MP4FragmentPtr> gop;
+    size_t gop_bytes;
+    uint64_t gop_duration;
+    bool gop_overflow;
+};
+
+/*
+ * Per subscriber: start its decode timeline at 0 and close the gaps left by the dropped fragments,
+ * so the player starts at once (no seek to the first buffered time) and never stalls on a gap.
+ */
+class MP4TimelineRebaser
+{
+public:
+
+    MP4TimelineRebaser();
+
+    // Copy the fragment up to its samples (moof + mdat header) with the new decode time, and the media time
+    // of its prft if any shifted as much.
+    // The samples themselves are unchanged: fragment.data from fragment.payload_offset.
+    // Return false if the fragment has no decode time to patch.
+    bool Rebase(const MP4Fragment &fragment, std::vector<unsigned char> &header);
+
+    void Reset();
+
+private:
+
+    bool started;
+    uint64_t origin;
+    uint64_t next_decode_time;
+};
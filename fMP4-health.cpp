@@ -0,0 +1,184 @@
+#include "fMP4-health.hpp"
+
+#include <cmath>
+#include <cstring>
+
+static const unsigned char NAL_SLICE     = 1;
+static const unsigned char NAL_SLICE_IDR = 5;
+static const unsigned char NAL_SPS       = 7;
+static const unsigned char NAL_PPS       = 8;
+
+// The next 00 00 01 from data, or end. memchr looks for the 01, much faster than a byte loop.
+static const unsigned char *FindStartCode(const unsigned char *data, const unsigned char *end)
+{
+    const unsigned char *p = data + 2;
+    while (p < end) {
+        p = static_cast<const unsigned char *>(memchr(p, 0x01, end - p));
+        if (!p)
+            return end;
+        if (p[-1] == 0 && p[-2] == 0)
+            return p - 2;
+        p++;
+    }
+    return end;
+}
+
+void MP4StreamAnalyzer::RunningStats::Add(double value)
+{
+    count++;
+    double delta = value - mean;
+    mean += delta / count;
+    m2 += delta * (value - mean);
+
+    if (count == 1 || value < min) min = value;
+    if (count == 1 || value > max) max = value;
+    last = value;
+}
+
+double MP4StreamAnalyzer::RunningStats::GetStddev() const
+{
+    return (count > 1) ? std::sqrt(m2 / (count - 1)) : 0.0;
+}
+
+MP4StreamAnalyzer::MP4StreamAnalyzer(unsigned int timescale)
+        : timescale(timescale > 0 ? timescale : 1000)
+        , frames(0)
+        , key_frames(0)
+        , bytes(0)
+        , gop_frames(0)
+        , first_dts(0)
+        , last_dts(0)
+        , current_second(0)
+        , current_second_bytes(0)
+        , parameter_set_changes(0)
+{
+}
+
+void MP4StreamAnalyzer::Analyze(const unsigned char *sample, unsigned int sample_size, bool is_key_frame, long long int dts)
+{
+    // Out of the lock: the scan is most of the cost.
+    unsigned int slice_count = 0;
+    const unsigned char *sps_nalu = nullptr, *pps_nalu = nullptr;
+    size_t sps_size = 0, pps_size = 0;
+
+    const unsigned char *end = sample + sample_size;
+    const unsigned char *start_code = FindStartCode(sample, end);
+    while (start_code + 3 < end) {
+        const unsigned char *nalu = start_code + 3;
+        const unsigned char *next = FindStartCode(nalu, end);
+        unsigned char type = nalu[0] & 0x1f;
+        if (type == NAL_SLICE || type == NAL_SLICE_IDR) {
+            slice_count++;
+        } else if (type == NAL_SPS || type == NAL_PPS) {
+            // Without the zero of a 4 bytes start code which follows.
+            size_t size = next - nalu;
+            if (next < end && size > 0 && nalu[size - 1] == 0)
+                size--;
+            if (type == NAL_SPS) {
+                sps_nalu = nalu;
+                sps_size = size;
+            } else {
+                pps_nalu = nalu;
+                pps_size = size;
+            }
+        }
+        start_code = next;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if (frames > 0) {
+        frame_intervals.Add(static_cast<double>(dts - last_dts) * 1000 / timescale);
+    } else {
+        first_dts = dts;
+        current_second = 0;
+    }
+    last_dts = dts;
+
+    long long int second = (dts - first_dts) / timescale;
+    if (second > current_second)
+        EndSecond(second);
+    current_second_bytes += sample_size;
+
+    frames++;
+    bytes += sample_size;
+    slices.Add(slice_count);
+
+    if (is_key_frame) {
+        if (key_frames > 0)
+            gop_lengths.Add(gop_frames);
+        gop_frames = 0;
+        key_frames++;
+        key_frame_sizes.Add(sample_size);
+    }
+    gop_frames++;
+
+    bool changed = false;
+    if (sps_nalu)
+        changed |= UpdateParameterSet(sps, sps_nalu, sps_size);
+    if (pps_nalu)
+        changed |= UpdateParameterSet(pps, pps_nalu, pps_size);
+    if (changed)
+        parameter_set_changes++;
+}
+
+void MP4StreamAnalyzer::EndSecond(long long int second)
+{
+    bitrates.Add(current_second_bytes * 8 / 1000.0);
+
+    // The seconds without any frame, Ex: the camera stalled.
+    for (long long int empty = current_second + 1; empty < second; empty++)
+        bitrates.Add(0);
+
+    current_second = second;
+    current_second_bytes = 0;
+}
+
+// Return true if the parameter set differs from the previous one, not for the first one.
+bool MP4StreamAnalyzer::UpdateParameterSet(std::vector<unsigned char> &parameter_set, const unsigned char *nalu, size_t size)
+{
+    if (parameter_set.size() == size && memcmp(parameter_set.data(), nalu, size) == 0)
+        return false;
+
+    bool first = parameter_set.empty();
+    parameter_set.assign(nalu, nalu + size);
+    return !first;
+}
+
+fMP4StreamHealth MP4StreamAnalyzer::GetHealth() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    fMP4StreamHealth health;
+    health.frames     = frames;
+    health.key_frames = key_frames;
+    health.bytes      = bytes;
+    health.duration_s = static_cast<double>(last_dts - first_dts) / timescale;
+
+    health.gop_frames_mean   = gop_lengths.mean;
+    health.gop_frames_stddev = gop_lengths.GetStddev();
+    health.gop_frames_min    = static_cast<unsigned int>(gop_lengths.min);
+    health.gop_frames_max    = static_cast<unsigned int>(gop_lengths.max);
+
+    health.frame_interval_ms_mean   = frame_intervals.mean;
+    health.frame_interval_jitter_ms = frame_intervals.GetStddev();
+    health.frame_interval_ms_max    = frame_intervals.max;
+
+    health.bitrate_kbps_mean = bitrates.mean;
+    health.bitrate_kbps_min  = bitrates.min;
+    health.bitrate_kbps_max  = bitrates.max;
+    health.bitrate_kbps_last = bitrates.last;
+
+    health.slices_per_frame_mean = slices.mean;
+    health.slices_per_frame_max  = static_cast<unsigned int>(slices.max);
+
+    health.key_frame_bytes_mean = static_cast<unsigned long long int>(key_frame_sizes.mean);
+    health.key_frame_bytes_min  = static_cast<unsigned long long int>(key_frame_sizes.min);
+    health.key_frame_bytes_max  = static_cast<unsigned long long int>(key_frame_sizes.max);
+
+    // profile_idc and level_idc are the first bytes after the NAL header, no need to decode the SPS.
+    health.profile_idc = sps.size() > 3 ? sps[1] : 0;
+    health.level_idc   = sps.size() > 3 ? sps[3] : 0;
+    health.parameter_set_changes = parameter_set_changes;
+    return health;
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include "fMP4.h"
+
+#include <mutex>
+#include <vector>
+
+/*
+ * The health of an H264 stream, from its AnnexB samples: GOP length, frame interval jitter,
+ * bitrate per second of stream time, slices per frame, key frame sizes and parameter set changes.
+ *
+ * Only the start codes are looked for (with memchr), the slices are never parsed: cheap enough
+ * to run on every live writer, and many times faster than real time on files.
+ * Analyze() must be called from a single thread, GetHealth() could be called from any thread.
+ */
+class MP4StreamAnalyzer
+{
+public:
+
+    explicit MP4StreamAnalyzer(unsigned int timescale);
+
+    MP4StreamAnalyzer(const MP4StreamAnalyzer &) = delete;
+    MP4StreamAnalyzer &operator=(const MP4StreamAnalyzer &) = delete;
+
+    // Samples in decode order, dts in the timescale.
+    void Analyze(const unsigned char *sample, unsigned int sample_size, bool is_key_frame, long long int dts);
+
+    fMP4StreamHealth GetHealth() const;
+
+private:
+
+    // Mean and variance in one pass (Welford).
+    struct RunningStats
+    {
+        RunningStats() : count(0), mean(0), m2(0), min(0), max(0), last(0) {}
+
+        void Add(double value);
+        double GetStddev() const;
+
+        unsigned long long int count;
+        double mean;
+        double m2;
+        double min;
+        double max;
+        double last;
+    };
+
+    void EndSecond(long long int second);
+    bool UpdateParameterSet(std::vector<unsigned char> &parameter_set, const unsigned char *nalu, size_t size);
+
+    const unsigned int timescale;
+
+    mutable std::mutex mutex;
+
+    unsigned long long int frames;
+    unsigned long long int key_frames;
+    unsigned long long int bytes;
+
+    // GOP: the frames from a key frame to the next one
+    unsigned int gop_frames;
+    RunningStats gop_lengths;
+    RunningStats key_frame_sizes;
+
+    // Frame interval, in ms
+    long long int first_dts;
+    long long int last_dts;
+    RunningStats frame_intervals;
+
+    // Bitrate of every whole second of stream time, in kbit/s
+    long long int current_second;
+    unsigned long long int current_second_bytes;
+    RunningStats bitrates;
+
+    RunningStats slices;
+
+    std::vector<unsigned char> sps;
+    std::vector<unsigned char> pps;
+    unsigned int parameter_set_changes;
+};
@@ -1,287 +1,299 @@
 #include "fMP4-imp.hpp"
-
-#include <netinet/in.h>
+#include "fMP4-async-writer.hpp"
 
 MP4Writer* MP4Writer::Create(DataCallback cb)
 {
     return new MP4WriterImp(cb);
 }
 
-void MP4Writer::Release(MP4Writer *writer)
+MP4Writer* MP4Writer::Create(DataCallbackWithContext cb, void *context)
 {
-    delete writer;
+    return new MP4WriterImp(cb, context);
 }
 
-MP4WriterImp::MP4WriterImp(DataCallback cb)
-        : MP4Writer(cb)
-        , file_duration(0)
-        , format_context(nullptr)
-        , video_stream_id(0)
-        , avio_buffer_size(1024 * 1024)
-        , h264_parser(nullptr)
-        , data_callback(cb)
+MP4Writer* MP4Writer::Create(const fMP4WriterConfig &config)
 {
-    av_register_all();
+    if (config.async_queue_size > 0)
+        return new MP4AsyncWriter(new MP4WriterImp(config), config);
+    return new MP4WriterImp(config);
+}
 
-    h264_parser = gst_h264_nal_parser_new();
+void MP4Writer::Release(MP4Writer *writer)
+{
+    delete writer;
 }
 
-MP4WriterImp::~MP4WriterImp()
+/*
+ * MP4WriterSink
+ */
+MP4WriterSink::MP4WriterSink(DataCallbackWithContext callback,
+                             void *context,
+                             MP4BufferPool *buffer_pool,
+                             MP4BufferBudget *buffer_budget,
+                             MP4FragmentSplitter *fragment_splitter)
+        : callback(callback)
+        , context(context)
+        , buffer_pool(buffer_pool)
+        , buffer_budget(buffer_budget)
+        , fragment_splitter(fragment_splitter)
 {
-    if (format_context && av_write_trailer(format_context) < 0) {
-        printf("Fail to write trailer\n");
-    }
+}
 
-    if (format_context && format_context->streams[video_stream_id]) {
-        if (format_context->streams[video_stream_id]->codec) {
-            avcodec_close(format_context->streams[video_stream_id]->codec);
-        }
-    }
+unsigned char *MP4WriterSink::AcquireBuffer(size_t size, size_t &capacity)
+{
+    if (buffer_pool)
+        return buffer_pool->Acquire(size, MP4BufferPool::MIN_CLASS_SIZE, buffer_budget, capacity);
 
-    if (format_context && !(format_context->oformat->flags & AVFMT_NOFILE)) {
-        // Need to free the buffer that we allocate to our custom AVIOContext.
-        if (format_context->pb->buffer)
-            av_free(format_context->pb->buffer);
+    unsigned char *buffer = static_cast<unsigned char *>(av_malloc(size));
+    capacity = buffer ? size : 0;
+    return buffer;
+}
 
-        // Free custom AVIOContext.
-        if (format_context->pb)
-            av_free(format_context->pb);
+void MP4WriterSink::ReleaseBuffer(unsigned char *buffer, size_t capacity)
+{
+    if (buffer_pool) {
+        buffer_pool->Release(buffer, capacity, buffer_budget);
+    } else {
+        av_free(buffer);
     }
+}
 
-    if (format_context)
-        avformat_free_context(format_context);
-
-    if (h264_parser)
-        gst_h264_nal_parser_free(h264_parser);
+/*
+ * MP4WriterImp
+ */
+MP4WriterImp::MP4WriterImp(DataCallback cb)
+        : MP4WriterImp(GetCallbackConfig(cb, nullptr, nullptr))
+{
 }
 
-// Performs a write operation using the signature required for avio.
-int MP4WriterImp::Write(void* opaque, uint8_t* buf, int buf_size)
+MP4WriterImp::MP4WriterImp(DataCallbackWithContext cb, void *context)
+        : MP4WriterImp(GetCallbackConfig(nullptr, cb, context))
 {
-    //static int i = 0;
-    //printf("#%d Write: buf: %p(%02x%02x%02x%02x %c%c%c%c), size: %d\n", i++, buf, buf[0], buf[1], buf[2], buf[3], buf[4], buf[5], buf[6], buf[7], buf_size);
+}
 
-    // Don't need to write mfra box
-    if (buf[4] == 'm' && buf[5] == 'f' && buf[6] == 'r' && buf[7] == 'a') {
-        return buf_size;
+MP4WriterImp::MP4WriterImp(const fMP4WriterConfig &config)
+        : MP4Writer()
+        , buffer_budget((config.buffer_pool && config.memory_budget > 0) ? new MP4BufferBudget(config.memory_budget) : nullptr)
+        , fragment_splitter(CreateFragmentSplitter(config))
+        , muxer(GetSink(config, buffer_budget.get(), fragment_splitter.get()),
+                config.timescale,
+                GetOutputBufferSize(config),
+                GetFragmentPolicy(config))
+        , trick_play(nullptr)
+        , trick_play_pts(0)
+        , trick_play_dts(0)
+        , thumbnailer(nullptr)
+        , thumbnail_interval(0)
+        , thumbnail_callback(nullptr)
+        , thumbnail_context(nullptr)
+        , last_thumbnail_dts(0)
+        , has_thumbnail(false)
+        , thumbnail_requested(false)
+        , analyzer(reinterpret_cast<MP4StreamAnalyzer *>(config.analyzer))
+{
+    muxer.GetCodec().GetNaluFilter().SetPolicy(config.keep_nal_types, config.drop_sei_payload_types);
+
+    if (config.thumbnailer && config.thumbnail_callback) {
+        unsigned int timescale = (config.timescale > 0) ? config.timescale : 1000;
+        thumbnailer = reinterpret_cast<MP4Thumbnailer *>(config.thumbnailer);
+        thumbnail_interval = static_cast<long long int>(config.thumbnail_interval_ms) * timescale / 1000;
+        thumbnail_callback = config.thumbnail_callback;
+        thumbnail_context = config.thumbnail_context;
     }
 
-    DataCallback cb = reinterpret_cast<MP4WriterImp*>(opaque)->data_callback;
-    return ((cb != nullptr) ? cb(buf, buf_size) : buf_size);
+    // The same writer, on the trick-play callback.
+    if (config.trick_play_callback || config.trick_play_callback_with_context) {
+        fMP4WriterConfig trick_play_config = config;
+        trick_play_config.callback = config.trick_play_callback;
+        trick_play_config.callback_with_context = config.trick_play_callback_with_context;
+        trick_play_config.context = config.trick_play_context;
+        trick_play_config.trick_play_callback = nullptr;
+        trick_play_config.trick_play_callback_with_context = nullptr;
+        trick_play_config.thumbnailer = nullptr;
+        trick_play_config.fragment_callback = nullptr;
+        trick_play_config.analyzer = nullptr;
+        trick_play_config.fragment_target_bytes = 0;
+        trick_play = new MP4WriterImp(trick_play_config);
+    }
 }
 
-bool MP4WriterImp::WriteH264VideoSample(unsigned char *sample,
-                                        unsigned int sample_size,
-                                        bool is_key_frame,
-                                        unsigned long long int duration)
+MP4WriterImp::~MP4WriterImp()
 {
-    // Parse the sample into NALUs
-    std::vector<GstH264NalUnit> nalus = ParseH264NALU(sample, sample_size);
-
-    // To compatible with AVC1 format, we need to add SPS/PPS into mp4 header. (In avcC box)
-    if (!format_context) {
-        if (is_key_frame) {
-            GstH264NalUnit nal_sps = {0}, nal_pps = {0};
-            for (auto nalu : nalus) {
-                if (nalu.type == GST_H264_NAL_SPS) nal_sps = nalu;
-                else if (nalu.type == GST_H264_NAL_PPS) nal_pps = nalu;
-            }
-
-            if (!AddH264VideoTrack(nal_sps, nal_pps)) {
-                printf("Fail to add H264 video track\n");
-                return false;
-            }
-        } else {
-            printf("Drop current frame because it is not a key frame. Need key frame for initialization\n");
-            return true;
-        }
+    // No callback once the writer is gone.
+    if (thumbnailer)
+        thumbnailer->Cancel(this);
+
+    if (trick_play) {
+        // The last key frame lasts until the end of the stream.
+        if (!trick_play_sample.empty())
+            WriteTrickPlaySample(static_cast<long long int>(muxer.GetEndTime()));
+        delete trick_play;
     }
 
-    // To compatible with AVC1 format, we could not put SPS/PPS in the sample.
-    // So, we need to parse the data and only write video frame NALU into mp4.
-    for (auto nalu : nalus) {
-        if (nalu.type == GST_H264_NAL_SLICE_IDR || nalu.type == GST_H264_NAL_SLICE) {
-
-            // Convert AnnexB format to AVC1
-            unsigned int *p = (unsigned int *) (nalu.data + nalu.offset - 4);
-            *p = htonl(nalu.size);
-
-            AVPacket packet = { 0 };
-            av_init_packet(&packet);
+    // The muxer writes the trailer, then returns its buffer.
+}
 
-            packet.stream_index = video_stream_id;
-            packet.data         = (unsigned char *)(p);
-            packet.size         = nalu.size + 4;
-            packet.pos          = -1;
+fMP4WriterConfig MP4WriterImp::GetCallbackConfig(DataCallback cb, DataCallbackWithContext cb_with_context, void *context)
+{
+    fMP4WriterConfig config;
+    fMP4_InitWriterConfig(&config);
+    config.callback = cb;
+    config.callback_with_context = cb_with_context;
+    config.context = context;
+    return config;
+}
 
-            packet.dts = packet.pts = static_cast<int64_t>(file_duration);
-            packet.duration = static_cast<int>(duration);
-            av_packet_rescale_ts(&packet, (AVRational){1, 1000}, format_context->streams[video_stream_id]->time_base);
+MP4WriterSink MP4WriterImp::GetSink(const fMP4WriterConfig &config, MP4BufferBudget *buffer_budget, MP4FragmentSplitter *fragment_splitter)
+{
+    MP4BufferPool *buffer_pool = reinterpret_cast<MP4BufferPool *>(config.buffer_pool);
+    if (config.callback_with_context)
+        return MP4WriterSink(config.callback_with_context, config.context, buffer_pool, buffer_budget, fragment_splitter);
+    if (config.callback)
+        return MP4WriterSink(&MP4CallDataCallback, reinterpret_cast<void *>(config.callback), buffer_pool, buffer_budget, fragment_splitter);
+    return MP4WriterSink(&MP4DiscardData, nullptr, buffer_pool, buffer_budget, fragment_splitter);
+}
 
-            if (is_key_frame) {
-                packet.flags |= AV_PKT_FLAG_KEY;
-            }
+MP4FragmentSplitter *MP4WriterImp::CreateFragmentSplitter(const fMP4WriterConfig &config)
+{
+    if (!config.fragment_callback)
+        return nullptr;
+
+    fMP4FragmentCallback callback = config.fragment_callback;
+    void *context = config.fragment_context;
+    return new MP4FragmentSplitter([callback, context](const unsigned char *data, size_t size, const MP4FragmentInfo &info) {
+        fMP4FragmentInfo fragment_info;
+        fragment_info.type               = (info.type == MP4_FRAGMENT_INIT) ? fMP4_FRAGMENT_INIT : fMP4_FRAGMENT_MEDIA;
+        fragment_info.size               = static_cast<unsigned int>(size);
+        fragment_info.timescale          = info.timescale;
+        fragment_info.sequence_number    = info.sequence_number;
+        fragment_info.base_decode_time   = info.base_decode_time;
+        fragment_info.duration           = info.duration;
+        fragment_info.is_key_frame       = info.is_key_frame;
+        fragment_info.capture_time_us    = info.capture_time_us;
+        fragment_info.capture_media_time = info.capture_media_time;
+        callback(context, data, &fragment_info);
+    });
+}
 
-            if (av_interleaved_write_frame(format_context, &packet) < 0) {
-                printf("Fail to write frame\n");
-                return false;
-            }
+unsigned int MP4WriterImp::GetOutputBufferSize(const fMP4WriterConfig &config)
+{
+    if (config.output_buffer_size > 0)
+        return config.output_buffer_size;
 
-            file_duration += duration;
-        }
-    }
+    // With a pool, sized from the first key frame.
+    return config.buffer_pool ? 0 : 1024 * 1024;
+}
 
-    return true;
+MP4SizeTargetedFragments MP4WriterImp::GetFragmentPolicy(const fMP4WriterConfig &config)
+{
+    // In the writer timescale, as the timestamps.
+    long long int timescale = (config.timescale > 0) ? config.timescale : 1000;
+    return MP4SizeTargetedFragments(config.fragment_target_bytes,
+                                    config.fragment_min_duration_ms * timescale / 1000,
+                                    config.fragment_max_duration_ms * timescale / 1000);
 }
 
-bool MP4WriterImp::AddH264VideoTrack(GstH264NalUnit &nal_sps, GstH264NalUnit &nal_pps)
+bool MP4WriterImp::WriteH264VideoSample(unsigned char *sample,
+                                        unsigned int sample_size,
+                                        bool is_key_frame,
+                                        unsigned long long int duration)
 {
-    // Parse SPS to get necessary params.
-    unsigned char profile_idc = 0;
-    unsigned char profile_compatibility = 0;
-    unsigned char level_idc = 0;
-    int width  = 0, height = 0;
-    {
-        GstH264SPS sps = {0};
-        gst_h264_parser_parse_sps(h264_parser, &nal_sps, &sps, false);
-
-        profile_idc = sps.profile_idc;
-        level_idc = sps.level_idc;
-        width  = sps.frame_cropping_flag ? sps.crop_rect_width : sps.width;
-        height = sps.frame_cropping_flag ? sps.crop_rect_height : sps.height;
-
-        profile_compatibility = 0x00;
-        //profile_compatibility = (sps.constraint_set0_flag << 7) | (sps.constraint_set1_flag << 6) |
-        //                        (sps.constraint_set2_flag << 5) | (sps.constraint_set3_flag << 4);
-
-        printf("Profile: %d, Compatibility: %d, Level: %d\n", profile_idc, profile_compatibility, level_idc);
-        printf("Width: %d, Height: %d\n", width, height);
-    }
+    // Without B-frames, the samples simply follow each other.
+    long long int timestamp = static_cast<long long int>(muxer.GetEndTime());
+    return WriteH264VideoSample(sample, sample_size, is_key_frame, timestamp, timestamp, duration);
+}
 
-    avformat_alloc_output_context2(&format_context, nullptr, "mp4", nullptr);
-    if (!format_context) {
-        printf("Fail to create output context\n");
-        return false;
-    }
+bool MP4WriterImp::WriteH264VideoSample(unsigned char *sample,
+                                        unsigned int sample_size,
+                                        bool is_key_frame,
+                                        long long int pts,
+                                        long long int dts,
+                                        unsigned long long int duration)
+{
+    return WriteH264VideoSample(sample, sample_size, is_key_frame, pts, dts, duration, 0);
+}
 
-    AVStream *out_stream = avformat_new_stream(format_context, nullptr);
-    if (!out_stream) {
-        printf("Fail to allocate output stream\n");
+bool MP4WriterImp::WriteH264VideoSample(unsigned char *sample,
+                                        unsigned int sample_size,
+                                        bool is_key_frame,
+                                        long long int pts,
+                                        long long int dts,
+                                        unsigned long long int duration,
+                                        unsigned long long int capture_time_us)
+{
+    if (!muxer.CheckTimestamps(pts, dts))
         return false;
-    }
 
-    out_stream->id = video_stream_id = format_context->nb_streams - 1;
-    out_stream->codec->codec_id   = AV_CODEC_ID_H264;
-    out_stream->codec->profile    = profile_idc;
-    out_stream->codec->level      = level_idc;
-    out_stream->codec->codec_type = AVMEDIA_TYPE_VIDEO;
-    out_stream->codec->width      = width;
-    out_stream->codec->height     = height;
-    out_stream->codec->pix_fmt    = AV_PIX_FMT_YUV420P;
-    out_stream->codec->codec_tag  = 0;
-
-    // Fill extra data for AVCC format
-    unsigned int extradata_offset = 0;
-    out_stream->codec->extradata_size = nal_sps.size + nal_pps.size + 11;
-    out_stream->codec->extradata = (uint8_t *)av_mallocz(out_stream->codec->extradata_size);
-    out_stream->codec->extradata[extradata_offset++] = 0x01;                     // configurationVersion
-    out_stream->codec->extradata[extradata_offset++] = profile_idc;              // AVCProfileIndication
-    out_stream->codec->extradata[extradata_offset++] = profile_compatibility;    // profile_compatibility
-    out_stream->codec->extradata[extradata_offset++] = level_idc;                // AVCLevelIndication, level: 4.0
-    out_stream->codec->extradata[extradata_offset++] = 0xff;                     // 6 bits reserved (111111) + 2 bits nal size length - 1 (11)
-    out_stream->codec->extradata[extradata_offset++] = 0xe1;                     // 3 bits reserved (111) + 5 bits number of sps (00001)
-
-    unsigned short sps_size = static_cast<unsigned short>(nal_sps.size);
-    *(unsigned short *)(out_stream->codec->extradata + extradata_offset) = htons(sps_size);
-    extradata_offset += 2;
-    memcpy(out_stream->codec->extradata + extradata_offset, nal_sps.data + nal_sps.offset, nal_sps.size);
-    extradata_offset += nal_sps.size;
-
-    out_stream->codec->extradata[extradata_offset++] = 0x01;                     // 8 bits number of pps (00000000)
-    unsigned short pps_size = static_cast<unsigned short>(nal_pps.size);
-    *(unsigned short *)(out_stream->codec->extradata + extradata_offset) = htons(pps_size);
-    extradata_offset += 2;
-    memcpy(out_stream->codec->extradata + extradata_offset, nal_pps.data + nal_pps.offset, nal_pps.size);
-    extradata_offset += nal_pps.size;
-
-    if (format_context->oformat->flags & AVFMT_GLOBALHEADER)
-        out_stream->codec->flags |= CODEC_FLAG_GLOBAL_HEADER;
-
-    av_dump_format(format_context, 0, "CustomAVIO", 1);
-
-    /*
-     * Open output file
-     */
-    {
-        if (!(format_context->oformat->flags & AVFMT_NOFILE)) {
-            // Allocate our custom AVIO context
-            AVIOContext *avio_out = avio_alloc_context(static_cast<unsigned char *>(av_malloc(avio_buffer_size)),
-                                                       avio_buffer_size,
-                                                       1,
-                                                       this,
-                                                       nullptr,
-                                                       &Write,
-                                                       nullptr
-            );
-            if(!avio_out) {
-                printf("Fail to create avio context\n");
-                return false;
+    // Still in AnnexB.
+    if (analyzer)
+        analyzer->Analyze(sample, sample_size, is_key_frame, dts);
+
+    if (thumbnailer && is_key_frame) {
+        bool requested = thumbnail_requested.exchange(false);
+        bool due = thumbnail_interval > 0 && (!has_thumbnail || dts - last_thumbnail_dts >= thumbnail_interval);
+        if (requested || due) {
+            if (thumbnailer->Submit(this, sample, sample_size, pts, thumbnail_callback, thumbnail_context)) {
+                last_thumbnail_dts = dts;
+                has_thumbnail = true;
+            } else if (requested) {
+                thumbnail_requested = true;     // Try again at the next key frame
             }
-
-            format_context->pb = avio_out;
-            format_context->flags = AVFMT_FLAG_CUSTOM_IO;
         }
     }
 
-    /*
-     * Write file header
-     */
-    {
-        AVDictionary *movflags = nullptr;
-
-        const bool low_delay = true;
-        if (low_delay) {
-            // In case of low delay, set fragment duration to 200 ms.
-            av_dict_set(&movflags, "movflags", "empty_moov+default_base_moof", 0);
-            av_dict_set_int(&movflags, "frag_duration", 200 * 1000, 0);
-        } else {
-            // Only produce fragment until we have next key frame.
-            av_dict_set(&movflags, "movflags", "empty_moov+default_base_moof+frag_keyframe", 0);
-        }
-
-        if (avformat_write_header(format_context, &movflags) < 0) {
-            printf("Error occurred when opening output file\n");
-            return false;
-        }
-        av_dict_free(&movflags);
+    // Keep a copy of the key frame before it is converted to AVCC in place, until the next one.
+    if (trick_play && is_key_frame) {
+        if (!trick_play_sample.empty())
+            WriteTrickPlaySample(dts);
+        trick_play_sample.assign(sample, sample + sample_size);
+        trick_play_pts = pts;
+        trick_play_dts = dts;
     }
 
-    return true;
+    return muxer.Write(sample, sample_size, is_key_frame, pts, dts, duration, capture_time_us);
 }
 
-std::vector<GstH264NalUnit> MP4WriterImp::ParseH264NALU(unsigned char *data, unsigned int length)
+bool MP4WriterImp::WriteTrickPlaySample(long long int end_dts)
 {
-    std::vector<GstH264NalUnit> nalus;
-
-    GstH264NalUnit nalu = {0};
-    GstH264ParserResult result;
-    unsigned int offset = 0;
-    while ((result = gst_h264_parser_identify_nalu(h264_parser, data, offset, length, &nalu)) == GST_H264_PARSER_OK)
-    {
-        // Update the offset
-        gst_h264_parser_parse_nal(h264_parser, &nalu);
-        offset = nalu.size + nalu.offset;
-
-        nalus.push_back(nalu);
-    }
-
-    // Handle the last NALU because there is no other start_code followed it.
-    if (gst_h264_parser_identify_nalu_unchecked(h264_parser, data, offset, length, &nalu) == GST_H264_PARSER_OK) {
+    unsigned long long int duration = (end_dts > trick_play_dts) ? static_cast<unsigned long long int>(end_dts - trick_play_dts) : 0;
+    bool result = trick_play->muxer.Write(trick_play_sample.data(),
+                                          static_cast<unsigned int>(trick_play_sample.size()),
+                                          true,
+                                          trick_play_pts,
+                                          trick_play_dts,
+                                          duration);
+    trick_play_sample.clear();
+
+    // The muxer would hold the fragment until the next key frame, a GOP later. Its duration is known already.
+    return result && trick_play->muxer.Flush();
+}
 
-        gst_h264_parser_parse_nal(h264_parser, &nalu);
+bool MP4WriterImp::OpenH264VideoTrack(const MP4H264TrackConfig &config, AVOutputFormat *output_format)
+{
+    if (!muxer.Open(config, output_format))
+        return false;
 
-        nalus.push_back(nalu);
+    // Same track for the trick-play output. Without it, only the main output goes on.
+    if (trick_play && !trick_play->muxer.IsOpen() && !trick_play->muxer.Open(config, output_format)) {
+        printf("Fail to open the trick-play track\n");
+        delete trick_play;
+        trick_play = nullptr;
     }
+    return true;
+}
+
+void MP4WriterImp::RequestThumbnail()
+{
+    if (thumbnailer)
+        thumbnail_requested = true;
+}
 
-    return nalus;
-}
\ No newline at end of file
+void MP4WriterImp::GetStats(fMP4WriterStats &stats) const
+{
+    muxer.GetStats(stats);
+    if (trick_play) {
+        fMP4WriterStats trick_play_stats;
+        trick_play->muxer.GetStats(trick_play_stats);
+        stats.trick_play_bytes = trick_play_stats.output_bytes;
+    }
+}
@@ -1,22 +1,61 @@
 #pragma once
 
 #include "fMP4.hpp"
+#include "fMP4-basic-writer.hpp"
+#include "fMP4-buffer-pool.hpp"
+#include "fMP4-fragment.hpp"
+#include "fMP4-health.hpp"
+#include "fMP4-thumbnail.hpp"
 
+#include <atomic>
+#include <memory>
 #include <vector>
 
-extern "C" {
-#include <libavformat/avformat.h>
-};
+// The output of MP4WriterImp: the callback of the writer, with its buffer from the pool if any,
+// and the splitter of the fragment callback if any.
+class MP4WriterSink
+{
+public:
+
+    MP4WriterSink(DataCallbackWithContext callback,
+                  void *context,
+                  MP4BufferPool *buffer_pool,
+                  MP4BufferBudget *buffer_budget,
+                  MP4FragmentSplitter *fragment_splitter);
+
+    int Write(unsigned char *buf, int size)
+    {
+        if (fragment_splitter)
+            fragment_splitter->Append(buf, static_cast<size_t>(size));
+        return callback(context, buf, size);
+    }
+
+    // Under a tight budget, a smaller buffer only means smaller chunks to the callback.
+    unsigned char *AcquireBuffer(size_t size, size_t &capacity);
+
+    void ReleaseBuffer(unsigned char *buffer, size_t capacity);
 
-#define GST_USE_UNSTABLE_API /* To avoid H264 parser warning */
-#include <gst/codecparsers/gsth264parser.h>
+private:
+
+    DataCallbackWithContext callback;
+    void *context;
+    MP4BufferPool *buffer_pool;
+    MP4BufferBudget *buffer_budget;
+    MP4FragmentSplitter *fragment_splitter;
+};
 
 class MP4WriterImp : public MP4Writer
 {
 public:
 
+    typedef BasicMP4Writer<MP4H264Codec, MP4SizeTargetedFragments, MP4WriterSink> Muxer;
+
     MP4WriterImp(DataCallback cb);
 
+    MP4WriterImp(DataCallbackWithContext cb, void *context);
+
+    MP4WriterImp(const fMP4WriterConfig &config);
+
     ~MP4WriterImp();
 
     virtual bool WriteH264VideoSample(unsigned char *sample,
@@ -24,19 +63,60 @@ public:
                                       bool is_key_frame,
                                       unsigned long long int duration);
 
+    virtual bool WriteH264VideoSample(unsigned char *sample,
+                                      unsigned int sample_size,
+                                      bool is_key_frame,
+                                      long long int pts,
+                                      long long int dts,
+                                      unsigned long long int duration);
+
+    virtual bool WriteH264VideoSample(unsigned char *sample,
+                                      unsigned int sample_size,
+                                      bool is_key_frame,
+                                      long long int pts,
+                                      long long int dts,
+                                      unsigned long long int duration,
+                                      unsigned long long int capture_time_us);
+
+    virtual void GetStats(fMP4WriterStats &stats) const;
+
+    virtual void RequestThumbnail();
+
+    // Set up the muxer and write the init segment, without waiting for the first key frame.
+    // The output format is looked up if not given.
+    bool OpenH264VideoTrack(const MP4H264TrackConfig &config, AVOutputFormat *output_format);
+
 private:
 
-    // Performs a write operation using the signature required for avio.
-    static int Write(void* opaque, uint8_t* buf, int buf_size);
+    static fMP4WriterConfig GetCallbackConfig(DataCallback cb, DataCallbackWithContext cb_with_context, void *context);
+    static MP4WriterSink GetSink(const fMP4WriterConfig &config, MP4BufferBudget *buffer_budget, MP4FragmentSplitter *fragment_splitter);
+    static MP4FragmentSplitter *CreateFragmentSplitter(const fMP4WriterConfig &config);
+    static unsigned int GetOutputBufferSize(const fMP4WriterConfig &config);
+    static MP4SizeTargetedFragments GetFragmentPolicy(const fMP4WriterConfig &config);
 
-    bool AddH264VideoTrack(GstH264NalUnit &nal_sps, GstH264NalUnit &nal_pps);
+    // Write the pending key frame to the trick-play writer, lasting until end_dts, and send its fragment at once.
+    bool WriteTrickPlaySample(long long int end_dts);
 
-    std::vector<GstH264NalUnit> ParseH264NALU(unsigned char *data, unsigned int length);
+    // Before the muxer, which returns its buffer to the budget, and flushes its last fragment on release.
+    std::unique_ptr<MP4BufferBudget> buffer_budget;
+    std::unique_ptr<MP4FragmentSplitter> fragment_splitter;
+    Muxer muxer;
 
-    unsigned long long int file_duration;
-    AVFormatContext *format_context;
-    unsigned int video_stream_id;
-    unsigned int avio_buffer_size;
-    GstH264NalParser *h264_parser;
-    DataCallback data_callback;
-};
\ No newline at end of file
+    // The key frames only. The last one waits for the next, which gives its duration.
+    MP4WriterImp *trick_play;
+    std::vector<unsigned char> trick_play_sample;
+    long long int trick_play_pts;
+    long long int trick_play_dts;
+
+    // Sampled key frames go to the thumbnailer, which copies them.
+    MP4Thumbnailer *thumbnailer;
+    long long int thumbnail_interval;           // In the timescale
+    fMP4ThumbnailCallback thumbnail_callback;
+    void *thumbnail_context;
+    long long int last_thumbnail_dts;
+    bool has_thumbnail;
+    std::atomic<bool> thumbnail_requested;
+
+    // Not owned.
+    MP4StreamAnalyzer *analyzer;
+};
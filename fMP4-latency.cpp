@@ -0,0 +1,44 @@
+#include "fMP4-latency.hpp"
+
+#include <vector>
+
+MP4LatencyHistogram::MP4LatencyHistogram()
+{
+    for (auto &bucket : buckets)
+        bucket.store(0, std::memory_order_relaxed);
+}
+
+void MP4LatencyHistogram::Add(long long int latency_us)
+{
+    unsigned long long int latency_ms = (latency_us > 0) ? static_cast<unsigned long long int>(latency_us) / 1000 : 0;
+    buckets[(latency_ms < MAX_MS) ? latency_ms : MAX_MS].fetch_add(1, std::memory_order_relaxed);
+}
+
+MP4LatencyPercentiles MP4LatencyHistogram::TakePercentiles()
+{
+    // The ones added meanwhile go to the next call.
+    std::vector<unsigned int> counts(MAX_MS + 1);
+    MP4LatencyPercentiles percentiles = MP4LatencyPercentiles();
+    for (unsigned int ms = 0; ms <= MAX_MS; ms++) {
+        counts[ms] = buckets[ms].exchange(0, std::memory_order_relaxed);
+        percentiles.count += counts[ms];
+    }
+    if (percentiles.count == 0)
+        return percentiles;
+
+    // The smallest latency with at least that many at or below it.
+    unsigned long long int rank50 = (percentiles.count * 50 + 99) / 100;
+    unsigned long long int rank90 = (percentiles.count * 90 + 99) / 100;
+    unsigned long long int rank99 = (percentiles.count * 99 + 99) / 100;
+    unsigned long long int below = 0;
+    for (unsigned int ms = 0; ms <= MAX_MS; ms++) {
+        if (counts[ms] == 0)
+            continue;
+        if (below < rank50 && below + counts[ms] >= rank50) percentiles.p50_ms = ms;
+        if (below < rank90 && below + counts[ms] >= rank90) percentiles.p90_ms = ms;
+        if (below < rank99 && below + counts[ms] >= rank99) percentiles.p99_ms = ms;
+        percentiles.max_ms = ms;
+        below += counts[ms];
+    }
+    return percentiles;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <atomic>
+
+struct MP4LatencyPercentiles
+{
+    unsigned long long int count;
+    unsigned int p50_ms;
+    unsigned int p90_ms;
+    unsigned int p99_ms;
+    unsigned int max_ms;
+};
+
+/*
+ * The distribution of latencies (Ex: from the capture time of a prft to now), for their percentiles.
+ * One bucket per ms up to MAX_MS, the latencies above all going to the last one: adding one is a single
+ * atomic increment, from any thread, and the percentiles are exact to the ms.
+ */
+class MP4LatencyHistogram
+{
+public:
+
+    static const unsigned int MAX_MS = 10000;
+
+    MP4LatencyHistogram();
+
+    MP4LatencyHistogram(const MP4LatencyHistogram &) = delete;
+    MP4LatencyHistogram &operator=(const MP4LatencyHistogram &) = delete;
+
+    // A negative latency (the clocks of the two ends apart) counts as 0.
+    void Add(long long int latency_us);
+
+    // Of the latencies added since the previous call. All 0 if none.
+    MP4LatencyPercentiles TakePercentiles();
+
+private:
+
+    std::atomic<unsigned int> buckets[MAX_MS + 1];
+};
@@ -0,0 +1,278 @@
+#include "fMP4-multi-track.hpp"
+
+#include <string>
+
+static const size_t OUTPUT_BUFFER_SIZE = 256 * 1024;
+
+static long long int GetElapsedMicroseconds(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+MP4MultiTrackWriter::MP4MultiTrackWriter(const fMP4MultiTrackWriterConfig &config)
+        : callback(config.callback_with_context ? config.callback_with_context
+                                                : (config.callback ? &MP4CallDataCallback : &MP4DiscardData))
+        , context(config.callback_with_context ? config.context : reinterpret_cast<void *>(config.callback))
+        , timescale(config.timescale > 0 ? config.timescale : 1000)
+        , separate_fragments(config.separate_fragments)
+        , pending_bytes(0)
+        , format_context(nullptr)
+        , avio_buffer(nullptr)
+        , created_at(std::chrono::steady_clock::now())
+        , time_to_first_byte_us(-1)
+        , setup_time_us(0)
+        , output_bytes(0)
+{
+    MP4RegisterAll();
+
+    for (unsigned int i = 0; i < config.track_count; i++)
+        tracks.emplace_back(new Track());
+}
+
+MP4MultiTrackWriter::~MP4MultiTrackWriter()
+{
+    if (format_context && av_write_trailer(format_context) < 0) {
+        printf("Fail to write trailer\n");
+    }
+    Free();
+}
+
+bool MP4MultiTrackWriter::WriteH264VideoSample(unsigned int track_index,
+                                               unsigned char *sample,
+                                               unsigned int sample_size,
+                                               bool is_key_frame,
+                                               long long int pts,
+                                               long long int dts,
+                                               unsigned long long int duration)
+{
+    if (track_index >= tracks.size()) {
+        printf("Invalid track %u of %zu\n", track_index, tracks.size());
+        return false;
+    }
+
+    Track &track = *tracks[track_index];
+    if (pts < dts) {
+        printf("Invalid timestamps: pts %lld is before dts %lld\n", pts, dts);
+        return false;
+    }
+    if (track.has_last_dts && dts <= track.last_dts) {
+        printf("Invalid timestamps of track %u: dts %lld is not after %lld\n", track_index, dts, track.last_dts);
+        return false;
+    }
+
+    if (is_key_frame) {
+        track.recovery_points_as_key_frames = false;
+    } else if (track.recovery_points_as_key_frames) {
+        track.codec.Parse(sample, sample_size);
+        is_key_frame = track.codec.IsRecoveryPoint();
+    }
+
+    if (format_context) {
+        if (!WritePacket(track_index, sample, sample_size, is_key_frame, pts, dts, duration))
+            return false;
+        track.last_dts = dts;
+        track.has_last_dts = true;
+        return true;
+    }
+
+    // Until every track is configured: a track starts at its first key frame, with its SPS and PPS.
+    if (!track.configured) {
+        if (!is_key_frame)
+            return true;
+        track.codec.Parse(sample, sample_size);
+        if (!track.codec.GetTrackConfig(track.config))
+            return false;
+        track.configured = true;
+    }
+
+    // Far too long for the other tracks to start: start over at the next key frames.
+    if (pending_bytes + sample_size > MAX_PENDING_BYTES) {
+        printf("No key frame on some tracks after %zu bytes, drop the pending samples\n", pending_bytes);
+        pending.clear();
+        pending_bytes = 0;
+        for (auto &waiting : tracks) {
+            waiting->configured = false;
+            waiting->has_last_dts = false;
+        }
+        return true;
+    }
+
+    pending.emplace_back();
+    PendingSample &pending_sample = pending.back();
+    pending_sample.track = track_index;
+    pending_sample.sample.assign(sample, sample + sample_size);
+    pending_sample.is_key_frame = is_key_frame;
+    pending_sample.pts = pts;
+    pending_sample.dts = dts;
+    pending_sample.duration = duration;
+    pending_bytes += sample_size;
+    track.last_dts = dts;
+    track.has_last_dts = true;
+
+    for (auto &waiting : tracks) {
+        if (!waiting->configured)
+            return true;
+    }
+
+    if (!Open())
+        return false;
+
+    // In arrival order: the interleaving of the muxer sorts them by dts across the tracks.
+    bool result = true;
+    for (auto &waiting : pending) {
+        result &= WritePacket(waiting.track, waiting.sample.data(), static_cast<unsigned int>(waiting.sample.size()),
+                              waiting.is_key_frame, waiting.pts, waiting.dts, waiting.duration);
+    }
+    pending.clear();
+    pending_bytes = 0;
+    return result;
+}
+
+bool MP4MultiTrackWriter::WritePacket(unsigned int track_index,
+                                      unsigned char *sample,
+                                      unsigned int sample_size,
+                                      bool is_key_frame,
+                                      long long int pts,
+                                      long long int dts,
+                                      unsigned long long int duration)
+{
+    Track &track = *tracks[track_index];
+    track.codec.Parse(sample, sample_size);
+
+    AVPacket packet = { 0 };
+    av_init_packet(&packet);
+    if (!track.codec.GetPacket(packet))
+        return true;
+
+    // One stream per track, in order.
+    packet.stream_index = static_cast<int>(track_index);
+    packet.pos          = -1;
+
+    packet.pts = pts;
+    packet.dts = dts;
+    packet.duration = static_cast<int>(duration);
+    av_packet_rescale_ts(&packet, (AVRational){1, static_cast<int>(timescale)}, format_context->streams[track_index]->time_base);
+
+    if (is_key_frame) {
+        packet.flags |= AV_PKT_FLAG_KEY;
+    }
+
+    if (av_interleaved_write_frame(format_context, &packet) < 0) {
+        printf("Fail to write frame of track %u\n", track_index);
+        return false;
+    }
+    return true;
+}
+
+bool MP4MultiTrackWriter::Open()
+{
+    auto start = std::chrono::steady_clock::now();
+
+    avformat_alloc_output_context2(&format_context, nullptr, "mp4", nullptr);
+    if (!format_context) {
+        printf("Fail to create output context\n");
+        return false;
+    }
+
+    for (auto &track : tracks) {
+        AVStream *out_stream = avformat_new_stream(format_context, nullptr);
+        if (!out_stream) {
+            printf("Fail to allocate output stream\n");
+            Free();
+            return false;
+        }
+
+        out_stream->id = format_context->nb_streams - 1;
+        MP4H264Codec::SetCodecParameters(out_stream->codec, track->config);
+
+        // The same timescale for all the tracks, so their fragments share the timeline.
+        if (90000 % timescale != 0)
+            out_stream->time_base = (AVRational){1, static_cast<int>(timescale)};
+
+        if (format_context->oformat->flags & AVFMT_GLOBALHEADER)
+            out_stream->codec->flags |= CODEC_FLAG_GLOBAL_HEADER;
+    }
+
+    avio_buffer = static_cast<unsigned char *>(av_malloc(OUTPUT_BUFFER_SIZE));
+    AVIOContext *avio_out = avio_buffer ? avio_alloc_context(avio_buffer, static_cast<int>(OUTPUT_BUFFER_SIZE), 1, this,
+                                                             nullptr, &Write, nullptr) : nullptr;
+    if (!avio_out) {
+        printf("Fail to create avio context\n");
+        Free();
+        return false;
+    }
+    format_context->pb = avio_out;
+    format_context->flags = AVFMT_FLAG_CUSTOM_IO;
+
+    AVDictionary *movflags = nullptr;
+    std::string flags = MP4LowDelayFragments::GetMovFlags();
+    if (separate_fragments)
+        flags += "+separate_moof";
+    av_dict_set(&movflags, "movflags", flags.c_str(), 0);
+    av_dict_set_int(&movflags, "frag_duration", MP4LowDelayFragments::GetFragmentDurationUs(), 0);
+
+    int result = avformat_write_header(format_context, &movflags);
+    av_dict_free(&movflags);
+    if (result < 0) {
+        printf("Error occurred when opening output file\n");
+        Free();
+        return false;
+    }
+
+    // Send the init segment now, instead of with the first fragment.
+    avio_flush(format_context->pb);
+
+    setup_time_us = GetElapsedMicroseconds(start);
+    return true;
+}
+
+void MP4MultiTrackWriter::Free()
+{
+    if (format_context) {
+        for (unsigned int i = 0; i < format_context->nb_streams; i++) {
+            if (format_context->streams[i]->codec)
+                avcodec_close(format_context->streams[i]->codec);
+        }
+        if (format_context->pb)
+            av_free(format_context->pb);
+        avformat_free_context(format_context);
+        format_context = nullptr;
+    }
+
+    if (avio_buffer)
+        av_free(avio_buffer);
+    avio_buffer = nullptr;
+}
+
+int MP4MultiTrackWriter::Write(void *opaque, uint8_t *buf, int buf_size)
+{
+    // Don't need to write mfra box
+    if (buf[4] == 'm' && buf[5] == 'f' && buf[6] == 'r' && buf[7] == 'a') {
+        return buf_size;
+    }
+
+    MP4MultiTrackWriter *writer = reinterpret_cast<MP4MultiTrackWriter *>(opaque);
+    if (writer->time_to_first_byte_us < 0)
+        writer->time_to_first_byte_us = GetElapsedMicroseconds(writer->created_at);
+    writer->output_bytes += buf_size;
+    return writer->callback(writer->context, buf, buf_size);
+}
+
+void MP4MultiTrackWriter::GetStats(fMP4WriterStats &stats) const
+{
+    stats.time_to_first_byte_us = time_to_first_byte_us;
+    stats.setup_time_us         = setup_time_us;
+    stats.output_bytes          = output_bytes;
+    stats.trick_play_bytes      = 0;
+    stats.queued_samples        = 0;
+    stats.dropped_samples       = 0;
+    stats.fragments             = 0;
+    stats.fragment_bytes_min    = 0;
+    stats.fragment_bytes_max    = 0;
+    stats.fragment_bytes_mean   = 0;
+    stats.fragment_bytes_stddev = 0;
+    memset(stats.filtered_nal_bytes, 0, sizeof(stats.filtered_nal_bytes));
+    stats.filtered_sei_bytes    = 0;
+    for (auto &track : tracks)
+        track->codec.AddStats(stats);
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include "fMP4.h"
+#include "fMP4-basic-writer.hpp"
+
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <vector>
+
+/*
+ * Several H264 renditions of one source (Ex: the main and the sub stream of a camera) in one muxer:
+ * one init segment with all the tracks, on a shared timeline, and the fragments of all the tracks
+ * either combined (one moof with a traf per track) or separate (a moof per track). A player switches
+ * renditions by track ID, the ID of track N being N + 1.
+ *
+ * The init segment needs the SPS and the PPS of every track: the samples of the tracks already
+ * started wait (copied) until every track has had its first key frame, up to max pending bytes.
+ */
+class MP4MultiTrackWriter
+{
+public:
+
+    MP4MultiTrackWriter(const fMP4MultiTrackWriterConfig &config);
+
+    // Write the trailer, so the last fragment goes out.
+    ~MP4MultiTrackWriter();
+
+    MP4MultiTrackWriter(const MP4MultiTrackWriter &) = delete;
+    MP4MultiTrackWriter &operator=(const MP4MultiTrackWriter &) = delete;
+
+    // Samples of a track in decode order, in the shared timescale. The sample could be converted in place.
+    bool WriteH264VideoSample(unsigned int track,
+                              unsigned char *sample,
+                              unsigned int sample_size,
+                              bool is_key_frame,
+                              long long int pts,
+                              long long int dts,
+                              unsigned long long int duration);
+
+    void GetStats(fMP4WriterStats &stats) const;
+
+private:
+
+    struct Track
+    {
+        Track() : configured(false), recovery_points_as_key_frames(true), last_dts(0), has_last_dts(false) {}
+
+        MP4H264Codec codec;
+        MP4H264TrackConfig config;
+        bool configured;
+        bool recovery_points_as_key_frames;     // Until the track has key frames of its own, see BasicMP4Writer
+        long long int last_dts;
+        bool has_last_dts;
+    };
+
+    struct PendingSample
+    {
+        unsigned int track;
+        std::vector<unsigned char> sample;
+        bool is_key_frame;
+        long long int pts;
+        long long int dts;
+        unsigned long long int duration;
+    };
+
+    bool Open();
+    bool WritePacket(unsigned int track,
+                     unsigned char *sample,
+                     unsigned int sample_size,
+                     bool is_key_frame,
+                     long long int pts,
+                     long long int dts,
+                     unsigned long long int duration);
+    void Free();
+
+    static int Write(void *opaque, uint8_t *buf, int buf_size);
+
+    static const size_t MAX_PENDING_BYTES = 16 * 1024 * 1024;
+
+    DataCallbackWithContext callback;
+    void *context;
+    const unsigned int timescale;
+    const bool separate_fragments;
+
+    std::vector<std::unique_ptr<Track>> tracks;
+    std::deque<PendingSample> pending;
+    size_t pending_bytes;
+
+    AVFormatContext *format_context;
+    unsigned char *avio_buffer;
+
+    std::chrono::steady_clock::time_point created_at;
+    long long int time_to_first_byte_us;
+    long long int setup_time_us;
+    unsigned long long int output_bytes;
+};
@@ -0,0 +1,130 @@
+#include "fMP4-nalu-filter.hpp"
+
+#include <cstring>
+
+static const unsigned char NAL_SLICE     = 1;
+static const unsigned char NAL_SLICE_IDR = 5;
+static const unsigned char NAL_SEI       = 6;
+
+// The length each NAL unit has in an AVCC sample.
+static const unsigned int NAL_LENGTH_SIZE = 4;
+
+MP4NaluFilter::MP4NaluFilter()
+        : keep_nal_types(0)
+        , drop_sei_payload_types(0)
+        , rewritten_count(0)
+        , filtered_sei_bytes(0)
+{
+    memset(filtered_nal_bytes, 0, sizeof(filtered_nal_bytes));
+}
+
+void MP4NaluFilter::SetPolicy(unsigned int keep_nal_types, unsigned long long int drop_sei_payload_types)
+{
+    this->keep_nal_types = keep_nal_types;
+    this->drop_sei_payload_types = drop_sei_payload_types;
+}
+
+void MP4NaluFilter::Begin()
+{
+    rewritten_count = 0;
+}
+
+bool MP4NaluFilter::Filter(const unsigned char *&data, unsigned int &size)
+{
+    if (size == 0)
+        return false;
+
+    unsigned char type = data[0] & 0x1f;
+    if (type == NAL_SLICE || type == NAL_SLICE_IDR)
+        return true;
+
+    if (!(keep_nal_types & (1u << type))) {
+        filtered_nal_bytes[type] += size + NAL_LENGTH_SIZE;
+        return false;
+    }
+
+    if (type == NAL_SEI && drop_sei_payload_types)
+        return FilterSei(data, size);
+    return true;
+}
+
+bool MP4NaluFilter::FilterSei(const unsigned char *&data, unsigned int &size)
+{
+    // The message sizes are in RBSP bytes, without the emulation prevention bytes.
+    rbsp.clear();
+    unsigned int zeros = 0;
+    for (unsigned int i = 1; i < size; i++) {
+        if (zeros >= 2 && data[i] == 0x03) {
+            zeros = 0;
+            continue;
+        }
+        zeros = (data[i] == 0) ? zeros + 1 : 0;
+        rbsp.push_back(data[i]);
+    }
+
+    // sei_message(): payloadType and payloadSize as runs of 0xff, then the payload, up to the rbsp_trailing_bits.
+    kept.clear();
+    bool removed = false;
+    size_t pos = 0;
+    while (pos + 1 < rbsp.size()) {
+        size_t start = pos;
+        unsigned long long int payload_type = 0, payload_size = 0;
+        while (pos < rbsp.size() && rbsp[pos] == 0xff)
+            payload_type += rbsp[pos++];
+        if (pos < rbsp.size())
+            payload_type += rbsp[pos++];
+        while (pos < rbsp.size() && rbsp[pos] == 0xff)
+            payload_size += rbsp[pos++];
+        if (pos < rbsp.size())
+            payload_size += rbsp[pos++];
+
+        // Not an SEI we understand: as it is.
+        if (pos + payload_size > rbsp.size())
+            return true;
+        pos += payload_size;
+
+        if (payload_type < 64 && (drop_sei_payload_types & (1ull << payload_type))) {
+            removed = true;
+        } else {
+            kept.insert(kept.end(), rbsp.begin() + start, rbsp.begin() + pos);
+        }
+    }
+    if (!removed)
+        return true;
+
+    unsigned int filtered_size = size;
+    if (kept.empty()) {
+        filtered_sei_bytes += size + NAL_LENGTH_SIZE;
+        return false;
+    }
+    kept.push_back(0x80);
+
+    // Back to a NAL unit, with the emulation prevention bytes the messages left need.
+    if (rewritten_count == rewritten.size())
+        rewritten.emplace_back();
+    std::vector<unsigned char> &nalu = rewritten[rewritten_count++];
+    nalu.clear();
+    nalu.push_back(data[0]);
+    zeros = 0;
+    for (unsigned char byte : kept) {
+        if (zeros >= 2 && byte <= 0x03) {
+            nalu.push_back(0x03);
+            zeros = 0;
+        }
+        zeros = (byte == 0) ? zeros + 1 : 0;
+        nalu.push_back(byte);
+    }
+
+    data = nalu.data();
+    size = static_cast<unsigned int>(nalu.size());
+    if (size < filtered_size)
+        filtered_sei_bytes += filtered_size - size;
+    return true;
+}
+
+void MP4NaluFilter::AddStats(fMP4WriterStats &stats) const
+{
+    for (unsigned int type = 0; type < 32; type++)
+        stats.filtered_nal_bytes[type] += filtered_nal_bytes[type];
+    stats.filtered_sei_bytes += filtered_sei_bytes;
+}
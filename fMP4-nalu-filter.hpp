@@ -0,0 +1,51 @@
+#pragma once
+
+#include "fMP4.h"
+
+#include <cstddef>
+#include <vector>
+
+/*
+ * Which NAL units of an access unit go into the mp4 sample. The slices always do. The other NAL unit types
+ * only if kept by the policy: none by default, the SPS and the PPS being in the avcC box. Of the SEI kept,
+ * the messages of some payload types could be removed, Ex: the vendor user_data_unregistered (5),
+ * or the filler payload (3).
+ *
+ * The bytes left out are counted per NAL unit type, with the 4 bytes length each NAL unit has in a sample.
+ */
+class MP4NaluFilter
+{
+public:
+
+    MP4NaluFilter();
+
+    // keep_nal_types: 1 << type for each NAL unit type kept besides the slices.
+    // drop_sei_payload_types: 1 << payloadType for each SEI message removed, for the types below 64.
+    void SetPolicy(unsigned int keep_nal_types, unsigned long long int drop_sei_payload_types);
+
+    // Before the NAL units of an access unit: the ones rewritten for the previous one are released.
+    void Begin();
+
+    // Return false to leave the NAL unit (from its header, without start code) out of the sample. Otherwise data
+    // and size are what goes in: the NAL unit as it is, or a copy without the SEI messages removed, until Begin().
+    bool Filter(const unsigned char *&data, unsigned int &size);
+
+    void AddStats(fMP4WriterStats &stats) const;
+
+private:
+
+    // Return false if no message is left, true with data and size on a rewritten copy if some were removed.
+    bool FilterSei(const unsigned char *&data, unsigned int &size);
+
+    unsigned int keep_nal_types;
+    unsigned long long int drop_sei_payload_types;
+
+    // The SEI rewritten for the current access unit, and the RBSP of the one being filtered.
+    std::vector<std::vector<unsigned char>> rewritten;
+    size_t rewritten_count;
+    std::vector<unsigned char> rbsp;
+    std::vector<unsigned char> kept;
+
+    unsigned long long int filtered_nal_bytes[32];
+    unsigned long long int filtered_sei_bytes;
+};
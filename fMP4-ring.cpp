@@ -0,0 +1,289 @@
+#include "fMP4-ring.hpp"
+
+#include <chrono>
+#include <thread>
+
+MP4FragmentRing::MP4FragmentRing(size_t capacity, fMP4RingOverflowPolicy policy)
+        : policy(policy)
+        , ring(capacity)
+        , assembler([this](const MP4FragmentPtr &fragment) { Push(fragment); })
+        , skip_to_key_frame(false)
+        , last_key_frame_position(0)
+        , has_key_frame_position(false)
+        , init_generation(0)
+        , delivered_init_generation(0)
+        , last_popped_position(0)
+        , has_popped_position(false)
+        , consumer_skip_to_key_frame(false)
+        , closed(false)
+        , consumer_waiting(false)
+        , producer_waiting(false)
+        , pushed_fragments(0)
+        , popped_fragments(0)
+        , dropped_fragments(0)
+        , dropped_bytes(0)
+        , blocked_pushes(0)
+        , queued_bytes(0)
+        , max_occupancy(0)
+{
+}
+
+int MP4FragmentRing::Write(void *context, unsigned char *buf, int buf_size)
+{
+    MP4FragmentRing *ring = reinterpret_cast<MP4FragmentRing *>(context);
+    ring->assembler.Append(buf, static_cast<size_t>(buf_size));
+    return buf_size;
+}
+
+bool MP4FragmentRing::Push(const MP4FragmentPtr &fragment)
+{
+    if (IsClosed())
+        return false;
+
+    if (fragment->type == MP4_FRAGMENT_INIT) {
+        // The queued fragments belong to the previous init segment.
+        DropAll();
+        skip_to_key_frame = false;
+        has_key_frame_position = false;
+        {
+            std::lock_guard<std::mutex> lock(init_mutex);
+            init_fragment = fragment;
+            init_generation.fetch_add(1, std::memory_order_release);
+        }
+        pushed_fragments++;
+        WakeUpConsumer();
+        return true;
+    }
+
+    if (!PushMedia(fragment))
+        return false;
+
+    pushed_fragments++;
+    if (fragment->is_key_frame) {
+        last_key_frame_position = ring.GetTail() - 1;
+        has_key_frame_position = true;
+    }
+
+    size_t occupancy = ring.GetSize();
+    if (occupancy > max_occupancy.load(std::memory_order_relaxed))
+        max_occupancy.store(occupancy, std::memory_order_relaxed);
+
+    WakeUpConsumer();
+    return true;
+}
+
+bool MP4FragmentRing::PushMedia(const MP4FragmentPtr &fragment)
+{
+    // After an overflow, a decoder could only resume from a key frame.
+    if (skip_to_key_frame) {
+        if (!fragment->is_key_frame) {
+            Drop(fragment, false);
+            return false;
+        }
+        skip_to_key_frame = false;
+    }
+
+    // Counted before the push, so the consumer never sees it go negative.
+    queued_bytes += fragment->data.size();
+
+    MP4FragmentPtr value = fragment;
+    while (!ring.TryPush(std::move(value))) {
+        if (IsClosed()) {
+            queued_bytes -= fragment->data.size();
+            return false;
+        }
+
+        MP4FragmentPtr dropped;
+        switch (policy) {
+            case fMP4_RING_DROP_OLDEST:
+                if (ring.TryPop(dropped)) {
+                    Drop(dropped, true);
+                } else {
+                    // The consumer is releasing the slot right now.
+                    std::this_thread::yield();
+                }
+                break;
+
+            case fMP4_RING_DROP_TO_NEXT_KEY_FRAME:
+                if (has_key_frame_position && ring.GetHead() < last_key_frame_position) {
+                    // Keep the last queued GOP, drop everything before it.
+                    while (ring.TryPop(dropped, nullptr, last_key_frame_position))
+                        Drop(dropped, true);
+                    break;
+                }
+
+                // The queue holds a single GOP (or none): start over from the next key frame.
+                DropAll();
+                has_key_frame_position = false;
+                if (!fragment->is_key_frame) {
+                    skip_to_key_frame = true;
+                    Drop(fragment, true);
+                    return false;
+                }
+                break;
+
+            case fMP4_RING_BLOCK:
+            default:
+            {
+                std::unique_lock<std::mutex> lock(wait_mutex);
+                producer_waiting.store(true, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                blocked_pushes++;
+
+                bool pushed;
+                while (!(pushed = ring.TryPush(std::move(value))) && !IsClosed())
+                    producer_cv.wait(lock);
+                producer_waiting.store(false, std::memory_order_relaxed);
+                if (!pushed)
+                    queued_bytes -= fragment->data.size();
+                return pushed;
+            }
+        }
+    }
+    return true;
+}
+
+void MP4FragmentRing::Drop(const MP4FragmentPtr &fragment, bool queued)
+{
+    dropped_fragments++;
+    dropped_bytes += fragment->data.size();
+    if (queued)
+        queued_bytes -= fragment->data.size();
+}
+
+void MP4FragmentRing::DropAll()
+{
+    MP4FragmentPtr dropped;
+    while (ring.TryPop(dropped))
+        Drop(dropped, true);
+}
+
+void MP4FragmentRing::WakeUpConsumer()
+{
+    // Pairs with the fence in Pop(): either the consumer sees the new fragment, or we see it waiting.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (consumer_waiting.load(std::memory_order_relaxed)) {
+        std::lock_guard<std::mutex> lock(wait_mutex);
+        consumer_cv.notify_one();
+    }
+}
+
+void MP4FragmentRing::WakeUpProducer()
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (producer_waiting.load(std::memory_order_relaxed)) {
+        std::lock_guard<std::mutex> lock(wait_mutex);
+        producer_cv.notify_one();
+    }
+}
+
+bool MP4FragmentRing::PopInitFragment(MP4FragmentPtr &fragment)
+{
+    std::lock_guard<std::mutex> lock(init_mutex);
+    fragment = init_fragment;
+    delivered_init_generation = init_generation.load(std::memory_order_relaxed);
+    has_popped_position = false;
+    // The media must restart from a key frame after an init segment.
+    consumer_skip_to_key_frame = true;
+    popped_fragments++;
+    return true;
+}
+
+bool MP4FragmentRing::PopInternal(MP4FragmentPtr &fragment)
+{
+    if (init_generation.load(std::memory_order_acquire) != delivered_init_generation)
+        return PopInitFragment(fragment);
+
+    size_t position;
+    while (ring.TryPop(fragment, &position)) {
+        // The producer could have pushed a new init segment, and media following it, since the check above:
+        // that media must not go first. The generation is bumped before that media is pushed, so it shows here.
+        if (init_generation.load(std::memory_order_acquire) != delivered_init_generation) {
+            Drop(fragment, true);
+            return PopInitFragment(fragment);
+        }
+
+        // The producer could drop the key frame right before we pop the fragments following it,
+        // so a gap in the positions means the same as an overflow here.
+        bool gap = has_popped_position && position != last_popped_position + 1;
+        last_popped_position = position;
+        has_popped_position = true;
+
+        if (policy == fMP4_RING_DROP_TO_NEXT_KEY_FRAME && (gap || consumer_skip_to_key_frame) && !fragment->is_key_frame) {
+            consumer_skip_to_key_frame = true;
+            Drop(fragment, true);
+            continue;
+        }
+        consumer_skip_to_key_frame = false;
+
+        popped_fragments++;
+        queued_bytes -= fragment->data.size();
+        return true;
+    }
+
+    fragment.reset();
+    return false;
+}
+
+bool MP4FragmentRing::TryPop(MP4FragmentPtr &fragment)
+{
+    if (!PopInternal(fragment))
+        return false;
+
+    WakeUpProducer();
+    return true;
+}
+
+bool MP4FragmentRing::Pop(MP4FragmentPtr &fragment, int timeout_ms)
+{
+    if (TryPop(fragment))
+        return true;
+    if (timeout_ms == 0)
+        return false;
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+
+    std::unique_lock<std::mutex> lock(wait_mutex);
+    consumer_waiting.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    bool popped;
+    while (!(popped = PopInternal(fragment)) && !IsClosed()) {
+        if (timeout_ms < 0) {
+            consumer_cv.wait(lock);
+        } else if (consumer_cv.wait_until(lock, deadline) == std::cv_status::timeout) {
+            popped = PopInternal(fragment);
+            break;
+        }
+    }
+    consumer_waiting.store(false, std::memory_order_relaxed);
+
+    // Already holding the lock, so wake up the producer directly.
+    if (popped && producer_waiting.load(std::memory_order_relaxed))
+        producer_cv.notify_one();
+    return popped;
+}
+
+void MP4FragmentRing::Close()
+{
+    closed.store(true, std::memory_order_release);
+
+    std::lock_guard<std::mutex> lock(wait_mutex);
+    consumer_cv.notify_all();
+    producer_cv.notify_all();
+}
+
+fMP4RingStats MP4FragmentRing::GetStats() const
+{
+    fMP4RingStats stats;
+    stats.pushed_fragments  = pushed_fragments.load();
+    stats.popped_fragments  = popped_fragments.load();
+    stats.dropped_fragments = dropped_fragments.load();
+    stats.dropped_bytes     = dropped_bytes.load();
+    stats.blocked_pushes    = blocked_pushes.load();
+    stats.occupancy         = static_cast<unsigned int>(ring.GetSize());
+    stats.max_occupancy     = static_cast<unsigned int>(max_occupancy.load());
+    stats.capacity          = static_cast<unsigned int>(ring.GetCapacity());
+    stats.queued_bytes      = queued_bytes.load();
+    return stats;
+}
@@ -0,0 +1,198 @@
+#pragma once
+
+#include "fMP4.h"
+#include "fMP4-fragment.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <limits>
+#include <memory>
+#include <mutex>
+
+/*
+ * Bounded lock-free ring for one producer and one consumer.
+ *
+ * Every slot carries a sequence number (as in Vyukov's bounded queue), and the read index is
+ * claimed with a CAS, so the producer could also pop the oldest element to make room
+ * while the consumer is popping.
+ */
+template <typename T>
+class SPSCRing
+{
+public:
+
+    // The capacity is rounded up to a power of two.
+    explicit SPSCRing(size_t capacity)
+            : mask(RoundUp(capacity) - 1)
+            , slots(new Slot[mask + 1])
+            , head(0)
+            , tail(0)
+    {
+        for (size_t i = 0; i <= mask; i++)
+            slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    // Producer only. Return false if the ring is full.
+    bool TryPush(T &&value)
+    {
+        size_t position = tail.load(std::memory_order_relaxed);
+        Slot &slot = slots[position & mask];
+        if (slot.sequence.load(std::memory_order_acquire) != position)
+            return false;
+
+        slot.value = std::move(value);
+        slot.sequence.store(position + 1, std::memory_order_release);
+        tail.store(position + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer, or the producer dropping the oldest element. Return false if the ring is empty,
+    // or if the oldest element is not before end_position.
+    bool TryPop(T &value, size_t *popped_position = nullptr, size_t end_position = std::numeric_limits<size_t>::max())
+    {
+        size_t position = head.load(std::memory_order_relaxed);
+        while (true) {
+            if (position >= end_position)
+                return false;
+
+            Slot &slot = slots[position & mask];
+            size_t sequence = slot.sequence.load(std::memory_order_acquire);
+            if (sequence == position + 1) {
+                if (head.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                    break;
+            } else if (sequence == position) {
+                return false;
+            } else {
+                position = head.load(std::memory_order_relaxed);
+            }
+        }
+
+        Slot &slot = slots[position & mask];
+        value = std::move(slot.value);
+        slot.value = T();
+        slot.sequence.store(position + mask + 1, std::memory_order_release);
+        if (popped_position)
+            *popped_position = position;
+        return true;
+    }
+
+    // Position of the next element to pop, and of the next element to push.
+    size_t GetHead() const { return head.load(std::memory_order_acquire); }
+    size_t GetTail() const { return tail.load(std::memory_order_acquire); }
+
+    size_t GetSize() const
+    {
+        size_t t = GetTail(), h = GetHead();
+        return (t > h) ? t - h : 0;
+    }
+
+    size_t GetCapacity() const { return mask + 1; }
+
+private:
+
+    struct Slot
+    {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    static size_t RoundUp(size_t value)
+    {
+        size_t result = 2;
+        while (result < value)
+            result <<= 1;
+        return result;
+    }
+
+    SPSCRing(const SPSCRing &) = delete;
+    SPSCRing &operator=(const SPSCRing &) = delete;
+
+    const size_t mask;
+    std::unique_ptr<Slot[]> slots;
+
+    // Keep the indexes written by the producer and by the consumer on different cache lines.
+    char padding0[64];
+    std::atomic<size_t> head;
+    char padding1[64];
+    std::atomic<size_t> tail;
+    char padding2[64];
+};
+
+/*
+ * Queue of fragments between the writer and its consumer, with an overflow policy.
+ *
+ * Push() and Write() must be called from the writer thread, Pop() from the consumer thread.
+ * Neither takes a lock, except to park a thread in Pop() with a timeout or in a BLOCK push.
+ * An init segment is never dropped: the consumer always gets it before the media fragments following it.
+ */
+class MP4FragmentRing
+{
+public:
+
+    MP4FragmentRing(size_t capacity, fMP4RingOverflowPolicy policy);
+
+    // Return false if the fragment was dropped by the overflow policy, or the ring is closed.
+    bool Push(const MP4FragmentPtr &fragment);
+
+    // Raw writer output, given to the internal assembler which pushes the complete fragments.
+    static int Write(void *context, unsigned char *buf, int buf_size);
+
+    bool TryPop(MP4FragmentPtr &fragment);
+
+    // Wait up to timeout_ms (-1 for no limit). Return false on timeout, or when the ring is closed and empty.
+    bool Pop(MP4FragmentPtr &fragment, int timeout_ms);
+
+    void Close();
+
+    bool IsClosed() const { return closed.load(std::memory_order_acquire); }
+
+    fMP4RingStats GetStats() const;
+
+private:
+
+    // Producer side
+    bool PushMedia(const MP4FragmentPtr &fragment);
+    void Drop(const MP4FragmentPtr &fragment, bool queued);
+    void DropAll();
+    void WakeUpConsumer();
+
+    // Consumer side
+    bool PopInternal(MP4FragmentPtr &fragment);
+    bool PopInitFragment(MP4FragmentPtr &fragment);
+    void WakeUpProducer();
+
+    const fMP4RingOverflowPolicy policy;
+    SPSCRing<MP4FragmentPtr> ring;
+    MP4FragmentAssembler assembler;
+
+    // Owned by the producer
+    bool skip_to_key_frame;
+    size_t last_key_frame_position;
+    bool has_key_frame_position;
+
+    // The init segment is kept aside, so it survives the overflows.
+    std::mutex init_mutex;
+    MP4FragmentPtr init_fragment;
+    std::atomic<unsigned int> init_generation;
+
+    // Owned by the consumer
+    unsigned int delivered_init_generation;
+    size_t last_popped_position;
+    bool has_popped_position;
+    bool consumer_skip_to_key_frame;
+
+    std::atomic<bool> closed;
+    std::mutex wait_mutex;
+    std::condition_variable consumer_cv;
+    std::condition_variable producer_cv;
+    std::atomic<bool> consumer_waiting;
+    std::atomic<bool> producer_waiting;
+
+    std::atomic<unsigned long long int> pushed_fragments;
+    std::atomic<unsigned long long int> popped_fragments;
+    std::atomic<unsigned long long int> dropped_fragments;
+    std::atomic<unsigned long long int> dropped_bytes;
+    std::atomic<unsigned long long int> blocked_pushes;
+    std::atomic<unsigned long long int> queued_bytes;
+    std::atomic<size_t> max_occupancy;
+};
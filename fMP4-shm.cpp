@@ -0,0 +1,375 @@
+#include "fMP4-shm.hpp"
+
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <new>
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2,
+              "The shared header needs address-free atomics");
+
+static const uint32_t SHM_MAGIC   = 0x664d5034;       // 'fMP4'
+static const uint32_t SHM_VERSION = 1;
+
+/*
+ * At the start of the shared memory, followed by the ring. The positions only increase,
+ * the offset in the ring is the position modulo the capacity.
+ */
+struct MP4ShmChannel::Header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t capacity;
+    uint32_t timescale;
+
+    // Written by the producer
+    alignas(64) std::atomic<uint64_t> head;
+    std::atomic<uint32_t> data_sequence;        // Futex word of the consumer
+    std::atomic<uint32_t> producer_closed;
+    std::atomic<uint64_t> written_samples;
+    std::atomic<uint64_t> written_bytes;
+    std::atomic<uint64_t> dropped_samples;
+    std::atomic<uint64_t> producer_waits;
+
+    // Written by the consumer
+    alignas(64) std::atomic<uint64_t> tail;
+    std::atomic<uint32_t> space_sequence;       // Futex word of the producer
+    std::atomic<uint32_t> consumer_closed;
+    std::atomic<uint64_t> read_samples;
+    std::atomic<uint64_t> consumer_waits;
+
+    // Set by a side before it sleeps, cleared by the other side when it wakes it up.
+    alignas(64) std::atomic<uint32_t> consumer_waiting;
+    std::atomic<uint32_t> producer_waiting;
+};
+
+struct MP4ShmChannel::Record
+{
+    enum
+    {
+        KEY_FRAME = 1,
+        PADDING   = 2           // The rest of the ring is unused, the next record is at its start
+    };
+
+    uint32_t size;
+    uint32_t flags;
+    int64_t pts;
+    int64_t dts;
+    uint64_t duration;
+};
+
+const size_t MP4ShmChannel::HEADER_SIZE = (sizeof(MP4ShmChannel::Header) + 4095) & ~static_cast<size_t>(4095);
+
+uint64_t MP4ShmChannel::GetRecordSize(unsigned int sample_size)
+{
+    return (sizeof(MP4ShmChannel::Record) + static_cast<uint64_t>(sample_size) + 7) & ~static_cast<uint64_t>(7);
+}
+
+// Not private: the processes don't share their address space.
+static void FutexWait(std::atomic<uint32_t> &word, uint32_t value, const struct timespec *timeout)
+{
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAIT, value, timeout, nullptr, 0);
+}
+
+static void FutexWake(std::atomic<uint32_t> &word)
+{
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
+
+static void Signal(std::atomic<uint32_t> &sequence, std::atomic<uint32_t> &waiting)
+{
+    sequence.fetch_add(1);
+    if (waiting.exchange(0))
+        FutexWake(sequence);
+}
+
+// Wait until the sequence moves from the value read before the last check, or until the deadline.
+// Return false once the deadline is passed.
+static bool Wait(std::atomic<uint32_t> &sequence, uint32_t value, std::atomic<uint32_t> &waiting,
+                 int timeout_ms, std::chrono::steady_clock::time_point deadline)
+{
+    struct timespec timeout = { 0, 0 };
+    if (timeout_ms >= 0) {
+        auto remaining = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - std::chrono::steady_clock::now());
+        if (remaining.count() <= 0)
+            return false;
+        timeout.tv_sec  = static_cast<time_t>(remaining.count() / 1000000000);
+        timeout.tv_nsec = static_cast<long>(remaining.count() % 1000000000);
+    }
+
+    waiting.store(1);
+    FutexWait(sequence, value, timeout_ms >= 0 ? &timeout : nullptr);
+    return true;
+}
+
+MP4ShmChannel *MP4ShmChannel::Create(unsigned int capacity, unsigned int timescale)
+{
+    size_t ring_size = (static_cast<size_t>(capacity) + 4095) & ~static_cast<size_t>(4095);
+    if (ring_size == 0)
+        ring_size = 4096;
+    size_t size = HEADER_SIZE + ring_size;
+
+    int fd = static_cast<int>(syscall(SYS_memfd_create, "fMP4-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING));
+    if (fd < 0) {
+        printf("Fail to create shared memory: %s\n", strerror(errno));
+        return nullptr;
+    }
+
+    // The producer could not shrink it under our feet.
+    if (ftruncate(fd, static_cast<off_t>(size)) < 0 || fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0) {
+        printf("Fail to size shared memory: %s\n", strerror(errno));
+        close(fd);
+        return nullptr;
+    }
+
+    void *memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (memory == MAP_FAILED) {
+        printf("Fail to map shared memory: %s\n", strerror(errno));
+        close(fd);
+        return nullptr;
+    }
+
+    // Zeroed by ftruncate, which is the initial state of all the counters.
+    Header *header = new (memory) Header();
+    header->capacity  = ring_size;
+    header->timescale = timescale > 0 ? timescale : 1000;
+    header->version   = SHM_VERSION;
+    std::atomic_thread_fence(std::memory_order_release);
+    header->magic     = SHM_MAGIC;
+
+    return new MP4ShmChannel(fd, memory, size, false);
+}
+
+MP4ShmChannel *MP4ShmChannel::Open(const std::string &path)
+{
+    int fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        printf("Fail to open shared memory %s: %s\n", path.c_str(), strerror(errno));
+        return nullptr;
+    }
+
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) < 0 || static_cast<size_t>(file_stat.st_size) <= HEADER_SIZE) {
+        printf("Invalid shared memory %s\n", path.c_str());
+        close(fd);
+        return nullptr;
+    }
+
+    size_t size = static_cast<size_t>(file_stat.st_size);
+    void *memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (memory == MAP_FAILED) {
+        printf("Fail to map shared memory: %s\n", strerror(errno));
+        close(fd);
+        return nullptr;
+    }
+
+    Header *header = static_cast<Header *>(memory);
+    if (header->magic != SHM_MAGIC || header->version != SHM_VERSION || header->capacity != size - HEADER_SIZE) {
+        printf("Not an fMP4 shared memory channel: %s\n", path.c_str());
+        munmap(memory, size);
+        close(fd);
+        return nullptr;
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+
+    return new MP4ShmChannel(fd, memory, size, true);
+}
+
+MP4ShmChannel::MP4ShmChannel(int fd, void *memory, size_t size, bool producer)
+        : fd(fd)
+        , memory(memory)
+        , size(size)
+        , producer(producer)
+        , header(static_cast<Header *>(memory))
+        , data(static_cast<unsigned char *>(memory) + HEADER_SIZE)
+        , reserved_position(0)
+        , reserved_end(0)
+        , reserved_size(0)
+{
+}
+
+MP4ShmChannel::~MP4ShmChannel()
+{
+    Close();
+    munmap(memory, size);
+    close(fd);
+}
+
+void MP4ShmChannel::Close()
+{
+    if (producer) {
+        header->producer_closed.store(1);
+        Signal(header->data_sequence, header->consumer_waiting);
+    } else {
+        header->consumer_closed.store(1);
+        Signal(header->space_sequence, header->producer_waiting);
+    }
+}
+
+std::string MP4ShmChannel::GetPath() const
+{
+    return "/proc/" + std::to_string(getpid()) + "/fd/" + std::to_string(fd);
+}
+
+unsigned int MP4ShmChannel::GetTimescale() const
+{
+    return header->timescale;
+}
+
+unsigned char *MP4ShmChannel::Reserve(unsigned int sample_size, int timeout_ms)
+{
+    const uint64_t capacity = header->capacity;
+    const uint64_t record_size = GetRecordSize(sample_size);
+    if (record_size > capacity) {
+        printf("Sample of %u bytes is larger than the shared memory\n", sample_size);
+        header->dropped_samples.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+    }
+
+    // A record that does not fit before the end of the ring skips the rest of it.
+    const uint64_t head = header->head.load(std::memory_order_relaxed);
+    const uint64_t offset = head % capacity;
+    const uint64_t skipped = (capacity - offset < record_size) ? capacity - offset : 0;
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms > 0 ? timeout_ms : 0);
+    bool waited = false;
+    while (true) {
+        uint32_t sequence = header->space_sequence.load();
+        if (header->consumer_closed.load()) {
+            header->dropped_samples.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        if (head + skipped + record_size - header->tail.load(std::memory_order_acquire) <= capacity)
+            break;
+
+        if (!Wait(header->space_sequence, sequence, header->producer_waiting, timeout_ms, deadline)) {
+            header->dropped_samples.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        if (!waited) {
+            header->producer_waits.fetch_add(1, std::memory_order_relaxed);
+            waited = true;
+        }
+    }
+
+    if (skipped >= sizeof(Record)) {
+        Record *padding = reinterpret_cast<Record *>(data + offset);
+        padding->size  = 0;
+        padding->flags = Record::PADDING;
+    }
+
+    reserved_position = head + skipped;
+    reserved_end      = reserved_position + record_size;
+    reserved_size     = sample_size;
+    return data + reserved_position % capacity + sizeof(Record);
+}
+
+void MP4ShmChannel::Commit(bool is_key_frame, long long int pts, long long int dts, unsigned long long int duration)
+{
+    Record *record = reinterpret_cast<Record *>(data + reserved_position % header->capacity);
+    record->size     = reserved_size;
+    record->flags    = is_key_frame ? Record::KEY_FRAME : 0;
+    record->pts      = pts;
+    record->dts      = dts;
+    record->duration = duration;
+
+    header->written_samples.fetch_add(1, std::memory_order_relaxed);
+    header->written_bytes.fetch_add(reserved_size, std::memory_order_relaxed);
+    header->head.store(reserved_end, std::memory_order_release);
+    Signal(header->data_sequence, header->consumer_waiting);
+}
+
+bool MP4ShmChannel::Write(const unsigned char *sample,
+                          unsigned int sample_size,
+                          bool is_key_frame,
+                          long long int pts,
+                          long long int dts,
+                          unsigned long long int duration,
+                          int timeout_ms)
+{
+    unsigned char *room = Reserve(sample_size, timeout_ms);
+    if (!room)
+        return false;
+
+    memcpy(room, sample, sample_size);
+    Commit(is_key_frame, pts, dts, duration);
+    return true;
+}
+
+int MP4ShmChannel::Read(MP4Writer *writer, int timeout_ms)
+{
+    const uint64_t capacity = header->capacity;
+    uint64_t tail = header->tail.load(std::memory_order_relaxed);
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms > 0 ? timeout_ms : 0);
+    uint64_t head;
+    bool waited = false;
+    while (true) {
+        uint32_t sequence = header->data_sequence.load();
+        bool closed = header->producer_closed.load();
+        head = header->head.load(std::memory_order_acquire);
+        if (head != tail)
+            break;
+        if (closed)
+            return -1;
+
+        if (!Wait(header->data_sequence, sequence, header->consumer_waiting, timeout_ms, deadline))
+            return 0;
+        if (!waited) {
+            header->consumer_waits.fetch_add(1, std::memory_order_relaxed);
+            waited = true;
+        }
+    }
+
+    int samples = 0;
+    while (tail != head) {
+        uint64_t offset = tail % capacity;
+        const Record *record = reinterpret_cast<const Record *>(data + offset);
+        if (capacity - offset < sizeof(Record) || (record->flags & Record::PADDING)) {
+            tail += capacity - offset;
+        } else {
+            // The producer is not trusted to stay within the ring.
+            uint32_t sample_size = record->size;
+            if (GetRecordSize(sample_size) > capacity - offset) {
+                printf("Invalid sample of %u bytes in shared memory\n", sample_size);
+                header->consumer_closed.store(1);
+                Signal(header->space_sequence, header->producer_waiting);
+                return -1;
+            }
+
+            // The writer converts the sample in place: the record is ours until the tail moves past it.
+            writer->WriteH264VideoSample(data + offset + sizeof(Record), sample_size, (record->flags & Record::KEY_FRAME) != 0,
+                                         record->pts, record->dts, record->duration);
+            tail += GetRecordSize(sample_size);
+            samples++;
+        }
+
+        header->tail.store(tail, std::memory_order_release);
+        Signal(header->space_sequence, header->producer_waiting);
+    }
+    header->read_samples.fetch_add(samples, std::memory_order_relaxed);
+    return samples;
+}
+
+void MP4ShmChannel::GetStats(fMP4ShmChannelStats &stats) const
+{
+    uint64_t head = header->head.load(std::memory_order_acquire);
+    uint64_t tail = header->tail.load(std::memory_order_acquire);
+
+    stats.written_samples = header->written_samples.load(std::memory_order_relaxed);
+    stats.written_bytes   = header->written_bytes.load(std::memory_order_relaxed);
+    stats.dropped_samples = header->dropped_samples.load(std::memory_order_relaxed);
+    stats.read_samples    = header->read_samples.load(std::memory_order_relaxed);
+    stats.producer_waits  = header->producer_waits.load(std::memory_order_relaxed);
+    stats.consumer_waits  = header->consumer_waits.load(std::memory_order_relaxed);
+    stats.queued_bytes    = head - tail;
+    stats.capacity        = header->capacity;
+}
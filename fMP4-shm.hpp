@@ -0,0 +1,94 @@
+#pragma once
+
+#include "fMP4.h"
+#include "fMP4.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+/*
+ * Samples from a capture process on the same host, through a byte ring in a memfd mapped by both processes:
+ * the producer writes each sample into the shared pages, and the consumer gives them to the writer from there.
+ *
+ * Each side waits on a futex word of the shared header, and is only woken up by the other side
+ * when it is actually waiting, so a busy channel does no syscall at all.
+ * A sample is always contiguous: a record which does not fit before the end of the ring starts it over.
+ *
+ * The consumer creates the channel, and the producer opens it by its path (/proc/<pid>/fd/<fd>).
+ * One producer and one consumer per channel.
+ */
+class MP4ShmChannel
+{
+public:
+
+    // Consumer side. The capacity is rounded up to pages. The timestamps are in the given timescale.
+    static MP4ShmChannel *Create(unsigned int capacity, unsigned int timescale);
+
+    // Producer side.
+    static MP4ShmChannel *Open(const std::string &path);
+
+    // Close our side: the consumer gets the end of stream once drained, the producer fails to write.
+    ~MP4ShmChannel();
+
+    MP4ShmChannel(const MP4ShmChannel &) = delete;
+    MP4ShmChannel &operator=(const MP4ShmChannel &) = delete;
+
+    int GetFd() const { return fd; }
+
+    std::string GetPath() const;
+
+    unsigned int GetTimescale() const;
+
+    /* Producer */
+
+    // Room for a sample of the given size in the shared pages, waiting up to timeout_ms (-1 for no limit)
+    // for the consumer. Return nullptr (the sample is dropped) on timeout, if it never fits, or if the consumer is gone.
+    unsigned char *Reserve(unsigned int sample_size, int timeout_ms);
+
+    // Publish the sample written into the reserved room.
+    void Commit(bool is_key_frame, long long int pts, long long int dts, unsigned long long int duration);
+
+    // Reserve, copy and commit.
+    bool Write(const unsigned char *sample,
+               unsigned int sample_size,
+               bool is_key_frame,
+               long long int pts,
+               long long int dts,
+               unsigned long long int duration,
+               int timeout_ms);
+
+    /* Consumer */
+
+    // Give all the queued samples to the writer, straight from the shared pages, waiting up to timeout_ms
+    // (-1 for no limit) for the first one. Return the number of samples, or -1 once the producer is gone and all are read.
+    int Read(MP4Writer *writer, int timeout_ms);
+
+    void GetStats(fMP4ShmChannelStats &stats) const;
+
+private:
+
+    struct Header;
+    struct Record;
+
+    // The header takes whole pages, the records are 8 bytes aligned.
+    static const size_t HEADER_SIZE;
+    static uint64_t GetRecordSize(unsigned int sample_size);
+
+    MP4ShmChannel(int fd, void *memory, size_t size, bool producer);
+
+    void Close();
+
+    const int fd;
+    void *const memory;
+    const size_t size;
+    const bool producer;
+
+    Header *header;
+    unsigned char *data;
+
+    // Producer: the reserved record, not published yet.
+    uint64_t reserved_position;
+    uint64_t reserved_end;
+    unsigned int reserved_size;
+};
@@ -0,0 +1,136 @@
+#include "fMP4-template.hpp"
+#include "fMP4-async-writer.hpp"
+
+MP4WriterTemplate *MP4WriterTemplate::Create(const unsigned char *data, unsigned int size)
+{
+    MP4H264Codec codec;
+    codec.Parse(data, size);
+
+    MP4H264TrackConfig track_config;
+    if (!codec.GetTrackConfig(track_config))
+        return nullptr;
+
+    MP4RegisterAll();
+    AVOutputFormat *output_format = av_guess_format("mp4", nullptr, nullptr);
+    if (!output_format) {
+        printf("Fail to find the mp4 output format\n");
+        return nullptr;
+    }
+
+    printf("Writer template: profile: %d, level: %d, %dx%d\n",
+           track_config.profile_idc, track_config.level_idc, track_config.width, track_config.height);
+    return new MP4WriterTemplate(track_config, output_format);
+}
+
+void MP4WriterTemplate::Release(MP4WriterTemplate *writer_template)
+{
+    delete writer_template;
+}
+
+MP4WriterTemplate::MP4WriterTemplate(const MP4H264TrackConfig &track_config, AVOutputFormat *output_format)
+        : track_config(track_config)
+        , output_format(output_format)
+{
+}
+
+MP4Writer *MP4WriterTemplate::CreateWriter(const fMP4WriterConfig &config) const
+{
+    MP4WriterImp *writer = new MP4WriterImp(config);
+    if (!writer->OpenH264VideoTrack(track_config, output_format)) {
+        printf("Fail to create writer from template\n");
+        MP4Writer::Release(writer);
+        return nullptr;
+    }
+
+    // The init segment is written already, the samples go through the muxing thread.
+    if (config.async_queue_size > 0)
+        return new MP4AsyncWriter(writer, config);
+    return writer;
+}
+
+/*
+ * MP4WriterTemplateCache
+ */
+
+// The SPS and the PPS of AnnexB data, as found by a start code scan. Stop at the first slice.
+static bool GetParameterSets(const unsigned char *data, unsigned int size, std::string &parameter_sets)
+{
+    bool has_sps = false, has_pps = false;
+
+    unsigned int offset = 0;
+    while (offset + 3 < size) {
+        if (!(data[offset] == 0 && data[offset + 1] == 0 && data[offset + 2] == 1)) {
+            offset++;
+            continue;
+        }
+
+        unsigned int start = offset + 3;
+        unsigned int end = start;
+        while (end + 2 < size && !(data[end] == 0 && data[end + 1] == 0 && data[end + 2] == 1))
+            end++;
+        if (end + 2 >= size)
+            end = size;
+
+        unsigned char type = data[start] & 0x1f;
+        if (type == GST_H264_NAL_SLICE || type == GST_H264_NAL_SLICE_IDR)
+            break;
+
+        if (type == GST_H264_NAL_SPS || type == GST_H264_NAL_PPS) {
+            // The trailing zero before a 4 bytes start code is not part of the NAL unit.
+            unsigned int nalu_end = end;
+            while (nalu_end > start && data[nalu_end - 1] == 0)
+                nalu_end--;
+
+            parameter_sets.append(reinterpret_cast<const char *>(data + start), nalu_end - start);
+            parameter_sets.push_back('\0');
+            has_sps |= (type == GST_H264_NAL_SPS);
+            has_pps |= (type == GST_H264_NAL_PPS);
+        }
+        offset = end;
+    }
+    return (has_sps && has_pps);
+}
+
+MP4WriterTemplateCache::MP4WriterTemplateCache(size_t max_templates)
+        : max_templates(max_templates)
+        , next_age(0)
+{
+}
+
+std::shared_ptr<const MP4WriterTemplate> MP4WriterTemplateCache::Get(const unsigned char *key_frame, unsigned int size)
+{
+    std::string key;
+    if (!GetParameterSets(key_frame, size, key))
+        return nullptr;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = templates.find(key);
+        if (it != templates.end())
+            return it->second;
+    }
+
+    // Parse outside of the lock. Streams racing on a new configuration could build it twice, but only one is kept.
+    std::shared_ptr<const MP4WriterTemplate> writer_template(MP4WriterTemplate::Create(key_frame, size),
+                                                             &MP4WriterTemplate::Release);
+    if (!writer_template)
+        return nullptr;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto result = templates.insert(std::make_pair(key, writer_template));
+    if (!result.second)
+        return result.first->second;
+
+    keys_by_age[next_age++] = key;
+    while (templates.size() > max_templates && !keys_by_age.empty()) {
+        templates.erase(keys_by_age.begin()->second);
+        keys_by_age.erase(keys_by_age.begin());
+    }
+    return writer_template;
+}
+
+size_t MP4WriterTemplateCache::GetSize() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return templates.size();
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include "fMP4-imp.hpp"
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+/*
+ * What a writer needs before its first sample, prepared once per codec configuration:
+ * the parsed SPS, the avcC box and the output format. The writers created from a template
+ * skip all that (and the format dump), and write their init segment at once.
+ *
+ * A template is immutable, so many threads could create writers from it.
+ * The stream given to such a writer must use the SPS and the PPS of the template.
+ */
+class MP4WriterTemplate
+{
+public:
+
+    // From AnnexB data holding the SPS and the PPS (Ex: a key frame). Return nullptr if they are missing.
+    static MP4WriterTemplate *Create(const unsigned char *data, unsigned int size);
+
+    static void Release(MP4WriterTemplate *writer_template);
+
+    // Return nullptr if the muxer could not be set up.
+    MP4Writer *CreateWriter(const fMP4WriterConfig &config) const;
+
+    const MP4H264TrackConfig &GetTrackConfig() const { return track_config; }
+
+private:
+
+    MP4WriterTemplate(const MP4H264TrackConfig &track_config, AVOutputFormat *output_format);
+
+    const MP4H264TrackConfig track_config;
+    AVOutputFormat *const output_format;
+};
+
+/*
+ * The templates by their SPS and PPS, so the streams sharing a codec configuration
+ * (Ex: many cameras of the same model) share one template.
+ */
+class MP4WriterTemplateCache
+{
+public:
+
+    // Once full, the oldest configurations are forgotten.
+    MP4WriterTemplateCache(size_t max_templates = 256);
+
+    // The template for the parameter sets of the key frame. Return nullptr if it has none.
+    std::shared_ptr<const MP4WriterTemplate> Get(const unsigned char *key_frame, unsigned int size);
+
+    size_t GetSize() const;
+
+private:
+
+    const size_t max_templates;
+
+    mutable std::mutex mutex;
+    std::map<std::string, std::shared_ptr<const MP4WriterTemplate>> templates;
+    std::map<unsigned long long int, std::string> keys_by_age;
+    unsigned long long int next_age;
+};
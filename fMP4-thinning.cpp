@@ -0,0 +1,405 @@
+#include "fMP4-thinning.hpp"
+#include "fMP4-box.hpp"
+
+#include <cstring>
+
+// Write a box header with a 32 bits size. Return where its payload starts.
+static unsigned char *WriteBoxHeader(unsigned char *p, size_t size, uint32_t type)
+{
+    MP4WriteU32(p, static_cast<uint32_t>(size));
+    MP4WriteU32(p + 4, type);
+    return p + 8;
+}
+
+/*
+ * MP4FragmentThinner
+ */
+MP4FragmentThinner::MP4FragmentThinner()
+        : level(MP4_THINNING_NONE)
+        , dropped_samples(0)
+        , dropped_duration(0)
+        , prefix_size(0)
+        , mfhd(nullptr)
+        , mfhd_size(0)
+        , tfhd(nullptr)
+        , tfhd_size(0)
+        , tfdt(nullptr)
+        , tfdt_size(0)
+        , trun_version(0)
+        , trun_flags(0)
+{
+}
+
+void MP4FragmentThinner::Reset()
+{
+    level = MP4_THINNING_NONE;
+    dropped_samples = 0;
+    dropped_duration = 0;
+}
+
+MP4FragmentPtr MP4FragmentThinner::Thin(const MP4FragmentPtr &fragment, MP4ThinningLevel requested)
+{
+    if (fragment->type != MP4_FRAGMENT_MEDIA)
+        return fragment;
+
+    if (requested > level || (requested < level && (level != MP4_THINNING_KEY_FRAMES || fragment->is_key_frame)))
+        level = requested;
+
+    if (level == MP4_THINNING_NONE && dropped_duration == 0)
+        return fragment;
+    if (!ParseSamples(*fragment) || fragment->tfdt_offset == 0 || fragment->base_decode_time < dropped_duration) {
+        // Cannot start it earlier: the viewer timeline goes on with a gap.
+        dropped_duration = 0;
+        return fragment;
+    }
+
+    size_t kept = 0;
+    uint64_t duration = 0;
+    for (auto &sample : samples) {
+        sample.keep = IsKept(sample);
+        kept += sample.keep ? 1 : 0;
+        duration += sample.duration;
+    }
+    dropped_samples += samples.size() - kept;
+
+    if (kept == 0) {
+        // Its time goes to the next fragment sent, not to be taken off the viewer timeline.
+        dropped_duration += duration;
+        if (dropped_duration > UINT32_MAX)
+            dropped_duration = 0;
+        return nullptr;
+    }
+    if (kept == samples.size() && dropped_duration == 0)
+        return fragment;
+    return Remux(*fragment);
+}
+
+bool MP4FragmentThinner::IsKept(const Sample &sample) const
+{
+    bool is_key_frame = !(sample.flags & SAMPLE_FLAG_IS_NON_SYNC);
+    switch (level) {
+        case MP4_THINNING_KEY_FRAMES:
+            return is_key_frame;
+        case MP4_THINNING_NON_REFERENCE:
+            return is_key_frame || IsReference(sample.data, sample.size);
+        default:
+            return true;
+    }
+}
+
+// True if a slice of the AVCC sample could be referred to, or if the sample could not be read.
+bool MP4FragmentThinner::IsReference(const unsigned char *sample, uint32_t size)
+{
+    uint32_t offset = 0;
+    while (offset + 4 < size) {
+        uint32_t nalu_size = MP4ReadU32(sample + offset);
+        if (nalu_size == 0 || nalu_size > size - offset - 4)
+            return true;
+
+        unsigned char header = sample[offset + 4];
+        unsigned char type = header & 0x1f;
+        if (type >= 1 && type <= 5 && (header >> 5) != 0)
+            return true;
+        offset += 4 + nalu_size;
+    }
+    return false;
+}
+
+bool MP4FragmentThinner::ParseSamples(const MP4Fragment &fragment)
+{
+    samples.clear();
+    mfhd = tfhd = tfdt = nullptr;
+
+    // From the moof on: the data offsets are relative to it.
+    MP4BoxHeader moof;
+    const unsigned char *data = MP4FindBox(fragment.data.data(), fragment.data.size(), MP4_FOURCC('m', 'o', 'o', 'f'), moof);
+    if (!data)
+        return false;
+    prefix_size = data - fragment.data.data();
+    size_t size = fragment.data.size() - prefix_size;
+
+    // moof: an mfhd and a single traf
+    const unsigned char *traf = nullptr;
+    MP4BoxHeader traf_header;
+    MP4BoxHeader header;
+    for (size_t offset = moof.header_size; offset < moof.size; offset += header.size) {
+        if (!MP4ParseBoxHeader(data + offset, moof.size - offset, header) || header.size > moof.size - offset)
+            return false;
+        if (header.type == MP4_FOURCC('m', 'f', 'h', 'd') && !mfhd) {
+            mfhd = data + offset;
+            mfhd_size = header.size;
+        } else if (header.type == MP4_FOURCC('t', 'r', 'a', 'f') && !traf) {
+            traf = data + offset;
+            traf_header = header;
+        } else {
+            return false;
+        }
+    }
+    if (!mfhd || !traf)
+        return false;
+
+    // traf: a tfhd, a tfdt and a trun, nothing with per sample data we would have to thin as well
+    const unsigned char *trun = nullptr;
+    MP4BoxHeader trun_header;
+    for (size_t offset = traf_header.header_size; offset < traf_header.size; offset += header.size) {
+        if (!MP4ParseBoxHeader(traf + offset, traf_header.size - offset, header) || header.size > traf_header.size - offset)
+            return false;
+        if (header.type == MP4_FOURCC('t', 'f', 'h', 'd') && !tfhd) {
+            tfhd = traf + offset;
+            tfhd_size = header.size;
+        } else if (header.type == MP4_FOURCC('t', 'f', 'd', 't') && !tfdt) {
+            tfdt = traf + offset;
+            tfdt_size = header.size;
+        } else if (header.type == MP4_FOURCC('t', 'r', 'u', 'n') && !trun) {
+            trun = traf + offset;
+            trun_header = header;
+        } else {
+            return false;
+        }
+    }
+    if (!tfhd || !tfdt || !trun || tfhd_size < 16 || trun_header.size < trun_header.header_size + 8)
+        return false;
+
+    // tfhd: the defaults. The data must be relative to the moof (default-base-is-moof).
+    uint32_t default_duration = 0, default_size = 0, default_flags = 0;
+    bool has_default_flags = false;
+    {
+        const unsigned char *p = tfhd + 8;
+        const unsigned char *end = tfhd + tfhd_size;
+        uint32_t flags = MP4ReadU32(p) & 0xffffff;
+        p += 8;     // version/flags + track_ID
+        if (flags & TFHD_BASE_DATA_OFFSET)
+            return false;
+        if (flags & TFHD_SAMPLE_DESCRIPTION_INDEX) p += 4;
+        if (flags & TFHD_DEFAULT_SAMPLE_DURATION) {
+            if (p + 4 > end) return false;
+            default_duration = MP4ReadU32(p);
+            p += 4;
+        }
+        if (flags & TFHD_DEFAULT_SAMPLE_SIZE) {
+            if (p + 4 > end) return false;
+            default_size = MP4ReadU32(p);
+            p += 4;
+        }
+        if (flags & TFHD_DEFAULT_SAMPLE_FLAGS) {
+            if (p + 4 > end) return false;
+            default_flags = MP4ReadU32(p);
+            has_default_flags = true;
+        }
+    }
+
+    // trun: the samples, from the data offset
+    const unsigned char *p = trun + trun_header.header_size;
+    const unsigned char *end = trun + trun_header.size;
+    trun_version = p[0];
+    trun_flags = MP4ReadU32(p) & 0xffffff;
+    uint32_t sample_count = MP4ReadU32(p + 4);
+    p += 8;
+
+    if (!(trun_flags & TRUN_DATA_OFFSET) || p + 4 > end)
+        return false;
+    int32_t data_offset = static_cast<int32_t>(MP4ReadU32(p));
+    p += 4;
+
+    bool has_first_flags = false;
+    uint32_t first_flags = 0;
+    if (trun_flags & TRUN_FIRST_SAMPLE_FLAGS) {
+        if (p + 4 > end) return false;
+        first_flags = MP4ReadU32(p);
+        has_first_flags = true;
+        p += 4;
+    }
+
+    unsigned int entry_size = ((trun_flags & TRUN_SAMPLE_DURATION) ? 4 : 0) + ((trun_flags & TRUN_SAMPLE_SIZE) ? 4 : 0) +
+                              ((trun_flags & TRUN_SAMPLE_FLAGS) ? 4 : 0) + ((trun_flags & TRUN_SAMPLE_CTS) ? 4 : 0);
+    if (static_cast<uint64_t>(entry_size) * sample_count > static_cast<uint64_t>(end - p))
+        return false;
+    if (data_offset < 0 || static_cast<size_t>(data_offset) > size)
+        return false;
+
+    size_t sample_offset = static_cast<size_t>(data_offset);
+    samples.resize(sample_count);
+    for (uint32_t i = 0; i < sample_count; i++, p += entry_size) {
+        Sample &sample = samples[i];
+        const unsigned char *field = p;
+
+        sample.duration = default_duration;
+        if (trun_flags & TRUN_SAMPLE_DURATION) {
+            sample.duration = MP4ReadU32(field);
+            field += 4;
+        }
+        sample.size = default_size;
+        if (trun_flags & TRUN_SAMPLE_SIZE) {
+            sample.size = MP4ReadU32(field);
+            field += 4;
+        }
+
+        // Without any flags, as MP4ParseMovieFragment: only the first sample of a key frame fragment is sync.
+        if (i == 0 && has_first_flags) {
+            sample.flags = first_flags;
+        } else if (trun_flags & TRUN_SAMPLE_FLAGS) {
+            sample.flags = MP4ReadU32(field);
+        } else if (has_default_flags) {
+            sample.flags = default_flags;
+        } else {
+            sample.flags = (i == 0 && fragment.is_key_frame) ? 0 : SAMPLE_FLAG_IS_NON_SYNC;
+        }
+        if (trun_flags & TRUN_SAMPLE_FLAGS)
+            field += 4;
+
+        sample.composition_offset = (trun_flags & TRUN_SAMPLE_CTS) ? MP4ReadU32(field) : 0;
+
+        if (sample.size > size - sample_offset) {
+            samples.clear();
+            return false;
+        }
+        sample.data = data + sample_offset;
+        sample.keep = true;
+        sample_offset += sample.size;
+    }
+    return sample_count > 0;
+}
+
+MP4FragmentPtr MP4FragmentThinner::Remux(const MP4Fragment &fragment)
+{
+    // The durations of the dropped samples go to the previous one kept, or to the first one kept for the leading ones
+    // and the fragments dropped before: decoded and presented that much earlier, it fills their time on the
+    // presentation timeline as well, which the buffered ranges of the player follow.
+    uint32_t leading_duration = static_cast<uint32_t>(dropped_duration);
+    Sample *previous = nullptr;
+    size_t kept = 0;
+    size_t payload_size = 0;
+    for (auto &sample : samples) {
+        if (sample.keep) {
+            if (!previous)
+                sample.duration += leading_duration;
+            previous = &sample;
+            kept++;
+            payload_size += sample.size;
+        } else if (previous) {
+            previous->duration += sample.duration;
+        } else {
+            leading_duration += sample.duration;
+        }
+    }
+
+    // All the fields per sample, but the flags which stay as they were given: by the trun, or by the tfhd.
+    uint32_t flags = TRUN_DATA_OFFSET | TRUN_SAMPLE_DURATION | TRUN_SAMPLE_SIZE | TRUN_SAMPLE_CTS | (trun_flags & TRUN_SAMPLE_FLAGS);
+    if ((trun_flags & TRUN_FIRST_SAMPLE_FLAGS) && samples[0].keep)
+        flags |= TRUN_FIRST_SAMPLE_FLAGS;
+
+    size_t entry_size = 12 + ((flags & TRUN_SAMPLE_FLAGS) ? 4 : 0);
+    size_t trun_size = 8 + 12 + ((flags & TRUN_FIRST_SAMPLE_FLAGS) ? 4 : 0) + kept * entry_size;
+    size_t traf_size = 8 + tfhd_size + tfdt_size + trun_size;
+    size_t moof_size = 8 + mfhd_size + traf_size;
+
+    std::shared_ptr<MP4Fragment> thinned = std::make_shared<MP4Fragment>();
+    static_cast<MP4FragmentInfo &>(*thinned) = fragment;
+    thinned->data.resize(prefix_size + moof_size + 8 + payload_size);
+
+    memcpy(thinned->data.data(), fragment.data.data(), prefix_size);
+    unsigned char *p = WriteBoxHeader(thinned->data.data() + prefix_size, moof_size, MP4_FOURCC('m', 'o', 'o', 'f'));
+    memcpy(p, mfhd, mfhd_size);
+    p += mfhd_size;
+
+    p = WriteBoxHeader(p, traf_size, MP4_FOURCC('t', 'r', 'a', 'f'));
+    memcpy(p, tfhd, tfhd_size);
+    p += tfhd_size;
+    if (fragment.tfdt_offset)
+        thinned->tfdt_offset = (p - thinned->data.data()) + (fragment.tfdt_offset - (tfdt - fragment.data.data()));
+    memcpy(p, tfdt, tfdt_size);
+    p += tfdt_size;
+    if (dropped_duration > 0) {
+        thinned->base_decode_time -= dropped_duration;
+        thinned->duration += dropped_duration;
+        if (thinned->tfdt_version == 1) {
+            MP4WriteU64(thinned->data.data() + thinned->tfdt_offset, thinned->base_decode_time);
+        } else {
+            MP4WriteU32(thinned->data.data() + thinned->tfdt_offset, static_cast<uint32_t>(thinned->base_decode_time));
+        }
+        dropped_duration = 0;
+    }
+
+    p = WriteBoxHeader(p, trun_size, MP4_FOURCC('t', 'r', 'u', 'n'));
+    MP4WriteU32(p, (trun_version << 24) | flags);
+    MP4WriteU32(p + 4, static_cast<uint32_t>(kept));
+    MP4WriteU32(p + 8, static_cast<uint32_t>(moof_size + 8));
+    p += 12;
+    if (flags & TRUN_FIRST_SAMPLE_FLAGS) {
+        MP4WriteU32(p, samples[0].flags);
+        p += 4;
+    }
+    for (auto &sample : samples) {
+        if (!sample.keep)
+            continue;
+        MP4WriteU32(p, sample.duration);
+        MP4WriteU32(p + 4, sample.size);
+        p += 8;
+        if (flags & TRUN_SAMPLE_FLAGS) {
+            MP4WriteU32(p, sample.flags);
+            p += 4;
+        }
+        MP4WriteU32(p, sample.composition_offset);
+        p += 4;
+    }
+
+    p = WriteBoxHeader(p, 8 + payload_size, MP4_FOURCC('m', 'd', 'a', 't'));
+    thinned->payload_offset = p - thinned->data.data();
+    for (auto &sample : samples) {
+        if (!sample.keep)
+            continue;
+        memcpy(p, sample.data, sample.size);
+        p += sample.size;
+    }
+
+    for (auto &sample : samples) {
+        if (sample.keep) {
+            thinned->is_key_frame = !(sample.flags & SAMPLE_FLAG_IS_NON_SYNC);
+            break;
+        }
+    }
+    return thinned;
+}
+
+/*
+ * MP4ViewerCongestion
+ */
+MP4ViewerCongestion::MP4ViewerCongestion(size_t high_watermark, size_t low_watermark, unsigned int settle_ms, unsigned int recovery_ms)
+        : high_watermark(high_watermark)
+        , low_watermark(low_watermark)
+        , settle(settle_ms)
+        , recovery(recovery_ms)
+        , level(MP4_THINNING_NONE)
+        , is_low(false)
+{
+}
+
+MP4ThinningLevel MP4ViewerCongestion::Update(size_t queued_bytes)
+{
+    auto now = std::chrono::steady_clock::now();
+
+    if (queued_bytes > high_watermark) {
+        is_low = false;
+        if (level != MP4_THINNING_KEY_FRAMES && now - last_change >= settle) {
+            level = static_cast<MP4ThinningLevel>(level + 1);
+            last_change = now;
+        }
+        return level;
+    }
+
+    if (queued_bytes >= low_watermark) {
+        is_low = false;
+        return level;
+    }
+
+    if (!is_low) {
+        is_low = true;
+        low_since = now;
+    }
+    if (level != MP4_THINNING_NONE && now - low_since >= recovery && now - last_change >= recovery) {
+        level = static_cast<MP4ThinningLevel>(level - 1);
+        last_change = now;
+        low_since = now;
+    }
+    return level;
+}
@@ -0,0 +1,107 @@
+#pragma once
+
+#include "fMP4-fragment.hpp"
+
+#include <chrono>
+#include <cstddef>
+#include <vector>
+
+enum MP4ThinningLevel
+{
+    MP4_THINNING_NONE,              // All the frames
+    MP4_THINNING_NON_REFERENCE,     // Without the frames no other one refers to (nal_ref_idc 0)
+    MP4_THINNING_KEY_FRAMES         // The key frames only
+};
+
+/*
+ * Thin the fragments sent to a viewer: the dropped samples are taken out of the moof and the mdat, and their
+ * duration goes to the previous sample kept, so the fragment still covers the same time. The first sample kept
+ * also takes the duration of the ones dropped before it: it is decoded and presented that much earlier, so that
+ * the presentation timeline has no hole either.
+ *
+ * Only the fragments of our writers are understood (one track fragment with a tfhd, a tfdt and a trun,
+ * AVCC samples): the others go as they are. A fragment with no sample left is dropped, and its duration goes to
+ * the first sample of the next one sent, the same way: the viewer timeline keeps its time. The boxes before
+ * the moof are kept as they are: a prft maps a media time to a wall-clock time, whichever samples are left.
+ */
+class MP4FragmentThinner
+{
+public:
+
+    MP4FragmentThinner();
+
+    // Return the fragment to send, nullptr if none. The level goes back down only at a key frame:
+    // the frames following the ones dropped could refer to them.
+    MP4FragmentPtr Thin(const MP4FragmentPtr &fragment, MP4ThinningLevel level);
+
+    MP4ThinningLevel GetLevel() const { return level; }
+
+    unsigned long long int GetDroppedSamples() const { return dropped_samples; }
+
+    void Reset();
+
+private:
+
+    struct Sample
+    {
+        const unsigned char *data;
+        uint32_t size;
+        uint32_t duration;
+        uint32_t flags;
+        uint32_t composition_offset;
+        bool keep;
+    };
+
+    // Fill samples from the moof. Return false if the fragment is not one we understand.
+    bool ParseSamples(const MP4Fragment &fragment);
+
+    bool IsKept(const Sample &sample) const;
+
+    static bool IsReference(const unsigned char *sample, uint32_t size);
+
+    MP4FragmentPtr Remux(const MP4Fragment &fragment);
+
+    MP4ThinningLevel level;
+    unsigned long long int dropped_samples;
+    uint64_t dropped_duration;  // Of the fragments dropped since the last one sent
+
+    // The boxes of the last parsed fragment, kept as they are.
+    size_t prefix_size;         // Before the moof
+    const unsigned char *mfhd;
+    size_t mfhd_size;
+    const unsigned char *tfhd;
+    size_t tfhd_size;
+    const unsigned char *tfdt;
+    size_t tfdt_size;
+    unsigned int trun_version;
+    uint32_t trun_flags;
+    std::vector<Sample> samples;
+};
+
+/*
+ * When to thin the stream of a viewer, from the bytes queued on its socket: one level up as soon as
+ * the backlog goes over high_watermark, then at most once per settle_ms for it to take effect,
+ * and one level down once the backlog stays under low_watermark for recovery_ms.
+ */
+class MP4ViewerCongestion
+{
+public:
+
+    MP4ViewerCongestion(size_t high_watermark, size_t low_watermark, unsigned int settle_ms, unsigned int recovery_ms);
+
+    MP4ThinningLevel Update(size_t queued_bytes);
+
+    MP4ThinningLevel GetLevel() const { return level; }
+
+private:
+
+    const size_t high_watermark;
+    const size_t low_watermark;
+    const std::chrono::milliseconds settle;
+    const std::chrono::milliseconds recovery;
+
+    MP4ThinningLevel level;
+    std::chrono::steady_clock::time_point last_change;
+    std::chrono::steady_clock::time_point low_since;
+    bool is_low;
+};
@@ -0,0 +1,303 @@
+#include "fMP4-thumbnail.hpp"
+#include "fMP4-basic-writer.hpp"
+
+#include <algorithm>
+#include <cstdio>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libswscale/swscale.h>
+};
+
+struct MP4Thumbnailer::Codec
+{
+    Codec()
+            : decoder(nullptr)
+            , encoder(nullptr)
+            , scaler(nullptr)
+            , frame(av_frame_alloc())
+            , scaled(av_frame_alloc())
+    {
+        AVCodec *h264 = avcodec_find_decoder(AV_CODEC_ID_H264);
+        if (h264 && (decoder = avcodec_alloc_context3(h264))) {
+            decoder->thread_count = 1;
+            decoder->flags |= CODEC_FLAG_LOW_DELAY;
+            if (avcodec_open2(decoder, h264, nullptr) < 0) {
+                printf("Fail to open the H264 decoder\n");
+                avcodec_free_context(&decoder);
+            }
+        }
+    }
+
+    ~Codec()
+    {
+        if (decoder)
+            avcodec_free_context(&decoder);
+        if (encoder)
+            avcodec_free_context(&encoder);
+        if (scaler)
+            sws_freeContext(scaler);
+        av_frame_free(&frame);
+        av_frame_free(&scaled);
+    }
+
+    AVCodecContext *decoder;
+    AVCodecContext *encoder;        // JPEG, opened for the size of the last thumbnail
+    SwsContext *scaler;
+    AVFrame *frame;
+    AVFrame *scaled;
+    std::vector<unsigned char> pixels;
+};
+
+MP4Thumbnailer::MP4Thumbnailer(const fMP4ThumbnailerConfig &config)
+        : format(config.format)
+        , width(config.width)
+        , height(config.height)
+        , jpeg_quality(std::min(std::max(config.jpeg_quality, 2u), 31u))
+        , max_pending(config.max_pending)
+        , stopping(false)
+        , submitted(0)
+        , dropped(0)
+        , produced(0)
+        , failed(0)
+{
+    MP4RegisterAll();
+
+    for (unsigned int i = 0; i < std::max(config.threads, 1u); i++)
+        threads.emplace_back(&MP4Thumbnailer::Run, this);
+}
+
+MP4Thumbnailer::~MP4Thumbnailer()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+        jobs.clear();
+    }
+    job_cv.notify_all();
+
+    for (auto &thread : threads)
+        thread.join();
+}
+
+bool MP4Thumbnailer::Submit(const void *owner,
+                            const unsigned char *key_frame,
+                            unsigned int size,
+                            long long int pts,
+                            fMP4ThumbnailCallback callback,
+                            void *context)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (stopping || jobs.size() >= max_pending) {
+            dropped++;
+            return false;
+        }
+
+        jobs.emplace_back();
+        Job &job = jobs.back();
+        job.owner = owner;
+        job.pts = pts;
+        job.callback = callback;
+        job.context = context;
+
+        // The decoder reads ahead of the data, the padding must be zeros.
+        job.key_frame.reserve(size + AV_INPUT_BUFFER_PADDING_SIZE);
+        job.key_frame.assign(key_frame, key_frame + size);
+        job.key_frame.resize(size + AV_INPUT_BUFFER_PADDING_SIZE, 0);
+    }
+    submitted++;
+    job_cv.notify_one();
+    return true;
+}
+
+void MP4Thumbnailer::Cancel(const void *owner)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    jobs.erase(std::remove_if(jobs.begin(), jobs.end(), [owner](const Job &job) { return job.owner == owner; }),
+               jobs.end());
+    done_cv.wait(lock, [this, owner]() {
+        return std::find(busy_owners.begin(), busy_owners.end(), owner) == busy_owners.end();
+    });
+}
+
+fMP4ThumbnailerStats MP4Thumbnailer::GetStats() const
+{
+    fMP4ThumbnailerStats stats;
+    stats.submitted = submitted;
+    stats.dropped   = dropped;
+    stats.produced  = produced;
+    stats.failed    = failed;
+    return stats;
+}
+
+void MP4Thumbnailer::Run()
+{
+    Codec codec;
+    std::vector<unsigned char> output;
+
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        job_cv.wait(lock, [this]() { return stopping || !jobs.empty(); });
+        if (stopping)
+            break;
+
+        Job job = std::move(jobs.front());
+        jobs.pop_front();
+        busy_owners.push_back(job.owner);
+        lock.unlock();
+
+        fMP4Thumbnail thumbnail;
+        if (Decode(codec, job) && Scale(codec, output, thumbnail)) {
+            thumbnail.pts  = job.pts;
+            thumbnail.data = output.data();
+            thumbnail.size = static_cast<unsigned int>(output.size());
+            job.callback(job.context, &thumbnail);
+            produced++;
+        } else {
+            failed++;
+        }
+
+        lock.lock();
+        busy_owners.erase(std::find(busy_owners.begin(), busy_owners.end(), job.owner));
+        done_cv.notify_all();
+    }
+}
+
+bool MP4Thumbnailer::Decode(Codec &codec, Job &job)
+{
+    if (!codec.decoder)
+        return false;
+
+    AVPacket packet;
+    av_init_packet(&packet);
+    packet.data = job.key_frame.data();
+    packet.size = static_cast<int>(job.key_frame.size() - AV_INPUT_BUFFER_PADDING_SIZE);
+    packet.flags |= AV_PKT_FLAG_KEY;
+
+    int got_frame = 0;
+    int result = avcodec_decode_video2(codec.decoder, codec.frame, &got_frame, &packet);
+    if (result >= 0 && !got_frame) {
+        // Held back for the reordering of the frames: there is no other frame, so drain it.
+        AVPacket drain;
+        av_init_packet(&drain);
+        drain.data = nullptr;
+        drain.size = 0;
+        result = avcodec_decode_video2(codec.decoder, codec.frame, &got_frame, &drain);
+    }
+
+    // The next key frame could be from another stream.
+    avcodec_flush_buffers(codec.decoder);
+
+    if (result < 0 || !got_frame) {
+        printf("Fail to decode key frame for thumbnail\n");
+        return false;
+    }
+    return true;
+}
+
+bool MP4Thumbnailer::Scale(Codec &codec, std::vector<unsigned char> &output, fMP4Thumbnail &thumbnail)
+{
+    const AVFrame *frame = codec.frame;
+    if (frame->width <= 0 || frame->height <= 0)
+        return false;
+
+    // Keep the aspect ratio if a side is not given. Even sizes, for the 4:2:0 chroma of JPEG.
+    int scaled_width = static_cast<int>(width), scaled_height = static_cast<int>(height);
+    if (scaled_width == 0 && scaled_height == 0) {
+        scaled_width = frame->width;
+        scaled_height = frame->height;
+    } else if (scaled_width == 0) {
+        scaled_width = static_cast<int>(static_cast<long long int>(frame->width) * scaled_height / frame->height);
+    } else if (scaled_height == 0) {
+        scaled_height = static_cast<int>(static_cast<long long int>(frame->height) * scaled_width / frame->width);
+    }
+    scaled_width = std::max(scaled_width & ~1, 2);
+    scaled_height = std::max(scaled_height & ~1, 2);
+
+    AVPixelFormat scaled_format = (format == fMP4_THUMBNAIL_JPEG) ? AV_PIX_FMT_YUVJ420P : AV_PIX_FMT_RGB24;
+    codec.scaler = sws_getCachedContext(codec.scaler,
+                                        frame->width, frame->height, static_cast<AVPixelFormat>(frame->format),
+                                        scaled_width, scaled_height, scaled_format,
+                                        SWS_BILINEAR, nullptr, nullptr, nullptr);
+    if (!codec.scaler) {
+        printf("Fail to create scaler for thumbnail\n");
+        return false;
+    }
+
+    // RGB24 is scaled straight into the output, YUV into the frame given to the encoder.
+    AVFrame *scaled = codec.scaled;
+    scaled->width  = scaled_width;
+    scaled->height = scaled_height;
+    scaled->format = scaled_format;
+    if (format == fMP4_THUMBNAIL_RGB24) {
+        output.resize(static_cast<size_t>(scaled_width) * scaled_height * 3);
+        scaled->data[0] = output.data();
+        scaled->linesize[0] = scaled_width * 3;
+    } else {
+        size_t luma_size = static_cast<size_t>(scaled_width) * scaled_height;
+        codec.pixels.resize(luma_size * 3 / 2);
+        scaled->data[0] = codec.pixels.data();
+        scaled->data[1] = scaled->data[0] + luma_size;
+        scaled->data[2] = scaled->data[1] + luma_size / 4;
+        scaled->linesize[0] = scaled_width;
+        scaled->linesize[1] = scaled_width / 2;
+        scaled->linesize[2] = scaled_width / 2;
+    }
+
+    sws_scale(codec.scaler, frame->data, frame->linesize, 0, frame->height, scaled->data, scaled->linesize);
+
+    if (format == fMP4_THUMBNAIL_JPEG && !Encode(codec, output))
+        return false;
+
+    thumbnail.format = format;
+    thumbnail.width  = static_cast<unsigned int>(scaled_width);
+    thumbnail.height = static_cast<unsigned int>(scaled_height);
+    return true;
+}
+
+bool MP4Thumbnailer::Encode(Codec &codec, std::vector<unsigned char> &output)
+{
+    AVFrame *scaled = codec.scaled;
+
+    if (codec.encoder && (codec.encoder->width != scaled->width || codec.encoder->height != scaled->height))
+        avcodec_free_context(&codec.encoder);
+
+    if (!codec.encoder) {
+        AVCodec *mjpeg = avcodec_find_encoder(AV_CODEC_ID_MJPEG);
+        if (!mjpeg || !(codec.encoder = avcodec_alloc_context3(mjpeg))) {
+            printf("Fail to create JPEG encoder\n");
+            return false;
+        }
+
+        codec.encoder->width          = scaled->width;
+        codec.encoder->height         = scaled->height;
+        codec.encoder->pix_fmt        = AV_PIX_FMT_YUVJ420P;
+        codec.encoder->time_base      = (AVRational){1, 25};
+        codec.encoder->flags         |= CODEC_FLAG_QSCALE;
+        codec.encoder->global_quality = FF_QP2LAMBDA * static_cast<int>(jpeg_quality);
+        if (avcodec_open2(codec.encoder, mjpeg, nullptr) < 0) {
+            printf("Fail to open JPEG encoder\n");
+            avcodec_free_context(&codec.encoder);
+            return false;
+        }
+    }
+
+    scaled->quality = codec.encoder->global_quality;
+    scaled->pts = 0;
+
+    AVPacket packet;
+    av_init_packet(&packet);
+    packet.data = nullptr;
+    packet.size = 0;
+
+    int got_packet = 0;
+    if (avcodec_encode_video2(codec.encoder, &packet, scaled, &got_packet) < 0 || !got_packet) {
+        printf("Fail to encode thumbnail\n");
+        return false;
+    }
+
+    output.assign(packet.data, packet.data + packet.size);
+    av_packet_unref(&packet);
+    return true;
+}
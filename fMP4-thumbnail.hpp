@@ -0,0 +1,80 @@
+#pragma once
+
+#include "fMP4.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * Decode single key frames into thumbnails on a pool of threads, each with its own decoder,
+ * scaler and JPEG encoder. A key frame is decoded alone (it needs no reference), so the other
+ * frames of the stream are never decoded.
+ *
+ * Submit() never blocks: the key frame is copied into the queue, or dropped when max_pending
+ * key frames are waiting already.
+ */
+class MP4Thumbnailer
+{
+public:
+
+    MP4Thumbnailer(const fMP4ThumbnailerConfig &config);
+
+    // Drop the queued key frames, and wait for the ones being decoded.
+    ~MP4Thumbnailer();
+
+    // The AnnexB key frame, with its SPS and PPS. The callback is called for it on a thumbnailer thread.
+    bool Submit(const void *owner,
+                const unsigned char *key_frame,
+                unsigned int size,
+                long long int pts,
+                fMP4ThumbnailCallback callback,
+                void *context);
+
+    // Drop the queued key frames of owner, and wait for the one being decoded if any.
+    // The callback is not called for owner after that. Must not be called from the callback.
+    void Cancel(const void *owner);
+
+    fMP4ThumbnailerStats GetStats() const;
+
+private:
+
+    struct Job
+    {
+        const void *owner;
+        std::vector<unsigned char> key_frame;
+        long long int pts;
+        fMP4ThumbnailCallback callback;
+        void *context;
+    };
+
+    // One per thread.
+    struct Codec;
+
+    void Run();
+    bool Decode(Codec &codec, Job &job);
+    bool Scale(Codec &codec, std::vector<unsigned char> &output, fMP4Thumbnail &thumbnail);
+    bool Encode(Codec &codec, std::vector<unsigned char> &output);
+
+    const fMP4ThumbnailFormat format;
+    const unsigned int width;
+    const unsigned int height;
+    const unsigned int jpeg_quality;
+    const unsigned int max_pending;
+
+    std::mutex mutex;
+    std::condition_variable job_cv;
+    std::condition_variable done_cv;
+    std::deque<Job> jobs;
+    std::vector<const void *> busy_owners;     // Of the jobs being decoded
+    bool stopping;
+    std::vector<std::thread> threads;
+
+    std::atomic<unsigned long long int> submitted;
+    std::atomic<unsigned long long int> dropped;
+    std::atomic<unsigned long long int> produced;
+    std::atomic<unsigned long long int> failed;
+};
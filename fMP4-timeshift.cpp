@@ -0,0 +1,147 @@
+#include "fMP4-timeshift.hpp"
+
+#include <algorithm>
+
+// The track timescale of the mov muxer, if the init segment does not tell.
+#define DEFAULT_TIMESCALE 90000
+
+MP4TimeShiftBuffer::MP4TimeShiftBuffer(unsigned int max_duration_ms, size_t max_bytes)
+        : max_duration_ms(max_duration_ms)
+        , max_bytes(max_bytes)
+        , timescale(DEFAULT_TIMESCALE)
+        , first_position(0)
+        , end_time(0)
+        , bytes(0)
+{
+}
+
+void MP4TimeShiftBuffer::Push(const MP4FragmentPtr &fragment)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if (fragment->type == MP4_FRAGMENT_INIT) {
+        // The timestamps start over with a new init segment.
+        ClearLocked();
+        init_fragment = fragment;
+        timescale = fragment->timescale ? fragment->timescale : DEFAULT_TIMESCALE;
+        return;
+    }
+
+    // Nothing to decode it from.
+    if (fragments.empty() && !fragment->is_key_frame)
+        return;
+
+    if (fragment->is_key_frame)
+        key_frames.push_back({fragment->base_decode_time, first_position + fragments.size()});
+
+    fragments.push_back(fragment);
+    bytes += fragment->data.size();
+    end_time = fragment->base_decode_time + fragment->duration;
+
+    Evict();
+}
+
+void MP4TimeShiftBuffer::Evict()
+{
+    // Drop the oldest GOP while the next one alone is still over the duration or the size.
+    while (key_frames.size() > 1) {
+        uint64_t decode_time = key_frames[1].decode_time;
+        bool too_long = ToMs((end_time > decode_time) ? end_time - decode_time : 0) >= max_duration_ms;
+        bool too_large = bytes > max_bytes;
+        if (!too_long && !too_large)
+            break;
+
+        uint64_t next_gop = key_frames[1].position;
+        while (first_position < next_gop) {
+            bytes -= fragments.front()->data.size();
+            fragments.pop_front();
+            first_position++;
+        }
+        key_frames.pop_front();
+    }
+}
+
+uint64_t MP4TimeShiftBuffer::ToMs(uint64_t decode_time) const
+{
+    return decode_time * 1000 / timescale;
+}
+
+MP4FragmentPtr MP4TimeShiftBuffer::GetInitFragment() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return init_fragment;
+}
+
+bool MP4TimeShiftBuffer::Seek(unsigned int offset_ms, uint64_t &position) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (key_frames.empty())
+        return false;
+
+    uint64_t offset = static_cast<uint64_t>(offset_ms) * timescale / 1000;
+    uint64_t target = (end_time > offset) ? end_time - offset : 0;
+
+    // The first key frame after the target, then step back to the one before.
+    auto it = std::upper_bound(key_frames.begin(), key_frames.end(), target,
+                               [](uint64_t time, const KeyFrame &key_frame) { return time < key_frame.decode_time; });
+    if (it != key_frames.begin())
+        --it;
+
+    position = it->position;
+    return true;
+}
+
+bool MP4TimeShiftBuffer::Get(uint64_t &position, MP4FragmentPtr &fragment) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (position < first_position)
+        position = first_position;
+    if (position >= first_position + fragments.size())
+        return false;
+
+    fragment = fragments[position - first_position];
+    return true;
+}
+
+uint64_t MP4TimeShiftBuffer::GetTimeMs(uint64_t decode_time) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return ToMs(decode_time);
+}
+
+void MP4TimeShiftBuffer::Clear()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    ClearLocked();
+    init_fragment.reset();
+}
+
+void MP4TimeShiftBuffer::ClearLocked()
+{
+    // The positions keep increasing, so the readers of the old fragments see them as evicted.
+    first_position += fragments.size();
+    fragments.clear();
+    key_frames.clear();
+    end_time = 0;
+    bytes = 0;
+}
+
+unsigned int MP4TimeShiftBuffer::GetDurationMs() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (fragments.empty())
+        return 0;
+    return static_cast<unsigned int>(ToMs(end_time - fragments.front()->base_decode_time));
+}
+
+size_t MP4TimeShiftBuffer::GetBytes() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return bytes;
+}
+
+size_t MP4TimeShiftBuffer::GetFragmentCount() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return fragments.size();
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include "fMP4-fragment.hpp"
+
+#include <deque>
+#include <mutex>
+
+/*
+ * The recent fragments of a stream, up to a max duration and size, indexed by decode time and key frame,
+ * so a viewer could start at "now minus T" from memory.
+ *
+ * Every fragment gets a position, increasing for the whole life of the buffer. The buffer always
+ * starts at a key frame: whole GOPs are evicted from the front. A new init segment clears the buffer.
+ * The writer must start a fragment at every key frame (movflags frag_keyframe). Thread-safe.
+ */
+class MP4TimeShiftBuffer
+{
+public:
+
+    MP4TimeShiftBuffer(unsigned int max_duration_ms = 30 * 60 * 1000, size_t max_bytes = 512 * 1024 * 1024);
+
+    void Push(const MP4FragmentPtr &fragment);
+
+    MP4FragmentPtr GetInitFragment() const;
+
+    // Position of the last key frame at or before "now - offset_ms", where now is the end of the last fragment.
+    // The oldest key frame if the buffer is shorter than that. Return false if the buffer is empty.
+    bool Seek(unsigned int offset_ms, uint64_t &position) const;
+
+    // The fragment at position. A position already evicted is moved to the oldest fragment (a key frame).
+    // Return false if there is no fragment there yet.
+    bool Get(uint64_t &position, MP4FragmentPtr &fragment) const;
+
+    // A decode time of the current track, in ms.
+    uint64_t GetTimeMs(uint64_t decode_time) const;
+
+    void Clear();
+
+    unsigned int GetDurationMs() const;
+
+    size_t GetBytes() const;
+
+    size_t GetFragmentCount() const;
+
+private:
+
+    struct KeyFrame
+    {
+        uint64_t decode_time;
+        uint64_t position;
+    };
+
+    // Must hold the lock.
+    void Evict();
+    uint64_t ToMs(uint64_t decode_time) const;
+    void ClearLocked();
+
+    const unsigned int max_duration_ms;
+    const size_t max_bytes;
+
+    mutable std::mutex mutex;
+    MP4FragmentPtr init_fragment;
+    uint32_t timescale;
+    std::deque<MP4FragmentPtr> fragments;
+    std::deque<KeyFrame> key_frames;        // The index, by decode time
+    uint64_t first_position;                // Position of fragments.front()
+    uint64_t end_time;                      // End of the last fragment, in the track timescale
+    size_t bytes;
+};
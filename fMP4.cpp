@@ -1,5 +1,14 @@
 #include "fMP4.h"
 #include "fMP4.hpp"
+#include "fMP4-buffer-pool.hpp"
+#include "fMP4-clip.hpp"
+#include "fMP4-file-sink.hpp"
+#include "fMP4-health.hpp"
+#include "fMP4-multi-track.hpp"
+#include "fMP4-ring.hpp"
+#include "fMP4-shm.hpp"
+#include "fMP4-template.hpp"
+#include "fMP4-thumbnail.hpp"
 
 fMP4Writer fMP4_CreateWriter(DataCallback cb)
 {
@@ -7,12 +16,150 @@ fMP4Writer fMP4_CreateWriter(DataCallback cb)
     return fmp4_writer;
 }
 
+fMP4Writer fMP4_CreateWriterWithContext(DataCallbackWithContext cb, void *context)
+{
+    MP4Writer *fmp4_writer = MP4Writer::Create(cb, context);
+    return fmp4_writer;
+}
+
+fMP4BufferPool fMP4_CreateBufferPool(unsigned int max_pooled_bytes)
+{
+    return new MP4BufferPool(max_pooled_bytes);
+}
+
+void fMP4_ReleaseBufferPool(fMP4BufferPool fmp4_pool)
+{
+    delete reinterpret_cast<MP4BufferPool *>(fmp4_pool);
+}
+
+void fMP4_GetBufferPoolStats(fMP4BufferPool fmp4_pool, fMP4BufferPoolStats *stats)
+{
+    *stats = reinterpret_cast<MP4BufferPool *>(fmp4_pool)->GetStats();
+}
+
+void fMP4_InitThumbnailerConfig(fMP4ThumbnailerConfig *config)
+{
+    config->format = fMP4_THUMBNAIL_JPEG;
+    config->width = 320;
+    config->height = 0;
+    config->jpeg_quality = 5;
+    config->threads = 2;
+    config->max_pending = 16;
+}
+
+fMP4Thumbnailer fMP4_CreateThumbnailer(const fMP4ThumbnailerConfig *config)
+{
+    return new MP4Thumbnailer(*config);
+}
+
+void fMP4_ReleaseThumbnailer(fMP4Thumbnailer fmp4_thumbnailer)
+{
+    delete reinterpret_cast<MP4Thumbnailer *>(fmp4_thumbnailer);
+}
+
+void fMP4_GetThumbnailerStats(fMP4Thumbnailer fmp4_thumbnailer, fMP4ThumbnailerStats *stats)
+{
+    *stats = reinterpret_cast<MP4Thumbnailer *>(fmp4_thumbnailer)->GetStats();
+}
+
+fMP4StreamAnalyzer fMP4_CreateStreamAnalyzer(unsigned int timescale)
+{
+    return new MP4StreamAnalyzer(timescale);
+}
+
+void fMP4_ReleaseStreamAnalyzer(fMP4StreamAnalyzer fmp4_analyzer)
+{
+    delete reinterpret_cast<MP4StreamAnalyzer *>(fmp4_analyzer);
+}
+
+void fMP4_AnalyzeH264Sample(fMP4StreamAnalyzer fmp4_analyzer,
+                            const unsigned char *sample,
+                            unsigned int sample_size,
+                            bool is_key_frame,
+                            long long int dts)
+{
+    reinterpret_cast<MP4StreamAnalyzer *>(fmp4_analyzer)->Analyze(sample, sample_size, is_key_frame, dts);
+}
+
+void fMP4_GetStreamHealth(fMP4StreamAnalyzer fmp4_analyzer, fMP4StreamHealth *health)
+{
+    *health = reinterpret_cast<MP4StreamAnalyzer *>(fmp4_analyzer)->GetHealth();
+}
+
+void fMP4_InitWriterConfig(fMP4WriterConfig *config)
+{
+    config->callback = nullptr;
+    config->callback_with_context = nullptr;
+    config->context = nullptr;
+    config->timescale = 1000;
+    config->buffer_pool = nullptr;
+    config->output_buffer_size = 0;
+    config->memory_budget = 0;
+    config->trick_play_callback = nullptr;
+    config->trick_play_callback_with_context = nullptr;
+    config->trick_play_context = nullptr;
+    config->thumbnailer = nullptr;
+    config->thumbnail_interval_ms = 0;
+    config->thumbnail_callback = nullptr;
+    config->thumbnail_context = nullptr;
+    config->fragment_callback = nullptr;
+    config->fragment_context = nullptr;
+    config->async_queue_size = 0;
+    config->completion_callback = nullptr;
+    config->completion_context = nullptr;
+    config->analyzer = nullptr;
+    config->fragment_target_bytes = 0;
+    config->fragment_min_duration_ms = 0;
+    config->fragment_max_duration_ms = 0;
+    config->keep_nal_types = 0;
+    config->drop_sei_payload_types = 0;
+}
+
+fMP4Writer fMP4_CreateWriterWithConfig(const fMP4WriterConfig *config)
+{
+    MP4Writer *fmp4_writer = MP4Writer::Create(*config);
+    return fmp4_writer;
+}
+
 void fMP4_ReleaseWriter(fMP4Writer fmp4_writer)
 {
     MP4Writer *writer = reinterpret_cast<MP4Writer *>(fmp4_writer);
     MP4Writer::Release(writer);
 }
 
+void fMP4_GetWriterStats(fMP4Writer fmp4_writer, fMP4WriterStats *stats)
+{
+    MP4Writer *writer = reinterpret_cast<MP4Writer *>(fmp4_writer);
+    writer->GetStats(*stats);
+}
+
+bool fMP4_FlushWriter(fMP4Writer fmp4_writer, int timeout_ms)
+{
+    MP4Writer *writer = reinterpret_cast<MP4Writer *>(fmp4_writer);
+    return writer->Flush(timeout_ms);
+}
+
+void fMP4_RequestThumbnail(fMP4Writer fmp4_writer)
+{
+    MP4Writer *writer = reinterpret_cast<MP4Writer *>(fmp4_writer);
+    writer->RequestThumbnail();
+}
+
+fMP4WriterTemplate fMP4_CreateWriterTemplate(const unsigned char *parameter_sets, unsigned int size)
+{
+    return MP4WriterTemplate::Create(parameter_sets, size);
+}
+
+void fMP4_ReleaseWriterTemplate(fMP4WriterTemplate fmp4_template)
+{
+    MP4WriterTemplate::Release(reinterpret_cast<MP4WriterTemplate *>(fmp4_template));
+}
+
+fMP4Writer fMP4_CreateWriterFromTemplate(fMP4WriterTemplate fmp4_template, const fMP4WriterConfig *config)
+{
+    return reinterpret_cast<MP4WriterTemplate *>(fmp4_template)->CreateWriter(*config);
+}
+
 bool fMP4_WriteH264Sample(fMP4Writer fmp4_writer,
                           unsigned char *sample,
                           unsigned int sample_size,
@@ -21,4 +168,227 @@ bool fMP4_WriteH264Sample(fMP4Writer fmp4_writer,
 {
     MP4Writer *writer = reinterpret_cast<MP4Writer *>(fmp4_writer);
     return writer->WriteH264VideoSample(sample, sample_size, is_key_frame, duration);
+}
+
+bool fMP4_WriteH264SampleWithTimestamps(fMP4Writer fmp4_writer,
+                                        unsigned char *sample,
+                                        unsigned int sample_size,
+                                        bool is_key_frame,
+                                        long long int pts,
+                                        long long int dts,
+                                        unsigned long long int duration)
+{
+    MP4Writer *writer = reinterpret_cast<MP4Writer *>(fmp4_writer);
+    return writer->WriteH264VideoSample(sample, sample_size, is_key_frame, pts, dts, duration);
+}
+
+bool fMP4_WriteH264SampleWithCaptureTime(fMP4Writer fmp4_writer,
+                                         unsigned char *sample,
+                                         unsigned int sample_size,
+                                         bool is_key_frame,
+                                         long long int pts,
+                                         long long int dts,
+                                         unsigned long long int duration,
+                                         unsigned long long int capture_time_us)
+{
+    MP4Writer *writer = reinterpret_cast<MP4Writer *>(fmp4_writer);
+    return writer->WriteH264VideoSample(sample, sample_size, is_key_frame, pts, dts, duration, capture_time_us);
+}
+
+void fMP4_InitMultiTrackWriterConfig(fMP4MultiTrackWriterConfig *config)
+{
+    config->callback = nullptr;
+    config->callback_with_context = nullptr;
+    config->context = nullptr;
+    config->timescale = 1000;
+    config->track_count = 2;
+    config->separate_fragments = false;
+}
+
+fMP4MultiTrackWriter fMP4_CreateMultiTrackWriter(const fMP4MultiTrackWriterConfig *config)
+{
+    return new MP4MultiTrackWriter(*config);
+}
+
+void fMP4_ReleaseMultiTrackWriter(fMP4MultiTrackWriter fmp4_writer)
+{
+    delete reinterpret_cast<MP4MultiTrackWriter *>(fmp4_writer);
+}
+
+bool fMP4_WriteTrackH264Sample(fMP4MultiTrackWriter fmp4_writer,
+                               unsigned int track,
+                               unsigned char *sample,
+                               unsigned int sample_size,
+                               bool is_key_frame,
+                               long long int pts,
+                               long long int dts,
+                               unsigned long long int duration)
+{
+    MP4MultiTrackWriter *writer = reinterpret_cast<MP4MultiTrackWriter *>(fmp4_writer);
+    return writer->WriteH264VideoSample(track, sample, sample_size, is_key_frame, pts, dts, duration);
+}
+
+void fMP4_GetMultiTrackWriterStats(fMP4MultiTrackWriter fmp4_writer, fMP4WriterStats *stats)
+{
+    reinterpret_cast<MP4MultiTrackWriter *>(fmp4_writer)->GetStats(*stats);
+}
+
+fMP4FragmentRing fMP4_CreateFragmentRing(unsigned int capacity, fMP4RingOverflowPolicy policy)
+{
+    return new MP4FragmentRing(capacity, policy);
+}
+
+void fMP4_ReleaseFragmentRing(fMP4FragmentRing fmp4_ring)
+{
+    delete reinterpret_cast<MP4FragmentRing *>(fmp4_ring);
+}
+
+int fMP4_WriteFragmentRing(void *fmp4_ring, unsigned char *buf, int buf_size)
+{
+    return MP4FragmentRing::Write(fmp4_ring, buf, buf_size);
+}
+
+void fMP4_CloseFragmentRing(fMP4FragmentRing fmp4_ring)
+{
+    reinterpret_cast<MP4FragmentRing *>(fmp4_ring)->Close();
+}
+
+fMP4Fragment fMP4_PopFragment(fMP4FragmentRing fmp4_ring, int timeout_ms)
+{
+    MP4FragmentPtr fragment;
+    if (!reinterpret_cast<MP4FragmentRing *>(fmp4_ring)->Pop(fragment, timeout_ms))
+        return nullptr;
+
+    // The C side holds its own reference until fMP4_ReleaseFragment.
+    return new MP4FragmentPtr(fragment);
+}
+
+const unsigned char *fMP4_GetFragmentData(fMP4Fragment fmp4_fragment, int *size, bool *is_key_frame)
+{
+    const MP4FragmentPtr &fragment = *reinterpret_cast<MP4FragmentPtr *>(fmp4_fragment);
+    if (size) *size = static_cast<int>(fragment->data.size());
+    if (is_key_frame) *is_key_frame = fragment->is_key_frame;
+    return fragment->data.data();
+}
+
+void fMP4_ReleaseFragment(fMP4Fragment fmp4_fragment)
+{
+    delete reinterpret_cast<MP4FragmentPtr *>(fmp4_fragment);
+}
+
+void fMP4_GetFragmentRingStats(fMP4FragmentRing fmp4_ring, fMP4RingStats *stats)
+{
+    *stats = reinterpret_cast<MP4FragmentRing *>(fmp4_ring)->GetStats();
+}
+
+void fMP4_InitFileSinkConfig(fMP4FileSinkConfig *config)
+{
+    config->path_prefix = "record";
+    config->max_file_duration_ms = 0;
+    config->max_file_size = 0;
+    config->sync_interval_ms = 1000;
+    config->direct_io = false;
+    config->max_pending_bytes = 64 * 1024 * 1024;
+}
+
+fMP4FileSink fMP4_CreateFileSink(const fMP4FileSinkConfig *config)
+{
+    return new MP4FileSink(*config);
+}
+
+void fMP4_ReleaseFileSink(fMP4FileSink fmp4_sink)
+{
+    delete reinterpret_cast<MP4FileSink *>(fmp4_sink);
+}
+
+int fMP4_WriteFileSink(void *fmp4_sink, unsigned char *buf, int buf_size)
+{
+    return MP4FileSink::Write(fmp4_sink, buf, buf_size);
+}
+
+void fMP4_GetFileSinkStats(fMP4FileSink fmp4_sink, fMP4FileSinkStats *stats)
+{
+    *stats = reinterpret_cast<MP4FileSink *>(fmp4_sink)->GetStats();
+}
+
+fMP4ShmChannel fMP4_CreateShmChannel(unsigned int capacity, unsigned int timescale)
+{
+    return MP4ShmChannel::Create(capacity, timescale);
+}
+
+fMP4ShmChannel fMP4_OpenShmChannel(const char *path)
+{
+    return MP4ShmChannel::Open(path);
+}
+
+void fMP4_ReleaseShmChannel(fMP4ShmChannel fmp4_channel)
+{
+    delete reinterpret_cast<MP4ShmChannel *>(fmp4_channel);
+}
+
+bool fMP4_GetShmChannelPath(fMP4ShmChannel fmp4_channel, char *path, unsigned int size)
+{
+    std::string channel_path = reinterpret_cast<MP4ShmChannel *>(fmp4_channel)->GetPath();
+    if (channel_path.size() >= size)
+        return false;
+    memcpy(path, channel_path.c_str(), channel_path.size() + 1);
+    return true;
+}
+
+unsigned int fMP4_GetShmChannelTimescale(fMP4ShmChannel fmp4_channel)
+{
+    return reinterpret_cast<MP4ShmChannel *>(fmp4_channel)->GetTimescale();
+}
+
+bool fMP4_WriteShmSample(fMP4ShmChannel fmp4_channel,
+                         const unsigned char *sample,
+                         unsigned int sample_size,
+                         bool is_key_frame,
+                         long long int pts,
+                         long long int dts,
+                         unsigned long long int duration,
+                         int timeout_ms)
+{
+    MP4ShmChannel *channel = reinterpret_cast<MP4ShmChannel *>(fmp4_channel);
+    return channel->Write(sample, sample_size, is_key_frame, pts, dts, duration, timeout_ms);
+}
+
+unsigned char *fMP4_ReserveShmSample(fMP4ShmChannel fmp4_channel, unsigned int sample_size, int timeout_ms)
+{
+    return reinterpret_cast<MP4ShmChannel *>(fmp4_channel)->Reserve(sample_size, timeout_ms);
+}
+
+void fMP4_CommitShmSample(fMP4ShmChannel fmp4_channel,
+                          bool is_key_frame,
+                          long long int pts,
+                          long long int dts,
+                          unsigned long long int duration)
+{
+    reinterpret_cast<MP4ShmChannel *>(fmp4_channel)->Commit(is_key_frame, pts, dts, duration);
+}
+
+int fMP4_ReadShmSamples(fMP4ShmChannel fmp4_channel, fMP4Writer fmp4_writer, int timeout_ms)
+{
+    MP4ShmChannel *channel = reinterpret_cast<MP4ShmChannel *>(fmp4_channel);
+    return channel->Read(reinterpret_cast<MP4Writer *>(fmp4_writer), timeout_ms);
+}
+
+void fMP4_GetShmChannelStats(fMP4ShmChannel fmp4_channel, fMP4ShmChannelStats *stats)
+{
+    reinterpret_cast<MP4ShmChannel *>(fmp4_channel)->GetStats(*stats);
+}
+
+bool fMP4_ExtractClip(const char *input_path,
+                      const char *output_path,
+                      unsigned long long int start_ms,
+                      unsigned long long int end_ms,
+                      fMP4ClipInfo *info)
+{
+    MP4ClipExtractor extractor;
+    fMP4ClipInfo clip_info;
+    if (!extractor.Open(input_path) || !extractor.Extract(start_ms, end_ms, output_path, clip_info))
+        return false;
+    if (info)
+        *info = clip_info;
+    return true;
 }
\ No newline at end of file
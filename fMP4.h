@@ -7,17 +7,519 @@ extern "C" {
 
 typedef void* fMP4Writer;
 typedef int (*DataCallback)(unsigned char*, int);
+typedef int (*DataCallbackWithContext)(void *context, unsigned char*, int);
 
 fMP4Writer fMP4_CreateWriter(DataCallback cb);
 
+// Same as fMP4_CreateWriter, but the context is given back to the callback so that many writers could share it.
+fMP4Writer fMP4_CreateWriterWithContext(DataCallbackWithContext cb, void *context);
+
+/*
+ * Output buffers shared by many writers, by size class, so the idle and the small streams don't pin
+ * a large buffer each. The pool must outlive the writers using it.
+ */
+typedef void* fMP4BufferPool;
+
+typedef struct
+{
+    unsigned long long int in_use_bytes;        // Held by the writers
+    unsigned long long int peak_in_use_bytes;
+    unsigned long long int pooled_bytes;        // Released, kept for reuse
+    unsigned long long int hits;                // Acquisitions served by a released buffer
+    unsigned long long int misses;              // Acquisitions allocating a new buffer
+    unsigned long long int over_budget;         // Acquisitions shrunk or refused by the budget of their writer
+} fMP4BufferPoolStats;
+
+// Keep up to max_pooled_bytes of released buffers for reuse.
+fMP4BufferPool fMP4_CreateBufferPool(unsigned int max_pooled_bytes);
+
+void fMP4_ReleaseBufferPool(fMP4BufferPool);
+
+void fMP4_GetBufferPoolStats(fMP4BufferPool, fMP4BufferPoolStats *stats);
+
+/*
+ * Thumbnails of the key frames, Ex: for preview tiles. Only the sampled key frames are decoded,
+ * on a thread pool shared by many writers, then scaled and encoded off the writer thread.
+ * The key frames must carry their SPS and PPS. The thumbnailer must outlive the writers using it.
+ */
+typedef void* fMP4Thumbnailer;
+
+typedef enum
+{
+    fMP4_THUMBNAIL_JPEG = 0,
+    fMP4_THUMBNAIL_RGB24                // Packed, width * 3 bytes per line
+} fMP4ThumbnailFormat;
+
+typedef struct
+{
+    fMP4ThumbnailFormat format;
+    unsigned int width;                 // 0 for the width of the video, or to keep the aspect ratio with height
+    unsigned int height;                // 0 for the height of the video, or to keep the aspect ratio with width
+    unsigned int jpeg_quality;          // From 2 (best) to 31
+    unsigned int threads;
+    unsigned int max_pending;           // Key frames waiting for a thread. More are dropped
+} fMP4ThumbnailerConfig;
+
+typedef struct
+{
+    fMP4ThumbnailFormat format;
+    unsigned int width;
+    unsigned int height;
+    long long int pts;                  // Of the key frame, in the writer timescale
+    const unsigned char *data;          // Only valid during the callback
+    unsigned int size;
+} fMP4Thumbnail;
+
+// Called on a thread of the thumbnailer.
+typedef void (*fMP4ThumbnailCallback)(void *context, const fMP4Thumbnail *thumbnail);
+
+typedef struct
+{
+    unsigned long long int submitted;   // Key frames queued
+    unsigned long long int dropped;     // Key frames refused, max_pending were queued already
+    unsigned long long int produced;
+    unsigned long long int failed;      // Fail to decode, scale or encode
+} fMP4ThumbnailerStats;
+
+// Fill the config with the defaults: JPEG, 320 pixels wide, quality 5, 2 threads, up to 16 pending key frames.
+void fMP4_InitThumbnailerConfig(fMP4ThumbnailerConfig *config);
+
+fMP4Thumbnailer fMP4_CreateThumbnailer(const fMP4ThumbnailerConfig *config);
+
+void fMP4_ReleaseThumbnailer(fMP4Thumbnailer);
+
+void fMP4_GetThumbnailerStats(fMP4Thumbnailer, fMP4ThumbnailerStats *stats);
+
+typedef enum
+{
+    fMP4_FRAGMENT_INIT = 0,             // ftyp + moov
+    fMP4_FRAGMENT_MEDIA                 // moof + mdat
+} fMP4FragmentType;
+
+typedef struct
+{
+    fMP4FragmentType type;
+    unsigned int size;
+    unsigned int timescale;                     // Of the track, from the init segment. 0 if unknown.
+
+    // Media fragments only. In the track timescale.
+    unsigned int sequence_number;
+    unsigned long long int base_decode_time;
+    unsigned long long int duration;
+    bool is_key_frame;                          // Starts with a key frame. Always true for the init segment.
+
+    // From the prft of the fragment: when the sample at capture_media_time was captured. 0 if unknown.
+    unsigned long long int capture_time_us;     // Since the Unix epoch
+    unsigned long long int capture_media_time;
+} fMP4FragmentInfo;
+
+// Called once per whole init segment or fragment. The data is only valid during the call.
+typedef void (*fMP4FragmentCallback)(void *context, const unsigned char *data, const fMP4FragmentInfo *info);
+
+/*
+ * The health of an H264 stream: GOP length, frame interval jitter, bitrate, slices, key frame sizes
+ * and parameter set changes. Fed with the samples of a file, or by a writer with the samples it gets.
+ * Only the start codes are scanned, so it costs little next to the muxing.
+ */
+typedef void* fMP4StreamAnalyzer;
+
+typedef struct
+{
+    unsigned long long int frames;
+    unsigned long long int key_frames;
+    unsigned long long int bytes;
+    double duration_s;                          // From the first to the last dts
+
+    double gop_frames_mean;                     // Frames from a key frame to the next one, whole GOPs only
+    double gop_frames_stddev;
+    unsigned int gop_frames_min;
+    unsigned int gop_frames_max;
+
+    double frame_interval_ms_mean;              // Between the dts of two frames
+    double frame_interval_jitter_ms;            // Standard deviation of the frame interval
+    double frame_interval_ms_max;
+
+    double bitrate_kbps_mean;                   // Over each whole second of stream time
+    double bitrate_kbps_min;
+    double bitrate_kbps_max;
+    double bitrate_kbps_last;                   // Of the last whole second
+
+    double slices_per_frame_mean;
+    unsigned int slices_per_frame_max;
+
+    unsigned long long int key_frame_bytes_mean;
+    unsigned long long int key_frame_bytes_min;
+    unsigned long long int key_frame_bytes_max;
+
+    unsigned int profile_idc;                   // Of the last SPS, 0 before one
+    unsigned int level_idc;
+    unsigned int parameter_set_changes;         // SPS or PPS different from the previous one
+} fMP4StreamHealth;
+
+// dts of the samples in 1/timescale seconds.
+fMP4StreamAnalyzer fMP4_CreateStreamAnalyzer(unsigned int timescale);
+
+void fMP4_ReleaseStreamAnalyzer(fMP4StreamAnalyzer);
+
+// AnnexB samples in decode order. Must be called from a single thread.
+void fMP4_AnalyzeH264Sample(fMP4StreamAnalyzer,
+                            const unsigned char *sample,
+                            unsigned int sample_size,
+                            bool is_key_frame,
+                            long long int dts);
+
+// Could be called from any thread.
+void fMP4_GetStreamHealth(fMP4StreamAnalyzer, fMP4StreamHealth *health);
+
+// Called on the muxing thread of an asynchronous writer, once a sample is muxed. sample_number counts
+// the samples accepted by the writer from 0, and result is what the synchronous write would have returned.
+typedef void (*fMP4CompletionCallback)(void *context, unsigned long long int sample_number, bool result);
+
+typedef struct
+{
+    DataCallback callback;                          // Either callback,
+    DataCallbackWithContext callback_with_context;  // or callback_with_context with its context.
+    void *context;
+
+    // Timestamps and durations given to the writer are in 1/timescale seconds. Ex: 90000 for RTP clocks.
+    unsigned int timescale;
+
+    // The output buffer is drawn from buffer_pool if given, and allocated by the writer otherwise.
+    fMP4BufferPool buffer_pool;
+
+    // The output is given to the callback in chunks of up to this size. 0 for the default:
+    // sized from the first key frame with a pool (a fragment starts with it), 1 MB without.
+    unsigned int output_buffer_size;
+
+    // Max bytes the writer draws from the pool, 0 for no limit. A smaller buffer is used to fit in.
+    unsigned int memory_budget;
+
+    // A second fMP4 output with only the key frames, each lasting up to the next one, for scrubbing
+    // and fast-forward. Either callback, or none for no trick-play output. A key frame is given
+    // to it when the next one is written (its duration is known then), the last one on release.
+    DataCallback trick_play_callback;
+    DataCallbackWithContext trick_play_callback_with_context;
+    void *trick_play_context;
+
+    // Thumbnails through thumbnailer if given, to thumbnail_callback: the first key frame after every
+    // thumbnail_interval_ms of stream time (0 for on demand only, see fMP4_RequestThumbnail).
+    fMP4Thumbnailer thumbnailer;
+    unsigned int thumbnail_interval_ms;
+    fMP4ThumbnailCallback thumbnail_callback;
+    void *thumbnail_context;
+
+    // The output cut at the init segment and at the fragments, with what their boxes tell.
+    // In addition to callback, or instead of it.
+    fMP4FragmentCallback fragment_callback;
+    void *fragment_context;
+
+    // With a queue size, the writes only queue a copy of the sample (up to that many samples) and return:
+    // the muxing and all the callbacks run on a thread of the writer. When the queue is full, the samples are
+    // dropped up to the next key frame, and the write returns false. 0 to mux on the writing thread.
+    unsigned int async_queue_size;
+    fMP4CompletionCallback completion_callback;
+    void *completion_context;
+
+    // Every sample also goes to the analyzer if given, in the writer timescale. It must outlive the writer.
+    fMP4StreamAnalyzer analyzer;
+
+    // Fragments of about fragment_target_bytes (moof + mdat), Ex: to fit a WebSocket message or an HTTP chunk.
+    // A key frame still starts a fragment, and in between one is cut before the sample which would go over
+    // the target, once it lasts fragment_min_duration_ms, and anyway at fragment_max_duration_ms (0 for no limit).
+    // 0 for a fragment every 200 ms whatever its size. The stats give the sizes achieved.
+    unsigned int fragment_target_bytes;
+    unsigned int fragment_min_duration_ms;
+    unsigned int fragment_max_duration_ms;
+
+    // What goes into the samples besides the slices: 1 << type for each NAL unit type kept, Ex: 1 << 6 for the SEI
+    // (captions, timecodes), 1 << 9 for the AUD. 0 by default, the SPS and the PPS being in the init segment.
+    // Of the SEI kept, the messages of drop_sei_payload_types are removed: 1 << payloadType for the types below 64,
+    // Ex: 1 << 5 for user_data_unregistered (vendor data), 1 << 3 for filler payload. The stats give the bytes saved.
+    unsigned int keep_nal_types;
+    unsigned long long int drop_sei_payload_types;
+} fMP4WriterConfig;
+
+// Fill the config with the defaults: no callback, timescale 1000 (ms), no pool, no trick-play output, no thumbnails,
+// no fragment callback, synchronous, no analyzer, fragments of 200 ms, only the slices in the samples.
+void fMP4_InitWriterConfig(fMP4WriterConfig *config);
+
+fMP4Writer fMP4_CreateWriterWithConfig(const fMP4WriterConfig *config);
+
 void fMP4_ReleaseWriter(fMP4Writer);
 
+typedef struct
+{
+    long long int time_to_first_byte_us;    // From the creation of the writer to its first output, -1 before that
+    long long int setup_time_us;            // Spent to set up the muxer, and to parse the SPS if not done by a template
+    unsigned long long int output_bytes;
+    unsigned long long int trick_play_bytes;    // Output of the trick-play track, 0 without one
+    unsigned long long int queued_samples;      // Asynchronous writer only: waiting to be muxed
+    unsigned long long int dropped_samples;     // Asynchronous writer only: dropped on a full queue
+    unsigned long long int fragments;           // Media fragments output, and their sizes (moof + mdat)
+    unsigned long long int fragment_bytes_min;
+    unsigned long long int fragment_bytes_max;
+    double fragment_bytes_mean;
+    double fragment_bytes_stddev;
+    unsigned long long int filtered_nal_bytes[32];  // Left out of the samples, per NAL unit type (Ex: [12] for filler data)
+    unsigned long long int filtered_sei_bytes;      // SEI messages removed by drop_sei_payload_types
+} fMP4WriterStats;
+
+void fMP4_GetWriterStats(fMP4Writer, fMP4WriterStats *stats);
+
+// Wait up to timeout_ms (-1 for no limit) until the samples written so far are muxed and given to the callbacks.
+// Return false on timeout. Returns at once for a synchronous writer. Could be called from any thread.
+bool fMP4_FlushWriter(fMP4Writer, int timeout_ms);
+
+// Take a thumbnail of the next key frame. The writer needs a thumbnailer. Could be called from any thread.
+void fMP4_RequestThumbnail(fMP4Writer);
+
+/*
+ * A writer template is built once per codec configuration (SPS and PPS), then writers are created
+ * from it with their muxer already set up: they write their init segment at once, and the samples right away.
+ * That keeps the startup of many streams at once (Ex: cameras reconnecting after a restart) cheap.
+ */
+typedef void* fMP4WriterTemplate;
+
+// From AnnexB data holding the SPS and the PPS (Ex: a key frame). Return NULL if they are missing.
+fMP4WriterTemplate fMP4_CreateWriterTemplate(const unsigned char *parameter_sets, unsigned int size);
+
+void fMP4_ReleaseWriterTemplate(fMP4WriterTemplate);
+
+// The stream must use the SPS and the PPS of the template. Return NULL on failure.
+fMP4Writer fMP4_CreateWriterFromTemplate(fMP4WriterTemplate, const fMP4WriterConfig *config);
+
+// The output starts at the first key frame, or at the first recovery point SEI for a stream without IDR
+// (intra refresh): a recovery point is taken as a key frame until the stream has key frames of its own.
+// The samples are in presentation order without B-frames: pts = dts = sum of the previous durations.
 bool fMP4_WriteH264Sample(fMP4Writer,
                           unsigned char *sample,
                           unsigned int sample_size,
                           bool is_key_frame,
                           unsigned long long int duration);
 
+// Samples in decode order with explicit timestamps (in the writer timescale), as needed for B-frames.
+// dts must increase, and pts must not be before dts. The composition offsets go into trun.
+bool fMP4_WriteH264SampleWithTimestamps(fMP4Writer,
+                                        unsigned char *sample,
+                                        unsigned int sample_size,
+                                        bool is_key_frame,
+                                        long long int pts,
+                                        long long int dts,
+                                        unsigned long long int duration);
+
+// As fMP4_WriteH264SampleWithTimestamps, with the wall-clock time the sample was captured, in us since
+// the Unix epoch (0 if unknown). The one of the first sample of each fragment goes in a prft box before it,
+// for the players to measure the glass-to-glass latency.
+bool fMP4_WriteH264SampleWithCaptureTime(fMP4Writer,
+                                         unsigned char *sample,
+                                         unsigned int sample_size,
+                                         bool is_key_frame,
+                                         long long int pts,
+                                         long long int dts,
+                                         unsigned long long int duration,
+                                         unsigned long long int capture_time_us);
+
+/*
+ * Several H264 renditions of one source in one output (Ex: simulcast): a single init segment with a track per
+ * rendition, on a shared timeline. The track ID of track N is N + 1, for the player to switch renditions.
+ * Nothing is written until every track has had a key frame (or a recovery point) with its SPS and PPS.
+ */
+typedef void* fMP4MultiTrackWriter;
+
+typedef struct
+{
+    DataCallback callback;
+    DataCallbackWithContext callback_with_context;  // Takes over callback if set
+    void *context;
+    unsigned int timescale;                         // Of the timestamps of all the tracks
+    unsigned int track_count;
+    bool separate_fragments;                        // A moof per track, instead of one moof with a traf per track
+} fMP4MultiTrackWriterConfig;
+
+// 2 tracks, timestamps in ms, combined fragments.
+void fMP4_InitMultiTrackWriterConfig(fMP4MultiTrackWriterConfig *config);
+
+fMP4MultiTrackWriter fMP4_CreateMultiTrackWriter(const fMP4MultiTrackWriterConfig *config);
+
+void fMP4_ReleaseMultiTrackWriter(fMP4MultiTrackWriter);
+
+// Samples of a track in decode order, as fMP4_WriteH264SampleWithTimestamps. track is from 0 to track_count - 1.
+bool fMP4_WriteTrackH264Sample(fMP4MultiTrackWriter,
+                               unsigned int track,
+                               unsigned char *sample,
+                               unsigned int sample_size,
+                               bool is_key_frame,
+                               long long int pts,
+                               long long int dts,
+                               unsigned long long int duration);
+
+void fMP4_GetMultiTrackWriterStats(fMP4MultiTrackWriter, fMP4WriterStats *stats);
+
+/*
+ * A bounded lock-free queue of whole fragments between the writer (the single producer)
+ * and one consumer, so that a slow consumer never stalls the writer unless asked to.
+ */
+typedef void* fMP4FragmentRing;
+typedef void* fMP4Fragment;
+
+typedef enum
+{
+    fMP4_RING_DROP_OLDEST = 0,          // Drop the oldest queued fragment to make room
+    fMP4_RING_DROP_TO_NEXT_KEY_FRAME,   // Drop the queued fragments up to the last key frame, or until the next one
+    fMP4_RING_BLOCK                     // Wait for the consumer
+} fMP4RingOverflowPolicy;
+
+typedef struct
+{
+    unsigned long long int pushed_fragments;
+    unsigned long long int popped_fragments;
+    unsigned long long int dropped_fragments;
+    unsigned long long int dropped_bytes;
+    unsigned long long int blocked_pushes;
+    unsigned int occupancy;             // Queued fragments
+    unsigned int max_occupancy;         // High-water mark of the queued fragments
+    unsigned int capacity;
+    unsigned long long int queued_bytes;
+} fMP4RingStats;
+
+fMP4FragmentRing fMP4_CreateFragmentRing(unsigned int capacity, fMP4RingOverflowPolicy policy);
+
+void fMP4_ReleaseFragmentRing(fMP4FragmentRing);
+
+// A DataCallbackWithContext taking the ring as context. Ex: fMP4_CreateWriterWithContext(fMP4_WriteFragmentRing, ring)
+int fMP4_WriteFragmentRing(void *ring, unsigned char *buf, int buf_size);
+
+// Wake up the consumer and the blocked producer. The queued fragments could still be popped.
+void fMP4_CloseFragmentRing(fMP4FragmentRing);
+
+// Wait up to timeout_ms (-1 for no limit). Return NULL on timeout, or when the ring is closed and empty.
+fMP4Fragment fMP4_PopFragment(fMP4FragmentRing, int timeout_ms);
+
+const unsigned char *fMP4_GetFragmentData(fMP4Fragment, int *size, bool *is_key_frame);
+
+void fMP4_ReleaseFragment(fMP4Fragment);
+
+void fMP4_GetFragmentRingStats(fMP4FragmentRing, fMP4RingStats *stats);
+
+/*
+ * Record the writer output into files without blocking the writer on the disk: the fragments are written
+ * asynchronously (io_uring if available, a thread pool otherwise), shared by all the sinks of the process.
+ */
+typedef void* fMP4FileSink;
+
+typedef struct
+{
+    const char *path_prefix;                    // The files are <path_prefix>-000000.mp4, -000001.mp4...
+    unsigned int max_file_duration_ms;          // Rotate at the first key frame after, 0 for no limit
+    unsigned long long int max_file_size;       // Rotate at the first key frame after, 0 for no limit
+    unsigned int sync_interval_ms;              // fdatasync at most once per interval, 0 only when a file is closed
+    bool direct_io;                             // O_DIRECT, through aligned buffers
+    unsigned long long int max_pending_bytes;   // Beyond that, drop the fragments until the next key frame. 0 for no limit
+} fMP4FileSinkConfig;
+
+typedef struct
+{
+    unsigned long long int written_bytes;       // Completed writes
+    unsigned long long int pending_bytes;       // Submitted writes not completed yet
+    unsigned long long int recorded_fragments;
+    unsigned long long int dropped_fragments;
+    unsigned long long int files;
+    unsigned long long int syncs;
+    unsigned long long int errors;
+} fMP4FileSinkStats;
+
+// Fill the config with the defaults: one file, sync every second, no O_DIRECT, up to 64 MB pending.
+void fMP4_InitFileSinkConfig(fMP4FileSinkConfig *config);
+
+fMP4FileSink fMP4_CreateFileSink(const fMP4FileSinkConfig *config);
+
+// Close the current file, and wait until all the files are synced and closed.
+void fMP4_ReleaseFileSink(fMP4FileSink);
+
+// A DataCallbackWithContext taking the sink as context. Ex: fMP4_CreateWriterWithContext(fMP4_WriteFileSink, sink)
+int fMP4_WriteFileSink(void *sink, unsigned char *buf, int buf_size);
+
+void fMP4_GetFileSinkStats(fMP4FileSink, fMP4FileSinkStats *stats);
+
+/*
+ * Samples from a capture process on the same host through shared memory, instead of a socket:
+ * the producer writes them into a ring mapped by both processes, the muxer gives them to its writer from there.
+ * The muxer creates the channel, the capture process opens it by its path.
+ */
+typedef void* fMP4ShmChannel;
+
+typedef struct
+{
+    unsigned long long int written_samples;
+    unsigned long long int written_bytes;
+    unsigned long long int dropped_samples;     // Not written: the ring stayed full, or the muxer is gone
+    unsigned long long int read_samples;
+    unsigned long long int producer_waits;      // Samples the producer had to wait room for
+    unsigned long long int consumer_waits;      // Reads which had to wait for a sample
+    unsigned long long int queued_bytes;
+    unsigned long long int capacity;
+} fMP4ShmChannelStats;
+
+// Muxer side. capacity in bytes, rounded up to pages. The timestamps of the samples are in timescale.
+fMP4ShmChannel fMP4_CreateShmChannel(unsigned int capacity, unsigned int timescale);
+
+// Capture side, with the path of the channel (/proc/<pid>/fd/<fd> of the muxer).
+fMP4ShmChannel fMP4_OpenShmChannel(const char *path);
+
+// Close our side of the channel. The muxer still reads the queued samples once the producer is gone.
+void fMP4_ReleaseShmChannel(fMP4ShmChannel);
+
+// The path to give to the capture process. Return false if it does not fit in size bytes.
+bool fMP4_GetShmChannelPath(fMP4ShmChannel, char *path, unsigned int size);
+
+unsigned int fMP4_GetShmChannelTimescale(fMP4ShmChannel);
+
+// Capture side: copy the sample into the ring, waiting up to timeout_ms (-1 for no limit) for room.
+// Return false if the sample is dropped.
+bool fMP4_WriteShmSample(fMP4ShmChannel,
+                         const unsigned char *sample,
+                         unsigned int sample_size,
+                         bool is_key_frame,
+                         long long int pts,
+                         long long int dts,
+                         unsigned long long int duration,
+                         int timeout_ms);
+
+// Capture side, without the copy: the room to build the sample of sample_size bytes in, or NULL if it is dropped.
+// The sample is sent by fMP4_CommitShmSample.
+unsigned char *fMP4_ReserveShmSample(fMP4ShmChannel, unsigned int sample_size, int timeout_ms);
+
+void fMP4_CommitShmSample(fMP4ShmChannel,
+                          bool is_key_frame,
+                          long long int pts,
+                          long long int dts,
+                          unsigned long long int duration);
+
+// Muxer side: write the queued samples with the writer, waiting up to timeout_ms (-1 for no limit) for the first one.
+// Return the number of samples, or -1 once the capture process is gone and all the samples are read.
+int fMP4_ReadShmSamples(fMP4ShmChannel, fMP4Writer writer, int timeout_ms);
+
+void fMP4_GetShmChannelStats(fMP4ShmChannel, fMP4ShmChannelStats *stats);
+
+/*
+ * Clips of a recorded fMP4 file, cut at the fragments: only the moof boxes are read and rewritten,
+ * the samples are copied as they are.
+ */
+typedef struct
+{
+    unsigned long long int start_ms;            // Of the clip in the recording: the key frame at or before the start asked
+    unsigned long long int duration_ms;
+    unsigned long long int fragments;
+    unsigned long long int bytes;
+} fMP4ClipInfo;
+
+// [start_ms, end_ms) from the start of the recording. info could be NULL.
+bool fMP4_ExtractClip(const char *input_path,
+                      const char *output_path,
+                      unsigned long long int start_ms,
+                      unsigned long long int end_ms,
+                      fMP4ClipInfo *info);
+
 #ifdef __cplusplus
 }
 #endif
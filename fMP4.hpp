@@ -8,15 +8,44 @@ public:
 
     static MP4Writer *Create(DataCallback cb);
 
+    static MP4Writer *Create(DataCallbackWithContext cb, void *context);
+
+    static MP4Writer *Create(const fMP4WriterConfig &config);
+
     static void Release(MP4Writer *writer);
 
-    MP4Writer(DataCallback cb) {};
+    MP4Writer() {};
+
+    virtual bool WriteH264VideoSample(unsigned char *sample,
+                                      unsigned int sample_size,
+                                      bool is_key_frame,
+                                      unsigned long long int duration) = 0;
 
     virtual bool WriteH264VideoSample(unsigned char *sample,
                                       unsigned int sample_size,
                                       bool is_key_frame,
+                                      long long int pts,
+                                      long long int dts,
                                       unsigned long long int duration) = 0;
 
+    // capture_time_us: when the sample was captured, in us since the Unix epoch (0 if unknown).
+    // Written in a prft box before the fragment the sample starts, for the glass-to-glass latency.
+    virtual bool WriteH264VideoSample(unsigned char *sample,
+                                      unsigned int sample_size,
+                                      bool is_key_frame,
+                                      long long int pts,
+                                      long long int dts,
+                                      unsigned long long int duration,
+                                      unsigned long long int capture_time_us) = 0;
+
+    virtual void GetStats(fMP4WriterStats &stats) const = 0;
+
+    virtual void RequestThumbnail() = 0;
+
+    // Wait up to timeout_ms (-1 for no limit) for the samples written so far to be muxed.
+    // Return false on timeout. Nothing to wait for unless the writer is asynchronous.
+    virtual bool Flush(int timeout_ms) { return true; }
+
 protected:
 
     virtual ~MP4Writer() {};
@@ -1,9 +1,14 @@
 #include "gomp4_callback.hpp"
-#include "_cgo_export.h"
 
-fMP4Writer CNewMP4()
+fMP4Writer CNewMP4WithRing(fMP4FragmentRing ring, unsigned int async_queue_size, unsigned int fragment_target_bytes)
 {
-	fMP4Writer handle = fMP4_CreateWriter(GoMP4Callback);
+	fMP4WriterConfig config;
+	fMP4_InitWriterConfig(&config);
+	config.callback_with_context = fMP4_WriteFragmentRing;
+	config.context = ring;
+	config.async_queue_size = async_queue_size;
+	config.fragment_target_bytes = fragment_target_bytes;
+	fMP4Writer handle = fMP4_CreateWriterWithConfig(&config);
 
 	return handle;
 }
@@ -6,8 +6,8 @@
 extern "C" {
 #endif
 
-fMP4Writer CNewMP4();
-int GoMP4Callback(unsigned char *buf, int len);
+// Muxing on a thread of the writer if async_queue_size > 0.
+fMP4Writer CNewMP4WithRing(fMP4FragmentRing ring, unsigned int async_queue_size, unsigned int fragment_target_bytes);
 
 #ifdef __cplusplus
 }
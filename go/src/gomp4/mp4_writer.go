@@ -18,9 +18,24 @@ type MP4 struct {
 	handle C.fMP4Writer
 }
 
-func NewMP4() MP4 {
+type FragmentRing struct {
+	handle C.fMP4FragmentRing
+}
+
+type RingOverflowPolicy C.fMP4RingOverflowPolicy
+
+const (
+	RingDropOldest         = RingOverflowPolicy(C.fMP4_RING_DROP_OLDEST)
+	RingDropToNextKeyFrame = RingOverflowPolicy(C.fMP4_RING_DROP_TO_NEXT_KEY_FRAME)
+	RingBlock              = RingOverflowPolicy(C.fMP4_RING_BLOCK)
+)
+
+// The writer pushes its fragments into the ring, instead of calling back into Go.
+// With async_queue_size > 0, the writes only queue the samples, and the muxing runs on a thread of the writer.
+// With fragment_target_bytes > 0, the fragments are cut at about that size instead of every 200 ms.
+func NewMP4WithRing(r FragmentRing, async_queue_size uint, fragment_target_bytes uint) MP4 {
 	var m MP4
-	handle := C.CNewMP4()
+	handle := C.CNewMP4WithRing(r.handle, C.uint(async_queue_size), C.uint(fragment_target_bytes))
 	m.handle = handle
 
 	return m
@@ -40,6 +55,56 @@ func (m MP4) WriteH264Sample(buf []byte, sample_size uint, is_key_frame bool, du
 	return nil
 }
 
+// Wait up to timeout_ms (-1 for no limit) until the samples written so far are muxed.
+func (m MP4) Flush(timeout_ms int) bool {
+	return bool(C.fMP4_FlushWriter(m.handle, C.int(timeout_ms)))
+}
+
+func (m MP4) Stats() C.fMP4WriterStats {
+	var stats C.fMP4WriterStats
+	C.fMP4_GetWriterStats(m.handle, &stats)
+
+	return stats
+}
+
 func (m MP4) Release() {
 	C.fMP4_ReleaseWriter(m.handle)
 }
+
+func NewFragmentRing(capacity uint, policy RingOverflowPolicy) FragmentRing {
+	var r FragmentRing
+	r.handle = C.fMP4_CreateFragmentRing(C.uint(capacity), C.fMP4RingOverflowPolicy(policy))
+
+	return r
+}
+
+// Wait up to timeout_ms (-1 for no limit) for the next fragment.
+// ok is false on timeout, or when the ring is closed and empty.
+func (r FragmentRing) Pop(timeout_ms int) (buf []byte, is_key_frame bool, ok bool) {
+	fragment := C.fMP4_PopFragment(r.handle, C.int(timeout_ms))
+	if fragment == nil {
+		return nil, false, false
+	}
+	defer C.fMP4_ReleaseFragment(fragment)
+
+	var size C.int
+	var key C._Bool
+	data := C.fMP4_GetFragmentData(fragment, &size, &key)
+
+	return C.GoBytes(unsafe.Pointer(data), size), bool(key), true
+}
+
+func (r FragmentRing) Stats() C.fMP4RingStats {
+	var stats C.fMP4RingStats
+	C.fMP4_GetFragmentRingStats(r.handle, &stats)
+
+	return stats
+}
+
+func (r FragmentRing) Close() {
+	C.fMP4_CloseFragmentRing(r.handle)
+}
+
+func (r FragmentRing) Release() {
+	C.fMP4_ReleaseFragmentRing(r.handle)
+}
@@ -11,32 +11,27 @@ import (
 	"golang.org/x/net/websocket"
 	"net/http"
 	"os"
-	"unsafe"
 )
 
 var camera_ch = make(chan *websocket.Conn)
 var client_ch = make(chan *websocket.Conn)
 var err_ch = make(chan error, 1)
-var frame_ch chan []byte
 
-//export GoMP4Callback
-func GoMP4Callback(buf *C.uchar, size C.int) C.int {
-	gobuf := C.GoBytes(unsafe.Pointer(buf), size)
-	fmt.Printf("Got buffer %d\n", len(gobuf))
+var ring_capacity uint
+var ring_policy RingOverflowPolicy
+var async_queue_size uint
+var fragment_target_bytes uint
 
-	frame_ch <- gobuf
+// The muxer only pushes into the ring, so a slow client never stalls the camera (unless -overflow block).
+func write_frame(writer *websocket.Conn, ring FragmentRing, done chan bool) {
+	defer close(done)
 
-	return size
-}
-
-func write_frame(writer *websocket.Conn) {
 	for {
-		s := <-frame_ch
-		fmt.Printf("Write buf: %d\n", len(s))
-
-		if len(s) == 0 {
+		s, _, ok := ring.Pop(-1)
+		if !ok {
 			return
 		}
+		fmt.Printf("Write buf: %d\n", len(s))
 
 		// Note: We must use websocket.Message to send binary frames
 		// The websocket.Conn.Write can't achieve that
@@ -92,18 +87,37 @@ func read_buffer(reader *websocket.Conn) (bool, int, []byte, error) {
 }
 
 func process(writer *websocket.Conn, reader *websocket.Conn) error {
-	var mp4writer = NewMP4()
-	defer mp4writer.Release()
+	var ring = NewFragmentRing(ring_capacity, ring_policy)
+	var mp4writer = NewMP4WithRing(ring, async_queue_size, fragment_target_bytes)
+	done := make(chan bool)
+
+	defer func() {
+		writer_stats := mp4writer.Stats()
+		if writer_stats.dropped_samples > 0 {
+			fmt.Printf("writer: dropped %d samples on a full queue\n", writer_stats.dropped_samples)
+		}
+		fmt.Printf("writer: %d fragments, %d to %d bytes, mean %.0f, stddev %.0f\n",
+			writer_stats.fragments, writer_stats.fragment_bytes_min, writer_stats.fragment_bytes_max,
+			writer_stats.fragment_bytes_mean, writer_stats.fragment_bytes_stddev)
+
+		// The queued samples and the trailer still go through the ring, then let the writer drain it.
+		mp4writer.Release()
+		ring.Close()
+		<-done
 
-	frame_ch = make(chan []byte, 1)
+		stats := ring.Stats()
+		fmt.Printf("ring: pushed %d, dropped %d (%d bytes), max occupancy %d/%d\n",
+			stats.pushed_fragments, stats.dropped_fragments, stats.dropped_bytes,
+			stats.max_occupancy, stats.capacity)
+		ring.Release()
+	}()
 
-	go write_frame(writer)
+	go write_frame(writer, ring, done)
 
 	var last_duration int
 	for {
 		is_key_frame, duration, buf, err := read_buffer(reader)
 		if err != nil {
-			frame_ch <- make([]byte, 0)
 			return err
 		}
 
@@ -192,13 +206,30 @@ func main() {
 	var is_ssl bool
 	var cert_path, key_path string
 	var port int
+	var overflow string
 
 	flag.BoolVar(&is_ssl, "ssl", false, "Enable SSL")
 	flag.StringVar(&cert_path, "cert", "", "Certificate path")
 	flag.StringVar(&key_path, "key", "", "Key path")
 	flag.IntVar(&port, "port", 8080, "Port")
+	flag.UintVar(&ring_capacity, "queue", 32, "Fragments queued for the client")
+	flag.StringVar(&overflow, "overflow", "key", "When the queue is full: oldest, key or block")
+	flag.UintVar(&async_queue_size, "async", 64, "Samples queued for the muxing thread, 0 to mux on the camera goroutine")
+	flag.UintVar(&fragment_target_bytes, "fragment-bytes", 0, "Target size of the fragments, 0 for a fragment every 200 ms")
 	flag.Parse()
 
+	switch overflow {
+	case "oldest":
+		ring_policy = RingDropOldest
+	case "key":
+		ring_policy = RingDropToNextKeyFrame
+	case "block":
+		ring_policy = RingBlock
+	default:
+		fmt.Printf("Unknown overflow policy: %s\n", overflow)
+		os.Exit(1)
+	}
+
 	if is_ssl {
 		if cert_path == "" || key_path == "" {
 			fmt.Println("Please specify certificate or key path")
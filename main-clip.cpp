@@ -0,0 +1,37 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+#include "fMP4-clip.hpp"
+
+// Cut [start, end) seconds out of a recording, Ex: main-clip camera-000003.mp4 incident.mp4 120 180.5
+int main(int argc, char **argv)
+{
+    if (argc < 5) {
+        printf("usage: %s input output start_seconds end_seconds\n", argv[0]);
+        return 1;
+    }
+
+    uint64_t start_ms = static_cast<uint64_t>(atof(argv[3]) * 1000);
+    uint64_t end_ms = static_cast<uint64_t>(atof(argv[4]) * 1000);
+
+    auto start = std::chrono::steady_clock::now();
+
+    MP4ClipExtractor extractor;
+    if (!extractor.Open(argv[1]))
+        return 1;
+
+    auto indexed = std::chrono::steady_clock::now();
+
+    fMP4ClipInfo info;
+    if (!extractor.Extract(start_ms, end_ms, argv[2], info))
+        return 1;
+
+    auto done = std::chrono::steady_clock::now();
+    printf("Clip from %.3f s, %.3f s long, %llu fragments, %llu bytes (recording of %.3f s)\n",
+           info.start_ms / 1000.0, info.duration_ms / 1000.0, info.fragments, info.bytes, extractor.GetDurationMs() / 1000.0);
+    printf("Indexed in %lld ms, copied in %lld ms\n",
+           static_cast<long long int>(std::chrono::duration_cast<std::chrono::milliseconds>(indexed - start).count()),
+           static_cast<long long int>(std::chrono::duration_cast<std::chrono::milliseconds>(done - indexed).count()));
+    return 0;
+}
@@ -0,0 +1,221 @@
+#include <chrono>
+#include <string>
+#include <cstdio>
+#include <cstring>
+
+#include <mp4v2/mp4v2.h>
+#include <netinet/in.h>
+
+#include "fMP4.h"
+
+class MP4Reader
+{
+public:
+
+    enum MP4ReadStatus
+    {
+        MP4_READ_OK,
+        MP4_READ_EOS,
+        MP4_READ_ERR
+    };
+
+    MP4Reader(const std::string &file_path)
+            : file_path(file_path)
+            , handle(MP4_INVALID_FILE_HANDLE)
+            , video_track_id(MP4_INVALID_TRACK_ID)
+            , next_video_sample_idx(1)
+            , video_sample(nullptr)
+            , video_timescale(0)
+            , video_sample_max_size(0)
+            , video_sample_number(0)
+            , video_duration(0)
+            , pSeqHeaders(nullptr)
+            , pSeqHeaderSize(nullptr)
+            , pPictHeaders(nullptr)
+            , pPictHeaderSize(nullptr)
+    {
+        handle = MP4Read(this->file_path.c_str());
+
+        video_track_id = MP4FindTrackId(handle, 0, MP4_VIDEO_TRACK_TYPE);
+        if (video_track_id != MP4_INVALID_TRACK_ID) {
+            video_timescale = MP4GetTrackTimeScale(handle, video_track_id);
+            video_sample_max_size = MP4GetTrackMaxSampleSize(handle, video_track_id) * 2;
+            video_duration = MP4GetTrackDuration(handle, video_track_id);
+            video_sample = new unsigned char[video_sample_max_size];
+            video_sample_number = MP4GetTrackNumberOfSamples(handle, video_track_id);
+
+            MP4GetTrackH264SeqPictHeaders(handle,
+                                          video_track_id,
+                                          &pSeqHeaders,
+                                          &pSeqHeaderSize,
+                                          &pPictHeaders,
+                                          &pPictHeaderSize);
+        }
+    }
+
+    ~MP4Reader()
+    {
+        if (pSeqHeaders || pSeqHeaderSize || pPictHeaders || pPictHeaderSize) {
+            MP4FreeH264SeqPictHeaders(pSeqHeaders, pSeqHeaderSize, pPictHeaders, pPictHeaderSize);
+        }
+
+        if (handle != MP4_INVALID_FILE_HANDLE) MP4Close(handle);
+        if (video_sample) delete[] video_sample;
+    }
+
+    unsigned int GetVideoTimeScale() const
+    {
+        return video_timescale;
+    }
+
+    bool HasVideoTrack() const
+    {
+        return video_track_id != MP4_INVALID_TRACK_ID;
+    }
+
+    MP4ReadStatus GetNextH264VideoSample(unsigned char **sample,
+                                         unsigned int &sample_size,
+                                         long long int &pts,
+                                         long long int &dts,
+                                         unsigned long long int &duration,
+                                         bool &is_key_frame)
+    {
+        if (next_video_sample_idx > video_sample_number) {
+            return MP4_READ_EOS;
+        }
+
+        unsigned int video_sample_offset = 0;
+        if(MP4GetSampleSync(handle, video_track_id, next_video_sample_idx)) {
+            /*
+             * If current sample has key frame, we need to put SPS/PPS in front of key frame.
+             */
+            if (pSeqHeaders && pSeqHeaderSize) {
+                for(int i = 0; (pSeqHeaders[i] && pSeqHeaderSize[i]); i++) {
+                    (*(unsigned int *)(video_sample + video_sample_offset)) = htonl(1);
+                    video_sample_offset += 4;
+                    memcpy(video_sample + video_sample_offset, pSeqHeaders[i], pSeqHeaderSize[i]);
+                    video_sample_offset += pSeqHeaderSize[i];
+                }
+            }
+            if (pPictHeaders && pPictHeaderSize) {
+                for(int i = 0; (pPictHeaders[i] && pPictHeaderSize[i]); i++) {
+                    (*(unsigned int *)(video_sample + video_sample_offset)) = htonl(1);
+                    video_sample_offset += 4;
+                    memcpy(video_sample + video_sample_offset, pPictHeaders[i], pPictHeaderSize[i]);
+                    video_sample_offset += pPictHeaderSize[i];
+                }
+            }
+        }
+
+        MP4Timestamp mp4_start_time = 0;
+        MP4Duration mp4_duration = 0;
+        MP4Duration mp4_rendering_offset = 0;
+        unsigned char *video_sample_start_addr = video_sample + video_sample_offset;
+        sample_size = video_sample_max_size - video_sample_offset;
+        if (!MP4ReadSample(handle, video_track_id, next_video_sample_idx,
+                           &video_sample_start_addr, &sample_size,
+                           &mp4_start_time,
+                           &mp4_duration,
+                           &mp4_rendering_offset,
+                           &is_key_frame)) {
+            printf("Fail to read video sample (%d)\n", next_video_sample_idx);
+            return MP4_READ_ERR;
+        }
+
+        // Convert AVC1 format to AnnexB, every NAL unit: the slices are counted.
+        unsigned int offset = 0;
+        while (offset + 4 <= sample_size) {
+            unsigned int *p = (unsigned int *) (video_sample_start_addr + offset);
+            unsigned int nalu_size = ntohl(*p);
+            *p = htonl(1);
+            offset += 4 + nalu_size;
+        }
+
+        *sample = video_sample;
+        sample_size += video_sample_offset;
+        dts = static_cast<long long int>(mp4_start_time);
+        pts = dts + static_cast<long long int>(mp4_rendering_offset);
+        duration = mp4_duration;
+        next_video_sample_idx++;
+        return MP4_READ_OK;
+    }
+
+private:
+
+    std::string file_path;
+    MP4FileHandle handle;
+    MP4TrackId video_track_id;
+    unsigned int next_video_sample_idx;
+    unsigned char *video_sample;
+
+    unsigned int video_timescale;
+    unsigned int video_sample_max_size;
+    unsigned int video_sample_number;
+    unsigned long long int video_duration;
+    unsigned char **pSeqHeaders;
+    unsigned int *pSeqHeaderSize;
+    unsigned char **pPictHeaders;
+    unsigned int *pPictHeaderSize;
+};
+
+static void PrintHealth(const char *path, const fMP4StreamHealth &health, double elapsed_s)
+{
+    printf("%s\n", path);
+    printf("  frames: %llu, key frames: %llu, %llu bytes, %.3f s\n",
+           health.frames, health.key_frames, health.bytes, health.duration_s);
+    printf("  GOP: mean %.2f frames, stddev %.2f, min %u, max %u\n",
+           health.gop_frames_mean, health.gop_frames_stddev, health.gop_frames_min, health.gop_frames_max);
+    printf("  frame interval: mean %.3f ms, jitter %.3f ms, max %.3f ms\n",
+           health.frame_interval_ms_mean, health.frame_interval_jitter_ms, health.frame_interval_ms_max);
+    printf("  bitrate: mean %.1f kbit/s, min %.1f, max %.1f, last %.1f\n",
+           health.bitrate_kbps_mean, health.bitrate_kbps_min, health.bitrate_kbps_max, health.bitrate_kbps_last);
+    printf("  slices per frame: mean %.2f, max %u\n", health.slices_per_frame_mean, health.slices_per_frame_max);
+    printf("  key frames: mean %llu bytes, min %llu, max %llu\n",
+           health.key_frame_bytes_mean, health.key_frame_bytes_min, health.key_frame_bytes_max);
+    printf("  profile_idc: %u, level_idc: %u, parameter set changes: %u\n",
+           health.profile_idc, health.level_idc, health.parameter_set_changes);
+    if (elapsed_s > 0)
+        printf("  analyzed in %.3f s, %.0fx real time\n", elapsed_s, health.duration_s / elapsed_s);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        printf("usage: %s input [input...]\n", argv[0]);
+        return 1;
+    }
+
+    int result = 0;
+    for (int i = 1; i < argc; i++) {
+        MP4Reader input(argv[i]);
+        if (!input.HasVideoTrack()) {
+            printf("%s: no video track\n", argv[i]);
+            result = 1;
+            continue;
+        }
+
+        fMP4StreamAnalyzer analyzer = fMP4_CreateStreamAnalyzer(input.GetVideoTimeScale());
+        auto start = std::chrono::steady_clock::now();
+
+        unsigned char *sample = nullptr;
+        unsigned int sample_size = 0;
+        long long int pts = 0, dts = 0;
+        unsigned long long int duration = 0;
+        bool is_key_frame = false;
+        MP4Reader::MP4ReadStatus status;
+        while ((status = input.GetNextH264VideoSample(&sample, sample_size, pts, dts, duration, is_key_frame)) == MP4Reader::MP4_READ_OK) {
+            fMP4_AnalyzeH264Sample(analyzer, sample, sample_size, is_key_frame, dts);
+        }
+        if (status == MP4Reader::MP4_READ_ERR)
+            result = 1;
+
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        fMP4StreamHealth health;
+        fMP4_GetStreamHealth(analyzer, &health);
+        PrintHealth(argv[i], health, elapsed.count());
+
+        fMP4_ReleaseStreamAnalyzer(analyzer);
+    }
+
+    return result;
+}
@@ -0,0 +1,863 @@
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <ctime>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <getopt.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "ws-server.hpp"
+#include "fMP4.hpp"
+#include "fMP4-buffer-pool.hpp"
+#include "fMP4-file-sink.hpp"
+#include "fMP4-fragment.hpp"
+#include "fMP4-gop-cache.hpp"
+#include "fMP4-latency.hpp"
+#include "fMP4-ring.hpp"
+#include "fMP4-template.hpp"
+#include "fMP4-thinning.hpp"
+#include "fMP4-thumbnail.hpp"
+#include "fMP4-timeshift.hpp"
+
+static std::atomic<bool> running(true);
+static size_t max_viewer_backlog = 4 * 1024 * 1024;
+static unsigned int viewer_queue_size = 32;
+static fMP4RingOverflowPolicy viewer_overflow_policy = fMP4_RING_DROP_TO_NEXT_KEY_FRAME;
+static size_t gop_cache_size = 16 * 1024 * 1024;
+
+// Thin the stream of a viewer whose socket backlog goes over thinning_backlog (0 to disable):
+// the non-reference frames first, then all but the key frames. Back to all the frames once it stays
+// under a quarter of it, at a key frame.
+static size_t thinning_backlog = 256 * 1024;
+static const unsigned int thinning_settle_ms = 1000;
+static const unsigned int thinning_recovery_ms = 5000;
+static std::atomic<unsigned long long int> thinned_samples(0);
+
+// From the capture time of a fragment (the prft written for the cameras sending it) to its send to a live viewer.
+// The two clocks are apart by as much as the camera and the relay are out of sync.
+static MP4LatencyHistogram viewer_latency;
+
+// Cameras sharing a codec configuration share a writer template, so a mass reconnection
+// does not parse and set up the same muxer configuration again for every camera.
+static MP4WriterTemplateCache writer_templates;
+
+// The muxer output buffers of all the streams, each stream drawing at most stream_memory_budget.
+static MP4BufferPool *buffer_pool = nullptr;
+static unsigned int stream_memory_budget = 256 * 1024;
+
+// Record every stream into this directory if not empty, one file per record_minutes.
+static std::string record_directory;
+static unsigned int record_minutes = 10;
+
+// Keep the last dvr_minutes of every stream in memory, so a viewer could start from "now minus T" (?t=seconds).
+static unsigned int dvr_minutes = 0;
+static size_t dvr_memory = 256 * 1024 * 1024;
+static const unsigned int time_shift_lead_ms = 3000;
+
+// Keep a JPEG preview of every stream in this directory if not empty, <id>.jpg, updated every thumbnail_seconds.
+static MP4Thumbnailer *thumbnailer = nullptr;
+static std::string thumbnail_directory;
+static unsigned int thumbnail_seconds = 10;
+
+/*
+ * A live stream: one camera feeding one muxer, and the viewers watching the muxer output.
+ *
+ * The camera thread only queues the fragments into the ring of every viewer, and the worker
+ * of the viewer sends them. A slow viewer loses fragments by the overflow policy of its ring,
+ * but never holds the camera.
+ *
+ * The last GOP is cached, so a new viewer starts from its key frame instead of waiting for the next one.
+ * With a time-shift buffer, a time-shifted viewer reads it at its own pace instead of having a ring.
+ */
+class LiveStream
+{
+public:
+
+    LiveStream(const std::string &id)
+            : id(id)
+            , writer(nullptr)
+            , assembler([this](const MP4FragmentPtr &fragment) { OnFragment(fragment); })
+            , gop_cache(gop_cache_size)
+            , timeshift(dvr_minutes * 60 * 1000, dvr_memory)
+            , last_duration(0)
+            , next_timestamp(0)
+            , dropped_fragments(0)
+    {
+        if (!record_directory.empty()) {
+            std::string record_prefix = GetRecordPrefix(id);
+
+            fMP4FileSinkConfig config;
+            fMP4_InitFileSinkConfig(&config);
+            config.path_prefix = record_prefix.c_str();
+            config.max_file_duration_ms = record_minutes * 60 * 1000;
+            recorder.reset(new MP4FileSink(config));
+        }
+        if (thumbnailer)
+            thumbnail_path = thumbnail_directory + "/" + GetFileName(id) + ".jpg";
+    }
+
+    ~LiveStream()
+    {
+        if (writer)
+            MP4Writer::Release(writer);
+    }
+
+    const std::string &GetId() const { return id; }
+
+    bool AttachCamera(const std::shared_ptr<WebSocketConnection> &connection)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (camera)
+            return false;
+
+        camera = connection;
+        assembler.Reset();
+        gop_cache.Clear();
+        last_duration = 0;
+        next_timestamp = 0;
+        return true;
+    }
+
+    // Called on the worker thread of the camera.
+    void DetachCamera(const std::shared_ptr<WebSocketConnection> &connection)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (camera != connection)
+                return;
+        }
+
+        // The trailer is written through OnMuxedData, so don't hold the lock here.
+        if (writer) {
+            MP4Writer::Release(writer);
+            writer = nullptr;
+        }
+        if (recorder)
+            recorder->Close();
+
+        // The viewers could not continue with a new init segment, so let them reconnect.
+        std::vector<Viewer> closing;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            camera.reset();
+            closing.swap(viewers);
+        }
+        for (auto &viewer : closing) {
+            if (viewer.ring)
+                viewer.ring->Close();
+            viewer.connection->Close();
+        }
+    }
+
+    std::shared_ptr<MP4FragmentRing> AddViewer(const std::shared_ptr<WebSocketConnection> &connection)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        // Late viewers still need the init segment, then the GOP so far, before the live fragments.
+        std::vector<MP4FragmentPtr> start;
+        gop_cache.GetStartFragments(start);
+
+        auto ring = std::make_shared<MP4FragmentRing>(viewer_queue_size + start.size(), viewer_overflow_policy);
+        for (auto &fragment : start)
+            ring->Push(fragment);
+        if (!start.empty())
+            connection->RequestDrain();
+
+        viewers.push_back({connection, ring});
+        return ring;
+    }
+
+    // Start offset_ms behind the live edge. Return false if the time-shift buffer is empty.
+    bool AddTimeShiftViewer(const std::shared_ptr<WebSocketConnection> &connection, unsigned int offset_ms, uint64_t &position)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!timeshift.Seek(offset_ms, position))
+            return false;
+
+        // Still woken up by every new fragment, as the other viewers.
+        viewers.push_back({connection, nullptr});
+        connection->RequestDrain();
+        return true;
+    }
+
+    const MP4TimeShiftBuffer &GetTimeShiftBuffer() const { return timeshift; }
+
+    void RemoveViewer(const std::shared_ptr<WebSocketConnection> &connection)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto it = viewers.begin(); it != viewers.end(); ++it) {
+            if (it->connection == connection) {
+                if (it->ring)
+                    dropped_fragments += it->ring->GetStats().dropped_fragments;
+                viewers.erase(it);
+                break;
+            }
+        }
+    }
+
+    bool IsIdle() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return (!camera && viewers.empty());
+    }
+
+    size_t GetViewerCount() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return viewers.size();
+    }
+
+    // Fragments dropped by the rings of the viewers, including the ones gone.
+    unsigned long long int GetDroppedFragments() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        unsigned long long int dropped = dropped_fragments;
+        for (auto &viewer : viewers) {
+            if (viewer.ring)
+                dropped += viewer.ring->GetStats().dropped_fragments;
+        }
+        return dropped;
+    }
+
+    // Called on the worker thread of the camera.
+    // Message: flags (1 byte) + duration in ms (4 bytes) + size (4 bytes) [+ capture time (8 bytes)] + H264 sample
+    // The flags: CAMERA_KEY_FRAME, and CAMERA_CAPTURE_TIME if the capture time in us since the Unix epoch follows.
+    void OnCameraMessage(unsigned char *data, size_t size)
+    {
+        size_t header_size = (size > 0 && (data[0] & CAMERA_CAPTURE_TIME)) ? 17 : 9;
+        if (size <= header_size) {
+            printf("[%s] The msg is too small: %zu\n", id.c_str(), size);
+            return;
+        }
+
+        bool is_key_frame = (data[0] & CAMERA_KEY_FRAME);
+        unsigned int duration = data[1] | (data[2] << 8) | (data[3] << 16) | (data[4] << 24);
+        unsigned int sample_size = data[5] | (data[6] << 8) | (data[7] << 16) | (data[8] << 24);
+        if (sample_size != size - header_size) {
+            printf("[%s] Size unmatch hdr: %u, msg: %zu\n", id.c_str(), sample_size, size - header_size);
+            return;
+        }
+
+        unsigned long long int capture_time_us = 0;
+        for (size_t i = header_size; i > 9; i--)
+            capture_time_us = capture_time_us << 8 | data[i - 1];
+
+        // Without a duration yet, the timestamps would not move on and the writer would reject all the samples.
+        if (duration == 0) {
+            duration = last_duration ? last_duration : DEFAULT_SAMPLE_DURATION_MS;
+        } else {
+            last_duration = duration;
+        }
+
+        // The writer is created on the first key frame, or the first access unit with an SPS and a PPS, from their template.
+        unsigned char *sample = data + header_size;
+        if (!writer && !OpenWriter(sample, sample_size, is_key_frame))
+            return;
+
+        // Without B-frames, the samples simply follow each other.
+        long long int timestamp = next_timestamp;
+        next_timestamp += duration;
+        if (!writer->WriteH264VideoSample(sample, sample_size, is_key_frame, timestamp, timestamp, duration, capture_time_us)) {
+            printf("[%s] Fail to write sample\n", id.c_str());
+        }
+    }
+
+private:
+
+    static const unsigned char CAMERA_KEY_FRAME = 0x01;
+    static const unsigned char CAMERA_CAPTURE_TIME = 0x02;
+    static const unsigned int DEFAULT_SAMPLE_DURATION_MS = 33;     // 30 fps, until the camera gives one
+
+    struct Viewer
+    {
+        std::shared_ptr<WebSocketConnection> connection;
+        std::shared_ptr<MP4FragmentRing> ring;     // nullptr for a time-shifted viewer
+    };
+
+    // Called on the worker thread of the camera. Return false, quietly, if the access unit cannot start the stream.
+    // Cameras with intra refresh never flag a key frame: from their parameter sets on, the writer starts at
+    // a recovery point.
+    bool OpenWriter(unsigned char *access_unit, unsigned int size, bool is_key_frame)
+    {
+        std::shared_ptr<const MP4WriterTemplate> writer_template = writer_templates.Get(access_unit, size);
+        if (!writer_template && !is_key_frame)
+            return false;
+
+        fMP4WriterConfig config;
+        fMP4_InitWriterConfig(&config);
+        config.callback_with_context = &OnMuxedData;
+        config.context = this;
+        config.buffer_pool = buffer_pool;
+        config.memory_budget = stream_memory_budget;
+        if (thumbnailer) {
+            config.thumbnailer = thumbnailer;
+            config.thumbnail_interval_ms = thumbnail_seconds * 1000;
+            config.thumbnail_callback = &OnThumbnail;
+            config.thumbnail_context = this;
+        }
+
+        writer = writer_template ? writer_template->CreateWriter(config) : MP4Writer::Create(config);
+        if (!writer) {
+            printf("[%s] Fail to create writer\n", id.c_str());
+            return false;
+        }
+
+        fMP4WriterStats stats;
+        writer->GetStats(stats);
+        printf("[%s] Writer ready in %lld us (time to first byte: %lld us)\n",
+               id.c_str(), stats.setup_time_us, stats.time_to_first_byte_us);
+        return true;
+    }
+
+    static std::string GetFileName(const std::string &id)
+    {
+        std::string name = id;
+        for (auto &c : name) {
+            if (!isalnum(static_cast<unsigned char>(c)) && c != '-' && c != '_')
+                c = '_';
+        }
+        return name;
+    }
+
+    static std::string GetRecordPrefix(const std::string &id)
+    {
+        // The files of a stream are <directory>/<id>-<start time>-<index>.mp4
+        std::string name = GetFileName(id);
+
+        char start_time[32];
+        time_t now = time(nullptr);
+        struct tm local_time;
+        strftime(start_time, sizeof(start_time), "%Y%m%d-%H%M%S", localtime_r(&now, &local_time));
+        return record_directory + "/" + name + "-" + start_time;
+    }
+
+    // Called on a thumbnailer thread, never after the writer is released.
+    static void OnThumbnail(void *context, const fMP4Thumbnail *thumbnail)
+    {
+        LiveStream *stream = reinterpret_cast<LiveStream *>(context);
+
+        // Replace the previous one at once, so a reader never gets a partial file.
+        std::string temporary_path = stream->thumbnail_path + ".tmp";
+        FILE *file = fopen(temporary_path.c_str(), "wb");
+        if (!file) {
+            printf("[%s] Fail to open %s\n", stream->id.c_str(), temporary_path.c_str());
+            return;
+        }
+        bool written = (fwrite(thumbnail->data, 1, thumbnail->size, file) == thumbnail->size);
+        if (fclose(file) != 0 || !written || rename(temporary_path.c_str(), stream->thumbnail_path.c_str()) != 0) {
+            printf("[%s] Fail to write %s\n", stream->id.c_str(), stream->thumbnail_path.c_str());
+            unlink(temporary_path.c_str());
+        }
+    }
+
+    static int OnMuxedData(void *context, unsigned char *buf, int buf_size)
+    {
+        LiveStream *stream = reinterpret_cast<LiveStream *>(context);
+        stream->assembler.Append(buf, static_cast<size_t>(buf_size));
+        return buf_size;
+    }
+
+    // Called on the worker thread of the camera.
+    void OnFragment(const MP4FragmentPtr &fragment)
+    {
+        // Never waits for the disk.
+        if (recorder)
+            recorder->Push(fragment);
+
+        // The pushes to a ring are serialized by this lock, so each ring still sees a single producer.
+        std::lock_guard<std::mutex> lock(mutex);
+
+        // Keep the init segment and the current GOP for the viewers joining later.
+        gop_cache.Push(fragment);
+        if (dvr_minutes > 0)
+            timeshift.Push(fragment);
+
+        for (auto &viewer : viewers) {
+            if (viewer.ring)
+                viewer.ring->Push(fragment);
+            viewer.connection->RequestDrain();
+        }
+    }
+
+    const std::string id;
+    mutable std::mutex mutex;
+    std::shared_ptr<WebSocketConnection> camera;
+    std::vector<Viewer> viewers;
+    MP4Writer *writer;
+    MP4FragmentAssembler assembler;
+    MP4GopCache gop_cache;
+    MP4TimeShiftBuffer timeshift;
+    std::unique_ptr<MP4FileSink> recorder;
+    std::string thumbnail_path;
+    unsigned int last_duration;
+    long long int next_timestamp;
+    unsigned long long int dropped_fragments;
+};
+
+class StreamRegistry
+{
+public:
+
+    // Attaching under the registry lock, so that an idle stream is never released while someone joins it.
+    std::shared_ptr<LiveStream> AddCamera(const std::string &id, const std::shared_ptr<WebSocketConnection> &connection)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::shared_ptr<LiveStream> &stream = streams[id];
+        if (!stream)
+            stream = std::make_shared<LiveStream>(id);
+        return stream->AttachCamera(connection) ? stream : nullptr;
+    }
+
+    // A time-shifted viewer gets a position in the time-shift buffer and no ring,
+    // unless the buffer is empty: it starts live then.
+    std::shared_ptr<LiveStream> AddViewer(const std::string &id,
+                                          const std::shared_ptr<WebSocketConnection> &connection,
+                                          unsigned int time_shift_ms,
+                                          std::shared_ptr<MP4FragmentRing> &ring,
+                                          uint64_t &position)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::shared_ptr<LiveStream> &stream = streams[id];
+        if (!stream)
+            stream = std::make_shared<LiveStream>(id);
+        if (time_shift_ms == 0 || !stream->AddTimeShiftViewer(connection, time_shift_ms, position))
+            ring = stream->AddViewer(connection);
+        return stream;
+    }
+
+    void ReleaseIfIdle(const std::shared_ptr<LiveStream> &stream)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = streams.find(stream->GetId());
+        if (it != streams.end() && it->second == stream && stream->IsIdle())
+            streams.erase(it);
+    }
+
+    void GetCounts(size_t &stream_count, size_t &viewer_count, unsigned long long int &dropped_fragments)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stream_count = streams.size();
+        viewer_count = 0;
+        dropped_fragments = 0;
+        for (auto &it : streams) {
+            viewer_count += it.second->GetViewerCount();
+            dropped_fragments += it.second->GetDroppedFragments();
+        }
+    }
+
+private:
+
+    std::mutex mutex;
+    std::map<std::string, std::shared_ptr<LiveStream>> streams;
+};
+
+/*
+ * Routes "/camera" connections to the muxer of their stream and "/client" connections to its output.
+ * The stream ID is given by "?id=xxx" or by the path ("/camera/xxx"), or "default" if none.
+ */
+class RelayServer : public WebSocketListener
+{
+public:
+
+    virtual bool OnOpen(const std::shared_ptr<WebSocketConnection> &connection)
+    {
+        std::string role, stream_id;
+        if (!ParsePath(connection, role, stream_id)) {
+            printf("Reject connection from %s to %s\n", connection->GetRemoteAddress().c_str(), connection->GetPath().c_str());
+            return false;
+        }
+
+        auto context = std::make_shared<ConnectionContext>();
+        context->is_camera = (role == "camera");
+        connection->user_data = context;
+
+        if (context->is_camera) {
+            context->stream = registry.AddCamera(stream_id, connection);
+            if (!context->stream) {
+                printf("[%s] Reject camera %s: the stream already has a camera\n",
+                       stream_id.c_str(), connection->GetRemoteAddress().c_str());
+                return false;
+            }
+            printf("[%s] Camera connected from %s\n", stream_id.c_str(), connection->GetRemoteAddress().c_str());
+        } else {
+            AddViewer(connection, *context, stream_id);
+        }
+        return true;
+    }
+
+    // GET /client/<id>: the live stream as one chunked MP4, the same fragments as on a websocket.
+    // GET /record/<file>: a recorded file, with byte ranges.
+    // Ex: curl -N http://localhost:8080/client/cam1 | ffplay -
+    virtual bool OnHttpRequest(const std::shared_ptr<WebSocketConnection> &connection)
+    {
+        const std::string &path = connection->GetPath();
+        if (path.compare(0, 8, "/record/") == 0) {
+            // Only the files of the record directory, not below nor above it.
+            std::string name = path.substr(8);
+            if (record_directory.empty() || name.empty() || name[0] == '.' || name.find('/') != std::string::npos)
+                return false;
+            return connection->SendHttpFile(record_directory + "/" + name, "video/mp4");
+        }
+
+        std::string role, stream_id;
+        if (!ParsePath(connection, role, stream_id) || role != "client")
+            return false;
+
+        if (!connection->SendHttpResponse("200 OK", "Content-Type: video/mp4\r\n"
+                                                    "Cache-Control: no-cache\r\n"
+                                                    "Access-Control-Allow-Origin: *\r\n", true))
+            return false;
+
+        auto context = std::make_shared<ConnectionContext>();
+        connection->user_data = context;
+        AddViewer(connection, *context, stream_id);
+        return true;
+    }
+
+    virtual void OnMessage(const std::shared_ptr<WebSocketConnection> &connection,
+                           unsigned char *data,
+                           size_t size,
+                           bool is_binary)
+    {
+        auto context = std::static_pointer_cast<ConnectionContext>(connection->user_data);
+        if (context && context->is_camera && context->stream && is_binary)
+            context->stream->OnCameraMessage(data, size);
+    }
+
+    virtual void OnClose(const std::shared_ptr<WebSocketConnection> &connection)
+    {
+        auto context = std::static_pointer_cast<ConnectionContext>(connection->user_data);
+        if (!context || !context->stream)
+            return;
+
+        if (context->is_camera) {
+            printf("[%s] Camera quit\n", context->stream->GetId().c_str());
+            context->stream->DetachCamera(connection);
+        } else {
+            if (context->ring)
+                context->ring->Close();
+            context->stream->RemoveViewer(connection);
+        }
+        registry.ReleaseIfIdle(context->stream);
+
+        connection->user_data.reset();
+    }
+
+    // Called on the worker thread of a viewer, the only consumer of its ring.
+    virtual void OnDrain(const std::shared_ptr<WebSocketConnection> &connection)
+    {
+        auto context = std::static_pointer_cast<ConnectionContext>(connection->user_data);
+        if (!context || context->is_camera || !context->stream)
+            return;
+        if (!context->ring) {
+            DrainTimeShift(connection, *context);
+            return;
+        }
+
+        // Leave the rest in the ring while the socket is behind, so the overflow policy decides what to drop.
+        MP4FragmentPtr fragment;
+        while (connection->GetQueuedBytes() < max_viewer_backlog && context->ring->TryPop(fragment)) {
+            if (thinning_backlog > 0) {
+                fragment = Thin(connection, *context, fragment);
+                if (!fragment)
+                    continue;
+            }
+            if (fragment->capture_time_us)
+                viewer_latency.Add(GetWallClockMicroseconds() - static_cast<long long int>(fragment->capture_time_us));
+            Send(connection, *context, fragment);
+        }
+    }
+
+    StreamRegistry &GetRegistry() { return registry; }
+
+private:
+
+    struct ConnectionContext
+    {
+        ConnectionContext()
+                : is_camera(false)
+                , position(0)
+                , init_sent(false)
+                , paced(false)
+                , pace_start_ms(0)
+                , congestion(thinning_backlog, thinning_backlog / 4, thinning_settle_ms, thinning_recovery_ms)
+        {
+        }
+
+        bool is_camera;
+        std::shared_ptr<LiveStream> stream;
+        std::shared_ptr<MP4FragmentRing> ring;     // Viewers only
+        MP4TimelineRebaser rebaser;                // Viewers only
+
+        // Time-shifted viewers only: where they are in the time-shift buffer, and the clock pacing them.
+        uint64_t position;
+        bool init_sent;
+        bool paced;
+        std::chrono::steady_clock::time_point pace_start;
+        uint64_t pace_start_ms;
+
+        // Live viewers only: the frames dropped while their socket is behind.
+        MP4ViewerCongestion congestion;
+        MP4FragmentThinner thinner;
+    };
+
+    // Return the fragment to send at the congestion level of the viewer, nullptr if nothing is left of it.
+    static MP4FragmentPtr Thin(const std::shared_ptr<WebSocketConnection> &connection, ConnectionContext &context, const MP4FragmentPtr &fragment)
+    {
+        MP4ThinningLevel previous_level = context.thinner.GetLevel();
+        unsigned long long int previous_dropped = context.thinner.GetDroppedSamples();
+
+        MP4FragmentPtr thinned = context.thinner.Thin(fragment, context.congestion.Update(connection->GetQueuedBytes()));
+
+        thinned_samples += context.thinner.GetDroppedSamples() - previous_dropped;
+        if (context.thinner.GetLevel() != previous_level) {
+            static const char *const LEVEL_NAMES[] = {"all frames", "reference frames only", "key frames only"};
+            printf("[%s] Viewer %s: %s\n", context.stream->GetId().c_str(), connection->GetRemoteAddress().c_str(),
+                   LEVEL_NAMES[context.thinner.GetLevel()]);
+        }
+        return thinned;
+    }
+
+    void AddViewer(const std::shared_ptr<WebSocketConnection> &connection, ConnectionContext &context, const std::string &stream_id)
+    {
+        // ?t=seconds to start behind the live edge.
+        unsigned int time_shift_ms = (dvr_minutes > 0) ? atoi(connection->GetQueryParameter("t").c_str()) * 1000 : 0;
+        context.stream = registry.AddViewer(stream_id, connection, time_shift_ms, context.ring, context.position);
+        printf("[%s] Client connected from %s%s%s\n", stream_id.c_str(), connection->GetRemoteAddress().c_str(),
+               connection->IsHttp() ? " (HTTP)" : "", context.ring ? "" : " (time-shifted)");
+    }
+
+    static long long int GetWallClockMicroseconds()
+    {
+        auto now = std::chrono::system_clock::now().time_since_epoch();
+        return std::chrono::duration_cast<std::chrono::microseconds>(now).count();
+    }
+
+    static void Send(const std::shared_ptr<WebSocketConnection> &connection, ConnectionContext &context, const MP4FragmentPtr &fragment)
+    {
+        // Share the fragment data with the other viewers, no copy. Only the moof is rewritten per viewer.
+        SharedBuffer data(fragment, &fragment->data);
+        std::vector<unsigned char> header;
+        if (context.rebaser.Rebase(*fragment, header)) {
+            connection->SendBinary(std::make_shared<const std::vector<unsigned char>>(std::move(header)),
+                                   data, fragment->payload_offset);
+        } else {
+            connection->SendBinary(data);
+        }
+    }
+
+    // Send the time-shift buffer from the position of the viewer, no more than time_shift_lead_ms ahead
+    // of its playback: the fragments are in memory already, so they would all go at once otherwise.
+    void DrainTimeShift(const std::shared_ptr<WebSocketConnection> &connection, ConnectionContext &context)
+    {
+        const MP4TimeShiftBuffer &timeshift = context.stream->GetTimeShiftBuffer();
+
+        if (!context.init_sent) {
+            MP4FragmentPtr init = timeshift.GetInitFragment();
+            if (!init)
+                return;
+            Send(connection, context, init);
+            context.init_sent = true;
+        }
+
+        MP4FragmentPtr fragment;
+        auto now = std::chrono::steady_clock::now();
+        while (connection->GetQueuedBytes() < max_viewer_backlog) {
+            uint64_t position = context.position;
+            if (!timeshift.Get(context.position, fragment))
+                break;
+
+            // Left behind by the eviction: it jumps to the oldest key frame, so start the clock over.
+            if (context.position != position)
+                context.paced = false;
+
+            uint64_t time_ms = timeshift.GetTimeMs(fragment->base_decode_time);
+            if (!context.paced) {
+                context.pace_start = now;
+                context.pace_start_ms = time_ms;
+                context.paced = true;
+            }
+
+            // Woken up again by the next live fragment.
+            uint64_t played_ms = std::chrono::duration_cast<std::chrono::milliseconds>(now - context.pace_start).count();
+            if (time_ms > context.pace_start_ms + played_ms + time_shift_lead_ms)
+                break;
+
+            Send(connection, context, fragment);
+            context.position++;
+        }
+    }
+
+    static bool ParsePath(const std::shared_ptr<WebSocketConnection> &connection, std::string &role, std::string &stream_id)
+    {
+        const std::string &path = connection->GetPath();
+        size_t slash = path.find('/', 1);
+
+        role = path.substr(1, (slash == std::string::npos) ? std::string::npos : slash - 1);
+        if (role != "camera" && role != "client")
+            return false;
+
+        stream_id = connection->GetQueryParameter("id");
+        if (stream_id.empty() && slash != std::string::npos)
+            stream_id = path.substr(slash + 1);
+        if (stream_id.empty())
+            stream_id = "default";
+        return true;
+    }
+
+    StreamRegistry registry;
+};
+
+static void OnSignal(int signal)
+{
+    running = false;
+}
+
+static void RaiseFileLimit()
+{
+    // Every camera and viewer holds a socket.
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    unsigned short port = 8080;
+    unsigned int workers = std::thread::hardware_concurrency();
+    unsigned int stats_interval = 10;
+    size_t max_pooled_bytes = 64 * 1024 * 1024;
+
+    static struct option long_options[] = {
+            {"port",    required_argument, nullptr, 'p'},
+            {"workers", required_argument, nullptr, 'w'},
+            {"backlog", required_argument, nullptr, 'b'},
+            {"stats",   required_argument, nullptr, 's'},
+            {"queue",   required_argument, nullptr, 'q'},
+            {"overflow", required_argument, nullptr, 'o'},
+            {"gop-cache", required_argument, nullptr, 'g'},
+            {"pool",    required_argument, nullptr, 'P'},
+            {"stream-memory", required_argument, nullptr, 'm'},
+            {"record",  required_argument, nullptr, 'r'},
+            {"record-minutes", required_argument, nullptr, 'R'},
+            {"dvr",     required_argument, nullptr, 'd'},
+            {"dvr-memory", required_argument, nullptr, 'D'},
+            {"thumbnails", required_argument, nullptr, 'T'},
+            {"thumbnail-seconds", required_argument, nullptr, 'i'},
+            {"thin-backlog", required_argument, nullptr, 'H'},
+            {nullptr, 0, nullptr, 0}
+    };
+
+    int option;
+    while ((option = getopt_long(argc, argv, "p:w:b:s:q:o:g:P:m:r:R:d:D:T:i:H:", long_options, nullptr)) != -1) {
+        switch (option) {
+            case 'p': port = static_cast<unsigned short>(atoi(optarg)); break;
+            case 'w': workers = static_cast<unsigned int>(atoi(optarg)); break;
+            case 'b': max_viewer_backlog = static_cast<size_t>(atoi(optarg)) * 1024; break;
+            case 's': stats_interval = static_cast<unsigned int>(atoi(optarg)); break;
+            case 'q': viewer_queue_size = static_cast<unsigned int>(atoi(optarg)); break;
+            case 'g': gop_cache_size = static_cast<size_t>(atoi(optarg)) * 1024 * 1024; break;
+            case 'P': max_pooled_bytes = static_cast<size_t>(atoi(optarg)) * 1024 * 1024; break;
+            case 'm': stream_memory_budget = static_cast<unsigned int>(atoi(optarg)) * 1024; break;
+            case 'r': record_directory = optarg; break;
+            case 'R': record_minutes = static_cast<unsigned int>(atoi(optarg)); break;
+            case 'd': dvr_minutes = static_cast<unsigned int>(atoi(optarg)); break;
+            case 'D': dvr_memory = static_cast<size_t>(atoi(optarg)) * 1024 * 1024; break;
+            case 'T': thumbnail_directory = optarg; break;
+            case 'i': thumbnail_seconds = static_cast<unsigned int>(atoi(optarg)); break;
+            case 'H': thinning_backlog = static_cast<size_t>(atoi(optarg)) * 1024; break;
+            case 'o':
+                // No blocking policy here: a slow viewer must never hold the camera.
+                if (strcmp(optarg, "oldest") == 0) {
+                    viewer_overflow_policy = fMP4_RING_DROP_OLDEST;
+                } else if (strcmp(optarg, "key") == 0) {
+                    viewer_overflow_policy = fMP4_RING_DROP_TO_NEXT_KEY_FRAME;
+                } else {
+                    printf("Unknown overflow policy: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            default:
+                printf("usage: %s [--port 8080] [--workers N] [--backlog KB per viewer] [--stats seconds]"
+                       " [--queue fragments per viewer] [--overflow oldest|key] [--gop-cache MB, 0 to disable]"
+                       " [--pool MB of free buffers kept] [--stream-memory KB per stream, 0 for no limit]"
+                       " [--record directory] [--record-minutes per file]"
+                       " [--dvr minutes kept in memory, 0 to disable] [--dvr-memory MB per stream]"
+                       " [--thumbnails directory] [--thumbnail-seconds between updates]"
+                       " [--thin-backlog KB per viewer before dropping frames, 0 to disable]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, OnSignal);
+    signal(SIGTERM, OnSignal);
+    RaiseFileLimit();
+
+    MP4BufferPool pool(max_pooled_bytes);
+    buffer_pool = &pool;
+
+    // Declared before the server, so it outlives the writers.
+    std::unique_ptr<MP4Thumbnailer> thumbnail_threads;
+    if (!thumbnail_directory.empty()) {
+        fMP4ThumbnailerConfig config;
+        fMP4_InitThumbnailerConfig(&config);
+        thumbnail_threads.reset(new MP4Thumbnailer(config));
+        thumbnailer = thumbnail_threads.get();
+    }
+
+    RelayServer relay;
+    WebSocketServer server(&relay);
+    if (!server.Start(port, workers)) {
+        printf("Fail to start server on %d\n", port);
+        return 1;
+    }
+    printf("Server start on %d with %u workers\n", port, workers);
+
+    unsigned int elapsed = 0;
+    while (running) {
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+
+        if (stats_interval > 0 && ++elapsed % stats_interval == 0) {
+            size_t streams = 0, viewers = 0;
+            unsigned long long int dropped = 0;
+            relay.GetRegistry().GetCounts(streams, viewers, dropped);
+            printf("[stats] connections: %zu, streams: %zu, viewers: %zu, dropped fragments: %llu, thinned frames: %llu, writer templates: %zu\n",
+                   server.GetConnectionCount(), streams, viewers, dropped, thinned_samples.load(), writer_templates.GetSize());
+
+            fMP4BufferPoolStats pool_stats = pool.GetStats();
+            printf("[stats] buffers in use: %llu KB (peak %llu KB), pooled: %llu KB, hits: %llu, misses: %llu, over budget: %llu\n",
+                   pool_stats.in_use_bytes / 1024, pool_stats.peak_in_use_bytes / 1024, pool_stats.pooled_bytes / 1024,
+                   pool_stats.hits, pool_stats.misses, pool_stats.over_budget);
+
+            MP4LatencyPercentiles latency = viewer_latency.TakePercentiles();
+            if (latency.count > 0) {
+                printf("[stats] capture to viewer latency: p50 %u ms, p90 %u ms, p99 %u ms, max %u ms, fragments: %llu\n",
+                       latency.p50_ms, latency.p90_ms, latency.p99_ms, latency.max_ms, latency.count);
+            }
+
+            if (thumbnailer) {
+                fMP4ThumbnailerStats thumbnail_stats = thumbnailer->GetStats();
+                printf("[stats] thumbnails: %llu, dropped key frames: %llu, failed: %llu\n",
+                       thumbnail_stats.produced, thumbnail_stats.dropped, thumbnail_stats.failed);
+            }
+        }
+    }
+
+    printf("Server stop\n");
+    server.Stop();
+    server.Join();
+
+    return 0;
+}
@@ -0,0 +1,277 @@
+#include <chrono>
+#include <string>
+#include <cstdlib>
+#include <cstring>
+
+#include <mp4v2/mp4v2.h>
+#include <netinet/in.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "fMP4.h"
+
+class MP4Reader
+{
+public:
+
+    enum MP4ReadStatus
+    {
+        MP4_READ_OK,
+        MP4_READ_EOS,
+        MP4_READ_ERR
+    };
+
+    MP4Reader(const std::string &file_path)
+            : file_path(file_path)
+            , handle(MP4_INVALID_FILE_HANDLE)
+            , video_track_id(MP4_INVALID_TRACK_ID)
+            , next_video_sample_idx(1)
+            , video_sample(nullptr)
+            , video_timescale(0)
+            , video_sample_max_size(0)
+            , video_sample_number(0)
+            , video_duration(0)
+            , pSeqHeaders(nullptr)
+            , pSeqHeaderSize(nullptr)
+            , pPictHeaders(nullptr)
+            , pPictHeaderSize(nullptr)
+    {
+        handle = MP4Read(this->file_path.c_str());
+
+        video_track_id = MP4FindTrackId(handle, 0, MP4_VIDEO_TRACK_TYPE);
+        if (video_track_id != MP4_INVALID_TRACK_ID) {
+            video_timescale = MP4GetTrackTimeScale(handle, video_track_id);
+            video_sample_max_size = MP4GetTrackMaxSampleSize(handle, video_track_id) * 2;
+            video_duration = MP4GetTrackDuration(handle, video_track_id);
+            video_sample = new unsigned char[video_sample_max_size];
+            video_sample_number = MP4GetTrackNumberOfSamples(handle, video_track_id);
+
+            if (MP4GetTrackH264SeqPictHeaders(handle,
+                                              video_track_id,
+                                              &pSeqHeaders,
+                                              &pSeqHeaderSize,
+                                              &pPictHeaders,
+                                              &pPictHeaderSize))
+            {
+                printf("Get SPS(%d) and PPS(%d)\n", *pSeqHeaderSize, *pPictHeaderSize);
+
+                for(int i = 0; (pSeqHeaders[i] && pSeqHeaderSize[i]); i++) {
+                    printf("SPS(%d): %02x %02x %02x %02x %02x\n", i,
+                           pSeqHeaders[i][0], pSeqHeaders[i][1], pSeqHeaders[i][2],
+                           pSeqHeaders[i][3], pSeqHeaders[i][4]);
+                }
+                for(int i = 0; (pPictHeaders[i] && pPictHeaderSize[i]); i++) {
+                    printf("PPS(%d): %02x %02x %02x %02x %02x\n", i,
+                           pPictHeaders[i][0], pPictHeaders[i][1], pPictHeaders[i][2],
+                           pPictHeaders[i][3], pPictHeaders[i][4]);
+                }
+            }
+        }
+    }
+
+    ~MP4Reader()
+    {
+        if (pSeqHeaders || pSeqHeaderSize || pPictHeaders || pPictHeaderSize) {
+            MP4FreeH264SeqPictHeaders(pSeqHeaders, pSeqHeaderSize, pPictHeaders, pPictHeaderSize);
+        }
+
+        if (handle != MP4_INVALID_FILE_HANDLE) MP4Close(handle);
+        if (video_sample) delete[] video_sample;
+    }
+
+    unsigned int GetVideoTimeScale() const
+    {
+        return video_timescale;
+    }
+
+    MP4ReadStatus GetNextH264VideoSample(unsigned char **sample,
+                                         unsigned int &sample_size,
+                                         long long int &pts,
+                                         long long int &dts,
+                                         unsigned long long int &duration,
+                                         bool &is_key_frame)
+    {
+        if (next_video_sample_idx > video_sample_number) {
+            return MP4_READ_EOS;
+        }
+
+        unsigned int video_sample_offset = 0;
+        if(MP4GetSampleSync(handle, video_track_id, next_video_sample_idx)) {
+            /*
+             * If current sample has key frame, we need to put SPS/PPS in front of key frame.
+             */
+            if (pSeqHeaders && pSeqHeaderSize) {
+                for(int i = 0; (pSeqHeaders[i] && pSeqHeaderSize[i]); i++) {
+                    (*(unsigned int *)(video_sample + video_sample_offset)) = htonl(1);
+                    video_sample_offset += 4;
+                    memcpy(video_sample + video_sample_offset, pSeqHeaders[i], pSeqHeaderSize[i]);
+                    video_sample_offset += pSeqHeaderSize[i];
+                }
+            }
+            if (pPictHeaders && pPictHeaderSize) {
+                for(int i = 0; (pPictHeaders[i] && pPictHeaderSize[i]); i++) {
+                    (*(unsigned int *)(video_sample + video_sample_offset)) = htonl(1);
+                    video_sample_offset += 4;
+                    memcpy(video_sample + video_sample_offset, pPictHeaders[i], pPictHeaderSize[i]);
+                    video_sample_offset += pPictHeaderSize[i];
+                }
+            }
+        }
+
+        MP4Timestamp mp4_start_time = 0;
+        MP4Duration mp4_duration = 0;
+        MP4Duration mp4_rendering_offset = 0;
+        unsigned char *video_sample_start_addr = video_sample + video_sample_offset;
+        sample_size = video_sample_max_size - video_sample_offset;
+        if (!MP4ReadSample(handle, video_track_id, next_video_sample_idx,
+                           &video_sample_start_addr, &sample_size,
+                           &mp4_start_time,
+                           &mp4_duration,
+                           &mp4_rendering_offset,
+                           &is_key_frame)) {
+            printf("Fail to read video sample (%d)\n", next_video_sample_idx);
+            return MP4_READ_ERR;
+        }
+
+        // Convert AVC1 format to AnnexB
+        if (sample_size >= 4) {
+            unsigned int *p = (unsigned int *) video_sample_start_addr;
+            *p = htonl(1);
+        }
+
+        *sample = video_sample;
+        sample_size += video_sample_offset;
+        // In the track timescale: the writer keeps it, with the composition offsets of the B-frames.
+        dts = static_cast<long long int>(mp4_start_time);
+        pts = dts + static_cast<long long int>(mp4_rendering_offset);
+        duration = mp4_duration;
+        next_video_sample_idx++;
+        return MP4_READ_OK;
+    }
+
+private:
+
+    std::string file_path;
+    MP4FileHandle handle;
+    MP4TrackId video_track_id;
+    unsigned int next_video_sample_idx;
+    unsigned char *video_sample;
+
+    unsigned int video_timescale;
+    unsigned int video_sample_max_size;
+    unsigned int video_sample_number;
+    unsigned long long int video_duration;
+    unsigned char **pSeqHeaders;
+    unsigned int *pSeqHeaderSize;
+    unsigned char **pPictHeaders;
+    unsigned int *pPictHeaderSize;
+};
+
+/*
+ * The capture process: the samples of the file, as fast as the muxer takes them.
+ */
+static int RunCapture(const char *input_path, const char *channel_path)
+{
+    fMP4ShmChannel channel = fMP4_OpenShmChannel(channel_path);
+    if (!channel)
+        return 1;
+
+    MP4Reader input(input_path);
+    const long long int input_timescale = input.GetVideoTimeScale();
+    const long long int channel_timescale = fMP4_GetShmChannelTimescale(channel);
+    if (input_timescale == 0) {
+        printf("No video track in %s\n", input_path);
+        fMP4_ReleaseShmChannel(channel);
+        return 1;
+    }
+
+    unsigned char *sample = nullptr;
+    unsigned int sample_size = 0;
+    long long int pts = 0, dts = 0;
+    unsigned long long int duration = 0;
+    bool is_key_frame = false;
+    while (input.GetNextH264VideoSample(&sample, sample_size, pts, dts, duration, is_key_frame) == MP4Reader::MP4_READ_OK) {
+        fMP4_WriteShmSample(channel, sample, sample_size, is_key_frame,
+                            pts * channel_timescale / input_timescale,
+                            dts * channel_timescale / input_timescale,
+                            duration * channel_timescale / input_timescale,
+                            -1);
+    }
+
+    // The muxer gets the end of stream once it has read everything.
+    fMP4_ReleaseShmChannel(channel);
+    return 0;
+}
+
+static int Write(void *context, unsigned char *buf, int buf_size)
+{
+    return fwrite(buf, 1, buf_size, static_cast<FILE *>(context));
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 3) {
+        printf("usage: %s input output [channel size in KB]\n", argv[0]);
+        return 1;
+    }
+
+    unsigned int capacity = (argc > 3) ? static_cast<unsigned int>(atoi(argv[3])) * 1024 : 4 * 1024 * 1024;
+    fMP4ShmChannel channel = fMP4_CreateShmChannel(capacity, 90000);
+    if (!channel)
+        return 1;
+
+    char channel_path[64];
+    fMP4_GetShmChannelPath(channel, channel_path, sizeof(channel_path));
+    printf("Shared memory channel: %s\n", channel_path);
+
+    // The capture process opens the channel by its path, as an unrelated process would.
+    pid_t capture = fork();
+    if (capture < 0) {
+        printf("Fail to start the capture process\n");
+        fMP4_ReleaseShmChannel(channel);
+        return 1;
+    } else if (capture == 0) {
+        _exit(RunCapture(argv[1], channel_path));
+    }
+
+    FILE *output = fopen(argv[2], "wb");
+    if (!output) {
+        printf("Fail to open %s\n", argv[2]);
+        fMP4_ReleaseShmChannel(channel);
+        waitpid(capture, nullptr, 0);
+        return 1;
+    }
+
+    fMP4WriterConfig config;
+    fMP4_InitWriterConfig(&config);
+    config.callback_with_context = &Write;
+    config.context = output;
+    config.timescale = fMP4_GetShmChannelTimescale(channel);
+    fMP4Writer fmp4_writer = fMP4_CreateWriterWithConfig(&config);
+
+    auto start = std::chrono::steady_clock::now();
+    while (fMP4_ReadShmSamples(channel, fmp4_writer, 1000) >= 0) {
+        // The capture process could be gone without closing its side.
+        if (waitpid(capture, nullptr, WNOHANG) == capture) {
+            capture = 0;
+            fMP4_ReadShmSamples(channel, fmp4_writer, 0);
+            break;
+        }
+    }
+    double elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count() / 1000000.0;
+
+    fMP4_ReleaseWriter(fmp4_writer);
+
+    fMP4ShmChannelStats stats;
+    fMP4_GetShmChannelStats(channel, &stats);
+    printf("%llu samples, %.2f MB in %.3f s (%.1f MB/s), dropped: %llu, producer waits: %llu, consumer waits: %llu, output: %ld bytes\n",
+           stats.read_samples, stats.written_bytes / 1048576.0, elapsed,
+           elapsed > 0 ? stats.written_bytes / 1048576.0 / elapsed : 0.0,
+           stats.dropped_samples, stats.producer_waits, stats.consumer_waits, ftell(output));
+    fMP4_ReleaseShmChannel(channel);
+    fclose(output);
+
+    if (capture > 0)
+        waitpid(capture, nullptr, 0);
+    return 0;
+}
@@ -22,8 +22,7 @@ public:
     };
 
     MP4Reader(const std::string &file_path)
-            : time_scale(9 * MP4_MSECS_TIME_SCALE)
-            , file_path(file_path)
+            : file_path(file_path)
             , handle(MP4_INVALID_FILE_HANDLE)
             , video_track_id(MP4_INVALID_TRACK_ID)
             , next_video_sample_idx(1)
@@ -100,8 +99,15 @@ public:
         return MP4GetTrackBitRate(handle, video_track_id);
     }
 
+    unsigned int GetVideoTimeScale() const
+    {
+        return video_timescale;
+    }
+
     MP4ReadStatus GetNextH264VideoSample(unsigned char **sample,
                                          unsigned int &sample_size,
+                                         long long int &pts,
+                                         long long int &dts,
                                          unsigned long long int &duration,
                                          bool &is_key_frame)
     {
@@ -132,14 +138,16 @@ public:
             }
         }
 
+        MP4Timestamp mp4_start_time = 0;
         MP4Duration mp4_duration = 0;
+        MP4Duration mp4_rendering_offset = 0;
         unsigned char *video_sample_start_addr = video_sample + video_sample_offset;
         sample_size = video_sample_max_size - video_sample_offset;
         if (!MP4ReadSample(handle, video_track_id, next_video_sample_idx,
                            &video_sample_start_addr, &sample_size,
-                           NULL,
+                           &mp4_start_time,
                            &mp4_duration,
-                           NULL,
+                           &mp4_rendering_offset,
                            &is_key_frame)) {
             printf("Fail to read video sample (%d)\n", next_video_sample_idx);
             return MP4_READ_ERR;
@@ -153,15 +161,16 @@ public:
 
         *sample = video_sample;
         sample_size += video_sample_offset;
-        duration = (1000 * mp4_duration) / time_scale;
+        // In the track timescale: the writer keeps it, with the composition offsets of the B-frames.
+        dts = static_cast<long long int>(mp4_start_time);
+        pts = dts + static_cast<long long int>(mp4_rendering_offset);
+        duration = mp4_duration;
         next_video_sample_idx++;
         return MP4_READ_OK;
     }
 
 private:
 
-    const unsigned int time_scale;
-
     std::string file_path;
     MP4FileHandle handle;
     MP4TrackId video_track_id;
@@ -190,10 +199,26 @@ static int Write(unsigned char* buf, int buf_size)
     }
 }
 
+static void PrintFragment(void *context, const unsigned char *data, const fMP4FragmentInfo *info)
+{
+    if (info->type == fMP4_FRAGMENT_INIT) {
+        printf("Init segment: %u bytes, timescale: %u\n", info->size, info->timescale);
+    } else {
+        printf("Fragment #%u: decode time: %llu, duration: %llu, %s, %u bytes\n",
+               info->sequence_number, info->base_decode_time, info->duration,
+               info->is_key_frame ? "key frame" : "no key frame", info->size);
+    }
+}
+
+static int WriteTrickPlay(void *context, unsigned char* buf, int buf_size)
+{
+    return fwrite(buf, 1, buf_size, static_cast<FILE *>(context));
+}
+
 int main(int argc, char **argv)
 {
     if (argc < 3) {
-        printf("usage: %s input output\n", argv[0]);
+        printf("usage: %s input output [trick-play output]\n", argv[0]);
         return 1;
     }
 
@@ -201,18 +226,35 @@ int main(int argc, char **argv)
 
     fptr = fopen(argv[2], "wb");
 
-    fMP4Writer fmp4_writer = fMP4_CreateWriter(&Write);
+    fMP4WriterConfig config;
+    fMP4_InitWriterConfig(&config);
+    config.callback = &Write;
+    config.timescale = input->GetVideoTimeScale();
+    config.fragment_callback = &PrintFragment;
+
+    // The key frames only, for scrubbing.
+    FILE *trick_play_file = (argc > 3) ? fopen(argv[3], "wb") : nullptr;
+    if (trick_play_file) {
+        config.trick_play_callback_with_context = &WriteTrickPlay;
+        config.trick_play_context = trick_play_file;
+    }
+    fMP4Writer fmp4_writer = fMP4_CreateWriterWithConfig(&config);
 
     unsigned char *sample = nullptr;
     unsigned int sample_size = 0;
+    long long int pts = 0, dts = 0;
     unsigned long long int duration = 0;
     bool is_key_frame = false;
-    while (input->GetNextH264VideoSample(&sample, sample_size, duration, is_key_frame) == MP4Reader::MP4_READ_OK) {
-        fMP4_WriteH264Sample(fmp4_writer, sample, sample_size, is_key_frame, duration);
+    while (input->GetNextH264VideoSample(&sample, sample_size, pts, dts, duration, is_key_frame) == MP4Reader::MP4_READ_OK) {
+        fMP4_WriteH264SampleWithTimestamps(fmp4_writer, sample, sample_size, is_key_frame, pts, dts, duration);
     }
 
     fMP4_ReleaseWriter(fmp4_writer);
 
+    if (trick_play_file) {
+        printf("Trick-play output: %ld bytes, %ld for the full stream\n", ftell(trick_play_file), ftell(fptr));
+        fclose(trick_play_file);
+    }
     fclose(fptr);
 
     return 0;
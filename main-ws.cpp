@@ -1,5 +1,5 @@
-#include <thread>
 #include <memory>
+#include <vector>
 #include <cstring>
 
 #include <glibmm-2.4/glibmm.h>
@@ -8,27 +8,54 @@
 #include <netinet/in.h>
 
 #include "ws-client.hpp"
+#include "stream-pacer.hpp"
 #include "fMP4.h"
 
 class OptionGroup : public Glib::OptionGroup
 {
 public:
 
-    OptionGroup() : Glib::OptionGroup("", ""), repeat(false)
+    OptionGroup()
+            : Glib::OptionGroup("", "")
+            , repeat(false)
+            , speed(1.0)
+            , connections(1)
+            , stagger(0)
+            , offset_jitter(0)
+            , stats_interval(0)
+            , capture_time(false)
     {
         AddEntry('s', "server", "Set server address. Ex: echo.websocket.org:80", server);
         AddEntry('r', "repeat", "Enable repeat mode", repeat);
-        AddEntryFileName('m', "mp4", "Set MP4 file path", mp4_file_path);
+        AddEntry('x', "speed", "Set replay speed. 1 for real time, N for N times faster, 0 for unpaced", speed);
+        AddEntryFileName('m', "mp4", "Set MP4 file path. Could be given multiple times", mp4_file_paths);
+        AddEntry('n', "connections", "Set the number of simulated cameras (load generator mode if > 1)", connections);
+        AddEntry('t', "stagger", "Set the delay in ms between two camera connections", stagger);
+        AddEntry('j', "offset-jitter", "Start each camera at a random sample in [0, N] of its file", offset_jitter);
+        AddEntry('i', "stats", "Set the statistics report interval in seconds", stats_interval);
+        AddEntry('c', "capture-time", "Send the time each frame is sent as its capture time, for the latency measurement", capture_time);
     }
 
     virtual ~OptionGroup() {}
 
     const std::string &GetServer() const { return server.raw(); }
 
-    const std::string &GetMp4FilePath() const { return mp4_file_path; }
+    const std::vector<std::string> &GetMp4FilePaths() const { return mp4_file_paths; }
 
     const bool GetRepeatMode() const { return repeat; }
 
+    const double GetSpeed() const { return speed; }
+
+    const unsigned int GetConnections() const { return (connections > 0) ? connections : 1; }
+
+    const unsigned int GetStagger() const { return (stagger > 0) ? stagger : 0; }
+
+    const unsigned int GetOffsetJitter() const { return (offset_jitter > 0) ? offset_jitter : 0; }
+
+    const unsigned int GetStatsInterval() const { return (stats_interval > 0) ? stats_interval : 0; }
+
+    const bool GetCaptureTime() const { return capture_time; }
+
     void AddEntry(const char &short_name, const std::string &long_name, const std::string &description, Glib::ustring &arg)
     {
         Glib::OptionEntry entry;
@@ -47,7 +74,25 @@ public:
         add_entry(entry, arg);
     }
 
-    void AddEntryFileName(const char &short_name, const std::string &long_name, const std::string &description, std::string &arg)
+    void AddEntry(const char &short_name, const std::string &long_name, const std::string &description, double &arg)
+    {
+        Glib::OptionEntry entry;
+        entry.set_short_name(short_name);
+        entry.set_long_name(long_name);
+        entry.set_description(description);
+        add_entry(entry, arg);
+    }
+
+    void AddEntry(const char &short_name, const std::string &long_name, const std::string &description, int &arg)
+    {
+        Glib::OptionEntry entry;
+        entry.set_short_name(short_name);
+        entry.set_long_name(long_name);
+        entry.set_description(description);
+        add_entry(entry, arg);
+    }
+
+    void AddEntryFileName(const char &short_name, const std::string &long_name, const std::string &description, std::vector<std::string> &arg)
     {
         Glib::OptionEntry entry;
         entry.set_short_name(short_name);
@@ -59,8 +104,14 @@ public:
 private:
 
     Glib::ustring server;
-    std::string mp4_file_path;
+    std::vector<std::string> mp4_file_paths;
     bool repeat;
+    double speed;
+    int connections;
+    int stagger;
+    int offset_jitter;
+    int stats_interval;
+    bool capture_time;
 };
 
 class MP4Reader
@@ -85,6 +136,7 @@ public:
             , video_sample_max_size(0)
             , video_sample_number(0)
             , video_duration(0)
+            , last_sample_duration(0)
             , pSeqHeaders(nullptr)
             , pSeqHeaderSize(nullptr)
             , pPictHeaders(nullptr)
@@ -138,6 +190,29 @@ public:
         return file_path;
     }
 
+    unsigned int GetVideoTimeScale() const
+    {
+        return video_timescale;
+    }
+
+    // Move to the first sync sample at or after the given sample index (0-based).
+    bool SkipToSyncSample(unsigned int sample_idx)
+    {
+        for (unsigned int idx = sample_idx + 1; idx <= video_sample_number; idx++) {
+            if (MP4GetSampleSync(handle, video_track_id, idx) == 1) {
+                next_video_sample_idx = idx;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Duration of the last read sample in the video timescale
+    unsigned long long int GetLastSampleDuration() const
+    {
+        return last_sample_duration;
+    }
+
     MP4ReadStatus GetNextH264VideoSample(unsigned char **sample,
                                          unsigned int &sample_size,
                                          unsigned long long int &duration,
@@ -192,6 +267,7 @@ public:
         *sample = video_sample;
         sample_size += video_sample_offset;
         duration = (1000 * mp4_duration) / time_scale;
+        last_sample_duration = mp4_duration;
         next_video_sample_idx++;
         return MP4_READ_OK;
     }
@@ -210,6 +286,7 @@ private:
     unsigned int video_sample_max_size;
     unsigned int video_sample_number;
     unsigned long long int video_duration;
+    unsigned long long int last_sample_duration;
     unsigned char **pSeqHeaders;
     unsigned int *pSeqHeaderSize;
     unsigned char **pPictHeaders;
@@ -217,74 +294,140 @@ private:
 };
 
 Glib::RefPtr<Glib::MainLoop> mainloop;
-std::shared_ptr<MP4Reader> mp4_reader;
-std::shared_ptr<WebSocketClient> websocket_client;
-std::chrono::steady_clock::time_point wait_timepoint = std::chrono::steady_clock::now();
+std::shared_ptr<StreamPacer> stream_pacer;
 unsigned char sample_buffer[1024 * 1024];
 OptionGroup option_group;
 
 fMP4Writer fmp4_writer = nullptr;
 FILE *fptr = nullptr;
 
-static bool OnExit(gpointer data)
+static int Write(unsigned char* buf, int buf_size)
 {
-    if (fmp4_writer) {
-        fMP4_ReleaseWriter(fmp4_writer);
-        fmp4_writer = nullptr;
-    }
+    static int i = 0;
+    printf("#%d Write: buf: %p(%02x%02x%02x%02x %c%c%c%c), size: %d\n", i++, buf, buf[0], buf[1], buf[2], buf[3], buf[4], buf[5], buf[6], buf[7], buf_size);
+    return fwrite(buf, 1, buf_size, fptr);
+}
 
-    if (fptr) {
-        fclose(fptr);
-        fptr = nullptr;
+/*
+ * One simulated camera: an MP4 file replayed over its own websocket connection.
+ */
+class CameraSession : public sigc::trackable
+{
+public:
+
+    CameraSession(unsigned int index, const std::string &file_path, unsigned int start_sample, bool verbose)
+            : index(index)
+            , file_path(file_path)
+            , start_sample(start_sample)
+            , verbose(verbose)
+            , pacer_stream_id(0)
+            , closed(false)
+            , frames_sent(0)
+            , bytes_sent(0)
+            , frames_dropped(0)
+            , connect_latency(-1)
+    {
+        websocket_client.SetVerbose(verbose);
+        websocket_client.RegisterSignals(sigc::mem_fun(*this, &CameraSession::OnConnected),
+                                         sigc::mem_fun(*this, &CameraSession::OnMessage),
+                                         sigc::mem_fun(*this, &CameraSession::OnData),
+                                         sigc::mem_fun(*this, &CameraSession::OnClosed),
+                                         NotifyPingPongSlot());
     }
 
-    mainloop->quit();
+    ~CameraSession()
+    {
+        if (pacer_stream_id)
+            stream_pacer->RemoveStream(pacer_stream_id);
+    }
 
-    return G_SOURCE_REMOVE;
-}
+    bool Connect(const std::string &server)
+    {
+        return websocket_client.Connect(server);
+    }
 
-static bool ReadSample()
-{
-    unsigned char *sample = nullptr;
-    unsigned int sample_size = 0;
-    unsigned long long int duration = 0;
-    bool is_key_frame = false;
-
-    MP4Reader::MP4ReadStatus status = mp4_reader->GetNextH264VideoSample(&sample, sample_size, duration, is_key_frame);
-    if (status == MP4Reader::MP4_READ_ERR) {
-        printf("Fail to get next H264 sample from MP4\n");
-        return true;
-    } else if (status == MP4Reader::MP4_READ_EOS) {
-        // Already get the end of current MP4 file, we will loop from the beginning.
-        std::string file_path = mp4_reader->GetFilePath();
-        mp4_reader.reset();
+    // Used as a one-shot timeout for staggered start.
+    bool ConnectLater(const std::string &server)
+    {
+        if (!Connect(server)) {
+            printf("[%u] Fail to connect websocket client to %s\n", index, server.c_str());
 
-        if (option_group.GetRepeatMode()) {
-            mp4_reader = std::make_shared<MP4Reader>(file_path);
-            status = mp4_reader->GetNextH264VideoSample(&sample, sample_size, duration, is_key_frame);
-            if (status != MP4Reader::MP4_READ_OK) {
-                printf("Fail to loop back to the first sample\n");
-                return true;
-            }
-        } else {
-            return false;
+            // Never to be closed otherwise, the others would wait for it.
+            closed = true;
+            OnSessionClosed();
         }
+        return false;
     }
-    if (sample_size == 0) {
-        printf("Fail because sample size is zero\n");
-        return true;
+
+    bool IsConnected() const { return websocket_client.IsConnected(); }
+
+    bool IsClosed() const { return closed; }
+
+    unsigned int GetSendQueueDepth() const { return websocket_client.GetSendQueueDepth(); }
+
+    void TakeStats(unsigned long long int &frames, unsigned long long int &bytes, unsigned long long int &dropped)
+    {
+        frames += frames_sent;
+        bytes += bytes_sent;
+        dropped += frames_dropped;
+        frames_sent = bytes_sent = frames_dropped = 0;
     }
 
-    // Wait until the next timestamp then push out the frame.
-    std::this_thread::sleep_until(wait_timepoint);
+    // The latency (us) of the last completed connect, or -1 if there is no new one.
+    long long int TakeConnectLatency()
+    {
+        long long int latency = connect_latency;
+        connect_latency = -1;
+        return latency;
+    }
+
+private:
 
-    // Send data to websocket
-    if (websocket_client) {
+    // The flags of a message, then the capture time after the size if FLAG_CAPTURE_TIME.
+    static const unsigned char FLAG_KEY_FRAME = 0x01;
+    static const unsigned char FLAG_CAPTURE_TIME = 0x02;
 
+    bool ReadSample(unsigned long long int &media_duration)
+    {
+        unsigned char *sample = nullptr;
+        unsigned int sample_size = 0;
+        unsigned long long int duration = 0;
+        bool is_key_frame = false;
+
+        MP4Reader::MP4ReadStatus status = mp4_reader->GetNextH264VideoSample(&sample, sample_size, duration, is_key_frame);
+        if (status == MP4Reader::MP4_READ_ERR) {
+            printf("[%u] Fail to get next H264 sample from MP4\n", index);
+            media_duration = mp4_reader->GetLastSampleDuration();
+            return true;
+        } else if (status == MP4Reader::MP4_READ_EOS) {
+            // Already get the end of current MP4 file, we will loop from the beginning.
+            mp4_reader.reset();
+
+            if (option_group.GetRepeatMode()) {
+                mp4_reader = std::make_shared<MP4Reader>(file_path);
+                status = mp4_reader->GetNextH264VideoSample(&sample, sample_size, duration, is_key_frame);
+                if (status != MP4Reader::MP4_READ_OK) {
+                    printf("[%u] Fail to loop back to the first sample\n", index);
+                    pacer_stream_id = 0;
+                    return false;
+                }
+            } else {
+                pacer_stream_id = 0;
+                return false;
+            }
+        }
+        media_duration = mp4_reader->GetLastSampleDuration();
+        if (sample_size == 0) {
+            printf("[%u] Fail because sample size is zero\n", index);
+            return true;
+        }
+
+        // The pacer calls us when the frame is due, so just push it out: as if captured now.
         // Append meta-data to sample buffer then copy sample to sample buffer
         unsigned int sample_buffer_offset = 0;
         {
-            sample_buffer[sample_buffer_offset++] = (is_key_frame) ? 0x01 : 0x00;
+            bool capture_time = option_group.GetCaptureTime();
+            sample_buffer[sample_buffer_offset++] = (is_key_frame ? FLAG_KEY_FRAME : 0) | (capture_time ? FLAG_CAPTURE_TIME : 0);
 
             *(unsigned int *)(&sample_buffer[sample_buffer_offset]) = static_cast<unsigned int>(duration);
             sample_buffer_offset += 4;
@@ -292,63 +435,180 @@ static bool ReadSample()
             *(unsigned int *)(&sample_buffer[sample_buffer_offset]) = sample_size;
             sample_buffer_offset += 4;
 
+            if (capture_time) {
+                *(unsigned long long int *)(&sample_buffer[sample_buffer_offset]) = g_get_real_time();
+                sample_buffer_offset += 8;
+            }
+
             memcpy(&sample_buffer[sample_buffer_offset], sample, sample_size);
             sample_buffer_offset += sample_size;
         }
 
-        websocket_client->SendData(sample_buffer, sample_buffer_offset);
+        if (websocket_client.SendData(sample_buffer, sample_buffer_offset)) {
+            frames_sent++;
+            bytes_sent += sample_buffer_offset;
+        } else {
+            frames_dropped++;
+        }
+
+        return true;
     }
 
-    // Update the waiting time point
-    wait_timepoint = std::chrono::steady_clock::now() + std::chrono::milliseconds(duration);
+    void OnConnected()
+    {
+        if (verbose) printf("Websocket connected\n");
+        connect_latency = websocket_client.GetConnectLatency();
+
+        // We could be reconnected after an error, just keep going with the running stream.
+        if (pacer_stream_id)
+            return;
+
+        mp4_reader = std::make_shared<MP4Reader>(file_path);
+        if (start_sample > 0)
+            mp4_reader->SkipToSyncSample(start_sample);
+        pacer_stream_id = stream_pacer->AddStream(sigc::mem_fun(*this, &CameraSession::ReadSample),
+                                                  mp4_reader->GetVideoTimeScale());
+    }
 
-    return true;
-}
+    void OnClosed()
+    {
+        printf("[%u] Websocket closed\n", index);
+        closed = true;
 
-static int Write(unsigned char* buf, int buf_size)
-{
-    static int i = 0;
-    printf("#%d Write: buf: %p(%02x%02x%02x%02x %c%c%c%c), size: %d\n", i++, buf, buf[0], buf[1], buf[2], buf[3], buf[4], buf[5], buf[6], buf[7], buf_size);
-    return fwrite(buf, 1, buf_size, fptr);
-}
+        if (pacer_stream_id) {
+            stream_pacer->RemoveStream(pacer_stream_id);
+            pacer_stream_id = 0;
+        }
+        mp4_reader.reset();
 
-static void OnWebsocketConnected(const std::string &file_path)
-{
-    printf("Websocket connected\n");
+        OnSessionClosed();
+    }
 
-    mp4_reader = std::make_shared<MP4Reader>(file_path);
-    Glib::signal_idle().connect(sigc::ptr_fun(&ReadSample));
+    void OnMessage(const std::string& msg)
+    {
+        printf("WebsocketMessage: %s\n", msg.c_str());
+    }
 
-    wait_timepoint = std::chrono::steady_clock::now();
-}
+    void OnData(const unsigned char *data, unsigned int data_size)
+    {
+        // If we test with echo server (echo.websocket.org),
+        // we will get data back so that we could mux and dump those data into mp4.
+        // Only make sense if we are the only camera.
+        if (option_group.GetConnections() > 1)
+            return;
 
-static void OnWebsocketClosed()
+        if (!fptr)
+            fptr = fopen("dump.mp4", "wb");
+        if (!fmp4_writer)
+            fmp4_writer = fMP4_CreateWriter(&Write);
+
+        bool tmp_is_key_frame = (data[0] & FLAG_KEY_FRAME);
+        unsigned int tmp_duration = *(unsigned int *)(&data[1]);
+        unsigned int tmp_size = *(unsigned int *)(&data[5]);
+        unsigned char *tmp_sample = const_cast<unsigned char *>(&data[(data[0] & FLAG_CAPTURE_TIME) ? 17 : 9]);
+        fMP4_WriteH264Sample(fmp4_writer, tmp_sample, tmp_size, tmp_is_key_frame, tmp_duration);
+    }
+
+    static void OnSessionClosed();
+
+    const unsigned int index;
+    const std::string file_path;
+    const unsigned int start_sample;
+    const bool verbose;
+
+    WebSocketClient websocket_client;
+    std::shared_ptr<MP4Reader> mp4_reader;
+    unsigned int pacer_stream_id;
+    bool closed;
+
+    unsigned long long int frames_sent;
+    unsigned long long int bytes_sent;
+    unsigned long long int frames_dropped;
+    long long int connect_latency;
+};
+
+std::vector<std::shared_ptr<CameraSession>> camera_sessions;
+
+void CameraSession::OnSessionClosed()
 {
-    printf("Websocket closed\n");
+    for (auto &session : camera_sessions) {
+        if (!session->IsClosed())
+            return;
+    }
+
+    // All cameras are gone
     mainloop->quit();
 }
 
-static void OnWebsocketMessage(const std::string& msg)
+// Set when the report is scheduled, so the first one covers its whole interval.
+static gint64 last_report_time = 0;
+
+static bool ReportStats()
 {
-    printf("WebsocketMessage: %s\n", msg.c_str());
+    static unsigned long long int total_frames = 0, total_bytes = 0;
+
+    gint64 now = g_get_monotonic_time();
+    double elapsed = (now - last_report_time) / 1000000.0;
+    last_report_time = now;
+    if (elapsed <= 0)
+        return true;
+
+    unsigned long long int frames = 0, bytes = 0, dropped = 0;
+    unsigned int connected = 0;
+    unsigned long long int queue_total = 0;
+    unsigned int queue_max = 0;
+    long long int connect_min = -1, connect_max = -1, connect_sum = 0, connect_count = 0;
+    for (auto &session : camera_sessions) {
+        session->TakeStats(frames, bytes, dropped);
+
+        if (session->IsConnected()) {
+            connected++;
+
+            unsigned int depth = session->GetSendQueueDepth();
+            queue_total += depth;
+            if (depth > queue_max) queue_max = depth;
+        }
+
+        long long int latency = session->TakeConnectLatency();
+        if (latency >= 0) {
+            if (connect_min < 0 || latency < connect_min) connect_min = latency;
+            if (latency > connect_max) connect_max = latency;
+            connect_sum += latency;
+            connect_count++;
+        }
+    }
+    total_frames += frames;
+    total_bytes += bytes;
+
+    printf("[stats] conns: %u/%zu, %.1f frames/s, %.2f Mbit/s, dropped: %llu, send queue: %llu KB (max %u KB), late: %lld ms",
+           connected, camera_sessions.size(),
+           frames / elapsed, bytes * 8 / elapsed / 1000000.0, dropped,
+           queue_total / 1024, queue_max / 1024,
+           stream_pacer->TakeMaxLateness() / 1000);
+    if (connect_count > 0) {
+        printf(", connect: %lld/%lld/%lld ms (min/avg/max of %lld)",
+               connect_min / 1000, connect_sum / connect_count / 1000, connect_max / 1000, connect_count);
+    }
+    printf(", total: %llu frames, %llu MB\n", total_frames, total_bytes / (1024 * 1024));
+
+    return true;
 }
 
-static void OnWebsocketData(const unsigned char *data, unsigned int data_size)
+static bool OnExit(gpointer data)
 {
-    // If we test with echo server (echo.websocket.org),
-    // we will get data back so that we could mux and dump those data into mp4.
-    {
-        if (!fptr)
-            fptr = fopen("dump.mp4", "wb");
-        if (!fmp4_writer)
-            fmp4_writer = fMP4_CreateWriter(&Write);
+    if (fmp4_writer) {
+        fMP4_ReleaseWriter(fmp4_writer);
+        fmp4_writer = nullptr;
+    }
 
-        bool tmp_is_key_frame = (data[0] == 0x01);
-        unsigned int tmp_duration = *(unsigned int *)(&data[1]);
-        unsigned int tmp_size = *(unsigned int *)(&data[5]);
-        unsigned char *tmp_sample = const_cast<unsigned char *>(&data[9]);
-        fMP4_WriteH264Sample(fmp4_writer, tmp_sample, tmp_size, tmp_is_key_frame, tmp_duration);
+    if (fptr) {
+        fclose(fptr);
+        fptr = nullptr;
     }
+
+    mainloop->quit();
+
+    return G_SOURCE_REMOVE;
 }
 
 int main (int argc, char **argv)
@@ -363,26 +623,58 @@ int main (int argc, char **argv)
         return 1;
     }
 
+    const std::vector<std::string> &file_paths = option_group.GetMp4FilePaths();
+    if (file_paths.empty()) {
+        printf("Please specify at least one MP4 file\n");
+        return 1;
+    }
+
     Gio::init();
 
-    websocket_client = std::make_shared<WebSocketClient>();
-    websocket_client->RegisterSignals(sigc::bind(sigc::ptr_fun(&OnWebsocketConnected), option_group.GetMp4FilePath()),
-                                      sigc::ptr_fun(&OnWebsocketMessage),
-                                      sigc::ptr_fun(&OnWebsocketData),
-                                      sigc::ptr_fun(&OnWebsocketClosed),
-                                      NotifyPingPongSlot());
+    stream_pacer = std::make_shared<StreamPacer>(option_group.GetSpeed());
 
-    if (!websocket_client->Connect(option_group.GetServer())) {
-        printf("Fail to connect websocket client to %s\n", option_group.GetServer().c_str());
-        return 1;
+    const unsigned int connections = option_group.GetConnections();
+    const bool load_mode = (connections > 1);
+    Glib::Rand rand;
+    for (unsigned int i = 0; i < connections; i++) {
+
+        // Spread the cameras over the given files and over the content of each file,
+        // so that they don't send their key frames at the same time.
+        const std::string &file_path = file_paths[i % file_paths.size()];
+        unsigned int start_sample = 0;
+        if (load_mode && option_group.GetOffsetJitter() > 0) {
+            start_sample = static_cast<unsigned int>(rand.get_int_range(0, option_group.GetOffsetJitter() + 1));
+        }
+
+        auto session = std::make_shared<CameraSession>(i, file_path, start_sample, !load_mode);
+        camera_sessions.push_back(session);
+
+        unsigned int delay = i * option_group.GetStagger();
+        if (delay == 0) {
+            if (!session->Connect(option_group.GetServer())) {
+                printf("Fail to connect websocket client to %s\n", option_group.GetServer().c_str());
+                return 1;
+            }
+        } else {
+            Glib::signal_timeout().connect(sigc::bind(sigc::mem_fun(*session, &CameraSession::ConnectLater),
+                                                      option_group.GetServer()), delay);
+        }
     }
 
-    printf("Start websocket client to %s\n", option_group.GetServer().c_str());
+    printf("Start %u websocket client(s) to %s\n", connections, option_group.GetServer().c_str());
+
+    if (load_mode || option_group.GetStatsInterval() > 0) {
+        unsigned int interval = (option_group.GetStatsInterval() > 0) ? option_group.GetStatsInterval() : 1;
+        last_report_time = g_get_monotonic_time();
+        Glib::signal_timeout().connect_seconds(sigc::ptr_fun(&ReportStats), interval);
+    }
 
     g_unix_signal_add(SIGINT, (GSourceFunc)OnExit, NULL);
     g_unix_signal_add(SIGTERM, (GSourceFunc)OnExit, NULL);
     mainloop = Glib::MainLoop::create();
     mainloop->run();
 
+    camera_sessions.clear();
+
     return 0;
 }
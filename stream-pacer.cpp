@@ -0,0 +1,140 @@
+#include "stream-pacer.hpp"
+
+// Limit the frames dispatched in one main loop iteration so that the websocket I/O is never starved.
+static const unsigned int max_dispatch_per_iteration = 64;
+
+StreamPacer::StreamPacer(double speed, GMainContext *context)
+        : speed(speed < 0 ? 0 : speed)
+        , next_stream_id(1)
+        , max_lateness(0)
+        , source(nullptr)
+{
+    static GSourceFuncs pacer_source_funcs = {
+            nullptr,            // prepare: the ready time is enough
+            nullptr,            // check
+            &OnSourceDispatch,  // dispatch
+            nullptr             // finalize
+    };
+
+    source = g_source_new(&pacer_source_funcs, sizeof(PacerSource));
+    reinterpret_cast<PacerSource *>(source)->pacer = this;
+    g_source_set_ready_time(source, -1);
+    g_source_attach(source, context);
+}
+
+StreamPacer::~StreamPacer()
+{
+    if (source) {
+        g_source_destroy(source);
+        g_source_unref(source);
+    }
+}
+
+unsigned int StreamPacer::AddStream(const PacedFrameSlot &slot, unsigned int timescale, unsigned int start_delay_ms)
+{
+    PacedStream stream;
+    stream.slot = slot;
+    stream.timescale = (timescale > 0) ? timescale : 1000;
+    stream.origin_time = g_get_monotonic_time() + static_cast<gint64>(start_delay_ms) * 1000;
+    stream.media_ticks = 0;
+
+    unsigned int stream_id = next_stream_id++;
+    streams[stream_id] = stream;
+
+    due_queue.push({stream.origin_time, stream_id});
+    Reschedule();
+
+    return stream_id;
+}
+
+void StreamPacer::RemoveStream(unsigned int stream_id)
+{
+    // The stale entry in the due queue is skipped when it is popped.
+    streams.erase(stream_id);
+}
+
+long long int StreamPacer::TakeMaxLateness()
+{
+    long long int lateness = max_lateness;
+    max_lateness = 0;
+    return lateness;
+}
+
+gint64 StreamPacer::GetDueTime(const PacedStream &stream) const
+{
+    if (speed == 0) {
+        return stream.origin_time;
+    }
+
+    // Always compute from the absolute media clock, so that rounding and dispatch delays never accumulate.
+    unsigned long long int media_us = stream.media_ticks / stream.timescale * 1000000 +
+                                      (stream.media_ticks % stream.timescale) * 1000000 / stream.timescale;
+    return stream.origin_time + static_cast<gint64>(media_us / speed);
+}
+
+void StreamPacer::Reschedule()
+{
+    // Drop the entries of removed streams so that they don't wake us up for nothing.
+    while (!due_queue.empty() && streams.find(due_queue.top().stream_id) == streams.end()) {
+        due_queue.pop();
+    }
+
+    if (due_queue.empty()) {
+        g_source_set_ready_time(source, -1);
+    } else {
+        g_source_set_ready_time(source, due_queue.top().due_time);
+    }
+}
+
+bool StreamPacer::Dispatch()
+{
+    gint64 now = g_get_monotonic_time();
+
+    unsigned int dispatched = 0;
+    while (!due_queue.empty() && due_queue.top().due_time <= now && dispatched < max_dispatch_per_iteration) {
+
+        DueEntry entry = due_queue.top();
+        due_queue.pop();
+
+        auto it = streams.find(entry.stream_id);
+        if (it == streams.end()) {
+            continue;
+        }
+
+        if (now - entry.due_time > max_lateness) {
+            max_lateness = now - entry.due_time;
+        }
+
+        // The slot may add or remove streams, so don't keep the iterator across the call.
+        PacedFrameSlot slot = it->second.slot;
+        unsigned long long int duration = 0;
+        bool keep = slot(duration);
+        dispatched++;
+
+        it = streams.find(entry.stream_id);
+        if (it == streams.end()) {
+            continue;
+        }
+        if (!keep) {
+            streams.erase(it);
+            continue;
+        }
+
+        if (speed == 0) {
+            // Unpaced: go to the back of the line so every stream gets its turn.
+            it->second.origin_time = now;
+        } else {
+            it->second.media_ticks += duration;
+        }
+        due_queue.push({GetDueTime(it->second), entry.stream_id});
+    }
+
+    Reschedule();
+
+    return true;
+}
+
+gboolean StreamPacer::OnSourceDispatch(GSource *source, GSourceFunc callback, gpointer data)
+{
+    return reinterpret_cast<PacerSource *>(source)->pacer->Dispatch() ? G_SOURCE_CONTINUE : G_SOURCE_REMOVE;
+}
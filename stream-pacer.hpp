@@ -0,0 +1,76 @@
+#pragma once
+
+#include <functional>
+#include <map>
+#include <queue>
+#include <vector>
+
+#include <glib.h>
+#include <sigc++/sigc++.h>
+
+/*
+ * Dispatch a frame of the stream and report its duration (in the stream timescale)
+ * so that the pacer knows when the next frame is due. Return false to stop the stream.
+ */
+typedef sigc::slot<bool, unsigned long long int&> PacedFrameSlot;
+
+class StreamPacer
+{
+public:
+
+    /*
+     * speed: 1.0 for real time, N for N times faster, 0 for unpaced (as fast as the main loop allows).
+     */
+    StreamPacer(double speed = 1.0, GMainContext *context = nullptr);
+
+    ~StreamPacer();
+
+    // Register a stream. The first frame is due at now + start_delay_ms.
+    unsigned int AddStream(const PacedFrameSlot &slot, unsigned int timescale, unsigned int start_delay_ms = 0);
+
+    void RemoveStream(unsigned int stream_id);
+
+    unsigned int GetStreamCount() const { return static_cast<unsigned int>(streams.size()); }
+
+    // The worst lateness (in us) of a dispatched frame since last call.
+    long long int TakeMaxLateness();
+
+private:
+
+    struct PacedStream
+    {
+        PacedFrameSlot slot;
+        unsigned int timescale;
+        gint64 origin_time;                 // Monotonic time (us) of the first frame
+        unsigned long long int media_ticks; // Media time of the next frame since the first frame
+    };
+
+    struct DueEntry
+    {
+        gint64 due_time;
+        unsigned int stream_id;
+
+        bool operator>(const DueEntry &other) const { return due_time > other.due_time; }
+    };
+
+    gint64 GetDueTime(const PacedStream &stream) const;
+
+    void Reschedule();
+
+    bool Dispatch();
+
+    static gboolean OnSourceDispatch(GSource *source, GSourceFunc callback, gpointer data);
+
+    struct PacerSource
+    {
+        GSource source;
+        StreamPacer *pacer;
+    };
+
+    const double speed;
+    unsigned int next_stream_id;
+    long long int max_lateness;
+    std::map<unsigned int, PacedStream> streams;
+    std::priority_queue<DueEntry, std::vector<DueEntry>, std::greater<DueEntry>> due_queue;
+    GSource *source;
+};
@@ -2,6 +2,9 @@
 
 #include <giomm-2.4/giomm.h>
 
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+
 void WebSocketClient::RegisterSignals(const NotifyConnectedSlot &connect_slot,
                                          const NotifyMessageSlot &message_slot,
                                          const NotifyDataSlot &data_slot,
@@ -26,43 +29,43 @@ void WebSocketClient::RegisterSignals(const NotifyConnectedSlot &connect_slot,
 
 bool WebSocketClient::SendMessage(const std::string &message)
 {
-    printf("SendMessage ->\n");
+    if (verbose) printf("SendMessage ->\n");
 
     if (message.empty()) {
-        printf("SendMessage <- Empty message\n");
+        if (verbose) printf("SendMessage <- Empty message\n");
         return true;
     }
 
     if (!websocket_connection) {
-        printf("SendMessage <- WebSocket connection is NULL\n");
+        if (verbose) printf("SendMessage <- WebSocket connection is NULL\n");
         return false;
     }
 
-    printf("message: %s\n", message.c_str());
+    if (verbose) printf("message: %s\n", message.c_str());
 
     soup_websocket_connection_send_text(websocket_connection, message.c_str());
 
-    printf("SendMessage <-\n");
+    if (verbose) printf("SendMessage <-\n");
     return true;
 }
 
 bool WebSocketClient::SendData(const unsigned char *data, unsigned int data_size)
 {
-    printf("SendData -> Size: %d\n", data_size);
+    if (verbose) printf("SendData -> Size: %d\n", data_size);
 
     if (data == nullptr || data_size == 0) {
-        printf("SendData <- Empty data\n");
+        if (verbose) printf("SendData <- Empty data\n");
         return true;
     }
 
     if (!websocket_connection) {
-        printf("SendData <- WebSocket connection is NULL\n");
+        if (verbose) printf("SendData <- WebSocket connection is NULL\n");
         return false;
     }
 
     soup_websocket_connection_send_binary(websocket_connection, data, data_size);
 
-    printf("SendData <-\n");
+    if (verbose) printf("SendData <-\n");
     return true;
 }
 
@@ -79,10 +82,29 @@ bool WebSocketClient::IsConnected() const
     return (websocket_connection != nullptr);
 }
 
+unsigned int WebSocketClient::GetSendQueueDepth() const
+{
+    if (!websocket_connection)
+        return 0;
+
+    // Only plain TCP connections expose their socket. (Not for TLS connections)
+    GIOStream *io_stream = soup_websocket_connection_get_io_stream(websocket_connection);
+    if (!G_IS_SOCKET_CONNECTION(io_stream))
+        return 0;
+
+    GSocket *socket = g_socket_connection_get_socket(G_SOCKET_CONNECTION(io_stream));
+    int queued = 0;
+    if (ioctl(g_socket_get_fd(socket), SIOCOUTQ, &queued) < 0)
+        return 0;
+
+    return static_cast<unsigned int>(queued);
+}
+
 bool WebSocketClient::Connect(const std::string &server_addr)
 {
     this->websocket_connection = nullptr;
     this->server_addr = server_addr;
+    this->connect_start_time = g_get_monotonic_time();
 
     // Create the soup session with WS or WSS
     SoupSession *session = soup_session_new();
@@ -142,7 +164,8 @@ void WebSocketClient::OnConnectionImp(SoupSession *session, GAsyncResult *res)
         g_clear_object(&conn);
         return;
     }
-    printf("Success to connect to Websocket server\n");
+    connect_latency = g_get_monotonic_time() - connect_start_time;
+    printf("Success to connect to Websocket server (%lld ms)\n", connect_latency / 1000);
 
     g_signal_connect(conn, "message",  G_CALLBACK(OnMessage),  this);
     g_signal_connect(conn, "closing",  G_CALLBACK(OnClosing),  this);
@@ -169,7 +192,7 @@ void WebSocketClient::OnMessageImp(SoupWebsocketConnection *conn, int type, GByt
 
         unsigned int data_size;
         const unsigned char *data = static_cast<const unsigned char *>(g_bytes_get_data(gbytes, (gsize *)&data_size));
-        printf("Received binary data: (%d bytes)\n", data_size);
+        if (verbose) printf("Received binary data: (%d bytes)\n", data_size);
         data_signal.emit(data, data_size);
     }
     else {
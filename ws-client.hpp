@@ -23,7 +23,7 @@ class WebSocketClient
 {
 public:
 
-    WebSocketClient() : websocket_connection(nullptr) {}
+    WebSocketClient() : websocket_connection(nullptr), verbose(true), connect_start_time(0), connect_latency(-1) {}
 
     ~WebSocketClient() {}
 
@@ -35,6 +35,15 @@ public:
 
     bool IsConnected() const;
 
+    // Turn off the logs on the data path, which matters when running many clients.
+    void SetVerbose(bool verbose) { this->verbose = verbose; }
+
+    // Bytes waiting in the kernel send queue of the underlying socket.
+    unsigned int GetSendQueueDepth() const;
+
+    // Time (us) taken by the last successful connect, or -1 if not connected yet.
+    long long int GetConnectLatency() const { return connect_latency; }
+
     bool Connect(const std::string &server_addr);
 
     bool SendMessage(const std::string &message);
@@ -84,4 +93,7 @@ private:
     NotifyClosedSignal closed_signal;
     NotifyPingPongSignal pingpong_signal;
     SoupWebsocketConnection* websocket_connection;
+    bool verbose;
+    gint64 connect_start_time;
+    long long int connect_latency;
 };
\ No newline at end of file
@@ -0,0 +1,968 @@
+#include "ws-server.hpp"
+
+#include <atomic>
+#include <algorithm>
+#include <cstring>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Reserved epoll ids. The connection ids start after them.
+static const unsigned long long int listen_event_id = 0;
+static const unsigned long long int wakeup_event_id = 1;
+static std::atomic<unsigned long long int> connection_id_counter(2);
+
+static const size_t max_handshake_size = 8 * 1024;
+static const size_t read_chunk_size = 64 * 1024;
+static const size_t max_read_per_event = 1024 * 1024;
+static const int max_iov_per_write = 64;
+
+enum WebSocketOpcode
+{
+    WS_OPCODE_CONTINUATION = 0x0,
+    WS_OPCODE_TEXT         = 0x1,
+    WS_OPCODE_BINARY       = 0x2,
+    WS_OPCODE_CLOSE        = 0x8,
+    WS_OPCODE_PING         = 0x9,
+    WS_OPCODE_PONG         = 0xA
+};
+
+/*
+ * SHA-1 and base64, only used to compute Sec-WebSocket-Accept.
+ */
+static std::string SHA1(const std::string &input)
+{
+    unsigned int h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+
+    std::string data = input;
+    unsigned long long int bit_length = static_cast<unsigned long long int>(input.size()) * 8;
+    data.push_back(static_cast<char>(0x80));
+    while (data.size() % 64 != 56)
+        data.push_back(0);
+    for (int i = 7; i >= 0; i--)
+        data.push_back(static_cast<char>((bit_length >> (i * 8)) & 0xff));
+
+    for (size_t chunk = 0; chunk < data.size(); chunk += 64) {
+        unsigned int w[80];
+        for (int i = 0; i < 16; i++) {
+            w[i] = (static_cast<unsigned char>(data[chunk + i * 4]) << 24) |
+                   (static_cast<unsigned char>(data[chunk + i * 4 + 1]) << 16) |
+                   (static_cast<unsigned char>(data[chunk + i * 4 + 2]) << 8) |
+                   (static_cast<unsigned char>(data[chunk + i * 4 + 3]));
+        }
+        for (int i = 16; i < 80; i++) {
+            unsigned int v = w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16];
+            w[i] = (v << 1) | (v >> 31);
+        }
+
+        unsigned int a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for (int i = 0; i < 80; i++) {
+            unsigned int f, k;
+            if (i < 20)      { f = (b & c) | (~b & d);           k = 0x5A827999; }
+            else if (i < 40) { f = b ^ c ^ d;                    k = 0x6ED9EBA1; }
+            else if (i < 60) { f = (b & c) | (b & d) | (c & d);  k = 0x8F1BBCDC; }
+            else             { f = b ^ c ^ d;                    k = 0xCA62C1D6; }
+
+            unsigned int temp = ((a << 5) | (a >> 27)) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = (b << 30) | (b >> 2);
+            b = a;
+            a = temp;
+        }
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+    }
+
+    std::string digest;
+    for (int i = 0; i < 5; i++) {
+        for (int j = 3; j >= 0; j--)
+            digest.push_back(static_cast<char>((h[i] >> (j * 8)) & 0xff));
+    }
+    return digest;
+}
+
+static std::string Base64Encode(const std::string &input)
+{
+    static const char *table = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    std::string output;
+    size_t i = 0;
+    for (; i + 2 < input.size(); i += 3) {
+        unsigned int v = (static_cast<unsigned char>(input[i]) << 16) |
+                         (static_cast<unsigned char>(input[i + 1]) << 8) |
+                         (static_cast<unsigned char>(input[i + 2]));
+        output.push_back(table[(v >> 18) & 0x3f]);
+        output.push_back(table[(v >> 12) & 0x3f]);
+        output.push_back(table[(v >> 6) & 0x3f]);
+        output.push_back(table[v & 0x3f]);
+    }
+    if (i + 1 == input.size()) {
+        unsigned int v = static_cast<unsigned char>(input[i]) << 16;
+        output.push_back(table[(v >> 18) & 0x3f]);
+        output.push_back(table[(v >> 12) & 0x3f]);
+        output += "==";
+    } else if (i + 2 == input.size()) {
+        unsigned int v = (static_cast<unsigned char>(input[i]) << 16) | (static_cast<unsigned char>(input[i + 1]) << 8);
+        output.push_back(table[(v >> 18) & 0x3f]);
+        output.push_back(table[(v >> 12) & 0x3f]);
+        output.push_back(table[(v >> 6) & 0x3f]);
+        output.push_back('=');
+    }
+    return output;
+}
+
+static std::string ToLower(std::string s)
+{
+    std::transform(s.begin(), s.end(), s.begin(), ::tolower);
+    return s;
+}
+
+static std::string Trim(const std::string &s)
+{
+    size_t begin = s.find_first_not_of(" \t");
+    size_t end = s.find_last_not_of(" \t\r");
+    return (begin == std::string::npos) ? std::string() : s.substr(begin, end - begin + 1);
+}
+
+static bool IsNumber(const std::string &s)
+{
+    return !s.empty() && s.size() < 20 && s.find_first_not_of("0123456789") == std::string::npos;
+}
+
+// The part [begin, end) of a file of size bytes asked by a Range header. Return false if it can't be satisfied.
+// Anything else than a single byte range is ignored, as allowed: the whole file goes then.
+static bool ParseRange(const std::string &range, size_t size, size_t &begin, size_t &end)
+{
+    begin = 0;
+    end = size;
+    if (range.compare(0, 6, "bytes=") != 0 || range.find(',') != std::string::npos)
+        return true;
+
+    std::string spec = Trim(range.substr(6));
+    size_t dash = spec.find('-');
+    if (dash == std::string::npos)
+        return true;
+    std::string first = spec.substr(0, dash);
+    std::string last = spec.substr(dash + 1);
+
+    // bytes=-N: the last N bytes
+    if (first.empty()) {
+        if (!IsNumber(last))
+            return true;
+        size_t count = std::min(static_cast<size_t>(strtoull(last.c_str(), nullptr, 10)), size);
+        begin = size - count;
+        return count > 0;
+    }
+
+    // bytes=N- or bytes=N-M, M included
+    if (!IsNumber(first) || (!last.empty() && !IsNumber(last)))
+        return true;
+    size_t first_byte = strtoull(first.c_str(), nullptr, 10);
+    size_t last_byte = last.empty() ? first_byte : strtoull(last.c_str(), nullptr, 10);
+    if (last_byte < first_byte)
+        return true;
+    if (first_byte >= size)
+        return false;
+    begin = first_byte;
+    end = last.empty() ? size : std::min(last_byte + 1, size);
+    return true;
+}
+
+/*
+ * WebSocketConnection
+ */
+WebSocketConnection::WebSocketConnection(WebSocketWorker *worker, int fd, unsigned long long int id)
+        : worker(worker)
+        , id(id)
+        , state(STATE_HANDSHAKE)
+        , message_opcode(0)
+        , fd(fd)
+        , watch_writable(false)
+        , close_after_flush(false)
+        , http_chunked(false)
+        , output_bytes(0)
+{
+}
+
+WebSocketConnection::~WebSocketConnection()
+{
+    if (fd >= 0)
+        close(fd);
+}
+
+std::string WebSocketConnection::GetQueryParameter(const std::string &name) const
+{
+    size_t pos = 0;
+    while (pos < query.size()) {
+        size_t end = query.find('&', pos);
+        if (end == std::string::npos) end = query.size();
+
+        std::string pair = query.substr(pos, end - pos);
+        size_t equal = pair.find('=');
+        if (pair.substr(0, equal) == name)
+            return (equal == std::string::npos) ? std::string() : pair.substr(equal + 1);
+
+        pos = end + 1;
+    }
+    return std::string();
+}
+
+std::string WebSocketConnection::GetHeader(const std::string &name) const
+{
+    auto it = headers.find(name);
+    return (it == headers.end()) ? std::string() : it->second;
+}
+
+bool WebSocketConnection::IsHttp() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return (state == STATE_HTTP);
+}
+
+bool WebSocketConnection::SendBinary(const unsigned char *data, size_t size)
+{
+    return SendBinary(std::make_shared<const std::vector<unsigned char>>(data, data + size));
+}
+
+bool WebSocketConnection::SendBinary(const SharedBuffer &buffer)
+{
+    return SendFrame(WS_OPCODE_BINARY, buffer);
+}
+
+bool WebSocketConnection::SendBinary(const SharedBuffer &head, const SharedBuffer &body, size_t body_offset)
+{
+    Segment payload[2] = {{head, 0, nullptr, 0}, {body, body_offset, nullptr, 0}};
+    return SendFrame(WS_OPCODE_BINARY, payload, 2);
+}
+
+bool WebSocketConnection::SendText(const std::string &text)
+{
+    return SendFrame(WS_OPCODE_TEXT, std::make_shared<const std::vector<unsigned char>>(text.begin(), text.end()));
+}
+
+bool WebSocketConnection::SendHttpResponse(const std::string &status, const std::string &headers, bool chunked, size_t content_length)
+{
+    std::string response = "HTTP/1.1 " + status + "\r\nConnection: close\r\n" + headers;
+    if (chunked) {
+        response += "Transfer-Encoding: chunked\r\n\r\n";
+    } else {
+        response += "Content-Length: " + std::to_string(content_length) + "\r\n\r\n";
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (state != STATE_HTTP)
+            return false;
+        http_chunked = chunked;
+    }
+    return SendRaw({std::make_shared<const std::vector<unsigned char>>(response.begin(), response.end()), 0, nullptr, 0});
+}
+
+bool WebSocketConnection::SendHttpFile(const std::string &path, const std::string &content_type)
+{
+    int file_fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (file_fd < 0)
+        return false;
+    SharedFile file(new int(file_fd), [](const int *fd) { close(*fd); delete fd; });
+
+    struct stat file_stat;
+    if (fstat(file_fd, &file_stat) < 0 || !S_ISREG(file_stat.st_mode))
+        return false;
+
+    // The size when asked: a file being recorded keeps growing.
+    size_t size = static_cast<size_t>(file_stat.st_size);
+    size_t begin, end;
+    if (!ParseRange(GetHeader("range"), size, begin, end)) {
+        SendHttpResponse("416 Range Not Satisfiable", "Content-Range: bytes */" + std::to_string(size) + "\r\n", false);
+        Close();
+        return true;
+    }
+
+    std::string headers = "Content-Type: " + content_type + "\r\nAccept-Ranges: bytes\r\n";
+    bool partial = (begin > 0 || end < size);
+    if (partial)
+        headers += "Content-Range: bytes " + std::to_string(begin) + "-" + std::to_string(end - 1) + "/" + std::to_string(size) + "\r\n";
+
+    // The file goes from the page cache to the socket, never through user space.
+    if (SendHttpResponse(partial ? "206 Partial Content" : "200 OK", headers, false, end - begin) && end > begin)
+        SendRaw({nullptr, begin, file, end});
+    Close();
+    return true;
+}
+
+size_t WebSocketConnection::GetQueuedBytes() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return output_bytes;
+}
+
+bool WebSocketConnection::IsOpen() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return (fd >= 0 && !close_after_flush);
+}
+
+void WebSocketConnection::Close()
+{
+    // Say goodbye, then let the owner worker tear down the connection once the close frame is out.
+    SendFrame(WS_OPCODE_CLOSE, std::make_shared<const std::vector<unsigned char>>());
+
+    std::lock_guard<std::mutex> lock(mutex);
+    close_after_flush = true;
+    if (fd >= 0 && output.empty())
+        shutdown(fd, SHUT_RDWR);
+}
+
+void WebSocketConnection::RequestDrain()
+{
+    // The socket is level-triggered: watching EPOLLOUT reports it right away if there is room.
+    std::lock_guard<std::mutex> lock(mutex);
+    bool is_stream = (state == STATE_OPEN || (state == STATE_HTTP && http_chunked));
+    if (fd >= 0 && !close_after_flush && is_stream && !watch_writable)
+        WatchWritableLocked(true);
+}
+
+bool WebSocketConnection::SendFrame(unsigned char opcode, const SharedBuffer &payload)
+{
+    Segment segment = {payload, 0, nullptr, 0};
+    return SendFrame(opcode, &segment, 1);
+}
+
+bool WebSocketConnection::SendFrame(unsigned char opcode, const Segment *payload, size_t count)
+{
+    // The end of an HTTP chunk.
+    static const SharedBuffer chunk_end = std::make_shared<const std::vector<unsigned char>>(std::initializer_list<unsigned char>{'\r', '\n'});
+
+    size_t size = 0;
+    for (size_t i = 0; i < count; i++)
+        size += payload[i].buffer->size() - payload[i].offset;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (fd < 0 || close_after_flush)
+        return false;
+
+    auto header = std::make_shared<std::vector<unsigned char>>();
+    if (!GetFrameHeaderLocked(opcode, size, *header))
+        return false;
+
+    PushLocked({header, 0, nullptr, 0});
+    for (size_t i = 0; i < count; i++)
+        PushLocked(payload[i]);
+    if (state == STATE_HTTP && http_chunked && opcode != WS_OPCODE_CLOSE)
+        PushLocked({chunk_end, 0, nullptr, 0});
+
+    if (!SendQueuedLocked()) {
+        shutdown(fd, SHUT_RDWR);
+        return false;
+    }
+    return true;
+}
+
+bool WebSocketConnection::GetFrameHeaderLocked(unsigned char opcode, size_t size, std::vector<unsigned char> &header) const
+{
+    if (state == STATE_HTTP) {
+        // Nothing to add after a response of known length. The close is the last chunk of a chunked one.
+        if (opcode == WS_OPCODE_CLOSE) {
+            if (http_chunked)
+                header.assign({'0', '\r', '\n', '\r', '\n'});
+            return true;
+        }
+
+        // An empty chunk would end the body.
+        if (!http_chunked || size == 0 || (opcode != WS_OPCODE_BINARY && opcode != WS_OPCODE_TEXT))
+            return false;
+
+        char size_line[24];
+        int length = snprintf(size_line, sizeof(size_line), "%zx\r\n", size);
+        header.assign(size_line, size_line + length);
+        return true;
+    }
+
+    if (state != STATE_OPEN)
+        return false;
+
+    header.reserve(10);
+    header.push_back(0x80 | opcode);
+    if (size < 126) {
+        header.push_back(static_cast<unsigned char>(size));
+    } else if (size <= 0xffff) {
+        header.push_back(126);
+        header.push_back(static_cast<unsigned char>(size >> 8));
+        header.push_back(static_cast<unsigned char>(size));
+    } else {
+        header.push_back(127);
+        for (int i = 7; i >= 0; i--)
+            header.push_back(static_cast<unsigned char>((static_cast<unsigned long long int>(size) >> (i * 8)) & 0xff));
+    }
+    return true;
+}
+
+bool WebSocketConnection::SendRaw(const Segment &segment)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (fd < 0)
+        return false;
+
+    PushLocked(segment);
+    return SendQueuedLocked();
+}
+
+void WebSocketConnection::PushLocked(const Segment &segment)
+{
+    size_t size = (segment.file ? segment.file_end : segment.buffer->size()) - segment.offset;
+    if (size == 0)
+        return;
+    output.push_back(segment);
+    output_bytes += size;
+}
+
+bool WebSocketConnection::SendQueuedLocked()
+{
+    // If the socket is already known to be full, the worker will flush when it is writable again.
+    if (!watch_writable) {
+        if (!FlushLocked())
+            return false;
+        if (!output.empty())
+            WatchWritableLocked(true);
+    }
+    return true;
+}
+
+void WebSocketConnection::SendHttpError(const std::string &status)
+{
+    std::string response = "HTTP/1.1 " + status + "\r\nConnection: close\r\nContent-Length: 0\r\n\r\n";
+    SendRaw({std::make_shared<const std::vector<unsigned char>>(response.begin(), response.end()), 0, nullptr, 0});
+}
+
+bool WebSocketConnection::FlushLocked()
+{
+    while (!output.empty()) {
+        Segment &front = output.front();
+        if (front.file) {
+            off_t offset = static_cast<off_t>(front.offset);
+            ssize_t sent = sendfile(fd, *front.file, &offset, front.file_end - front.offset);
+            if (sent < 0) {
+                if (errno == EINTR) continue;
+                return (errno == EAGAIN || errno == EWOULDBLOCK);
+            }
+            if (sent == 0)
+                return false; // The file got shorter
+
+            output_bytes -= sent;
+            front.offset += sent;
+            if (front.offset == front.file_end)
+                output.pop_front();
+            continue;
+        }
+
+        // The buffers up to the next file, in one call.
+        struct iovec iov[max_iov_per_write];
+        int iov_count = 0;
+        for (auto it = output.begin(); it != output.end() && !it->file && iov_count < max_iov_per_write; ++it, ++iov_count) {
+            iov[iov_count].iov_base = const_cast<unsigned char *>(it->buffer->data()) + it->offset;
+            iov[iov_count].iov_len  = it->buffer->size() - it->offset;
+        }
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iov_count;
+
+        ssize_t sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            return (errno == EAGAIN || errno == EWOULDBLOCK);
+        }
+
+        output_bytes -= sent;
+        while (sent > 0) {
+            Segment &segment = output.front();
+            size_t remain = segment.buffer->size() - segment.offset;
+            if (static_cast<size_t>(sent) >= remain) {
+                sent -= remain;
+                output.pop_front();
+            } else {
+                segment.offset += sent;
+                sent = 0;
+            }
+        }
+    }
+    return true;
+}
+
+void WebSocketConnection::WatchWritableLocked(bool enable)
+{
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN | EPOLLRDHUP | (enable ? static_cast<unsigned int>(EPOLLOUT) : 0u);
+    event.data.u64 = id;
+    epoll_ctl(worker->epoll_fd, EPOLL_CTL_MOD, fd, &event);
+    watch_writable = enable;
+}
+
+bool WebSocketConnection::OnWritable(WebSocketServer *server)
+{
+    bool drained = false;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (fd < 0)
+            return false;
+
+        if (!FlushLocked())
+            return false;
+
+        if (output.empty()) {
+            WatchWritableLocked(false);
+            if (close_after_flush)
+                shutdown(fd, SHUT_RDWR);
+            else
+                drained = (state == STATE_OPEN || state == STATE_HTTP);
+        }
+    }
+
+    // Not holding the lock, the listener is going to send.
+    if (drained)
+        server->GetListener()->OnDrain(shared_from_this());
+    return true;
+}
+
+bool WebSocketConnection::OnReadable(WebSocketServer *server)
+{
+    size_t total = 0;
+    while (total < max_read_per_event) {
+        size_t offset = input.size();
+        input.resize(offset + read_chunk_size);
+
+        ssize_t received = recv(fd, input.data() + offset, read_chunk_size, 0);
+        if (received <= 0) {
+            input.resize(offset);
+            if (received < 0 && errno == EINTR) continue;
+            if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            return false; // Closed by peer or error
+        }
+        input.resize(offset + received);
+        total += received;
+    }
+
+    if (state == STATE_HANDSHAKE && !HandleHandshake(server))
+        return false;
+
+    if (state == STATE_OPEN)
+        return HandleFrames(server);
+
+    // Nothing is expected after a plain HTTP request.
+    if (state == STATE_HTTP)
+        input.clear();
+    return true;
+}
+
+bool WebSocketConnection::HandleHandshake(WebSocketServer *server)
+{
+    static const char *terminator = "\r\n\r\n";
+    auto end = std::search(input.begin(), input.end(), terminator, terminator + 4);
+    if (end == input.end()) {
+        return (input.size() <= max_handshake_size);
+    }
+
+    std::string request(input.begin(), end);
+    input.erase(input.begin(), end + 4);
+
+    // Request line: GET /path?query HTTP/1.1
+    size_t line_end = request.find("\r\n");
+    std::string request_line = request.substr(0, line_end);
+    size_t method_end = request_line.find(' ');
+    size_t target_end = request_line.find(' ', method_end + 1);
+    if (method_end == std::string::npos || target_end == std::string::npos || request_line.substr(0, method_end) != "GET") {
+        SendHttpError("405 Method Not Allowed");
+        return false;
+    }
+
+    std::string target = request_line.substr(method_end + 1, target_end - method_end - 1);
+    size_t query_start = target.find('?');
+    path = target.substr(0, query_start);
+    query = (query_start == std::string::npos) ? std::string() : target.substr(query_start + 1);
+
+    size_t pos = (line_end == std::string::npos) ? request.size() : line_end + 2;
+    while (pos < request.size()) {
+        size_t next = request.find("\r\n", pos);
+        if (next == std::string::npos) next = request.size();
+
+        std::string line = request.substr(pos, next - pos);
+        size_t colon = line.find(':');
+        if (colon != std::string::npos)
+            headers[ToLower(Trim(line.substr(0, colon)))] = Trim(line.substr(colon + 1));
+
+        pos = next + 2;
+    }
+
+    if (ToLower(GetHeader("upgrade")) != "websocket") {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            state = STATE_HTTP;
+        }
+        if (!server->GetListener()->OnHttpRequest(shared_from_this())) {
+            SendHttpResponse("404 Not Found", "", false);
+            Close();
+        }
+        return true;
+    }
+
+    auto key = headers.find("sec-websocket-key");
+    if (key == headers.end()) {
+        SendHttpError("400 Bad Request");
+        return false;
+    }
+
+    std::string accept = Base64Encode(SHA1(key->second + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"));
+    std::string response = "HTTP/1.1 101 Switching Protocols\r\n"
+                           "Upgrade: websocket\r\n"
+                           "Connection: Upgrade\r\n"
+                           "Sec-WebSocket-Accept: " + accept + "\r\n\r\n";
+    if (!SendRaw({std::make_shared<const std::vector<unsigned char>>(response.begin(), response.end()), 0, nullptr, 0}))
+        return false;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        state = STATE_OPEN;
+    }
+
+    return server->GetListener()->OnOpen(shared_from_this());
+}
+
+bool WebSocketConnection::HandleFrames(WebSocketServer *server)
+{
+    size_t pos = 0;
+    bool keep = true;
+    while (keep && input.size() - pos >= 2) {
+        unsigned char *frame = input.data() + pos;
+        size_t available = input.size() - pos;
+
+        bool fin = (frame[0] & 0x80) != 0;
+        unsigned char opcode = frame[0] & 0x0f;
+        bool masked = (frame[1] & 0x80) != 0;
+        unsigned long long int length = frame[1] & 0x7f;
+        size_t header_size = 2;
+
+        if (length == 126) {
+            if (available < 4) break;
+            length = (frame[2] << 8) | frame[3];
+            header_size = 4;
+        } else if (length == 127) {
+            if (available < 10) break;
+            length = 0;
+            for (int i = 0; i < 8; i++)
+                length = (length << 8) | frame[2 + i];
+            header_size = 10;
+        }
+
+        // Client frames must be masked
+        if (!masked || length > server->GetMaxMessageSize() ||
+            message.size() + length > server->GetMaxMessageSize()) {
+            printf("Drop websocket connection %llu: invalid frame\n", id);
+            return false;
+        }
+
+        if (available < header_size + 4 + length) break;
+
+        const unsigned char *mask = frame + header_size;
+        unsigned char *payload = frame + header_size + 4;
+        for (unsigned long long int i = 0; i < length; i++)
+            payload[i] ^= mask[i & 3];
+
+        pos += header_size + 4 + length;
+
+        if (opcode >= WS_OPCODE_CLOSE) {
+            if (opcode == WS_OPCODE_PING) {
+                SendFrame(WS_OPCODE_PONG, std::make_shared<const std::vector<unsigned char>>(payload, payload + length));
+            } else if (opcode == WS_OPCODE_CLOSE) {
+                Close();
+                keep = false;
+            }
+            continue;
+        }
+
+        if (opcode != WS_OPCODE_CONTINUATION) {
+            message_opcode = opcode;
+            if (fin && message.empty()) {
+                // The common case: a message in a single frame, no need to copy it.
+                server->GetListener()->OnMessage(shared_from_this(), payload, length, opcode == WS_OPCODE_BINARY);
+                continue;
+            }
+            message.clear();
+        }
+
+        message.insert(message.end(), payload, payload + length);
+        if (fin) {
+            server->GetListener()->OnMessage(shared_from_this(), message.data(), message.size(),
+                                             message_opcode == WS_OPCODE_BINARY);
+            message.clear();
+        }
+    }
+
+    input.erase(input.begin(), input.begin() + pos);
+    return true;
+}
+
+void WebSocketConnection::OnClosed()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (fd >= 0) {
+        close(fd);
+        fd = -1;
+    }
+    state = STATE_CLOSED;
+    output.clear();
+    output_bytes = 0;
+}
+
+/*
+ * WebSocketWorker
+ */
+WebSocketWorker::WebSocketWorker(WebSocketServer *server)
+        : server(server)
+        , epoll_fd(-1)
+        , listen_fd(-1)
+        , wakeup_fd(-1)
+        , running(false)
+{
+}
+
+WebSocketWorker::~WebSocketWorker()
+{
+    Stop();
+    Join();
+
+    if (listen_fd >= 0) close(listen_fd);
+    if (wakeup_fd >= 0) close(wakeup_fd);
+    if (epoll_fd >= 0) close(epoll_fd);
+}
+
+bool WebSocketWorker::Start(unsigned short port)
+{
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (epoll_fd < 0 || wakeup_fd < 0 || listen_fd < 0) {
+        printf("Fail to create worker fds: %s\n", strerror(errno));
+        return false;
+    }
+
+    int enable = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable));
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(port);
+    if (bind(listen_fd, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(listen_fd, SOMAXCONN) < 0) {
+        printf("Fail to listen on port %d: %s\n", port, strerror(errno));
+        return false;
+    }
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.u64 = listen_event_id;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event);
+    event.data.u64 = wakeup_event_id;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wakeup_fd, &event);
+
+    running = true;
+    thread = std::thread(&WebSocketWorker::Run, this);
+    return true;
+}
+
+void WebSocketWorker::Stop()
+{
+    if (!running.exchange(false))
+        return;
+
+    unsigned long long int value = 1;
+    if (write(wakeup_fd, &value, sizeof(value)) < 0) {
+        printf("Fail to wake up worker: %s\n", strerror(errno));
+    }
+}
+
+void WebSocketWorker::Join()
+{
+    if (thread.joinable())
+        thread.join();
+}
+
+size_t WebSocketWorker::GetConnectionCount() const
+{
+    std::lock_guard<std::mutex> lock(connections_mutex);
+    return connections.size();
+}
+
+void WebSocketWorker::Run()
+{
+    const int max_events = 256;
+    struct epoll_event events[max_events];
+
+    while (running) {
+        int count = epoll_wait(epoll_fd, events, max_events, -1);
+        if (count < 0) {
+            if (errno == EINTR) continue;
+            printf("epoll_wait fails: %s\n", strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < count; i++) {
+            unsigned long long int event_id = events[i].data.u64;
+            if (event_id == listen_event_id) {
+                Accept();
+                continue;
+            }
+            if (event_id == wakeup_event_id) {
+                unsigned long long int value;
+                while (read(wakeup_fd, &value, sizeof(value)) > 0) {}
+                continue;
+            }
+
+            std::shared_ptr<WebSocketConnection> connection;
+            {
+                std::lock_guard<std::mutex> lock(connections_mutex);
+                auto it = connections.find(event_id);
+                if (it == connections.end()) continue;
+                connection = it->second;
+            }
+
+            bool keep = true;
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                keep = connection->OnReadable(server);
+            if (keep && (events[i].events & EPOLLOUT))
+                keep = connection->OnWritable(server);
+            if (!keep)
+                CloseConnection(connection);
+        }
+    }
+
+    // Tear down everything left on this worker
+    std::map<unsigned long long int, std::shared_ptr<WebSocketConnection>> remaining;
+    {
+        std::lock_guard<std::mutex> lock(connections_mutex);
+        remaining.swap(connections);
+    }
+    for (auto &it : remaining) {
+        bool was_open = (it.second->state == WebSocketConnection::STATE_OPEN || it.second->state == WebSocketConnection::STATE_HTTP);
+        it.second->OnClosed();
+        if (was_open)
+            server->GetListener()->OnClose(it.second);
+    }
+}
+
+void WebSocketWorker::Accept()
+{
+    while (true) {
+        struct sockaddr_in address;
+        socklen_t address_size = sizeof(address);
+        int fd = accept4(listen_fd, (struct sockaddr *)&address, &address_size, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                printf("Fail to accept connection: %s\n", strerror(errno));
+            return;
+        }
+
+        int enable = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+
+        unsigned long long int id = connection_id_counter++;
+        auto connection = std::make_shared<WebSocketConnection>(this, fd, id);
+
+        char address_string[INET_ADDRSTRLEN] = {0};
+        inet_ntop(AF_INET, &address.sin_addr, address_string, sizeof(address_string));
+        connection->remote_address = std::string(address_string) + ":" + std::to_string(ntohs(address.sin_port));
+
+        {
+            std::lock_guard<std::mutex> lock(connections_mutex);
+            connections[id] = connection;
+        }
+
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN | EPOLLRDHUP;
+        event.data.u64 = id;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+            printf("Fail to watch connection: %s\n", strerror(errno));
+            CloseConnection(connection);
+        }
+    }
+}
+
+void WebSocketWorker::CloseConnection(const std::shared_ptr<WebSocketConnection> &connection)
+{
+    bool was_open = (connection->state == WebSocketConnection::STATE_OPEN || connection->state == WebSocketConnection::STATE_HTTP);
+
+    // Closing the fd also removes it from the epoll set.
+    connection->OnClosed();
+    {
+        std::lock_guard<std::mutex> lock(connections_mutex);
+        connections.erase(connection->GetId());
+    }
+
+    if (was_open)
+        server->GetListener()->OnClose(connection);
+}
+
+/*
+ * WebSocketServer
+ */
+WebSocketServer::WebSocketServer(WebSocketListener *listener, size_t max_message_size)
+        : listener(listener)
+        , max_message_size(max_message_size)
+{
+}
+
+WebSocketServer::~WebSocketServer()
+{
+    Stop();
+    Join();
+}
+
+bool WebSocketServer::Start(unsigned short port, unsigned int worker_count)
+{
+    if (worker_count == 0)
+        worker_count = 1;
+
+    for (unsigned int i = 0; i < worker_count; i++) {
+        std::unique_ptr<WebSocketWorker> worker(new WebSocketWorker(this));
+        if (!worker->Start(port)) {
+            Stop();
+            return false;
+        }
+        workers.push_back(std::move(worker));
+    }
+    return true;
+}
+
+void WebSocketServer::Stop()
+{
+    for (auto &worker : workers)
+        worker->Stop();
+}
+
+void WebSocketServer::Join()
+{
+    for (auto &worker : workers)
+        worker->Join();
+}
+
+size_t WebSocketServer::GetConnectionCount() const
+{
+    size_t count = 0;
+    for (auto &worker : workers)
+        count += worker->GetConnectionCount();
+    return count;
+}
@@ -0,0 +1,236 @@
+#pragma once
+
+#include <atomic>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+class WebSocketServer;
+class WebSocketWorker;
+
+typedef std::shared_ptr<const std::vector<unsigned char>> SharedBuffer;
+
+// A file descriptor, closed with its last reference.
+typedef std::shared_ptr<const int> SharedFile;
+
+/*
+ * A websocket connection accepted by WebSocketServer.
+ * The listener callbacks of a connection always run on the worker thread owning it,
+ * but Send*() and Close() could be called from any thread.
+ *
+ * A GET without the websocket upgrade is a plain HTTP request: the listener answers it with
+ * SendHttpResponse(), then the body. On a chunked response, every message sent is one chunk
+ * and Close() ends the body, so a live stream goes the same way as on a websocket.
+ * One request per connection: it is closed once the response is out.
+ */
+class WebSocketConnection : public std::enable_shared_from_this<WebSocketConnection>
+{
+public:
+
+    WebSocketConnection(WebSocketWorker *worker, int fd, unsigned long long int id);
+
+    ~WebSocketConnection();
+
+    unsigned long long int GetId() const { return id; }
+
+    // Request path without the query string. Ex: "/camera"
+    const std::string &GetPath() const { return path; }
+
+    // Value of a query string parameter, or an empty string if there is no such parameter.
+    std::string GetQueryParameter(const std::string &name) const;
+
+    // Value of a request header, by its lower case name, or an empty string.
+    std::string GetHeader(const std::string &name) const;
+
+    bool IsHttp() const;
+
+    const std::string &GetRemoteAddress() const { return remote_address; }
+
+    bool SendBinary(const unsigned char *data, size_t size);
+
+    // Send a buffer shared by many connections without copying it.
+    bool SendBinary(const SharedBuffer &buffer);
+
+    // Send one message made of head, then body from body_offset. Ex: a patched header and shared samples.
+    bool SendBinary(const SharedBuffer &head, const SharedBuffer &body, size_t body_offset);
+
+    bool SendText(const std::string &text);
+
+    // Plain HTTP only. headers: "Name: value\r\n" lines, without the length or the transfer encoding.
+    bool SendHttpResponse(const std::string &status, const std::string &headers, bool chunked, size_t content_length = 0);
+
+    // Plain HTTP only: the whole file, or the byte range asked by the Range header, sent by sendfile().
+    // Return false if there is no such file.
+    bool SendHttpFile(const std::string &path, const std::string &content_type);
+
+    // Bytes queued but not accepted by the socket yet.
+    size_t GetQueuedBytes() const;
+
+    void Close();
+
+    bool IsOpen() const;
+
+    // Ask the owner worker to call the listener OnDrain() as soon as the socket is writable,
+    // so a producer on another thread could hand over the sending to the worker.
+    void RequestDrain();
+
+    // Anything the listener wants to attach to the connection.
+    std::shared_ptr<void> user_data;
+
+private:
+
+    friend class WebSocketWorker;
+
+    enum State
+    {
+        STATE_HANDSHAKE,
+        STATE_OPEN,
+        STATE_HTTP,
+        STATE_CLOSED
+    };
+
+    // Some bytes of a buffer, or of a file if there is one: from offset to file_end then.
+    struct Segment
+    {
+        SharedBuffer buffer;
+        size_t offset;
+        SharedFile file;
+        size_t file_end;
+    };
+
+    // Called by the owner worker.
+    bool OnReadable(WebSocketServer *server);
+    bool OnWritable(WebSocketServer *server);
+    void OnClosed();
+
+    bool HandleHandshake(WebSocketServer *server);
+    bool HandleFrames(WebSocketServer *server);
+
+    bool SendFrame(unsigned char opcode, const SharedBuffer &payload);
+    bool SendFrame(unsigned char opcode, const Segment *payload, size_t count);
+    bool SendRaw(const Segment &segment);
+    void SendHttpError(const std::string &status);
+
+    // Must hold the mutex.
+    bool GetFrameHeaderLocked(unsigned char opcode, size_t size, std::vector<unsigned char> &header) const;
+    void PushLocked(const Segment &segment);
+    bool SendQueuedLocked();
+    bool FlushLocked();
+    void WatchWritableLocked(bool enable);
+
+    WebSocketWorker *worker;
+    const unsigned long long int id;
+    State state;
+
+    std::string path;
+    std::string query;
+    std::map<std::string, std::string> headers;
+    std::string remote_address;
+
+    std::vector<unsigned char> input;
+    std::vector<unsigned char> message;
+    unsigned char message_opcode;
+
+    mutable std::mutex mutex;
+    int fd;
+    bool watch_writable;
+    bool close_after_flush;
+    bool http_chunked;
+    std::deque<Segment> output;
+    size_t output_bytes;
+};
+
+class WebSocketListener
+{
+public:
+
+    virtual ~WebSocketListener() {}
+
+    // Return false to reject the connection.
+    virtual bool OnOpen(const std::shared_ptr<WebSocketConnection> &connection) = 0;
+
+    // The data belongs to the connection input buffer, so the listener could modify it in place.
+    virtual void OnMessage(const std::shared_ptr<WebSocketConnection> &connection,
+                           unsigned char *data,
+                           size_t size,
+                           bool is_binary) = 0;
+
+    virtual void OnClose(const std::shared_ptr<WebSocketConnection> &connection) = 0;
+
+    // Called on the worker thread after RequestDrain(), and whenever the queued output is fully flushed.
+    virtual void OnDrain(const std::shared_ptr<WebSocketConnection> &) {}
+
+    // A plain HTTP GET. Return false to answer 404. OnClose() follows, as after OnOpen().
+    virtual bool OnHttpRequest(const std::shared_ptr<WebSocketConnection> &) { return false; }
+};
+
+/*
+ * Event loop of one worker thread: its own epoll instance and its own listening socket
+ * (SO_REUSEPORT), so the kernel balances the new connections over the workers.
+ */
+class WebSocketWorker
+{
+public:
+
+    WebSocketWorker(WebSocketServer *server);
+
+    ~WebSocketWorker();
+
+    bool Start(unsigned short port);
+
+    void Stop();
+
+    void Join();
+
+    size_t GetConnectionCount() const;
+
+private:
+
+    friend class WebSocketConnection;
+
+    void Run();
+
+    void Accept();
+
+    void CloseConnection(const std::shared_ptr<WebSocketConnection> &connection);
+
+    WebSocketServer *server;
+    int epoll_fd;
+    int listen_fd;
+    int wakeup_fd;
+    std::atomic<bool> running;      // Cleared by Stop() from any thread, then the loop is woken up by wakeup_fd
+    std::map<unsigned long long int, std::shared_ptr<WebSocketConnection>> connections;
+    mutable std::mutex connections_mutex;
+    std::thread thread;
+};
+
+class WebSocketServer
+{
+public:
+
+    WebSocketServer(WebSocketListener *listener, size_t max_message_size = 8 * 1024 * 1024);
+
+    ~WebSocketServer();
+
+    bool Start(unsigned short port, unsigned int worker_count);
+
+    void Stop();
+
+    void Join();
+
+    size_t GetConnectionCount() const;
+
+    WebSocketListener *GetListener() const { return listener; }
+
+    size_t GetMaxMessageSize() const { return max_message_size; }
+
+private:
+
+    WebSocketListener *listener;
+    const size_t max_message_size;
+    std::vector<std::unique_ptr<WebSocketWorker>> workers;
+};